@@ -10,35 +10,29 @@
 #include <getopt.h>
 #include <sys/un.h>
 
+#include "protocol.h"
+#include "registry.h"
+
 #define BUFFER_SIZE 1024
 
 /**
- * Validates if a TCP command is in the correct format: ADD <ATOM> <AMOUNT>
+ * Validates an atom type and amount pair
  * 
- * @param command   Command string to validate
- * @return          1 if the command is valid, 0 if not
+ * @param atom_type   Atom type string
+ * @param amount_str  Amount string
+ * @param amount      Receives the amount
+ * @return            1 if the pair is valid, 0 if not
  */
-int validate_tcp_command(const char *command) {
-    char add[16], atom_type[16], amount_str[32];
-    
-    // Split the command into parts
-    if (sscanf(command, "%15s %15s %31s", add, atom_type, amount_str) != 3) {
-        return 0;
-    }
-    
-    // Verify the command starts with ADD
-    if (strcmp(add, "ADD") != 0) {
-        return 0;
-    }
-    
+int validate_atom_pair(const char *atom_type, const char *amount_str, unsigned int *amount) {
     // Verify the atom type is valid
-    if (strcmp(atom_type, "CARBON") != 0 && 
-        strcmp(atom_type, "HYDROGEN") != 0 && 
-        strcmp(atom_type, "OXYGEN") != 0) {
+    if (registry_element_id(atom_type) < 0) {
         return 0;
     }
     
     // Verify the amount is a valid number
+    if (amount_str[0] == '\0') {
+        return 0;
+    }
     for (int i = 0; amount_str[i]; ++i) {
         if (!isdigit((unsigned char)amount_str[i])) {
             return 0;
@@ -50,14 +44,152 @@ int validate_tcp_command(const char *command) {
         return 0;
     }
     
-    unsigned int amount = (unsigned int)strtoul(amount_str, NULL, 10);
-    if (amount == 0) {
+    *amount = (unsigned int)strtoul(amount_str, NULL, 10);
+    if (*amount == 0) {
         return 0; // Amount must be greater than 0
     }
     
     return 1;
 }
 
+/**
+ * Parses and validates a single-atom TCP command in the format: ADD <ATOM> <AMOUNT>
+ * 
+ * @param command    Command string to parse
+ * @param atom_type  Receives the atom type (at least 16 bytes)
+ * @param amount     Receives the amount
+ * @return           1 if the command is valid, 0 if not
+ */
+int parse_tcp_command(const char *command, char *atom_type, unsigned int *amount) {
+    char add[16], amount_str[32];
+    int consumed = 0;
+    
+    // Split the command into parts; nothing may follow the amount
+    if (sscanf(command, "%15s %15s %31s %n", add, atom_type, amount_str, &consumed) != 3 ||
+        command[consumed] != '\0') {
+        return 0;
+    }
+    
+    // Verify the command starts with ADD
+    if (strcmp(add, "ADD") != 0) {
+        return 0;
+    }
+    
+    return validate_atom_pair(atom_type, amount_str, amount);
+}
+
+/**
+ * Checks for a query the server answers from its stock snapshot:
+ * STATUS, REPLICATION, RAFT, or GEN <DRINK or MOLECULE> (the server checks the name)
+ *
+ * @param command   Command string to check
+ * @return          1 if the command is a query, 0 if not
+ */
+int is_query_command(const char *command) {
+    char copy[BUFFER_SIZE], *save = NULL;
+
+    snprintf(copy, sizeof(copy), "%s", command);
+    char *op = strtok_r(copy, " \t", &save);
+    char *word = strtok_r(NULL, " \t", &save);
+    if (op == NULL) return 0;
+    return ((strcmp(op, "STATUS") == 0 || strcmp(op, "REPLICATION") == 0 ||
+             strcmp(op, "RAFT") == 0) && word == NULL) ||
+           (strcmp(op, "GEN") == 0 && word != NULL);
+}
+
+/**
+ * Validates if a TCP command is in the correct format:
+ * ADD <ATOM> <AMOUNT> [<ATOM> <AMOUNT> ...], or a STATUS / GEN query
+ * 
+ * @param command   Command string to validate
+ * @return          1 if the command is valid, 0 if not
+ */
+int validate_tcp_command(const char *command) {
+    char copy[BUFFER_SIZE], *save = NULL;
+    unsigned int amount;
+    int pairs = 0;
+    
+    if (is_query_command(command)) return 1;
+    snprintf(copy, sizeof(copy), "%s", command);
+    
+    // Verify the command starts with ADD
+    char *token = strtok_r(copy, " \t", &save);
+    if (token == NULL || strcmp(token, "ADD") != 0) {
+        return 0;
+    }
+    
+    // Verify every atom type / amount pair
+    while ((token = strtok_r(NULL, " \t", &save)) != NULL) {
+        char *amount_str = strtok_r(NULL, " \t", &save);
+        if (amount_str == NULL || !validate_atom_pair(token, amount_str, &amount)) {
+            return 0;
+        }
+        pairs++;
+    }
+    
+    return pairs > 0;
+}
+
+/**
+ * Receives exactly len bytes from a stream socket
+ *
+ * @param sock_fd  Connected socket
+ * @param buf      Destination buffer
+ * @param len      Number of bytes to receive
+ * @return         len on success, 0 if the server closed the connection, -1 on error
+ */
+ssize_t recv_all(int sock_fd, unsigned char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = recv(sock_fd, buf + got, len - got, 0);
+        if (n <= 0) return n;
+        got += n;
+    }
+    return (ssize_t)got;
+}
+
+/**
+ * Sends an ADD command as a binary protocol frame and prints the reply
+ *
+ * @param sock_fd     Connected socket
+ * @param command     Validated ADD command
+ * @param request_id  Request id to put in the frame
+ * @return            0 on success, -1 if the connection failed
+ */
+int send_binary_add(int sock_fd, const char *command, uint32_t request_id) {
+    char atom_type[16];
+    unsigned int amount;
+    unsigned char frame[PROTO_FRAME_SIZE];
+    ProtoFrame req, reply;
+
+    parse_tcp_command(command, atom_type, &amount);
+    req.opcode = PROTO_OP_ADD;
+    req.id = (uint8_t)registry_element_id(atom_type);
+    req.request_id = request_id;
+    req.amount = amount;
+    proto_encode(&req, frame);
+
+    if (send(sock_fd, frame, sizeof(frame), 0) == -1) {
+        perror("send failed");
+        return -1;
+    }
+    ssize_t n = recv_all(sock_fd, frame, sizeof(frame));
+    if (n <= 0) {
+        if (n == 0) {
+            printf("Server closed connection\n");
+        } else {
+            perror("recv failed");
+        }
+        return -1;
+    }
+    if (!proto_decode(frame, sizeof(frame), &reply) || reply.request_id != request_id) {
+        printf("Invalid reply from server\n");
+        return -1;
+    }
+    printf("Server response: %s\n", proto_reply_text(&reply));
+    return 0;
+}
+
 /**
  * Creates a TCP socket and connects to the server
  * 
@@ -150,9 +282,19 @@ int main(int argc, char *argv[]) {
     const char *host = NULL;
     const char *port = NULL;
     const char *socket_path = NULL;
+    int binary = 0;
+    uint32_t request_id = 0;
+
+    static struct option long_options[] = {
+        {"host",   required_argument, 0, 'h'},
+        {"port",   required_argument, 0, 'p'},
+        {"file",   required_argument, 0, 'f'},
+        {"binary", no_argument,       0, 'b'},
+        {0, 0, 0, 0}
+    };
     
     // Process command line options
-    while ((opt = getopt(argc, argv, "h:p:f:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "h:p:f:b", long_options, NULL)) != -1) {
         switch (opt) {
             case 'h':
                 host = optarg;
@@ -163,8 +305,11 @@ int main(int argc, char *argv[]) {
             case 'f':
                 socket_path = optarg;
                 break; 
+            case 'b':
+                binary = 1;
+                break;
             default:
-                fprintf(stderr, "Usage: %s -h <hostname/IP> -p <port> OR %s -f <UDS socket file path>\n", 
+                fprintf(stderr, "Usage: %s -h <hostname/IP> -p <port> OR %s -f <UDS socket file path> [--binary]\n", 
                         argv[0], argv[0]);
                 exit(1);
         }
@@ -204,8 +349,9 @@ int main(int argc, char *argv[]) {
         printf("Connected to atom warehouse server at %s:%s\n", host, port);
     }
     
-    printf("Enter command: ADD <ATOM_TYPE> <AMOUNT>\n");
+    printf("Enter command: ADD <ATOM_TYPE> <AMOUNT> [<ATOM_TYPE> <AMOUNT> ...]\n");
     printf("Available atom types: CARBON, HYDROGEN, OXYGEN\n");
+    printf("Queries: STATUS, REPLICATION, RAFT, GEN <DRINK or MOLECULE>\n");
     
     char command[BUFFER_SIZE];
     char buffer[BUFFER_SIZE];
@@ -225,9 +371,19 @@ int main(int argc, char *argv[]) {
             break;
         }
         
-        if (validate_tcp_command(command)) {
-            // Send command to server
-            if (send(sock_fd, command, strlen(command), 0) == -1) {
+        char atom_type[16];
+        unsigned int amount;
+        if (binary && parse_tcp_command(command, atom_type, &amount)) {
+            // Send the command as a fixed-size binary frame
+            // (a frame carries one atom type, so multi-atom ADD is sent as text)
+            if (send_binary_add(sock_fd, command, ++request_id) == -1) {
+                break;
+            }
+        } else if (validate_tcp_command(command)) {
+            // Send command to server, newline-terminated so the server can frame it
+            char line[BUFFER_SIZE + 1];
+            int line_len = snprintf(line, sizeof(line), "%s\n", command);
+            if (send(sock_fd, line, line_len, 0) == -1) {
                 perror("send failed");
                 break;
             }
@@ -0,0 +1,204 @@
+/*
+ * bench_catalog - startup cost of loading a large recipe catalog
+ *
+ * Writes a catalog of M molecules and R drink recipes (each drink uses 3 to
+ * 6 molecules, some with a count), then loads it with registry_load_catalog
+ * in a fresh child process per run, so every run starts from the built-in
+ * registry. Reports the load time of each run and the name lookup cost, and
+ * fails if the median load time is over the budget.
+ *
+ * Usage: bench_catalog [-r recipes] [-m molecules] [-n runs] [-b budget-ms] [-f catalog-file]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "registry.h"
+
+#define MAX_RUNS 64
+
+/**
+ * Result of one load, written by the child process into a pipe
+ */
+typedef struct {
+    long long load_ns;    // Time spent in registry_load_catalog
+    long long lookup_ns;  // Average time of one drink name lookup
+    int ok;               // Load succeeded and every name resolved to its id
+} LoadResult;
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Name of a generated molecule or drink ("MOLECULE 12 A", "DRINK 7 B")
+ * Words may not start with a digit, so the number is spelled with letters
+ */
+static void generated_name(char *out, size_t size, const char *kind, int i) {
+    char digits[16];
+    int len = 0;
+    do {
+        digits[len++] = (char)('A' + i % 26);
+        i /= 26;
+    } while (i > 0);
+    digits[len] = '\0';
+    snprintf(out, size, "%s %s", kind, digits);
+}
+
+/**
+ * Writes a catalog with the given number of molecules and drinks
+ *
+ * @return  0 on success, -1 if the file cannot be written
+ */
+static int write_catalog(const char *path, int num_molecules, int num_recipes) {
+    FILE *file = fopen(path, "w");
+    char name[64];
+    unsigned int seed = 1;
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(file, "# generated by bench_catalog: %d molecules, %d drinks\n", num_molecules, num_recipes);
+    for (int m = 0; m < num_molecules; m++) {
+        generated_name(name, sizeof(name), "MOLECULE", m);
+        fprintf(file, "molecule %s: %d %d %d\n", name, rand_r(&seed) % 13, 1 + rand_r(&seed) % 24,
+                rand_r(&seed) % 13);
+    }
+    for (int r = 0; r < num_recipes; r++) {
+        int parts = 3 + rand_r(&seed) % 4;
+        generated_name(name, sizeof(name), "DRINK", r);
+        fprintf(file, "drink %s:", name);
+        for (int p = 0; p < parts; p++) {
+            int m = rand_r(&seed) % (num_molecules + NUM_BUILTIN_MOLECULES);
+            if (m < NUM_BUILTIN_MOLECULES) {
+                strcpy(name, registry_molecule_name(m));
+            } else {
+                generated_name(name, sizeof(name), "MOLECULE", m - NUM_BUILTIN_MOLECULES);
+            }
+            if (rand_r(&seed) % 4 == 0) {
+                fprintf(file, "%s %d %s", p ? "," : "", 2 + rand_r(&seed) % 3, name);
+            } else {
+                fprintf(file, "%s %s", p ? "," : "", name);
+            }
+        }
+        fputc('\n', file);
+    }
+    if (fclose(file) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Child process: loads the catalog and checks that every drink resolves
+ */
+static LoadResult load_once(const char *path, int num_molecules, int num_recipes) {
+    LoadResult result = {0, 0, 0};
+    char name[64];
+
+    // The built-in registry is set up before the clock starts, as drinks_bar's would be
+    registry_num_drinks();
+
+    long long start = now_ns();
+    int loaded = registry_load_catalog(path) == 0;
+    result.load_ns = now_ns() - start;
+    if (!loaded || registry_num_molecules() != NUM_BUILTIN_MOLECULES + num_molecules ||
+        registry_num_drinks() != NUM_BUILTIN_DRINKS + num_recipes) {
+        return result;
+    }
+
+    result.ok = 1;
+    start = now_ns();
+    for (int r = 0; r < num_recipes; r++) {
+        generated_name(name, sizeof(name), "DRINK", r);
+        if (registry_drink_id(name) != NUM_BUILTIN_DRINKS + r) result.ok = 0;
+    }
+    result.lookup_ns = num_recipes > 0 ? (now_ns() - start) / num_recipes : 0;
+    return result;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    int num_recipes = 10000, num_molecules = 500, runs = 9;
+    double budget_ms = 20.0;
+    char default_path[64];
+    const char *path = default_path;
+    int opt;
+
+    snprintf(default_path, sizeof(default_path), "/tmp/bench_catalog_%d.txt", (int)getpid());
+
+    while ((opt = getopt(argc, argv, "r:m:n:b:f:")) != -1) {
+        switch (opt) {
+            case 'r': num_recipes = atoi(optarg); break;
+            case 'm': num_molecules = atoi(optarg); break;
+            case 'n': runs = atoi(optarg); break;
+            case 'b': budget_ms = atof(optarg); break;
+            case 'f': path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-r recipes] [-m molecules] [-n runs] [-b budget-ms] [-f catalog-file]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (num_recipes < 0 || num_molecules < 0 || runs <= 0 || runs > MAX_RUNS || budget_ms <= 0) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+    if (write_catalog(path, num_molecules, num_recipes) == -1) return 1;
+
+    printf("catalog %s: %d molecules, %d drinks, budget %.1f ms (median of %d loads)\n", path, num_molecules,
+           num_recipes, budget_ms, runs);
+    printf("%4s %12s %14s   %s\n", "run", "load ms", "lookup ns/op", "check");
+
+    long long load_ns[MAX_RUNS];
+    int all_ok = 1;
+    for (int i = 0; i < runs; i++) {
+        LoadResult result = {0, 0, 0};
+        int fds[2];
+        if (pipe(fds) == -1) {
+            perror("pipe");
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            result = load_once(path, num_molecules, num_recipes);
+            _exit(write(fds[1], &result, sizeof(result)) == (ssize_t)sizeof(result) ? 0 : 1);
+        }
+        close(fds[1]);
+        if (read(fds[0], &result, sizeof(result)) != (ssize_t)sizeof(result)) result.ok = 0;
+        close(fds[0]);
+        waitpid(pid, NULL, 0);
+
+        load_ns[i] = result.load_ns;
+        all_ok &= result.ok;
+        printf("%4d %12.3f %14lld   %s\n", i + 1, result.load_ns / 1e6, result.lookup_ns, result.ok ? "ok" : "FAILED");
+    }
+
+    qsort(load_ns, runs, sizeof(load_ns[0]), compare_ll);
+    double median_ms = load_ns[runs / 2] / 1e6;
+    int within_budget = median_ms <= budget_ms;
+    printf("median load %.3f ms: %s\n", median_ms, within_budget ? "within budget" : "OVER BUDGET");
+
+    unlink(path);
+    return (all_ok && within_budget) ? 0 : 1;
+}
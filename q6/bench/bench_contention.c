@@ -0,0 +1,1283 @@
+/*
+ * bench_contention - K drinks_bar processes on one save file, checked for linearizability
+ *
+ * For every locked --lock-mode the harness starts K servers on a fresh save
+ * file, with a small initial stock so that many DELIVERs are refused, and
+ * runs C closed-loop clients against them (client i talks to server i % K):
+ *   ADD <element> 1-4       over TCP
+ *   DELIVER <molecule> 1-2  over UDP
+ *   STATUS                  over TCP (reads the whole stock)
+ * Every request is recorded with the time it was sent and the time its
+ * reply arrived, and the history is checked afterwards:
+ *   linearizable  some order of the operations, each placed between its
+ *                 send and its reply, explains every reply: each DELIVER
+ *                 that succeeded had its atoms, each one refused lacked
+ *                 them, and each STATUS saw the stock of that moment
+ *   conservation  initial + atoms added - atoms delivered equals the final
+ *                 stock, as read by STATUS from every server and from the
+ *                 save file once the clients stopped
+ * A request without a reply (timeout) may or may not have happened: the
+ * check lets it take effect at any point after it was sent, or never.
+ *
+ * The checker follows Wing and Gong, placing operations only when a reply
+ * forces it. The stock depends only on which operations took effect, so a
+ * search state is the next event and the set of pending operations already
+ * placed (a bitmask); operations without an effect (refused DELIVER, STATUS)
+ * are placed as soon as they fit, and interchangeable operations are placed
+ * in reply order. A STATUS jumps straight to the sets of pending operations
+ * that sum to what it saw, and a refused DELIVER to deliveries that run the
+ * stock short. A quick search tries only those moves; if it fails, a
+ * complete search decides, or gives up after MAX_STATES states and calls the
+ * history undecided (more likely the more clients run at once; the default
+ * 8 clients for 2 seconds are decided in seconds, 16 often are not).
+ *
+ * The run fails (exit status 1) on a conservation error, and in a locked
+ * mode (flock, fcntl, mutex) on any history that is not proven linearizable,
+ * undecided included. In atomic mode multi-atom updates are not atomic (see
+ * --lock-mode atomic), so its history is not checked; conservation is its
+ * only oracle.
+ *
+ * Usage: bench_contention [-k servers] [-c clients] [-d seconds] [-l mode] [-a add%] [-r status%]
+ *                         [-t server-threads] [-o history-prefix] [-p base-port] <drinks_bar>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "registry.h"
+
+#define MAX_SERVERS 16
+#define MAX_CLIENTS 48
+#define MAX_SLOTS 64               // Pending operations the checker can track at once
+#define MAX_STATES (1 << 22)       // Search states explored before the check gives up
+#define MAX_SETS 4096              // Sets of operations tried for one STATUS
+#define REPLY_SIZE 256
+#define TEXT_SIZE 48
+#define NUM_MOLECULES 4            // WATER, CARBON DIOXIDE, ALCOHOL, GLUCOSE
+
+#define INITIAL_CARBON 20
+#define INITIAL_HYDROGEN 40
+#define INITIAL_OXYGEN 20
+
+#define OP_ADD 0
+#define OP_DELIVER 1
+#define OP_STATUS 2
+
+#define RESULT_OK 0
+#define RESULT_FAILED 1
+#define RESULT_UNKNOWN 2  // No reply: the operation may or may not have taken effect
+
+/**
+ * One request of the history and its reply
+ */
+typedef struct {
+    int client;
+    int type;                       // OP_*
+    int result;                     // RESULT_*
+    long long delta[NUM_ELEMENTS];  // ADD: atoms added; DELIVER: atoms taken (negative)
+    long long seen[NUM_ELEMENTS];   // STATUS: the stock in the reply
+    long long invoke_ns;            // Before the request was sent
+    long long response_ns;          // After the reply arrived (unused for RESULT_UNKNOWN)
+    char request[TEXT_SIZE];
+    char reply[TEXT_SIZE];
+} Op;
+
+/**
+ * One client thread and the operations it recorded
+ */
+typedef struct {
+    pthread_t thread;
+    int id;
+    int tcp_port;
+    int add_percent;
+    int status_percent;
+    int timeout_ms;
+    unsigned int seed;
+    Op *ops;
+    size_t num_ops, cap_ops;
+} Client;
+
+static volatile int stop_clients = 0;
+static long long epoch_ns = 0;
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ------------------------------------------------------------------ */
+/* Servers                                                            */
+/* ------------------------------------------------------------------ */
+
+/**
+ * Starts one drinks_bar on the shared save file; its console reads a pipe
+ * that stays open and its output is discarded
+ *
+ * @param console_fd  Receives the write end of the console pipe
+ * @return            Child pid, or -1 on failure
+ */
+static pid_t start_server(const char *binary, int tcp_port, const char *save_path, const char *mode, int threads,
+                          int *console_fd) {
+    char tcp[16], udp[16], carbon[16], hydrogen[16], oxygen[16], nthreads[16];
+    int pipefd[2];
+
+    snprintf(tcp, sizeof(tcp), "%d", tcp_port);
+    snprintf(udp, sizeof(udp), "%d", tcp_port + 1);
+    snprintf(carbon, sizeof(carbon), "%d", INITIAL_CARBON);
+    snprintf(hydrogen, sizeof(hydrogen), "%d", INITIAL_HYDROGEN);
+    snprintf(oxygen, sizeof(oxygen), "%d", INITIAL_OXYGEN);
+    snprintf(nthreads, sizeof(nthreads), "%d", threads);
+    if (pipe(pipefd) == -1) return -1;
+
+    pid_t pid = fork();
+    if (pid == -1) return -1;
+    if (pid == 0) {
+        int out = open("/dev/null", O_WRONLY);
+        dup2(pipefd[0], STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execl(binary, binary, "-T", tcp, "-U", udp, "-f", save_path, "--lock-mode", mode, "--threads", nthreads,
+              "--carbon", carbon, "--hydrogen", hydrogen, "--oxygen", oxygen, (char *)NULL);
+        _exit(127);
+    }
+    close(pipefd[0]);
+    *console_fd = pipefd[1];
+    return pid;
+}
+
+/**
+ * Connects a TCP socket to a port on this host
+ *
+ * @return  Socket, or -1 on failure
+ */
+static int connect_tcp(int port, int timeout_ms) {
+    struct sockaddr_in addr;
+    struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    int one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+/**
+ * Opens a UDP socket connected to a port on this host
+ *
+ * @return  Socket, or -1 on failure
+ */
+static int connect_udp(int port, int timeout_ms) {
+    struct sockaddr_in addr;
+    struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+/**
+ * Sends one line over TCP and reads the reply line
+ *
+ * @return  Length of the reply, -1 on error or timeout
+ */
+static int tcp_request(int fd, const char *line, char *reply, size_t reply_size) {
+    size_t len = strlen(line), got = 0;
+    if (send(fd, line, len, MSG_NOSIGNAL) != (ssize_t)len) return -1;
+    while (got + 1 < reply_size) {
+        ssize_t n = recv(fd, reply + got, reply_size - 1 - got, 0);
+        if (n <= 0) return -1;
+        got += n;
+        if (memchr(reply, '\n', got) != NULL) break;
+    }
+    reply[got] = '\0';
+    return (int)got;
+}
+
+/* ------------------------------------------------------------------ */
+/* Clients                                                            */
+/* ------------------------------------------------------------------ */
+
+/**
+ * Appends an operation to a client's history
+ *
+ * @return  The new entry
+ */
+static Op *record_op(Client *client) {
+    if (client->num_ops == client->cap_ops) {
+        client->cap_ops = client->cap_ops ? client->cap_ops * 2 : 4096;
+        client->ops = realloc(client->ops, client->cap_ops * sizeof(Op));
+        if (client->ops == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    Op *op = &client->ops[client->num_ops++];
+    memset(op, 0, sizeof(*op));
+    op->client = client->id;
+    return op;
+}
+
+/**
+ * Parses a STATUS reply into op->seen
+ *
+ * @return  1 on success, 0 if the reply is not a STATUS line
+ */
+static int parse_status(const char *reply, Op *op) {
+    unsigned long long version, c, h, o;
+    if (sscanf(reply, "STATUS %llu CARBON %llu HYDROGEN %llu OXYGEN %llu", &version, &c, &h, &o) != 4) return 0;
+    op->seen[ELEMENT_CARBON] = (long long)c;
+    op->seen[ELEMENT_HYDROGEN] = (long long)h;
+    op->seen[ELEMENT_OXYGEN] = (long long)o;
+    return 1;
+}
+
+/**
+ * Reads the stock with STATUS over a fresh connection and records the request
+ *
+ * @return  1 if the server answered, 0 if not
+ */
+static int status_request(Client *client, int tcp_port) {
+    char reply[REPLY_SIZE];
+    Op *op = record_op(client);
+    op->type = OP_STATUS;
+    snprintf(op->request, sizeof(op->request), "STATUS");
+
+    int fd = connect_tcp(tcp_port, client->timeout_ms);
+    op->invoke_ns = now_ns();
+    int len = fd == -1 ? -1 : tcp_request(fd, "STATUS\n", reply, sizeof(reply));
+    op->response_ns = now_ns();
+    if (fd != -1) close(fd);
+    if (len <= 0 || !parse_status(reply, op)) {
+        op->result = RESULT_UNKNOWN;
+        return 0;
+    }
+    reply[strcspn(reply, "\r\n")] = '\0';
+    snprintf(op->reply, sizeof(op->reply), "%.*s", (int)sizeof(op->reply) - 1, reply);
+    op->result = RESULT_OK;
+    return 1;
+}
+
+/**
+ * Body of one client: closed loop of ADD, DELIVER and STATUS until stopped
+ * After a timeout the socket is replaced, so a late reply cannot be taken
+ * for the reply of the next request
+ */
+static void *client_main(void *arg) {
+    Client *client = arg;
+    char line[64], reply[REPLY_SIZE];
+    int tcp = connect_tcp(client->tcp_port, client->timeout_ms);
+    int udp = connect_udp(client->tcp_port + 1, client->timeout_ms);
+
+    while (!__atomic_load_n(&stop_clients, __ATOMIC_ACQUIRE)) {
+        if (tcp == -1) tcp = connect_tcp(client->tcp_port, client->timeout_ms);
+        if (udp == -1) udp = connect_udp(client->tcp_port + 1, client->timeout_ms);
+        if (tcp == -1 || udp == -1) {
+            usleep(10000);
+            continue;
+        }
+
+        Op *op = record_op(client);
+        int r = rand_r(&client->seed) % 100, len;
+        if (r < client->status_percent) {
+            op->type = OP_STATUS;
+            snprintf(line, sizeof(line), "STATUS\n");
+        } else if (r < client->status_percent + client->add_percent) {
+            int element = rand_r(&client->seed) % NUM_ELEMENTS;
+            int amount = 1 + rand_r(&client->seed) % 4;
+            op->type = OP_ADD;
+            op->delta[element] = amount;
+            snprintf(line, sizeof(line), "ADD %s %d\n", registry_element_name(element), amount);
+        } else {
+            int molecule = rand_r(&client->seed) % NUM_MOLECULES;
+            int amount = 1 + rand_r(&client->seed) % 2;
+            const unsigned int *formula = registry_molecule_formula(molecule);
+            op->type = OP_DELIVER;
+            for (int e = 0; e < NUM_ELEMENTS; e++) op->delta[e] = -(long long)formula[e] * amount;
+            snprintf(line, sizeof(line), "DELIVER %s %d", registry_molecule_name(molecule), amount);
+        }
+        snprintf(op->request, sizeof(op->request), "%.*s", (int)strcspn(line, "\n"), line);
+
+        op->invoke_ns = now_ns();
+        if (op->type == OP_DELIVER) {
+            len = send(udp, line, strlen(line), 0) == (ssize_t)strlen(line) ? recv(udp, reply, sizeof(reply) - 1, 0)
+                                                                            : -1;
+            if (len >= 0) reply[len] = '\0';
+        } else {
+            len = tcp_request(tcp, line, reply, sizeof(reply));
+        }
+        op->response_ns = now_ns();
+
+        if (len <= 0) {
+            op->result = RESULT_UNKNOWN;
+            snprintf(op->reply, sizeof(op->reply), "(no reply)");
+            if (op->type == OP_DELIVER) {
+                close(udp);
+                udp = -1;
+            } else {
+                close(tcp);
+                tcp = -1;
+            }
+            continue;
+        }
+        reply[strcspn(reply, "\r\n")] = '\0';
+        snprintf(op->reply, sizeof(op->reply), "%.*s", (int)sizeof(op->reply) - 1, reply);
+        if (op->type == OP_ADD) {
+            op->result = strncmp(reply, "added", 5) == 0 ? RESULT_OK : RESULT_FAILED;
+        } else if (op->type == OP_DELIVER) {
+            op->result = strncmp(reply, "Molecule delivered", 18) == 0 ? RESULT_OK : RESULT_FAILED;
+        } else {
+            // A STATUS reply that cannot be parsed says nothing about the stock
+            op->result = parse_status(reply, op) ? RESULT_OK : RESULT_UNKNOWN;
+        }
+    }
+    if (tcp != -1) close(tcp);
+    if (udp != -1) close(udp);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Linearizability check                                              */
+/* ------------------------------------------------------------------ */
+
+/**
+ * One point of the replayed history: a request sent or a reply received
+ */
+typedef struct {
+    long long time;
+    int is_reply;
+    int slot;                      // Checker slot of the operation while it is pending
+    const Op *op;
+    uint64_t active;               // Pending slots before this event
+    long long base[NUM_ELEMENTS];  // Stock after every reply before this event
+} Event;
+
+/**
+ * A search state: the next event and the pending operations already placed
+ * The stock of a state is the base of its event plus the effect of the placed operations
+ */
+typedef struct {
+    uint32_t event;
+    uint64_t placed;
+} SearchState;
+
+/**
+ * Open-addressing set of visited search states
+ */
+typedef struct {
+    SearchState *keys;
+    unsigned char *used;
+    size_t cap, count;
+} StateSet;
+
+/**
+ * A choice point of the search: the state and the operations still to try placing there
+ */
+typedef struct {
+    SearchState state;
+    uint64_t untried;    // Operations still to try placing first
+    size_t next, end;    // Sets of operations still to try, in the jump pool
+    int expanded;        // The sets were found
+} Choice;
+
+/**
+ * Adds a state to a set
+ *
+ * @return  1 if it was added, 0 if it was already there
+ */
+static int state_set_add(StateSet *set, SearchState key) {
+    if ((set->count + 1) * 2 > set->cap) {
+        StateSet bigger = {NULL, NULL, set->cap ? set->cap * 2 : 1 << 16, 0};
+        bigger.keys = malloc(bigger.cap * sizeof(SearchState));
+        bigger.used = calloc(bigger.cap, 1);
+        if (bigger.keys == NULL || bigger.used == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < set->cap; i++) {
+            if (set->used[i]) state_set_add(&bigger, set->keys[i]);
+        }
+        free(set->keys);
+        free(set->used);
+        *set = bigger;
+    }
+    uint64_t hash = (key.placed ^ ((uint64_t)key.event << 40) ^ key.event) * 0x9E3779B97F4A7C15ULL;
+    size_t i = (size_t)(hash >> 24) & (set->cap - 1);
+    while (set->used[i]) {
+        if (set->keys[i].event == key.event && set->keys[i].placed == key.placed) return 0;
+        i = (i + 1) & (set->cap - 1);
+    }
+    set->used[i] = 1;
+    set->keys[i] = key;
+    set->count++;
+    return 1;
+}
+
+/**
+ * Whether an operation changes the stock when it takes effect
+ */
+static int has_effect(const Op *op) {
+    return op->type != OP_STATUS && op->result != RESULT_FAILED;
+}
+
+/**
+ * Whether an operation may take effect on a stock with the reply it got
+ */
+static int fits(const Op *op, const long long stock[NUM_ELEMENTS]) {
+    int enough = 1;
+    switch (op->type) {
+        case OP_ADD:
+            // The stock here stays far below MAX_ATOMS, so every ADD succeeds
+            return op->result != RESULT_FAILED;
+        case OP_DELIVER:
+            for (int e = 0; e < NUM_ELEMENTS; e++) enough &= stock[e] + op->delta[e] >= 0;
+            return op->result == RESULT_FAILED ? !enough : enough;
+        default:
+            return memcmp(stock, op->seen, sizeof(op->seen)) == 0;
+    }
+}
+
+/**
+ * The operations that held one checker slot, in event order
+ */
+typedef struct {
+    size_t *from;     // First event at which each operation was pending
+    const Op **ops;
+    size_t len, cap;
+} SlotTimeline;
+
+/**
+ * Brings pending[] to the operations pending at an event
+ * Moving forward replays the requests in between; moving back looks every
+ * slot up in its timeline
+ *
+ * @param loaded  Event pending[] currently describes; updated
+ */
+static void load_slots(const Event *events, const SlotTimeline *timelines, const Op *pending[MAX_SLOTS],
+                       size_t *loaded, size_t event) {
+    if (event >= *loaded && event - *loaded < 2 * MAX_SLOTS) {
+        for (size_t i = *loaded; i < event; i++) {
+            if (!events[i].is_reply) pending[events[i].slot] = events[i].op;
+        }
+    } else {
+        for (int s = 0; s < MAX_SLOTS; s++) {
+            const SlotTimeline *tl = &timelines[s];
+            size_t lo = 0, hi = tl->len;
+            // The last operation that took the slot at or before this event
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (tl->from[mid] <= event) lo = mid + 1; else hi = mid;
+            }
+            pending[s] = lo > 0 ? tl->ops[lo - 1] : NULL;
+        }
+    }
+    *loaded = event;
+}
+
+/**
+ * When the reply of an operation arrived; never for one without a reply
+ */
+static long long reply_time(const Op *op) {
+    return op->result == RESULT_UNKNOWN ? LLONG_MAX : op->response_ns;
+}
+
+/**
+ * Whether two operations are interchangeable in any order
+ */
+static int same_effect(const Op *a, const Op *b) {
+    return a->type == b->type && a->result == b->result && memcmp(a->delta, b->delta, sizeof(a->delta)) == 0;
+}
+
+/**
+ * Adds the effect of an operation to a stock
+ */
+static void apply_op(const Op *op, long long stock[NUM_ELEMENTS]) {
+    if (!has_effect(op)) return;
+    for (int e = 0; e < NUM_ELEMENTS; e++) stock[e] += op->delta[e];
+}
+
+/**
+ * Places every open operation without an effect that fits a stock
+ *
+ * @param placed  Placed slots; updated
+ */
+static void place_free_ops(const Op *pending[MAX_SLOTS], uint64_t active, uint64_t *placed,
+                           const long long stock[NUM_ELEMENTS]) {
+    for (uint64_t m = active & ~*placed; m; m &= m - 1) {
+        const Op *op = pending[__builtin_ctzll(m)];
+        if (!has_effect(op) && op->result != RESULT_UNKNOWN && fits(op, stock)) *placed |= m & -m;
+    }
+}
+
+/**
+ * Keeps, of the open operations with an effect, the first to be answered of each kind
+ * Swapping two interchangeable operations keeps a linearization valid, so
+ * placing the one answered first loses nothing
+ */
+static uint64_t first_of_kind(const Op *pending[MAX_SLOTS], uint64_t open) {
+    uint64_t keep = 0;
+
+    for (uint64_t m = open; m; m &= m - 1) {
+        const Op *op = pending[__builtin_ctzll(m)];
+        int first = has_effect(op);
+        for (uint64_t n = open; n && first; n &= n - 1) {
+            const Op *other = pending[__builtin_ctzll(n)];
+            if (other == op || !same_effect(op, other)) continue;
+            if (reply_time(other) < reply_time(op) || (reply_time(other) == reply_time(op) && (n & -n) < (m & -m))) {
+                first = 0;
+            }
+        }
+        if (first) keep |= m & -m;
+    }
+    return keep;
+}
+
+/**
+ * Sets of operations a STATUS reply can be explained by, for all choice points
+ */
+typedef struct {
+    uint64_t *sets;
+    size_t len, cap;
+    size_t start;      // First set of the STATUS being explained
+    int truncated;     // Some set was left out
+} JumpPool;
+
+/**
+ * Operations of one kind, by the time they were answered
+ */
+typedef struct {
+    int num_kinds;
+    int size[MAX_SLOTS];
+    uint64_t slots[MAX_SLOTS][MAX_SLOTS];
+    long long delta[MAX_SLOTS][NUM_ELEMENTS];
+    long long low[MAX_SLOTS + 1][NUM_ELEMENTS];   // Least change the kinds from here on can make
+    long long high[MAX_SLOTS + 1][NUM_ELEMENTS];  // Greatest change the kinds from here on can make
+} Kinds;
+
+/**
+ * Adds every set of operations that changes the stock by exactly the remainder
+ * Each set takes the first few of every kind
+ */
+static void find_sets(const Kinds *kinds, int k, const long long remainder[NUM_ELEMENTS], uint64_t chosen,
+                      JumpPool *pool) {
+    for (int e = 0; e < NUM_ELEMENTS; e++) {
+        if (remainder[e] < kinds->low[k][e] || remainder[e] > kinds->high[k][e]) return;
+    }
+    if (k == kinds->num_kinds) {
+        if (pool->len == pool->cap) {
+            pool->cap = pool->cap ? pool->cap * 2 : 1024;
+            pool->sets = realloc(pool->sets, pool->cap * sizeof(uint64_t));
+        }
+        pool->sets[pool->len++] = chosen;
+        return;
+    }
+    long long rest[NUM_ELEMENTS];
+    memcpy(rest, remainder, sizeof(rest));
+    for (int count = 0; count <= kinds->size[k]; count++) {
+        if (count > 0) {
+            chosen |= kinds->slots[k][count - 1];
+            for (int e = 0; e < NUM_ELEMENTS; e++) rest[e] -= kinds->delta[k][e];
+        }
+        find_sets(kinds, k + 1, rest, chosen, pool);
+        if (pool->len - pool->start >= MAX_SETS) {
+            pool->truncated = 1;
+            return;
+        }
+    }
+}
+
+// Operations sent before the STATUS being explained, for ordering its sets
+static uint64_t sent_before = 0;
+
+/**
+ * Orders sets by how far they stray from the order the requests were sent in
+ */
+static int compare_sets(const void *a, const void *b) {
+    int x = __builtin_popcountll(*(const uint64_t *)a ^ sent_before);
+    int y = __builtin_popcountll(*(const uint64_t *)b ^ sent_before);
+    return x - y;
+}
+
+/**
+ * Adds to a pool the sets of open operations that bring a stock to what a STATUS saw,
+ * closest to the order the requests were sent in first
+ *
+ * @param open  Open operations with an effect that may be placed
+ * @return      Number of sets added
+ */
+static size_t find_status_sets(const Op *pending[MAX_SLOTS], uint64_t open, const long long stock[NUM_ELEMENTS],
+                               const Op *status, JumpPool *pool) {
+    static Kinds kinds;
+    long long remainder[NUM_ELEMENTS];
+    size_t first = pool->len;
+
+    pool->start = first;
+    kinds.num_kinds = 0;
+    for (uint64_t m = open; m; m &= m - 1) {
+        const Op *op = pending[__builtin_ctzll(m)];
+        int k = 0;
+        while (k < kinds.num_kinds && !same_effect(pending[__builtin_ctzll(kinds.slots[k][0])], op)) k++;
+        if (k == kinds.num_kinds) {
+            kinds.num_kinds++;
+            kinds.size[k] = 0;
+            memcpy(kinds.delta[k], op->delta, sizeof(op->delta));
+        }
+        // Insertion by reply time
+        int i = kinds.size[k]++;
+        while (i > 0 && reply_time(pending[__builtin_ctzll(kinds.slots[k][i - 1])]) > reply_time(op)) {
+            kinds.slots[k][i] = kinds.slots[k][i - 1];
+            i--;
+        }
+        kinds.slots[k][i] = m & -m;
+    }
+    memset(kinds.low[kinds.num_kinds], 0, sizeof(kinds.low[0]));
+    memset(kinds.high[kinds.num_kinds], 0, sizeof(kinds.high[0]));
+    for (int k = kinds.num_kinds - 1; k >= 0; k--) {
+        for (int e = 0; e < NUM_ELEMENTS; e++) {
+            long long all = kinds.delta[k][e] * kinds.size[k];
+            kinds.low[k][e] = kinds.low[k + 1][e] + (all < 0 ? all : 0);
+            kinds.high[k][e] = kinds.high[k + 1][e] + (all > 0 ? all : 0);
+        }
+    }
+
+    for (int e = 0; e < NUM_ELEMENTS; e++) remainder[e] = status->seen[e] - stock[e];
+    find_sets(&kinds, 0, remainder, 0, pool);
+    sent_before = 0;
+    for (uint64_t m = open; m; m &= m - 1) {
+        if (pending[__builtin_ctzll(m)]->invoke_ns < status->invoke_ns) sent_before |= m & -m;
+    }
+    qsort(pool->sets + first, pool->len - first, sizeof(uint64_t), compare_sets);
+    return pool->len - first;
+}
+
+/**
+ * Adds to a pool, for each element a refused DELIVER uses, the deliveries
+ * sent first that run the stock short of it, with the additions they need
+ *
+ * @param open  Open operations with an effect that may be placed
+ * @return      Number of sets added
+ */
+static size_t find_shortage_sets(const Op *pending[MAX_SLOTS], uint64_t open, const long long stock[NUM_ELEMENTS],
+                                 const Op *refused, JumpPool *pool) {
+    size_t added = 0;
+
+    for (int e = 0; e < NUM_ELEMENTS; e++) {
+        long long left[NUM_ELEMENTS];
+        uint64_t set = 0, candidates = 0;
+
+        if (refused->delta[e] == 0) continue;
+        memcpy(left, stock, sizeof(left));
+        for (uint64_t m = open; m; m &= m - 1) {
+            if (pending[__builtin_ctzll(m)]->type == OP_DELIVER && pending[__builtin_ctzll(m)]->delta[e] < 0) {
+                candidates |= m & -m;
+            }
+        }
+        // The first sent, with the additions it needs first, until the element runs short
+        while (candidates != 0 && left[e] + refused->delta[e] >= 0) {
+            uint64_t pick = 0, with = 0;
+            for (uint64_t m = candidates; m; m &= m - 1) {
+                if (pick == 0 || pending[__builtin_ctzll(m)]->invoke_ns < pending[__builtin_ctzll(pick)]->invoke_ns) {
+                    pick = m & -m;
+                }
+            }
+            candidates &= ~pick;
+            const Op *delivery = pending[__builtin_ctzll(pick)];
+            long long after[NUM_ELEMENTS];
+            memcpy(after, left, sizeof(after));
+            for (int need = 0; need < NUM_ELEMENTS; need++) {
+                uint64_t adds = open & ~set & ~with;
+                while (after[need] + delivery->delta[need] < 0) {
+                    uint64_t add = 0;
+                    for (uint64_t m = adds; m; m &= m - 1) {
+                        const Op *op = pending[__builtin_ctzll(m)];
+                        if (op->type == OP_ADD && op->delta[need] > 0 &&
+                            (add == 0 || op->invoke_ns < pending[__builtin_ctzll(add)]->invoke_ns)) {
+                            add = m & -m;
+                        }
+                    }
+                    if (add == 0) break;
+                    apply_op(pending[__builtin_ctzll(add)], after);
+                    adds &= ~add;
+                    with |= add;
+                }
+            }
+            // Worth it only if the element ends up lower than it was
+            if (!fits(delivery, after) || after[e] + delivery->delta[e] >= left[e]) continue;
+            apply_op(delivery, after);
+            memcpy(left, after, sizeof(left));
+            set |= pick | with;
+        }
+        if (set != 0 && left[e] + refused->delta[e] < 0) {
+            if (pool->len == pool->cap) {
+                pool->cap = pool->cap ? pool->cap * 2 : 1024;
+                pool->sets = realloc(pool->sets, pool->cap * sizeof(uint64_t));
+            }
+            pool->sets[pool->len++] = set;
+            added++;
+        }
+    }
+    return added;
+}
+
+/**
+ * Places a set of operations on a state, deliveries first while they fit, so
+ * operations without an effect see the lowest stocks on the way too
+ *
+ * @param placed  Placed slots; updated
+ * @param stock   Stock of the state; updated
+ * @return        1 on success, 0 if no order fits
+ */
+static int place_set(const Op *pending[MAX_SLOTS], uint64_t active, uint64_t set, uint64_t *placed,
+                     long long stock[NUM_ELEMENTS]) {
+    while (set != 0) {
+        uint64_t pick = 0;
+        for (uint64_t m = set; m && pick == 0; m &= m - 1) {
+            const Op *op = pending[__builtin_ctzll(m)];
+            if (op->type == OP_DELIVER && fits(op, stock)) pick = m & -m;
+        }
+        for (uint64_t m = set; m && pick == 0; m &= m - 1) {
+            if (pending[__builtin_ctzll(m)]->type == OP_ADD) pick = m & -m;
+        }
+        if (pick == 0) return 0;
+        apply_op(pending[__builtin_ctzll(pick)], stock);
+        *placed |= pick;
+        set &= ~pick;
+        place_free_ops(pending, active, placed, stock);
+    }
+    return 1;
+}
+
+/**
+ * Whether placing an operation first can make a DELIVER take the side its reply says
+ */
+static int helps(const Op *op, const Op *target, const long long stock[NUM_ELEMENTS]) {
+    for (int e = 0; e < NUM_ELEMENTS; e++) {
+        if (target->result == RESULT_FAILED) {
+            // A refusal needs some element it uses to run short
+            if (target->delta[e] < 0 && op->delta[e] < 0) return 1;
+        } else if (stock[e] + target->delta[e] < 0 && op->delta[e] > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int compare_events(const void *a, const void *b) {
+    const Event *x = a, *y = b;
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    // A request sent at the moment another reply arrived counts as concurrent with it
+    return x->is_reply - y->is_reply;
+}
+
+/**
+ * Searches for an order of the operations that explains every reply
+ *
+ * The events are replayed in time order. At the reply of an operation that
+ * is not placed yet, the search tries placing it, then jumps that place a
+ * pending STATUS or refused DELIVER right there, then (complete search only)
+ * every other pending operation that fits, one at a time; a dead end
+ * backtracks to the last choice. Operations without an effect are placed as
+ * soon as they fit, since placing them later can never explain more. States
+ * already explored are skipped.
+ *
+ * @param complete  0 to try only the likely orders, 1 to try them all
+ * @param failed    Receives the reply the search could not get past, if any
+ * @return          1 if an order was found, 0 if there is none, -1 if the search gave up
+ */
+static int search(const Event *events, size_t num_events, const SlotTimeline *timelines, int complete,
+                  const Op **failed) {
+    const Op *pending[MAX_SLOTS] = {NULL};
+    size_t loaded = 0;
+
+    StateSet visited = {NULL, NULL, 0, 0};
+    JumpPool pool = {NULL, 0, 0, 0, 0};
+    size_t stack_cap = 1024, depth = 0, furthest = 0;
+    Choice *stack = malloc(stack_cap * sizeof(Choice));
+    SearchState st = {0, 0};
+    int verdict = -2;
+
+    while (verdict == -2) {
+        const Event *ev = &events[st.event];
+        long long stock[NUM_ELEMENTS];
+
+        // The stock of this state, then every operation without an effect that fits it
+        load_slots(events, timelines, pending, &loaded, st.event);
+        memcpy(stock, ev->base, sizeof(stock));
+        for (uint64_t m = st.placed; m; m &= m - 1) apply_op(pending[__builtin_ctzll(m)], stock);
+        place_free_ops(pending, ev->active, &st.placed, stock);
+
+        int dead = !state_set_add(&visited, st);
+        if (visited.count > MAX_STATES) {
+            *failed = events[furthest].op;
+            verdict = -1;
+            break;
+        }
+        if (!dead && st.event == num_events) {
+            verdict = 1;
+            break;
+        }
+        if (!dead && !ev->is_reply) {
+            st.event++;
+            continue;
+        }
+        if (!dead && (st.placed & (1ULL << ev->slot))) {
+            // Placed already: the operation joins the base
+            st.placed &= ~(1ULL << ev->slot);
+            st.event++;
+            continue;
+        }
+
+        if (!dead) {
+            Choice choice = {st, 0, 0, 0, 0};
+            if (st.event > furthest) furthest = st.event;
+            for (uint64_t m = first_of_kind(pending, ev->active & ~st.placed); m; m &= m - 1) {
+                const Op *op = pending[__builtin_ctzll(m)];
+                if (!fits(op, stock)) continue;
+                // The quick search only lets in what a DELIVER that does not fit yet needs
+                if (!complete && op != ev->op && (ev->op->type != OP_DELIVER || fits(ev->op, stock) ||
+                                                  !helps(op, ev->op, stock))) {
+                    continue;
+                }
+                choice.untried |= m & -m;
+            }
+            if (depth == stack_cap) {
+                stack_cap *= 2;
+                stack = realloc(stack, stack_cap * sizeof(Choice));
+            }
+            stack[depth++] = choice;
+        }
+
+        // Take the next option of the latest choice point
+        while (depth > 0 && stack[depth - 1].untried == 0 && stack[depth - 1].expanded &&
+               stack[depth - 1].next == stack[depth - 1].end) {
+            pool.len = stack[--depth].next;
+        }
+        if (depth == 0) {
+            *failed = events[furthest].op;
+            verdict = pool.truncated ? -1 : 0;
+            break;
+        }
+        Choice *choice = &stack[depth - 1];
+        const Event *at = &events[choice->state.event];
+        uint64_t target = 1ULL << at->slot;
+        st = choice->state;
+        load_slots(events, timelines, pending, &loaded, st.event);
+        memcpy(stock, at->base, sizeof(stock));
+        for (uint64_t m = st.placed; m; m &= m - 1) apply_op(pending[__builtin_ctzll(m)], stock);
+
+        // First the replied operation itself
+        if (choice->untried & target) {
+            choice->untried &= ~target;
+            st.placed |= target;
+            continue;
+        }
+        // Then straight to each pending STATUS or refused DELIVER, with the
+        // sets of operations that explain it
+        if (!choice->expanded) {
+            uint64_t open = at->active & ~st.placed, effects = 0;
+            for (uint64_t m = open; m; m &= m - 1) {
+                if (has_effect(pending[__builtin_ctzll(m)])) effects |= m & -m;
+            }
+            choice->expanded = 1;
+            choice->next = choice->end = pool.len;
+            for (uint64_t m = open & ~effects; m; m &= m - 1) {
+                const Op *op = pending[__builtin_ctzll(m)];
+                if (op->type == OP_STATUS) {
+                    choice->end += find_status_sets(pending, effects, stock, op, &pool);
+                } else {
+                    choice->end += find_shortage_sets(pending, effects, stock, op, &pool);
+                }
+            }
+        }
+        if (choice->next != choice->end) {
+            place_set(pending, at->active, pool.sets[choice->next++], &st.placed, stock);
+            continue;
+        }
+        // Then one operation at a time, which also reaches the stocks in between:
+        // operations that move the stock the reply's way first, then the server
+        // most likely ran the one sent first
+        uint64_t pick = 0;
+        for (uint64_t m = choice->untried; m; m &= m - 1) {
+            const Op *op = pending[__builtin_ctzll(m)];
+            if (pick == 0) {
+                pick = m & -m;
+                continue;
+            }
+            const Op *best = pending[__builtin_ctzll(pick)];
+            int op_helps = helps(op, at->op, stock), best_helps = helps(best, at->op, stock);
+            if (op_helps > best_helps || (op_helps == best_helps && op->invoke_ns < best->invoke_ns)) pick = m & -m;
+        }
+        choice->untried &= ~pick;
+        st.placed |= pick;
+    }
+
+    free(stack);
+    free(pool.sets);
+    free(visited.keys);
+    free(visited.used);
+    return verdict;
+}
+
+/**
+ * Checks a history for linearizability against the stock model
+ * The requests and replies become events in time order, and search() looks
+ * for an order of the operations that explains them
+ *
+ * @param ops      Every operation, from all clients
+ * @param num_ops  Number of operations
+ * @param initial  Stock before the first operation
+ * @param failed   Receives the reply the search could not get past, if any
+ * @return         1 if linearizable, 0 if not, -1 if the check gave up
+ */
+static int check_history(const Op *ops, size_t num_ops, const long long initial[NUM_ELEMENTS], const Op **failed) {
+    Event *events = malloc((2 * num_ops + 1) * sizeof(Event));
+    const Op *slots[MAX_SLOTS] = {NULL};
+    size_t num_events = 0;
+
+    for (size_t i = 0; i < num_ops; i++) {
+        // A STATUS without a reply says nothing
+        if (ops[i].type == OP_STATUS && ops[i].result == RESULT_UNKNOWN) continue;
+        events[num_events++] = (Event){ops[i].invoke_ns, 0, -1, &ops[i], 0, {0}};
+        if (ops[i].result != RESULT_UNKNOWN) events[num_events++] = (Event){ops[i].response_ns, 1, -1, &ops[i], 0, {0}};
+    }
+    qsort(events, num_events, sizeof(Event), compare_events);
+
+    // Slots, pending sets and base stocks follow from the event order alone
+    uint64_t active = 0;
+    long long base[NUM_ELEMENTS];
+    memcpy(base, initial, sizeof(base));
+    for (size_t i = 0; i < num_events; i++) {
+        Event *ev = &events[i];
+        ev->active = active;
+        memcpy(ev->base, base, sizeof(base));
+        if (!ev->is_reply) {
+            if (active == ~0ULL) {
+                free(events);
+                return -1;
+            }
+            ev->slot = __builtin_ctzll(~active);
+            slots[ev->slot] = ev->op;
+            active |= 1ULL << ev->slot;
+        } else {
+            for (uint64_t m = active; m; m &= m - 1) {
+                if (slots[__builtin_ctzll(m)] == ev->op) ev->slot = __builtin_ctzll(m);
+            }
+            active &= ~(1ULL << ev->slot);
+            if (has_effect(ev->op)) {
+                for (int e = 0; e < NUM_ELEMENTS; e++) base[e] += ev->op->delta[e];
+            }
+        }
+    }
+    events[num_events].active = active;
+    memcpy(events[num_events].base, base, sizeof(base));
+
+    // Which operation holds each slot from which event on
+    SlotTimeline timelines[MAX_SLOTS];
+    memset(timelines, 0, sizeof(timelines));
+    for (size_t i = 0; i < num_events; i++) {
+        if (events[i].is_reply) continue;
+        SlotTimeline *tl = &timelines[events[i].slot];
+        if (tl->len == tl->cap) {
+            tl->cap = tl->cap ? tl->cap * 2 : 256;
+            tl->from = realloc(tl->from, tl->cap * sizeof(*tl->from));
+            tl->ops = realloc(tl->ops, tl->cap * sizeof(*tl->ops));
+        }
+        tl->from[tl->len] = i + 1;
+        tl->ops[tl->len++] = events[i].op;
+    }
+    // A quick search first; only a history it cannot explain gets the complete one
+    int verdict = search(events, num_events, timelines, 0, failed);
+    if (verdict != 1) {
+        const Op *quick_failed = *failed;
+        verdict = search(events, num_events, timelines, 1, failed);
+        if (verdict == -1) *failed = quick_failed;
+    }
+
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        free(timelines[i].from);
+        free(timelines[i].ops);
+    }
+    free(events);
+    return verdict;
+}
+
+/* ------------------------------------------------------------------ */
+/* Runs                                                               */
+/* ------------------------------------------------------------------ */
+
+/**
+ * Reads the live stock from the end of the save file
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int read_file_stock(const char *path, long long stock[NUM_ELEMENTS]) {
+    unsigned long long counters[NUM_ELEMENTS];
+    int fd = open(path, O_RDONLY);
+    off_t size = fd == -1 ? -1 : lseek(fd, 0, SEEK_END);
+    int ok = size >= (off_t)sizeof(counters) &&
+             pread(fd, counters, sizeof(counters), size - sizeof(counters)) == (ssize_t)sizeof(counters);
+    if (fd != -1) close(fd);
+    if (!ok) return -1;
+    for (int e = 0; e < NUM_ELEMENTS; e++) stock[e] = (long long)counters[e];
+    return 0;
+}
+
+/**
+ * Writes the history, one operation per line in send order of each client:
+ * client, send and reply time in microseconds from the start, request, reply
+ */
+static void write_history(const char *path, const Op *ops, size_t num_ops) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return;
+    }
+    for (size_t i = 0; i < num_ops; i++) {
+        const Op *op = &ops[i];
+        fprintf(out, "%d %.1f ", op->client, (op->invoke_ns - epoch_ns) / 1e3);
+        if (op->result == RESULT_UNKNOWN) {
+            fprintf(out, "- ");
+        } else {
+            fprintf(out, "%.1f ", (op->response_ns - epoch_ns) / 1e3);
+        }
+        fprintf(out, "%s -> %s\n", op->request, op->reply);
+    }
+    fclose(out);
+}
+
+/**
+ * Runs one lock mode: starts the servers, drives the clients, checks the history
+ *
+ * @return  1 if the history was linearizable and atoms were conserved, 0 otherwise
+ */
+static int run_mode(const char *binary, const char *mode, int servers, int clients, int seconds, int add_percent,
+                    int status_percent, int threads, int base_port, const char *history_prefix) {
+    char save_path[64];
+    pid_t pids[MAX_SERVERS];
+    int consoles[MAX_SERVERS], ok = 1;
+    static Client pool[MAX_CLIENTS + 1];
+
+    snprintf(save_path, sizeof(save_path), "/tmp/bench_contention_%d.dat", (int)getpid());
+    unlink(save_path);
+
+    // The first server creates the file; the others join it
+    for (int i = 0; i < servers; i++) {
+        pids[i] = start_server(binary, base_port + 2 * i, save_path, mode, threads, &consoles[i]);
+        int fd = -1;
+        for (int t = 0; t < 200 && pids[i] != -1 && (fd = connect_tcp(base_port + 2 * i, 1000)) == -1; t++) {
+            usleep(10000);
+        }
+        if (fd == -1) {
+            fprintf(stderr, "%s: server %d did not start\n", mode, i + 1);
+            for (int j = 0; j <= i; j++) {
+                if (pids[j] != -1) kill(pids[j], SIGKILL);
+            }
+            while (wait(NULL) > 0) {}
+            unlink(save_path);
+            return 0;
+        }
+        close(fd);
+    }
+
+    stop_clients = 0;
+    long long start = now_ns();
+    for (int i = 0; i < clients; i++) {
+        Client *client = &pool[i];
+        free(client->ops);
+        memset(client, 0, sizeof(*client));
+        client->id = i;
+        client->tcp_port = base_port + 2 * (i % servers);
+        client->add_percent = add_percent;
+        client->status_percent = status_percent;
+        client->timeout_ms = 2000;
+        client->seed = 777u + i;
+        pthread_create(&client->thread, NULL, client_main, client);
+    }
+    sleep(seconds);
+    __atomic_store_n(&stop_clients, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < clients; i++) pthread_join(pool[i].thread, NULL);
+    long long wall = now_ns() - start;
+
+    // Once every client stopped, every server must show the same final stock
+    Client *final = &pool[clients];
+    free(final->ops);
+    memset(final, 0, sizeof(*final));
+    final->id = clients;
+    final->timeout_ms = 2000;
+    for (int i = 0; i < servers; i++) status_request(final, base_port + 2 * i);
+    long long file_stock[NUM_ELEMENTS] = {-1, -1, -1};
+    int file_ok = read_file_stock(save_path, file_stock) == 0;
+
+    for (int i = 0; i < servers; i++) {
+        kill(pids[i], SIGTERM);
+        close(consoles[i]);
+    }
+    while (wait(NULL) > 0) {}
+    unlink(save_path);
+
+    // Merge the histories
+    size_t num_ops = 0, n = 0;
+    for (int i = 0; i <= clients; i++) num_ops += pool[i].num_ops;
+    Op *ops = malloc(num_ops * sizeof(Op));
+    for (int i = 0; i <= clients; i++) {
+        memcpy(ops + n, pool[i].ops, pool[i].num_ops * sizeof(Op));
+        n += pool[i].num_ops;
+    }
+
+    long long initial[NUM_ELEMENTS] = {INITIAL_CARBON, INITIAL_HYDROGEN, INITIAL_OXYGEN};
+    long long expected[NUM_ELEMENTS];
+    unsigned long long counts[3][3] = {{0}};  // [type][result]
+    memcpy(expected, initial, sizeof(expected));
+    for (size_t i = 0; i < num_ops; i++) {
+        counts[ops[i].type][ops[i].result]++;
+        if (ops[i].result == RESULT_OK && ops[i].type != OP_STATUS) {
+            for (int e = 0; e < NUM_ELEMENTS; e++) expected[e] += ops[i].delta[e];
+        }
+    }
+    unsigned long long unknown = counts[OP_ADD][RESULT_UNKNOWN] + counts[OP_DELIVER][RESULT_UNKNOWN] +
+                                 counts[OP_STATUS][RESULT_UNKNOWN];
+
+    // Conservation: exact only if every update got its reply
+    const char *conservation = "ok";
+    int finals = 0;
+    for (size_t i = 0; i < final->num_ops; i++) {
+        if (final->ops[i].result != RESULT_OK) continue;
+        finals++;
+        if (memcmp(final->ops[i].seen, expected, sizeof(expected)) != 0) conservation = "MISMATCH";
+    }
+    if (!file_ok || memcmp(file_stock, expected, sizeof(expected)) != 0) conservation = "MISMATCH";
+    if (finals != servers) conservation = "NO FINAL STOCK";
+    if (counts[OP_ADD][RESULT_UNKNOWN] + counts[OP_DELIVER][RESULT_UNKNOWN] > 0 && strcmp(conservation, "ok") != 0) {
+        conservation = "unknown (updates without reply)";
+    }
+
+    // Atomic mode keeps only conservation, so its history is not checked
+    int checked = strcmp(mode, "atomic") != 0;
+    long long check_start = now_ns();
+    const Op *bad = NULL;
+    int verdict = checked ? check_history(ops, num_ops, initial, &bad) : 1;
+    double check_s = (now_ns() - check_start) / 1e9;
+
+    printf("%-7s %8zu %10.0f %9llu/%-9llu %9llu/%-9llu %8llu %7llu  %-10s %s (%.1f s)\n", mode, num_ops,
+           (num_ops - final->num_ops) / (wall / 1e9), counts[OP_ADD][RESULT_OK], counts[OP_ADD][RESULT_FAILED],
+           counts[OP_DELIVER][RESULT_OK], counts[OP_DELIVER][RESULT_FAILED], counts[OP_STATUS][RESULT_OK], unknown,
+           conservation,
+           !checked ? "not checked" : verdict == 1 ? "linearizable" : verdict == 0 ? "NOT LINEARIZABLE" : "undecided",
+           check_s);
+    if (strcmp(conservation, "ok") != 0 && strncmp(conservation, "unknown", 7) != 0) {
+        printf("        expected C=%lld H=%lld O=%lld, save file C=%lld H=%lld O=%lld\n", expected[0], expected[1],
+               expected[2], file_stock[0], file_stock[1], file_stock[2]);
+        ok = 0;
+    }
+    if (verdict != 1 && bad != NULL) {
+        printf("        client %d: %s -> %s, sent at %.1f us, reply at %.1f us: %s\n", bad->client, bad->request,
+               bad->reply, (bad->invoke_ns - epoch_ns) / 1e3, (bad->response_ns - epoch_ns) / 1e3,
+               verdict == 0 ? "no order explains this reply" : "the likely orders do not explain this reply");
+    }
+    if (verdict == -1) {
+        printf("        undecided: the search gave up after %d states; run fewer clients (-c) or a shorter run (-d)\n",
+               MAX_STATES);
+    }
+    if (verdict != 1) ok = 0;
+    fflush(stdout);
+
+    if (history_prefix != NULL) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s.%s.log", history_prefix, mode);
+        write_history(path, ops, num_ops);
+    }
+    free(ops);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int servers = 3, clients = 8, seconds = 2, add_percent = 45, status_percent = 10, threads = 1;
+    int base_port = 26000, opt;
+    const char *only_mode = NULL, *history_prefix = NULL;
+    const char *modes[] = {"flock", "fcntl", "mutex", "atomic"};
+
+    while ((opt = getopt(argc, argv, "k:c:d:l:a:r:t:o:p:")) != -1) {
+        switch (opt) {
+            case 'k': servers = atoi(optarg); break;
+            case 'c': clients = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'l': only_mode = optarg; break;
+            case 'a': add_percent = atoi(optarg); break;
+            case 'r': status_percent = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'o': history_prefix = optarg; break;
+            case 'p': base_port = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-k servers] [-c clients] [-d seconds] [-l mode] [-a add%%] [-r status%%] [-t server-threads] [-o history-prefix] [-p base-port] <drinks_bar>\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || servers < 1 || servers > MAX_SERVERS || clients < 1 || clients > MAX_CLIENTS ||
+        seconds < 1 || add_percent < 0 || status_percent < 0 || add_percent + status_percent > 100 || threads < 1) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+    int known_mode = only_mode == NULL;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]) && !known_mode; m++) {
+        known_mode = strcmp(only_mode, modes[m]) == 0;
+    }
+    if (!known_mode) {
+        fprintf(stderr, "-l needs a locked mode: flock, fcntl, mutex or atomic\n");
+        return 1;
+    }
+    const char *binary = argv[optind];
+    signal(SIGPIPE, SIG_IGN);
+    epoch_ns = now_ns();
+
+    printf("%d servers on one save file, %d clients, %d s per mode, %d%% ADD, %d%% STATUS, rest DELIVER\n", servers,
+           clients, seconds, add_percent, status_percent);
+    printf("%-7s %8s %10s %19s %19s %8s %7s  %-10s %s\n", "mode", "ops", "ops/s", "ADD ok/err", "DELIVER ok/err",
+           "STATUS", "no-rep", "atoms", "history");
+
+    int all_ok = 1;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        if (only_mode != NULL && strcmp(only_mode, modes[m]) != 0) continue;
+        all_ok &= run_mode(binary, modes[m], servers, clients, seconds, add_percent, status_percent, threads,
+                           base_port + 100 * (int)m, history_prefix);
+    }
+    return all_ok ? 0 : 1;
+}
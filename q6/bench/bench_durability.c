@@ -0,0 +1,256 @@
+/*
+ * bench_durability - ADD latency histograms of drinks_bar by --durability mode
+ *
+ * For every mode M the benchmark starts
+ * `drinks_bar -f <dir>/bench_durability.save --durability M --threads T`,
+ * runs C closed-loop clients that send ADD over TCP, and prints the
+ * throughput and the histogram of the reply latency seen by the clients,
+ * followed by the server's own update and msync latency lines (from STATS).
+ *
+ * The save file goes to <dir> (default: the current directory), which should
+ * be on the disk being measured rather than on a tmpfs.
+ *
+ * Usage: bench_durability [-c clients] [-n threads] [-d seconds] [-i sync-interval-ms] [-D dir] [-p base-port] <drinks_bar>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "latency.h"
+
+#define BUFFER_SIZE 1024
+
+static const char *modes[] = {"none", "periodic", "per-op"};
+#define NUM_MODES 3
+
+/**
+ * State of one simulated client thread
+ */
+typedef struct {
+    pthread_t thread;
+    int tcp_port;
+    long long ops;     // Completed operations
+    long long errors;  // Failed operations
+} Client;
+
+static volatile int running = 0;
+
+// Reply latency of every client operation of the current mode
+static LatencyHistogram client_latency;
+
+/**
+ * Creates a TCP socket connected to 127.0.0.1:port
+ *
+ * @return  Connected socket, or -1 on failure
+ */
+static int connect_local(int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Starts drinks_bar on a fresh save file
+ *
+ * @param binary       Path of the drinks_bar binary
+ * @param tcp_port     TCP port (UDP uses tcp_port + 1)
+ * @param threads      Value passed to --threads
+ * @param mode         Value passed to --durability
+ * @param interval_ms  Value passed to --sync-interval
+ * @param save_path    Save file
+ * @param out_path     File that receives the server's output
+ * @param console_fd   Receives the write end of the console pipe
+ * @return             Child pid, or -1 on failure
+ */
+static pid_t start_server(const char *binary, int tcp_port, int threads, const char *mode, int interval_ms,
+                          const char *save_path, const char *out_path, int *console_fd) {
+    int pipefd[2];
+
+    unlink(save_path);
+    if (pipe(pipefd) == -1) return -1;
+
+    pid_t pid = fork();
+    if (pid == -1) return -1;
+    if (pid == 0) {
+        char tcp[16], udp[16], nthreads[16], interval[16];
+        snprintf(tcp, sizeof(tcp), "%d", tcp_port);
+        snprintf(udp, sizeof(udp), "%d", tcp_port + 1);
+        snprintf(nthreads, sizeof(nthreads), "%d", threads);
+        snprintf(interval, sizeof(interval), "%d", interval_ms);
+
+        int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(pipefd[0], STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execl(binary, binary, "-T", tcp, "-U", udp, "--threads", nthreads, "-f", save_path, "--durability", mode,
+              "--sync-interval", interval, (char *)NULL);
+        _exit(127);
+    }
+    close(pipefd[0]);
+    *console_fd = pipefd[1];
+
+    // Wait until the server accepts connections
+    for (int i = 0; i < 200; i++) {
+        int fd = connect_local(tcp_port);
+        if (fd != -1) {
+            close(fd);
+            return pid;
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(*console_fd);
+    return -1;
+}
+
+/**
+ * Client thread: one ADD at a time over TCP until the run ends
+ */
+static void *client_main(void *arg) {
+    Client *c = arg;
+    char reply[BUFFER_SIZE];
+    const char *cmd = "ADD OXYGEN 1\n";
+    int one = 1;
+
+    int tcp = connect_local(c->tcp_port);
+    if (tcp == -1) {
+        c->errors++;
+        return NULL;
+    }
+    setsockopt(tcp, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    while (running) {
+        unsigned long long start = latency_now_ns();
+        if (send(tcp, cmd, strlen(cmd), 0) == -1 || recv(tcp, reply, sizeof(reply), 0) <= 0) {
+            c->errors++;
+            break;
+        }
+        latency_record(&client_latency, latency_now_ns() - start);
+        c->ops++;
+    }
+    close(tcp);
+    return NULL;
+}
+
+/**
+ * Copies the server's latency lines (STATS) to stdout
+ */
+static void print_server_latency(const char *out_path) {
+    char line[512];
+    FILE *out = fopen(out_path, "r");
+    if (out == NULL) return;
+    while (fgets(line, sizeof(line), out) != NULL) {
+        if (strncmp(line, "Update latency", 14) == 0 || strncmp(line, "msync latency", 13) == 0) {
+            printf("server %s", line);
+        }
+    }
+    fclose(out);
+}
+
+int main(int argc, char *argv[]) {
+    int clients = 8, threads = 4, seconds = 3, interval_ms = 100, base_port = 22600, opt;
+    const char *dir = ".";
+
+    while ((opt = getopt(argc, argv, "c:n:d:i:D:p:")) != -1) {
+        switch (opt) {
+            case 'c': clients = atoi(optarg); break;
+            case 'n': threads = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'i': interval_ms = atoi(optarg); break;
+            case 'D': dir = optarg; break;
+            case 'p': base_port = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-c clients] [-n threads] [-d seconds] [-i sync-interval-ms] [-D dir] [-p base-port] <drinks_bar>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind >= argc || clients <= 0 || threads <= 0 || seconds <= 0 || interval_ms <= 0) {
+        fprintf(stderr, "Usage: %s [-c clients] [-n threads] [-d seconds] [-i sync-interval-ms] [-D dir] [-p base-port] <drinks_bar>\n", argv[0]);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char save_path[4096], out_path[4096];
+    snprintf(save_path, sizeof(save_path), "%s/bench_durability_%d.save", dir, (int)getpid());
+    snprintf(out_path, sizeof(out_path), "%s/bench_durability_%d.out", dir, (int)getpid());
+
+    Client *pool = calloc(clients, sizeof(Client));
+    if (pool == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    printf("ADD over TCP, %d clients, %d reactor threads, %d s per mode, sync interval %d ms, save file in %s\n",
+           clients, threads, seconds, interval_ms, dir);
+    int port = base_port;
+    for (int m = 0; m < NUM_MODES; m++, port += 2) {
+        int console_fd;
+        pid_t pid = start_server(argv[optind], port, threads, modes[m], interval_ms, save_path, out_path, &console_fd);
+        if (pid == -1) {
+            printf("\n--durability %s: failed to start server\n", modes[m]);
+            continue;
+        }
+
+        memset(&client_latency, 0, sizeof(client_latency));
+        running = 1;
+        for (int i = 0; i < clients; i++) {
+            memset(&pool[i], 0, sizeof(Client));
+            pool[i].tcp_port = port;
+            pthread_create(&pool[i].thread, NULL, client_main, &pool[i]);
+        }
+        unsigned long long start = latency_now_ns();
+        sleep(seconds);
+        running = 0;
+
+        long long ops = 0, errors = 0;
+        for (int i = 0; i < clients; i++) {
+            pthread_join(pool[i].thread, NULL);
+            ops += pool[i].ops;
+            errors += pool[i].errors;
+        }
+        double elapsed = (latency_now_ns() - start) / 1e9;
+
+        // STATS prints the server's histograms, then the server exits
+        // (one console line per wakeup: the console reads with stdio)
+        if (write(console_fd, "STATS\n", 6) != 6) kill(pid, SIGTERM);
+        usleep(200000);
+        if (write(console_fd, "quit\n", 5) != 5) kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        close(console_fd);
+
+        printf("\n--durability %s: %.0f ops/s, %lld errors\n", modes[m], ops / elapsed, errors);
+        latency_print(stdout, "client reply latency", &client_latency);
+        print_server_latency(out_path);
+        fflush(stdout);
+    }
+
+    unlink(save_path);
+    unlink(out_path);
+    free(pool);
+    return 0;
+}
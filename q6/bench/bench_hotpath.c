@@ -0,0 +1,339 @@
+/*
+ * bench_hotpath - in-process cost of the stock hot paths, per lock mode
+ *
+ * Calls the server's own functions directly, with no sockets in between:
+ *   atom_adder            ADD OXYGEN 1 on the stock
+ *   molecule_subtract     DELIVER WATER 1 on the stock
+ *   capacity_drink        GEN SOFT DRINK (the cached successor of q3-q5's
+ *                         calculate_drink_production)
+ *   process_tcp_command   "ADD OXYGEN 1": parse, update, print_stock, reply
+ *   process_udp_command   "DELIVER WATER 1": query check, parse, update, reply
+ * process_*_command come from drinks_bar.c itself, built without its main()
+ * (-DDRINKS_BAR_NO_MAIN). Their print_stock() output goes to /dev/null.
+ *
+ * Every function runs against a fresh save file in each locked backend
+ * (flock, fcntl range locks, shared mutex, atomics) and against the
+ * in-memory stock:
+ *   1 proc   ns/op and cycles/op of one process alone
+ *   P procs  ns/op inside each of P processes that map the same save file,
+ *            and their total ops/s
+ * Cycles are read from the time stamp counter on x86 (reference cycles at
+ * the nominal clock); other machines report nanoseconds in that column.
+ *
+ * A function whose single-process cycles/op exceeds its budget (-b) is
+ * marked OVER and the exit status is 1. -b takes a default budget for
+ * every function and/or name=cycles pairs, e.g. -b 20000,capacity_drink=500
+ *
+ * Usage: bench_hotpath [-n ops] [-p procs] [-b budgets] [-f save-file]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "stock.h"
+#include "capacity.h"
+#include "registry.h"
+
+#define MAX_PROCS 64
+#define INITIAL_ATOMS 1000000000000ULL  // Enough that no ADD or DELIVER of a run fails
+#define DEFAULT_BUDGET 50000ULL         // Cycles per operation
+#define REPLY_SIZE 256
+
+// From drinks_bar.c, built with -DDRINKS_BAR_NO_MAIN
+size_t process_tcp_command(const char *cmd, AtomStock *stock, char *reply, size_t reply_size);
+size_t process_udp_command(const char *cmd, AtomStock *stock, char *reply, size_t reply_size);
+
+/**
+ * One measured function: performs a single operation
+ *
+ * @return  1 if the operation did what it should, 0 if not
+ */
+typedef int (*HotpathOp)(void);
+
+/**
+ * A measured function and its cycle budget
+ */
+typedef struct {
+    const char *name;
+    HotpathOp op;
+    unsigned long long budget;  // Cycles per operation in one process, 0 for the default
+} HotpathCase;
+
+/**
+ * A backend: a lock mode with or without a save file
+ */
+typedef struct {
+    const char *name;
+    StockLockMode mode;
+    int save_file;
+} Backend;
+
+/**
+ * Per-process results, kept in an anonymous shared mapping
+ */
+typedef struct {
+    long long elapsed_ns;
+    unsigned long long cycles;
+    long failures;
+    int ok;  // The process opened the save file and ran its operations
+} OpResult;
+
+static int soft_drink = -1;
+
+static const Backend backends[] = {
+    {"memory", LOCK_MODE_FLOCK, 0},
+    {"flock", LOCK_MODE_FLOCK, 1},
+    {"fcntl", LOCK_MODE_FCNTL, 1},
+    {"mutex", LOCK_MODE_MUTEX, 1},
+    {"atomic", LOCK_MODE_ATOMIC, 1},
+};
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Returns a cycle count: the time stamp counter on x86, nanoseconds elsewhere
+ */
+static unsigned long long read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return (unsigned long long)now_ns();
+#endif
+}
+
+static int op_atom_adder(void) {
+    return atom_adder(stock_ptr, "OXYGEN", 1);
+}
+
+static int op_molecule_subtract(void) {
+    return molecule_subtract(stock_ptr, "WATER", 1);
+}
+
+static int op_capacity_drink(void) {
+    return capacity_drink(soft_drink, NULL) > 0;
+}
+
+static int op_process_tcp_command(void) {
+    char reply[REPLY_SIZE];
+    process_tcp_command("ADD OXYGEN 1", stock_ptr, reply, sizeof(reply));
+    return reply[0] == 'a';
+}
+
+static int op_process_udp_command(void) {
+    char reply[REPLY_SIZE];
+    process_udp_command("DELIVER WATER 1", stock_ptr, reply, sizeof(reply));
+    return reply[0] == 'M';
+}
+
+static HotpathCase cases[] = {
+    {"atom_adder", op_atom_adder, 0},
+    {"molecule_subtract", op_molecule_subtract, 0},
+    {"capacity_drink", op_capacity_drink, 0},
+    {"process_tcp_command", op_process_tcp_command, 0},
+    {"process_udp_command", op_process_udp_command, 0},
+};
+
+#define NUM_CASES ((int)(sizeof(cases) / sizeof(cases[0])))
+
+/**
+ * Parses the -b list: a bare number sets the default budget, name=cycles sets one function's
+ *
+ * @param list            List such as "20000,capacity_drink=500"
+ * @param default_budget  Receives the default budget if the list has one
+ * @return                1 on success, 0 if an entry is invalid
+ */
+static int parse_budgets(const char *list, unsigned long long *default_budget) {
+    char copy[512];
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        if (eq == NULL) {
+            *default_budget = strtoull(tok, NULL, 10);
+            if (*default_budget == 0) return 0;
+            continue;
+        }
+        *eq = '\0';
+        int found = 0;
+        for (int c = 0; c < NUM_CASES; c++) {
+            if (strcmp(cases[c].name, tok) == 0) {
+                cases[c].budget = strtoull(eq + 1, NULL, 10);
+                found = cases[c].budget > 0;
+            }
+        }
+        if (!found) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Body of one worker process: opens the stock and times ops calls of one function
+ * A tenth of ops runs first, untimed, to warm caches and the capacity cache
+ */
+static void run_worker(const Backend *backend, const char *path, const HotpathCase *hc, long ops, OpResult *result) {
+    if (backend->save_file && stock_open_save_file(path) == -1) _exit(1);
+
+    for (long i = 0; i < ops / 10; i++) hc->op();
+
+    long failures = 0;
+    long long start = now_ns();
+    unsigned long long start_cycles = read_cycles();
+    for (long i = 0; i < ops; i++) {
+        if (!hc->op()) failures++;
+    }
+    result->cycles = read_cycles() - start_cycles;
+    result->elapsed_ns = now_ns() - start;
+    result->failures = failures;
+    result->ok = 1;
+    fflush(stdout);
+    _exit(0);
+}
+
+/**
+ * Runs one function in procs processes sharing a fresh save file (or each
+ * with its own in-memory stock)
+ *
+ * @param results  Receives one result per process
+ * @param wall_ns  Receives the time until the last process finished
+ * @return         1 if every process ran, 0 otherwise
+ */
+static int run_case(const Backend *backend, const char *path, const HotpathCase *hc, int procs, long ops,
+                    OpResult *results, long long *wall_ns) {
+    memset(results, 0, sizeof(OpResult) * procs);
+    unlink(path);
+    // The first process creates the save file from in_memory_stock
+    in_memory_stock.carbon = in_memory_stock.hydrogen = in_memory_stock.oxygen = INITIAL_ATOMS;
+    stock_lock_mode = backend->mode;
+    fflush(stdout);
+
+    long long start = now_ns();
+    for (int i = 0; i < procs; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) run_worker(backend, path, hc, ops, &results[i]);
+    }
+    int ok = 1, status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = 0;
+    }
+    *wall_ns = now_ns() - start;
+    for (int i = 0; i < procs; i++) ok &= results[i].ok && results[i].failures == 0;
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    long ops = 200000;
+    int procs = 4, opt;
+    unsigned long long default_budget = DEFAULT_BUDGET;
+    char default_path[64];
+    const char *path = default_path;
+
+    snprintf(default_path, sizeof(default_path), "/tmp/bench_hotpath_%d.dat", (int)getpid());
+
+    while ((opt = getopt(argc, argv, "n:p:b:f:")) != -1) {
+        switch (opt) {
+            case 'n': ops = atol(optarg); break;
+            case 'p': procs = atoi(optarg); break;
+            case 'b':
+                if (!parse_budgets(optarg, &default_budget)) {
+                    fprintf(stderr, "invalid budget list: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f': path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n ops] [-p procs] [-b budgets] [-f save-file]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (ops <= 0 || procs <= 0 || procs > MAX_PROCS) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+    soft_drink = registry_drink_id("SOFT DRINK");
+
+    OpResult *results = mmap(NULL, sizeof(OpResult) * MAX_PROCS, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    // The report keeps the real stdout; the server code prints the stock on every update
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("/dev/null");
+        return 1;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    const char *cycle_unit = "TSC cycles";
+#else
+    const char *cycle_unit = "ns (no cycle counter)";
+#endif
+    fprintf(report, "%ld ops per process, %d contending processes, save file %s, cycles are %s\n", ops, procs, path,
+            cycle_unit);
+    fprintf(report, "%-20s %-7s %10s %10s %12s %14s  %s\n", "function", "backend", "ns/op", "cycles/op",
+            "ns/op", "ops/s", "budget");
+    fprintf(report, "%-20s %-7s %21s %27s\n", "", "", "------ 1 proc ------", "------- P procs -------");
+
+    int all_ok = 1;
+    for (int c = 0; c < NUM_CASES; c++) {
+        const HotpathCase *hc = &cases[c];
+        unsigned long long budget = hc->budget ? hc->budget : default_budget;
+        for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+            const Backend *backend = &backends[b];
+            long long wall;
+
+            if (!run_case(backend, path, hc, 1, ops, results, &wall)) {
+                fprintf(report, "%-20s %-7s FAILED (%ld of %ld operations failed)\n", hc->name, backend->name,
+                        results[0].failures, ops);
+                all_ok = 0;
+                continue;
+            }
+            double single_ns = (double)results[0].elapsed_ns / ops;
+            double single_cycles = (double)results[0].cycles / ops;
+            int over = single_cycles > (double)budget;
+
+            // Without a save file every process has a stock of its own, so only
+            // the locked backends contend
+            double shared_ns = 0, shared_rate = 0;
+            int shared_ok = !backend->save_file || run_case(backend, path, hc, procs, ops, results, &wall);
+            if (backend->save_file && shared_ok) {
+                long long busy = 0;
+                for (int i = 0; i < procs; i++) busy += results[i].elapsed_ns;
+                shared_ns = (double)busy / ((double)ops * procs);
+                shared_rate = (double)ops * procs / (wall / 1e9);
+            }
+
+            char shared_ns_text[32] = "-", shared_rate_text[32] = "-";
+            if (!shared_ok) {
+                snprintf(shared_ns_text, sizeof(shared_ns_text), "FAILED");
+            } else if (backend->save_file) {
+                snprintf(shared_ns_text, sizeof(shared_ns_text), "%.1f", shared_ns);
+                snprintf(shared_rate_text, sizeof(shared_rate_text), "%.0f", shared_rate);
+            }
+            fprintf(report, "%-20s %-7s %10.1f %10.0f %12s %14s  %s (%llu)\n", hc->name, backend->name, single_ns,
+                    single_cycles, shared_ns_text, shared_rate_text, over ? "OVER" : "ok", budget);
+            fflush(report);
+            all_ok &= !over && shared_ok;
+        }
+    }
+    unlink(path);
+    return all_ok ? 0 : 1;
+}
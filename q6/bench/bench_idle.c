@@ -0,0 +1,254 @@
+/*
+ * bench_idle - event loop cost versus number of idle connections
+ *
+ * For each server binary and each connection count N the benchmark:
+ *   1. starts the server on a private TCP/UDP port pair,
+ *   2. opens N idle TCP connections that never send anything,
+ *   3. measures the round-trip time of ADD commands on one extra active connection.
+ *
+ * With select() every wakeup scans descriptors 0..maxfd, so the round trip grows
+ * with N; with epoll only the ready descriptor is visited.
+ *
+ * The default base port (21000) sits below the Linux ephemeral range so the
+ * idle client sockets never collide with the ports the servers bind.
+ *
+ * Usage: bench_idle [-r rounds] [-n N1,N2,...] [-p base-port] <server-binary>...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_COUNTS 16
+#define BUFFER_SIZE 1024
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Comparison function for qsort on long long values
+ */
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Connects a TCP socket to 127.0.0.1:port
+ *
+ * @param port  Server TCP port
+ * @return      Connected socket, or -1 on failure
+ */
+static int connect_local(int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Starts a server binary with its console attached to a pipe that stays open
+ *
+ * @param binary      Path of the drinks_bar binary
+ * @param tcp_port    TCP port to listen on
+ * @param max_conns   Value passed to --max-clients
+ * @param console_fd  Receives the write end of the console pipe
+ * @return            Child pid, or -1 on failure
+ */
+static pid_t start_server(const char *binary, int tcp_port, int max_conns, int *console_fd) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1) return -1;
+
+    pid_t pid = fork();
+    if (pid == -1) return -1;
+    if (pid == 0) {
+        char tcp[16], udp[16], maxc[16];
+        snprintf(tcp, sizeof(tcp), "%d", tcp_port);
+        snprintf(udp, sizeof(udp), "%d", tcp_port + 1);
+        snprintf(maxc, sizeof(maxc), "%d", max_conns);
+
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(pipefd[0], STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execl(binary, binary, "-T", tcp, "-U", udp, "--max-clients", maxc, (char *)NULL);
+        perror("execl");
+        _exit(127);
+    }
+    close(pipefd[0]);
+    *console_fd = pipefd[1];
+
+    // Wait until the server accepts connections
+    for (int i = 0; i < 200; i++) {
+        int fd = connect_local(tcp_port);
+        if (fd != -1) {
+            close(fd);
+            return pid;
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(*console_fd);
+    return -1;
+}
+
+/**
+ * Runs one measurement: N idle connections plus one active ping-pong connection
+ *
+ * @param binary    Server binary
+ * @param port      TCP port for this run
+ * @param idle      Number of idle connections
+ * @param rounds    Number of measured ADD round trips
+ * @param p50       Receives the median round trip in microseconds
+ * @param p99       Receives the 99th percentile round trip in microseconds
+ * @return          Mean round trip in microseconds, or -1 if the run failed
+ */
+static double run_one(const char *binary, int port, int idle, int rounds, double *p50, double *p99) {
+    int console_fd;
+    pid_t pid = start_server(binary, port, idle + 8, &console_fd);
+    if (pid == -1) {
+        fprintf(stderr, "failed to start %s\n", binary);
+        return -1;
+    }
+
+    int *fds = malloc(sizeof(int) * idle);
+    long long *samples = malloc(sizeof(long long) * rounds);
+    double mean = -1;
+    int opened = 0;
+
+    for (; opened < idle; opened++) {
+        fds[opened] = connect_local(port);
+        if (fds[opened] == -1) {
+            fprintf(stderr, "connect %d/%d failed: %s\n", opened, idle, strerror(errno));
+            goto out;
+        }
+    }
+
+    int active = connect_local(port);
+    if (active == -1) goto out;
+    int one = 1;
+    setsockopt(active, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    const char *cmd = "ADD CARBON 1\n";
+    char reply[BUFFER_SIZE];
+    long long total = 0;
+    for (int i = -rounds / 10; i < rounds; i++) {   // Negative indices are warm-up rounds
+        long long start = now_ns();
+        if (send(active, cmd, strlen(cmd), 0) == -1) break;
+        ssize_t n = recv(active, reply, sizeof(reply), 0);
+        if (n <= 0) {
+            fprintf(stderr, "server closed the active connection (descriptor limit?)\n");
+            close(active);
+            goto out;
+        }
+        long long elapsed = now_ns() - start;
+        if (i >= 0) {
+            samples[i] = elapsed;
+            total += elapsed;
+        }
+    }
+    close(active);
+
+    qsort(samples, rounds, sizeof(long long), cmp_ll);
+    *p50 = samples[rounds / 2] / 1000.0;
+    *p99 = samples[(int)(rounds * 0.99)] / 1000.0;
+    mean = (double)total / rounds / 1000.0;
+
+out:
+    for (int i = 0; i < opened; i++) close(fds[i]);
+    free(fds);
+    free(samples);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(console_fd);
+    return mean;
+}
+
+int main(int argc, char *argv[]) {
+    int counts[MAX_COUNTS] = {100, 1000, 10000};
+    int ncounts = 3, rounds = 20000, base_port = 21000, opt;
+
+    while ((opt = getopt(argc, argv, "r:n:p:")) != -1) {
+        switch (opt) {
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 'n':
+            {
+                ncounts = 0;
+                for (char *tok = strtok(optarg, ","); tok && ncounts < MAX_COUNTS; tok = strtok(NULL, ",")) {
+                    counts[ncounts++] = atoi(tok);
+                }
+                break;
+            }
+            case 'p':
+                base_port = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-r rounds] [-n N1,N2,...] [-p base-port] <server-binary>...\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind >= argc || rounds <= 0) {
+        fprintf(stderr, "Usage: %s [-r rounds] [-n N1,N2,...] [-p base-port] <server-binary>...\n", argv[0]);
+        exit(1);
+    }
+
+    // Idle connections need descriptors on both sides
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-28s %8s %12s %12s %12s\n", "server", "idle", "mean(us)", "p50(us)", "p99(us)");
+    int port = base_port;
+    for (int b = optind; b < argc; b++) {
+        for (int c = 0; c < ncounts; c++, port += 2) {
+            double p50 = 0, p99 = 0;
+            if ((rlim_t)counts[c] + 64 > rl.rlim_cur) {
+                printf("%-28s %8d %12s\n", argv[b], counts[c], "n/a (RLIMIT_NOFILE)");
+                continue;
+            }
+            double mean = run_one(argv[b], port, counts[c], rounds, &p50, &p99);
+            if (mean < 0) {
+                printf("%-28s %8d %12s\n", argv[b], counts[c], "n/a");
+            } else {
+                printf("%-28s %8d %12.2f %12.2f %12.2f\n", argv[b], counts[c], mean, p50, p99);
+            }
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,421 @@
+/*
+ * bench_matrix - fixed scenarios against every server generation (q1-q6) and transport
+ *
+ * Every row starts a fresh server and runs drinks_load against it:
+ *   add   closed loop, ADD only, over the stream endpoint
+ *   mix   closed loop, 50% ADD / 50% DELIVER
+ *   open  open loop at a fixed rate (-r), 50% ADD / 50% DELIVER; the
+ *         latency is corrected for coordinated omission
+ * for each generation with the transports it has:
+ *   q1 atom_warehouse      TCP (ADD only, so "add" only)
+ *   q2 molecule_supplier   TCP + UDP
+ *   q3, q4 drinks_bar      TCP + UDP
+ *   q5 drinks_bar          TCP + UDP, UDS stream + UDS datagram
+ *   q6 drinks_bar          as q5, each with and without --save-file
+ * Every server starts with an empty stock, so DELIVER errors (not enough
+ * atoms) are part of the mix and counted, not failures of the run.
+ *
+ * The table goes to stdout and the report, one JSON object with a row per
+ * line, to -o (default bench_report.json). With -b <old report> every row
+ * is compared to the row with the same id: a throughput drop or p99 rise
+ * beyond -t percent is flagged and the exit status is 1.
+ *
+ * Usage: bench_matrix [-d seconds] [-c clients] [-r rate] [-o report] [-b baseline] [-t percent]
+ *                     [-D dir] [-p base-port] <repo root>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_ROWS 64
+#define PATH_SIZE 4096
+#define RESULT_SIZE 4096
+
+#define TRANSPORT_INET 0  // TCP stream + UDP datagrams
+#define TRANSPORT_UDS 1   // UDS stream + UDS datagrams
+
+/**
+ * A server generation and how it is started
+ */
+typedef struct {
+    const char *name;      // Directory (q1 .. q6)
+    const char *binary;    // Server program in that directory
+    int args_style;        // 0: <tcp>, 1: <tcp> <udp>, 2: -T/-U (and -s/-d)
+    int has_datagram;      // Serves DELIVER
+    int has_uds;           // Accepts -s/-d
+    int has_save_file;     // Accepts -f
+} Generation;
+
+/**
+ * A workload run by drinks_load
+ */
+typedef struct {
+    const char *name;
+    int add_percent;
+    int open_loop;  // Runs at the fixed rate (-r)
+} Scenario;
+
+/**
+ * The headline numbers of one row
+ */
+typedef struct {
+    char id[128];
+    double ops;     // Replies per second
+    double p99_us;
+} RowResult;
+
+static const Generation generations[] = {
+    {"q1", "atom_warehouse", 0, 0, 0, 0},
+    {"q2", "molecule_supplier", 1, 1, 0, 0},
+    {"q3", "drinks_bar", 1, 1, 0, 0},
+    {"q4", "drinks_bar", 2, 1, 0, 0},
+    {"q5", "drinks_bar", 2, 1, 1, 0},
+    {"q6", "drinks_bar", 2, 1, 1, 1},
+};
+
+static const Scenario scenarios[] = {
+    {"add", 100, 0},
+    {"mix", 50, 0},
+    {"open", 50, 1},
+};
+
+/**
+ * Checks whether a server accepts stream connections yet
+ *
+ * @return  1 if a connection succeeded, 0 if not
+ */
+static int server_ready(int transport, int tcp_port, const char *stream_path) {
+    int fd, ok;
+    if (transport == TRANSPORT_UDS) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", stream_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ok = fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(tcp_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        ok = fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    }
+    if (fd != -1) close(fd);
+    return ok;
+}
+
+/**
+ * Starts a server of one generation
+ * Its console reads a pipe that stays open, and its output is discarded
+ *
+ * @param console_fd  Receives the write end of the console pipe
+ * @return            Child pid, or -1 on failure
+ */
+static pid_t start_server(const char *root, const Generation *gen, int transport, const char *save_path,
+                          int tcp_port, const char *stream_path, const char *datagram_path, int *console_fd) {
+    char binary[PATH_SIZE], tcp[16], udp[16];
+    int pipefd[2];
+
+    snprintf(binary, sizeof(binary), "%s/%s/%s", root, gen->name, gen->binary);
+    snprintf(tcp, sizeof(tcp), "%d", tcp_port);
+    snprintf(udp, sizeof(udp), "%d", tcp_port + 1);
+    if (access(binary, X_OK) == -1 || pipe(pipefd) == -1) return -1;
+
+    pid_t pid = fork();
+    if (pid == -1) return -1;
+    if (pid == 0) {
+        const char *args[16];
+        int n = 0;
+        args[n++] = binary;
+        if (gen->args_style == 0) {
+            args[n++] = tcp;
+        } else if (gen->args_style == 1) {
+            args[n++] = tcp;
+            args[n++] = udp;
+        } else if (transport == TRANSPORT_UDS) {
+            args[n++] = "-s";
+            args[n++] = stream_path;
+            args[n++] = "-d";
+            args[n++] = datagram_path;
+        } else {
+            args[n++] = "-T";
+            args[n++] = tcp;
+            args[n++] = "-U";
+            args[n++] = udp;
+        }
+        if (save_path != NULL) {
+            args[n++] = "-f";
+            args[n++] = save_path;
+        }
+        args[n] = NULL;
+
+        int out = open("/dev/null", O_WRONLY);
+        dup2(pipefd[0], STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execv(binary, (char *const *)args);
+        _exit(127);
+    }
+    close(pipefd[0]);
+    *console_fd = pipefd[1];
+
+    for (int i = 0; i < 200; i++) {
+        if (server_ready(transport, tcp_port, stream_path)) return pid;
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(*console_fd);
+    return -1;
+}
+
+/**
+ * Stops a server (SIGTERM, then SIGKILL) and removes its socket files
+ */
+static void stop_server(pid_t pid, int console_fd, const char *stream_path, const char *datagram_path) {
+    kill(pid, SIGTERM);
+    for (int i = 0; i < 100 && waitpid(pid, NULL, WNOHANG) == 0; i++) usleep(10000);
+    if (waitpid(pid, NULL, WNOHANG) == 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    close(console_fd);
+    unlink(stream_path);
+    unlink(datagram_path);
+}
+
+/**
+ * Runs drinks_load and captures its --json line
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int run_load(const char *root, const Scenario *scenario, int transport, int tcp_port, const char *stream_path,
+                    const char *datagram_path, int seconds, int clients, int rate, char *result, size_t result_size) {
+    char binary[PATH_SIZE], tcp[16], udp[16], duration[16], nclients[16], percent[16], rate_text[16];
+    int pipefd[2];
+
+    snprintf(binary, sizeof(binary), "%s/q6/drinks_load", root);
+    snprintf(tcp, sizeof(tcp), "%d", tcp_port);
+    snprintf(udp, sizeof(udp), "%d", tcp_port + 1);
+    snprintf(duration, sizeof(duration), "%d", seconds);
+    snprintf(nclients, sizeof(nclients), "%d", clients);
+    snprintf(percent, sizeof(percent), "%d", scenario->add_percent);
+    snprintf(rate_text, sizeof(rate_text), "%d", scenario->open_loop ? rate : 0);
+    if (pipe(pipefd) == -1) return -1;
+
+    pid_t pid = fork();
+    if (pid == -1) return -1;
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(pipefd[1], STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (transport == TRANSPORT_UDS) {
+            execl(binary, binary, "-s", stream_path, "-d", datagram_path, "-D", duration, "-c", nclients, "-a",
+                  percent, "-R", rate_text, "--json", (char *)NULL);
+        } else {
+            execl(binary, binary, "-T", tcp, "-U", udp, "-D", duration, "-c", nclients, "-a", percent, "-R",
+                  rate_text, "--json", (char *)NULL);
+        }
+        _exit(127);
+    }
+    close(pipefd[1]);
+
+    size_t len = 0;
+    ssize_t n;
+    while (len + 1 < result_size && (n = read(pipefd[0], result + len, result_size - 1 - len)) > 0) len += n;
+    close(pipefd[0]);
+    result[len] = '\0';
+    char *newline = strchr(result, '\n');
+    if (newline != NULL) *newline = '\0';
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 && result[0] == '{' ? 0 : -1;
+}
+
+/**
+ * Reads a number field of the "total" object of a drinks_load result
+ *
+ * @return  The value, or -1 if it is missing
+ */
+static double total_field(const char *result, const char *key) {
+    char pattern[64];
+    const char *total = strstr(result, "\"total\": {");
+    if (total == NULL) return -1;
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    const char *field = strstr(total, pattern);
+    return field != NULL ? atof(field + strlen(pattern)) : -1;
+}
+
+/**
+ * Loads the id, throughput and p99 of every row of an earlier report
+ *
+ * @return  Number of rows, or -1 if the file cannot be read
+ */
+static int load_baseline(const char *path, RowResult *rows, int max_rows) {
+    char line[RESULT_SIZE + 512];
+    int count = 0;
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (count < max_rows && fgets(line, sizeof(line), in) != NULL) {
+        const char *id = strstr(line, "{\"id\": \"");
+        if (id == NULL) continue;
+        id += 8;
+        const char *end = strchr(id, '"');
+        if (end == NULL) continue;
+        snprintf(rows[count].id, sizeof(rows[count].id), "%.*s", (int)(end - id), id);
+        rows[count].ops = total_field(line, "replies_per_s");
+        rows[count].p99_us = total_field(line, "p99_us");
+        count++;
+    }
+    fclose(in);
+    return count;
+}
+
+/**
+ * Prints the usage line
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d seconds] [-c clients] [-r rate] [-o report] [-b baseline] [-t percent] [-D dir] [-p base-port] <repo root>\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int seconds = 3, clients = 16, rate = 5000, threshold = 15, base_port = 23000, opt;
+    const char *report_path = "bench_report.json", *baseline_path = NULL, *dir = ".";
+    RowResult baseline[MAX_ROWS * 4];
+    int baseline_rows = 0, regressions = 0, rows = 0;
+
+    while ((opt = getopt(argc, argv, "d:c:r:o:b:t:D:p:")) != -1) {
+        switch (opt) {
+            case 'd': seconds = atoi(optarg); break;
+            case 'c': clients = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 'o': report_path = optarg; break;
+            case 'b': baseline_path = optarg; break;
+            case 't': threshold = atoi(optarg); break;
+            case 'D': dir = optarg; break;
+            case 'p': base_port = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (optind >= argc || seconds <= 0 || clients <= 0 || rate <= 0 || threshold <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+    const char *root = argv[optind];
+    signal(SIGPIPE, SIG_IGN);
+    if (baseline_path != NULL) {
+        baseline_rows = load_baseline(baseline_path, baseline, sizeof(baseline) / sizeof(baseline[0]));
+        if (baseline_rows == -1) exit(1);
+    }
+
+    FILE *report = fopen(report_path, "w");
+    if (report == NULL) {
+        perror(report_path);
+        exit(1);
+    }
+    char host[256] = "unknown", stamp[32];
+    time_t now = time(NULL);
+    gethostname(host, sizeof(host) - 1);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(report, "{\"generated\": \"%s\", \"host\": \"%s\", \"duration_s\": %d, \"clients\": %d, "
+            "\"open_loop_rate\": %d, \"rows\": [\n", stamp, host, seconds, clients, rate);
+
+    char save_path[PATH_SIZE], stream_path[108], datagram_path[108];
+    snprintf(save_path, sizeof(save_path), "%s/bench_matrix_%d.save", dir, (int)getpid());
+    snprintf(stream_path, sizeof(stream_path), "/tmp/bench_matrix_%d.sock", (int)getpid());
+    snprintf(datagram_path, sizeof(datagram_path), "/tmp/bench_matrix_%d.dgram", (int)getpid());
+
+    printf("%d clients, %d s per row, open loop at %d requests/s; report in %s\n", clients, seconds, rate,
+           report_path);
+    printf("%-30s %12s %10s %10s %10s %8s %8s %10s\n", "row", "replies/s", "p50 us", "p99 us", "p99.9 us", "errors",
+           "timeouts", "vs base");
+    int port = base_port;
+    for (size_t g = 0; g < sizeof(generations) / sizeof(generations[0]); g++) {
+        const Generation *gen = &generations[g];
+        for (int transport = TRANSPORT_INET; transport <= TRANSPORT_UDS; transport++) {
+            if (transport == TRANSPORT_UDS && !gen->has_uds) continue;
+            for (int save = 0; save <= gen->has_save_file; save++) {
+                for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++, port += 2) {
+                    const Scenario *scenario = &scenarios[s];
+                    if (scenario->add_percent < 100 && !gen->has_datagram) continue;
+
+                    const char *stream = transport == TRANSPORT_UDS ? "uds" : "tcp";
+                    const char *datagram = !gen->has_datagram ? "none" : transport == TRANSPORT_UDS ? "uds" : "udp";
+                    char id[128], result[RESULT_SIZE];
+                    snprintf(id, sizeof(id), "%s/%s+%s/%s/%s", gen->name, stream, datagram,
+                             save ? "save-file" : "memory", scenario->name);
+                    unlink(save_path);
+
+                    // A fresh server per row, so every row starts from an empty stock
+                    int console_fd;
+                    pid_t pid = start_server(root, gen, transport, save ? save_path : NULL, port, stream_path,
+                                             datagram_path, &console_fd);
+                    if (pid == -1) {
+                        printf("%-30s failed to start %s/%s\n", id, gen->name, gen->binary);
+                        continue;
+                    }
+                    int rc = run_load(root, scenario, transport, port, stream_path, datagram_path, seconds, clients,
+                                      rate, result, sizeof(result));
+                    stop_server(pid, console_fd, stream_path, datagram_path);
+                    if (rc == -1) {
+                        printf("%-30s drinks_load failed\n", id);
+                        continue;
+                    }
+
+                    double ops = total_field(result, "replies_per_s"), p99 = total_field(result, "p99_us");
+                    char versus[32] = "-";
+                    for (int b = 0; b < baseline_rows; b++) {
+                        if (strcmp(baseline[b].id, id) != 0 || baseline[b].ops <= 0) continue;
+                        double change = (ops - baseline[b].ops) * 100 / baseline[b].ops;
+                        int slower = change < -threshold ||
+                                     (baseline[b].p99_us > 0 && p99 > baseline[b].p99_us * (100 + threshold) / 100);
+                        snprintf(versus, sizeof(versus), "%+.0f%%%s", change, slower ? " REGR" : "");
+                        regressions += slower;
+                    }
+                    printf("%-30s %12.0f %10.1f %10.1f %10.1f %8.0f %8.0f %10s\n", id, ops,
+                           total_field(result, "p50_us"), p99, total_field(result, "p999_us"),
+                           total_field(result, "errors"), total_field(result, "timeouts"), versus);
+                    fflush(stdout);
+
+                    fprintf(report, "%s{\"id\": \"%s\", \"generation\": \"%s\", \"server\": \"%s\", "
+                            "\"stream\": \"%s\", \"datagram\": \"%s\", \"save_file\": %s, \"scenario\": \"%s\", "
+                            "\"result\": %s}\n", rows ? "," : "", id, gen->name, gen->binary, stream, datagram,
+                            save ? "true" : "false", scenario->name, result);
+                    rows++;
+                }
+            }
+        }
+    }
+    fprintf(report, "]}\n");
+    fclose(report);
+    unlink(save_path);
+
+    if (baseline_path != NULL) {
+        printf("%d row(s) regressed by more than %d%% against %s\n", regressions, threshold, baseline_path);
+    }
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,337 @@
+/*
+ * bench_protocol - text commands versus binary protocol frames
+ *
+ * 1. Parse cost (in process): decoding one request and encoding its reply,
+ *    using the same sscanf/strcmp/snprintf steps as drinks_bar's text path
+ *    against proto_decode/proto_encode from protocol.c.
+ * 2. Throughput (against a running drinks_bar): one client keeps a window
+ *    of W requests in flight and reports completed requests per second for
+ *    TCP ADD and UDP DELIVER, in text and in binary.
+ *
+ * Usage: bench_protocol [-n parse-iterations] [-d seconds] [-w window] [-p base-port] <drinks_bar>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "registry.h"
+
+#define BUFFER_SIZE 1024
+#define MAX_WINDOW 256
+
+static const char *tcp_text = "ADD OXYGEN 1\n";
+static const char *tcp_reply_text = "added to warehouse successfully\n";
+static const char *udp_text = "DELIVER CARBON DIOXIDE 1";
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Text request path: the parsing and reply formatting drinks_bar does for ADD and DELIVER
+ *
+ * @return  Number of reply bytes (keeps the work observable)
+ */
+static size_t text_round(const char *add_cmd, const char *deliver_cmd, char *reply) {
+    char op[256], atom[16], molecule1[256], molecule2[256], amount_str[256], molecule[512];
+    unsigned int amount;
+    size_t total = 0;
+
+    if (sscanf(add_cmd, "%15s %15s %u", op, atom, &amount) == 3 && strcmp(op, "ADD") == 0 &&
+        (strcmp(atom, "CARBON") == 0 || strcmp(atom, "HYDROGEN") == 0 || strcmp(atom, "OXYGEN") == 0)) {
+        total += snprintf(reply, BUFFER_SIZE, "%s", "added to warehouse successfully\n");
+    }
+
+    int n = sscanf(deliver_cmd, "%255s %255s %255s %255s", op, molecule1, molecule2, amount_str);
+    if (n >= 3 && strcmp(op, "DELIVER") == 0) {
+        if (n == 4) {
+            snprintf(molecule, sizeof(molecule), "%s %s", molecule1, molecule2);
+        } else {
+            snprintf(molecule, sizeof(molecule), "%s", molecule1);
+            snprintf(amount_str, sizeof(amount_str), "%s", molecule2);
+        }
+        amount = (unsigned int)strtoul(amount_str, NULL, 10);
+        if (amount > 0 && (strcmp(molecule, "WATER") == 0 || strcmp(molecule, "CARBON DIOXIDE") == 0 ||
+                           strcmp(molecule, "ALCOHOL") == 0 || strcmp(molecule, "GLUCOSE") == 0)) {
+            total += snprintf(reply, BUFFER_SIZE, "%s", "Molecule delivered successfully\n");
+        }
+    }
+    return total;
+}
+
+/**
+ * Binary request path: decode, look up the name, encode the reply
+ *
+ * @return  Number of reply bytes (keeps the work observable)
+ */
+static size_t binary_round(const unsigned char *add_frame, const unsigned char *deliver_frame,
+                           unsigned char *reply) {
+    ProtoFrame req;
+    size_t total = 0;
+
+    if (proto_decode(add_frame, PROTO_FRAME_SIZE, &req) && registry_element_name(req.id) != NULL) {
+        req.opcode |= PROTO_REPLY_FLAG;
+        req.id = PROTO_STATUS_OK;
+        proto_encode(&req, reply);
+        total += PROTO_FRAME_SIZE;
+    }
+    if (proto_decode(deliver_frame, PROTO_FRAME_SIZE, &req) && registry_molecule_name(req.id) != NULL) {
+        req.opcode |= PROTO_REPLY_FLAG;
+        req.id = PROTO_STATUS_OK;
+        proto_encode(&req, reply);
+        total += PROTO_FRAME_SIZE;
+    }
+    return total;
+}
+
+/**
+ * Measures the per-request parse and reply cost of both formats
+ */
+static void run_parse_bench(long iterations) {
+    char text_reply[BUFFER_SIZE];
+    unsigned char add_frame[PROTO_FRAME_SIZE], deliver_frame[PROTO_FRAME_SIZE], bin_reply[PROTO_FRAME_SIZE];
+    ProtoFrame add = {PROTO_OP_ADD, 2, 1, 1}, deliver = {PROTO_OP_DELIVER, 1, 2, 1};
+    volatile size_t sink = 0;
+
+    proto_encode(&add, add_frame);
+    proto_encode(&deliver, deliver_frame);
+
+    long long start = now_ns();
+    for (long i = 0; i < iterations; i++) sink += text_round(tcp_text, udp_text, text_reply);
+    double text_ns = (double)(now_ns() - start) / (2.0 * iterations);
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) sink += binary_round(add_frame, deliver_frame, bin_reply);
+    double bin_ns = (double)(now_ns() - start) / (2.0 * iterations);
+
+    (void)sink;
+    printf("parse + reply cost per request (%ld ADD + %ld DELIVER)\n", iterations, iterations);
+    printf("  %-8s %10.1f ns   request %zu/%zu bytes, reply %zu bytes\n", "text", text_ns,
+           strlen(tcp_text), strlen(udp_text), strlen(tcp_reply_text));
+    printf("  %-8s %10.1f ns   request %d bytes, reply %d bytes\n", "binary", bin_ns,
+           PROTO_FRAME_SIZE, PROTO_FRAME_SIZE);
+    printf("  speedup  %10.1fx\n\n", text_ns / bin_ns);
+}
+
+/**
+ * Creates a socket of the given type connected to 127.0.0.1:port
+ *
+ * @param type  SOCK_STREAM or SOCK_DGRAM
+ * @param port  Server port
+ * @return      Connected socket, or -1 on failure
+ */
+static int connect_local(int type, int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, type, 0);
+    if (fd == -1) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Starts drinks_bar with a well-stocked warehouse
+ *
+ * @param binary      Path of the drinks_bar binary
+ * @param tcp_port    TCP port (UDP uses tcp_port + 1)
+ * @param console_fd  Receives the write end of the console pipe
+ * @return            Child pid, or -1 on failure
+ */
+static pid_t start_server(const char *binary, int tcp_port, int *console_fd) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1) return -1;
+
+    pid_t pid = fork();
+    if (pid == -1) return -1;
+    if (pid == 0) {
+        char tcp[16], udp[16];
+        const char *plenty = "100000000000000000";
+        snprintf(tcp, sizeof(tcp), "%d", tcp_port);
+        snprintf(udp, sizeof(udp), "%d", tcp_port + 1);
+
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(pipefd[0], STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execl(binary, binary, "-T", tcp, "-U", udp, "-c", plenty, "-h", plenty, "-o", plenty, (char *)NULL);
+        _exit(127);
+    }
+    close(pipefd[0]);
+    *console_fd = pipefd[1];
+
+    // Wait until the server accepts connections
+    for (int i = 0; i < 200; i++) {
+        int fd = connect_local(SOCK_STREAM, tcp_port);
+        if (fd != -1) {
+            close(fd);
+            return pid;
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(*console_fd);
+    return -1;
+}
+
+/**
+ * TCP ADD throughput: keeps window requests in flight on one connection
+ *
+ * @param use_binary  Send binary frames instead of text lines
+ * @return            Completed requests per second, or -1 on error
+ */
+static double run_tcp(int port, int use_binary, int window, int seconds) {
+    unsigned char request[BUFFER_SIZE], buf[65536];
+    size_t request_len, reply_len;
+    int one = 1;
+
+    if (use_binary) {
+        ProtoFrame add = {PROTO_OP_ADD, 2, 1, 1};
+        proto_encode(&add, request);
+        request_len = reply_len = PROTO_FRAME_SIZE;
+    } else {
+        request_len = strlen(tcp_text);
+        memcpy(request, tcp_text, request_len);
+        reply_len = strlen(tcp_reply_text);
+    }
+
+    int fd = connect_local(SOCK_STREAM, port);
+    if (fd == -1) return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    long long done = 0, in_flight = 0;
+    size_t pending_bytes = 0;  // Received reply bytes not yet forming a whole reply
+    long long start = now_ns(), end = start + (long long)seconds * 1000000000LL;
+    while (now_ns() < end) {
+        // Top the window up, then read whatever replies arrived
+        for (; in_flight < window; in_flight++) {
+            if (send(fd, request, request_len, MSG_NOSIGNAL) != (ssize_t)request_len) {
+                close(fd);
+                return -1;
+            }
+        }
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        pending_bytes += n;
+        done += pending_bytes / reply_len;
+        in_flight -= pending_bytes / reply_len;
+        pending_bytes %= reply_len;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    close(fd);
+    return done / elapsed;
+}
+
+/**
+ * UDP DELIVER throughput: sends window datagrams, then collects their replies
+ *
+ * @param use_binary  Send binary frames instead of text commands
+ * @return            Completed requests per second, or -1 on error
+ */
+static double run_udp(int port, int use_binary, int window, int seconds) {
+    unsigned char request[BUFFER_SIZE], buf[BUFFER_SIZE];
+    size_t request_len;
+    struct timeval tv = {1, 0};
+
+    if (use_binary) {
+        ProtoFrame deliver = {PROTO_OP_DELIVER, 1, 1, 1};
+        proto_encode(&deliver, request);
+        request_len = PROTO_FRAME_SIZE;
+    } else {
+        request_len = strlen(udp_text);
+        memcpy(request, udp_text, request_len);
+    }
+
+    int fd = connect_local(SOCK_DGRAM, port);
+    if (fd == -1) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    long long done = 0;
+    long long start = now_ns(), end = start + (long long)seconds * 1000000000LL;
+    while (now_ns() < end) {
+        for (int i = 0; i < window; i++) send(fd, request, request_len, 0);
+        for (int i = 0; i < window; i++) {
+            if (recv(fd, buf, sizeof(buf), 0) <= 0) break;  // Lost datagram: start a new window
+            done++;
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    close(fd);
+    return done / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = 1000000;
+    int seconds = 2, window = 32, base_port = 24000, opt;
+
+    while ((opt = getopt(argc, argv, "n:d:w:p:")) != -1) {
+        switch (opt) {
+            case 'n': iterations = atol(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 'p': base_port = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n parse-iterations] [-d seconds] [-w window] [-p base-port] <drinks_bar>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind >= argc || iterations <= 0 || seconds <= 0 || window <= 0 || window > MAX_WINDOW) {
+        fprintf(stderr, "Usage: %s [-n parse-iterations] [-d seconds] [-w window] [-p base-port] <drinks_bar>\n", argv[0]);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    run_parse_bench(iterations);
+
+    int console_fd;
+    pid_t pid = start_server(argv[optind], base_port, &console_fd);
+    if (pid == -1) {
+        fprintf(stderr, "failed to start %s\n", argv[optind]);
+        exit(1);
+    }
+
+    printf("throughput, 1 client, window %d, %d s per run\n", window, seconds);
+    printf("  %-16s %14s %14s\n", "", "text ops/s", "binary ops/s");
+    double tcp_text_rate = run_tcp(base_port, 0, window, seconds);
+    double tcp_bin_rate = run_tcp(base_port, 1, window, seconds);
+    printf("  %-16s %14.0f %14.0f\n", "TCP ADD", tcp_text_rate, tcp_bin_rate);
+    double udp_text_rate = run_udp(base_port + 1, 0, window, seconds);
+    double udp_bin_rate = run_udp(base_port + 1, 1, window, seconds);
+    printf("  %-16s %14.0f %14.0f\n", "UDP DELIVER", udp_text_rate, udp_bin_rate);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(console_fd);
+    return 0;
+}
@@ -0,0 +1,453 @@
+/*
+ * bench_raft - commit latency and throughput of a drinks_bar Raft cluster against a single node
+ *
+ * Every row starts fresh servers on one host: a single drinks_bar, a single
+ * drinks_bar with --wal (one node, durable before the reply), and clusters
+ * of 3 and 5 nodes (--raft-id/--raft-peers). C closed-loop clients send
+ * ADD over TCP to the node that reports itself LEADER on the RAFT query;
+ * the row shows completed operations per second and the reply latency
+ * percentiles, which for a cluster is the commit latency seen by a client.
+ *
+ * After the run the leader's STATUS must show exactly the acknowledged
+ * ADDs. For a cluster the leader is then killed with SIGKILL: the failover
+ * column is the time until another node commits an ADD, and the check is
+ * repeated on the new leader (acknowledged ADDs + that one).
+ *
+ * Save files and logs go to <dir> (default: the current directory), which
+ * should be on the disk being measured rather than on a tmpfs.
+ *
+ * Usage: bench_raft [-c clients] [-n threads] [-d seconds] [-D dir] [-p base-port] <drinks_bar>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_NODES 5
+#define MAX_SAMPLES 200000
+#define BUFFER_SIZE 1024
+#define LEADER_WAIT_MS 5000   // Longest wait for a leader with a lease
+#define RAFT_PORT_OFFSET 100  // Raft port of node k: base-port + RAFT_PORT_OFFSET + k
+
+/**
+ * State of one simulated client thread
+ */
+typedef struct {
+    pthread_t thread;
+    int tcp_port;
+    long long ops;          // Acknowledged ADDs
+    long long errors;       // Failed or refused ADDs
+    long long *latency_ns;  // Reply latency of the first MAX_SAMPLES operations
+} Client;
+
+/**
+ * One server process of a row
+ */
+typedef struct {
+    pid_t pid;
+    int tcp_port;
+    int console_fd;
+    char save_path[4096];
+    char out_path[4096];
+} Node;
+
+/**
+ * A row of the table
+ */
+typedef struct {
+    const char *label;
+    int nodes;  // 0: single node without Raft
+    int wal;    // Single node with --wal
+} Setup;
+
+static volatile int running = 0;
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Creates a TCP socket connected to 127.0.0.1:port
+ *
+ * @return  Connected socket, or -1 on failure
+ */
+static int connect_local(int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Sends one command line on a new connection and reads the reply line
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int ask(int port, const char *cmd, char *reply, size_t reply_size) {
+    struct timeval timeout = {1, 0};
+    size_t len = 0;
+
+    int fd = connect_local(port);
+    if (fd == -1) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (send(fd, cmd, strlen(cmd), MSG_NOSIGNAL) == -1) {
+        close(fd);
+        return -1;
+    }
+    while (len + 1 < reply_size && memchr(reply, '\n', len) == NULL) {
+        ssize_t n = recv(fd, reply + len, reply_size - 1 - len, 0);
+        if (n <= 0) break;
+        len += n;
+    }
+    close(fd);
+    reply[len] = '\0';
+    return len > 0 ? 0 : -1;
+}
+
+/**
+ * Removes the files a node leaves next to its save file
+ */
+static void remove_node_files(const Node *node) {
+    const char *suffixes[] = {"", ".wal", ".raft", ".raft-state", ".raft.snap"};
+    char path[4200];
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        snprintf(path, sizeof(path), "%s%s", node->save_path, suffixes[i]);
+        unlink(path);
+    }
+}
+
+/**
+ * Starts one drinks_bar of a row on a fresh save file
+ *
+ * @param binary   Path of the drinks_bar binary
+ * @param node     The node; its tcp_port, save_path and out_path are set
+ * @param threads  Value passed to --threads
+ * @param setup    The row
+ * @param id       Raft node id (1-based), unused without Raft
+ * @param peers    Value passed to --raft-peers
+ * @return         0 on success, -1 on failure
+ */
+static int start_node(const char *binary, Node *node, int threads, const Setup *setup, int id, const char *peers) {
+    int pipefd[2];
+
+    remove_node_files(node);
+    if (pipe(pipefd) == -1) return -1;
+
+    node->pid = fork();
+    if (node->pid == -1) return -1;
+    if (node->pid == 0) {
+        char tcp[16], udp[16], nthreads[16], raft_id[16];
+        snprintf(tcp, sizeof(tcp), "%d", node->tcp_port);
+        snprintf(udp, sizeof(udp), "%d", node->tcp_port + 1);
+        snprintf(nthreads, sizeof(nthreads), "%d", threads);
+        snprintf(raft_id, sizeof(raft_id), "%d", id);
+
+        int out = open(node->out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(pipefd[0], STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (setup->nodes > 0) {
+            execl(binary, binary, "-T", tcp, "-U", udp, "--threads", nthreads, "-f", node->save_path, "--raft-id",
+                  raft_id, "--raft-peers", peers, (char *)NULL);
+        } else if (setup->wal) {
+            execl(binary, binary, "-T", tcp, "-U", udp, "--threads", nthreads, "-f", node->save_path, "--wal",
+                  (char *)NULL);
+        } else {
+            execl(binary, binary, "-T", tcp, "-U", udp, "--threads", nthreads, "-f", node->save_path, (char *)NULL);
+        }
+        _exit(127);
+    }
+    close(pipefd[0]);
+    node->console_fd = pipefd[1];
+
+    // Wait until the server accepts connections
+    for (int i = 0; i < 200; i++) {
+        int fd = connect_local(node->tcp_port);
+        if (fd != -1) {
+            close(fd);
+            return 0;
+        }
+        usleep(10000);
+    }
+    kill(node->pid, SIGKILL);
+    waitpid(node->pid, NULL, 0);
+    close(node->console_fd);
+    node->pid = -1;
+    return -1;
+}
+
+/**
+ * Stops a node (console quit, or SIGKILL if it does not exit)
+ */
+static void stop_node(Node *node) {
+    if (node->pid <= 0) return;
+    if (write(node->console_fd, "quit\n", 5) != 5) kill(node->pid, SIGKILL);
+    for (int i = 0; i < 100 && waitpid(node->pid, NULL, WNOHANG) == 0; i++) usleep(10000);
+    if (waitpid(node->pid, NULL, WNOHANG) == 0) {
+        kill(node->pid, SIGKILL);
+        waitpid(node->pid, NULL, 0);
+    }
+    close(node->console_fd);
+    node->pid = -1;
+}
+
+/**
+ * Waits for a node that is the leader and answers STATUS under its lease
+ *
+ * @return  Index of the leader in nodes, or -1 if none was found in time
+ */
+static int find_leader(Node *nodes, int count) {
+    char reply[BUFFER_SIZE];
+    long long deadline = now_ns() + LEADER_WAIT_MS * 1000000LL;
+
+    while (now_ns() < deadline) {
+        for (int i = 0; i < count; i++) {
+            if (nodes[i].pid <= 0) continue;
+            if (ask(nodes[i].tcp_port, "RAFT\n", reply, sizeof(reply)) == 0 && strstr(reply, " LEADER TERM") != NULL &&
+                ask(nodes[i].tcp_port, "STATUS\n", reply, sizeof(reply)) == 0 && strncmp(reply, "STATUS", 6) == 0) {
+                return i;
+            }
+        }
+        usleep(5000);
+    }
+    return -1;
+}
+
+/**
+ * Reads the oxygen of the stock with a STATUS query
+ *
+ * @return  Amount of oxygen, or -1 if the node did not answer STATUS
+ */
+static long long status_oxygen(int port) {
+    char reply[BUFFER_SIZE];
+    if (ask(port, "STATUS\n", reply, sizeof(reply)) == -1) return -1;
+    char *field = strstr(reply, "OXYGEN ");
+    return field != NULL ? atoll(field + 7) : -1;
+}
+
+/**
+ * Client thread: one ADD at a time over TCP until the run ends
+ */
+static void *client_main(void *arg) {
+    Client *c = arg;
+    char reply[BUFFER_SIZE];
+    const char *cmd = "ADD OXYGEN 1\n";
+    int one = 1;
+
+    int tcp = connect_local(c->tcp_port);
+    if (tcp == -1) {
+        c->errors++;
+        return NULL;
+    }
+    setsockopt(tcp, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    while (running) {
+        long long start = now_ns();
+        ssize_t n;
+        if (send(tcp, cmd, strlen(cmd), MSG_NOSIGNAL) == -1 || (n = recv(tcp, reply, sizeof(reply) - 1, 0)) <= 0) {
+            c->errors++;
+            break;
+        }
+        reply[n] = '\0';
+        if (strncmp(reply, "added", 5) != 0) {
+            c->errors++;
+            continue;
+        }
+        if (c->ops < MAX_SAMPLES) c->latency_ns[c->ops] = now_ns() - start;
+        c->ops++;
+    }
+    close(tcp);
+    return NULL;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Kills the leader and measures the time until another node commits an ADD
+ *
+ * @param leader  Index of the leader in nodes; receives the new leader's index
+ * @return        Failover time in milliseconds, or -1 if no node took over
+ */
+static double failover(Node *nodes, int count, int *leader) {
+    char reply[BUFFER_SIZE];
+
+    kill(nodes[*leader].pid, SIGKILL);
+    waitpid(nodes[*leader].pid, NULL, 0);
+    close(nodes[*leader].console_fd);
+    nodes[*leader].pid = -1;
+
+    long long start = now_ns(), deadline = start + LEADER_WAIT_MS * 1000000LL;
+    while (now_ns() < deadline) {
+        for (int i = 0; i < count; i++) {
+            if (nodes[i].pid <= 0) continue;
+            if (ask(nodes[i].tcp_port, "ADD OXYGEN 1\n", reply, sizeof(reply)) == 0 &&
+                strncmp(reply, "added", 5) == 0) {
+                *leader = i;
+                return (now_ns() - start) / 1e6;
+            }
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    Setup setups[] = {
+        {"single", 0, 0},
+        {"single+wal", 0, 1},
+        {"raft-3", 3, 0},
+        {"raft-5", 5, 0},
+    };
+    int clients = 32, threads = 4, seconds = 3, base_port = 22600, opt;
+    const char *dir = ".";
+
+    while ((opt = getopt(argc, argv, "c:n:d:D:p:")) != -1) {
+        switch (opt) {
+            case 'c': clients = atoi(optarg); break;
+            case 'n': threads = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'D': dir = optarg; break;
+            case 'p': base_port = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-c clients] [-n threads] [-d seconds] [-D dir] [-p base-port] <drinks_bar>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind >= argc || clients <= 0 || threads <= 0 || seconds <= 0) {
+        fprintf(stderr, "Usage: %s [-c clients] [-n threads] [-d seconds] [-D dir] [-p base-port] <drinks_bar>\n", argv[0]);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    Client *pool = calloc(clients, sizeof(Client));
+    long long *samples = malloc((size_t)clients * MAX_SAMPLES * sizeof(long long));
+    if (pool == NULL || samples == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    printf("ADD over TCP to the leader, %d clients, %d reactor threads per node, %d s per row, files in %s\n",
+           clients, threads, seconds, dir);
+    printf("%-12s %12s %10s %10s %10s %12s %8s %s\n", "setup", "ops/s", "p50 us", "p99 us", "p99.9 us",
+           "failover ms", "errors", "stock");
+    int port = base_port;
+    for (size_t s = 0; s < sizeof(setups) / sizeof(setups[0]); s++) {
+        const Setup *setup = &setups[s];
+        int count = setup->nodes > 0 ? setup->nodes : 1;
+        Node nodes[MAX_NODES];
+        char peers[256];
+        size_t len = 0;
+
+        peers[0] = '\0';
+        for (int k = 0; k < count; k++) {
+            memset(&nodes[k], 0, sizeof(Node));
+            nodes[k].tcp_port = port + 2 * k;
+            snprintf(nodes[k].save_path, sizeof(nodes[k].save_path), "%s/bench_raft_%d_%d.save", dir, (int)getpid(),
+                     k + 1);
+            snprintf(nodes[k].out_path, sizeof(nodes[k].out_path), "%s/bench_raft_%d_%d.out", dir, (int)getpid(),
+                     k + 1);
+            len += snprintf(peers + len, sizeof(peers) - len, "%s%d", k ? "," : "", port + RAFT_PORT_OFFSET + k);
+        }
+        port += 2 * MAX_NODES;
+
+        int started = 1;
+        for (int k = 0; k < count && started; k++) {
+            started = start_node(argv[optind], &nodes[k], threads, setup, k + 1, peers) == 0;
+        }
+        int leader = started ? (setup->nodes > 0 ? find_leader(nodes, count) : 0) : -1;
+        if (leader == -1) {
+            printf("%-12s failed to start the %s\n", setup->label, started ? "election" : "servers");
+            for (int k = 0; k < count; k++) stop_node(&nodes[k]);
+            for (int k = 0; k < count; k++) remove_node_files(&nodes[k]);
+            continue;
+        }
+
+        running = 1;
+        for (int i = 0; i < clients; i++) {
+            memset(&pool[i], 0, sizeof(Client));
+            pool[i].tcp_port = nodes[leader].tcp_port;
+            pool[i].latency_ns = samples + (size_t)i * MAX_SAMPLES;
+            pthread_create(&pool[i].thread, NULL, client_main, &pool[i]);
+        }
+        long long start = now_ns();
+        sleep(seconds);
+        running = 0;
+
+        long long ops = 0, errors = 0;
+        size_t nsamples = 0;
+        for (int i = 0; i < clients; i++) {
+            pthread_join(pool[i].thread, NULL);
+            ops += pool[i].ops;
+            errors += pool[i].errors;
+            long long kept = pool[i].ops < MAX_SAMPLES ? pool[i].ops : MAX_SAMPLES;
+            memmove(samples + nsamples, pool[i].latency_ns, kept * sizeof(long long));
+            nsamples += kept;
+        }
+        double elapsed = (now_ns() - start) / 1e9;
+        qsort(samples, nsamples, sizeof(long long), compare_ll);
+
+        // Every acknowledged ADD is in the stock, before and after a failover
+        int conserved = status_oxygen(nodes[leader].tcp_port) == ops;
+        double failover_ms = -1;
+        if (setup->nodes > 0) {
+            failover_ms = failover(nodes, count, &leader);
+            conserved = conserved && failover_ms >= 0 && find_leader(nodes, count) == leader &&
+                        status_oxygen(nodes[leader].tcp_port) == ops + 1;
+        }
+
+        char failover_text[16];
+        if (setup->nodes == 0) {
+            snprintf(failover_text, sizeof(failover_text), "-");
+        } else if (failover_ms < 0) {
+            snprintf(failover_text, sizeof(failover_text), "none");
+        } else {
+            snprintf(failover_text, sizeof(failover_text), "%.0f", failover_ms);
+        }
+        printf("%-12s %12.0f %10.1f %10.1f %10.1f %12s %8lld %s\n", setup->label, ops / elapsed,
+               nsamples ? samples[nsamples / 2] / 1e3 : 0.0, nsamples ? samples[nsamples * 99 / 100] / 1e3 : 0.0,
+               nsamples ? samples[nsamples * 999 / 1000] / 1e3 : 0.0, failover_text, errors,
+               conserved ? "ok" : "MISMATCH");
+        fflush(stdout);
+
+        for (int k = 0; k < count; k++) stop_node(&nodes[k]);
+        for (int k = 0; k < count; k++) {
+            remove_node_files(&nodes[k]);
+            unlink(nodes[k].out_path);
+        }
+    }
+
+    free(samples);
+    free(pool);
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * bench_recovery - startup check and recovery time of the save file
+ *
+ * Builds a save file through stock.c (create, then three ADDs, so the two
+ * slots hold the last two stocks), damages it the way a crash or a wrong
+ * file could, and opens it in a fresh child process per run, as the first
+ * drinks_bar to start would. Every scenario checks the outcome (the stock
+ * that was recovered, or that the file was refused) and reports the median
+ * time of stock_open_save_file() and of the check/recovery part of it.
+ * Fails if a scenario has the wrong outcome or a median is over the budget.
+ *
+ * Usage: bench_recovery [-n runs] [-b budget-us] [-f save-file]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "stock.h"
+#include "crc32c.h"
+
+#define MAX_RUNS 256
+#define INITIAL_ATOMS 1000ULL
+#define NUM_ADDS 3
+
+/**
+ * How the save file is damaged before it is opened
+ */
+typedef enum {
+    DAMAGE_NONE,          // Clean file from this boot: the live stock is used
+    DAMAGE_REBOOT,        // Written on another boot: the newest slot replaces the live stock
+    DAMAGE_TORN_NEWEST,   // Another boot, and the newest slot was torn: the older slot is used
+    DAMAGE_TORN_BOTH,     // Another boot, both slots torn: the file must be refused
+    DAMAGE_FOREIGN,       // Right size, random bytes: the file must be refused
+    DAMAGE_TRUNCATED      // One byte short: the file must be refused
+} Damage;
+
+static const struct {
+    Damage damage;
+    const char *name;
+    long long expected_carbon;  // Carbon after recovery, -1 if the open must fail
+} scenarios[] = {
+    {DAMAGE_NONE, "clean (same boot)", INITIAL_ATOMS + NUM_ADDS},
+    {DAMAGE_REBOOT, "after reboot", INITIAL_ATOMS + NUM_ADDS},
+    {DAMAGE_TORN_NEWEST, "after reboot, newest slot torn", INITIAL_ATOMS + NUM_ADDS - 1},
+    {DAMAGE_TORN_BOTH, "after reboot, both slots torn", -1},
+    {DAMAGE_FOREIGN, "foreign file", -1},
+    {DAMAGE_TRUNCATED, "truncated file", -1},
+};
+#define NUM_SCENARIOS (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+/**
+ * Result of one open, written by the child process into a pipe
+ */
+typedef struct {
+    long long open_ns;      // Time spent in stock_open_save_file
+    long long recovery_ns;  // stock_recovery_ns: header check and recovery
+    long long carbon;       // Carbon after the open, -1 if the open failed
+} OpenResult;
+
+/**
+ * Creates the save file through stock.c in a child process
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int build_file(const char *path) {
+    unlink(path);
+    fflush(stdout);  // The child must not flush our buffered output again
+    pid_t pid = fork();
+    if (pid == -1) return -1;
+    if (pid == 0) {
+        if (freopen("/dev/null", "w", stdout) == NULL || freopen("/dev/null", "w", stderr) == NULL) _exit(1);
+        in_memory_stock.carbon = in_memory_stock.hydrogen = in_memory_stock.oxygen = INITIAL_ATOMS;
+        if (stock_open_save_file(path) == -1) _exit(1);
+        for (int i = 0; i < NUM_ADDS; i++) {
+            if (!atom_adder(stock_ptr, "CARBON", 1)) _exit(1);
+        }
+        stock_close_save_file();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/**
+ * Damages the save file as a scenario describes
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int damage_file(const char *path, Damage damage) {
+    StockFile file;
+    int fd = open(path, O_RDWR);
+    if (fd == -1 || pread(fd, &file, sizeof(file), 0) != (ssize_t)sizeof(file)) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    if (damage != DAMAGE_NONE) {
+        // Any other boot id makes the opener distrust the live stock
+        snprintf(file.boot_id, sizeof(file.boot_id), "another-boot");
+        // A write that was in progress leaves the live stock half-updated
+        file.stock.carbon = 0xdeadbeefULL;
+    }
+    if (damage == DAMAGE_TORN_NEWEST || damage == DAMAGE_TORN_BOTH) {
+        file.slots[file.slot_seq & 1].stock.carbon ^= 0x100;
+    }
+    if (damage == DAMAGE_TORN_BOTH) {
+        file.slots[(file.slot_seq + 1) & 1].stock.oxygen ^= 0x1;
+    }
+    if (damage == DAMAGE_FOREIGN) {
+        for (size_t i = 0; i < sizeof(file); i++) ((unsigned char *)&file)[i] = (unsigned char)rand();
+    }
+
+    int ok = pwrite(fd, &file, sizeof(file), 0) == (ssize_t)sizeof(file);
+    if (ok && damage == DAMAGE_TRUNCATED) ok = ftruncate(fd, sizeof(file) - 1) == 0;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = "/tmp/bench_recovery.save";
+    int runs = 50, opt;
+    double budget_us = 1000.0;
+
+    while ((opt = getopt(argc, argv, "n:b:f:")) != -1) {
+        switch (opt) {
+            case 'n': runs = atoi(optarg); break;
+            case 'b': budget_us = atof(optarg); break;
+            case 'f': path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n runs] [-b budget-us] [-f save-file]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (runs <= 0 || runs > MAX_RUNS || budget_us <= 0) {
+        fprintf(stderr, "Usage: %s [-n runs] [-b budget-us] [-f save-file]\n", argv[0]);
+        return 1;
+    }
+
+    printf("save file %s (%zu bytes, crc32c: %s), budget %.0f us (median of %d opens)\n", path, sizeof(StockFile),
+           crc32c_implementation(), budget_us, runs);
+    printf("%-34s %12s %14s %10s\n", "scenario", "open us", "recovery us", "outcome");
+
+    int all_ok = 1;
+    for (int s = 0; s < NUM_SCENARIOS; s++) {
+        long long open_ns[MAX_RUNS], recovery_ns[MAX_RUNS];
+        int ok = 1;
+
+        for (int r = 0; r < runs; r++) {
+            OpenResult result;
+            int fds[2];
+            if (build_file(path) == -1 || damage_file(path, scenarios[s].damage) == -1 || pipe(fds) == -1) {
+                fprintf(stderr, "cannot prepare %s\n", path);
+                return 1;
+            }
+
+            pid_t pid = fork();
+            if (pid == -1) {
+                perror("fork");
+                return 1;
+            }
+            if (pid == 0) {
+                close(fds[0]);
+                if (freopen("/dev/null", "w", stdout) == NULL || freopen("/dev/null", "w", stderr) == NULL) _exit(1);
+                long long start = latency_now_ns();
+                int rc = stock_open_save_file(path);
+                result.open_ns = latency_now_ns() - start;
+                result.recovery_ns = stock_recovery_ns;
+                result.carbon = rc == 0 ? (long long)stock_ptr->carbon : -1;
+                _exit(write(fds[1], &result, sizeof(result)) == (ssize_t)sizeof(result) ? 0 : 1);
+            }
+            close(fds[1]);
+            if (read(fds[0], &result, sizeof(result)) != (ssize_t)sizeof(result)) result.carbon = -2;
+            close(fds[0]);
+            waitpid(pid, NULL, 0);
+
+            open_ns[r] = result.open_ns;
+            recovery_ns[r] = result.recovery_ns;
+            if (result.carbon != scenarios[s].expected_carbon) ok = 0;
+        }
+
+        qsort(open_ns, runs, sizeof(long long), compare_ll);
+        qsort(recovery_ns, runs, sizeof(long long), compare_ll);
+        double open_us = open_ns[runs / 2] / 1e3, check_us = recovery_ns[runs / 2] / 1e3;
+        int within_budget = open_us <= budget_us;
+        printf("%-34s %12.1f %14.1f %10s%s\n", scenarios[s].name, open_us, check_us,
+               ok ? (scenarios[s].expected_carbon < 0 ? "refused" : "recovered") : "WRONG",
+               within_budget ? "" : "  OVER BUDGET");
+        all_ok = all_ok && ok && within_budget;
+    }
+
+    unlink(path);
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,192 @@
+/*
+ * bench_replay - log replay speed against the memory bandwidth of the same pass
+ *
+ * Writes an operation log of N records (the format of wal.h, ADD and DELIVER
+ * in turn) and, with the log in the page cache, measures:
+ *   - read:    one sequential pass summing the mapped log (the bandwidth bound)
+ *   - replay:  wal_replay() over the mapping: sequence number, opcode and
+ *              CRC32C checks plus the stock updates, as drinks_restore does
+ *   - restore: mmap(MAP_POPULATE) of the file and wal_replay(), end to end
+ * Every replay must rebuild the expected stock. Each figure is the best of
+ * several runs.
+ *
+ * Usage: bench_replay [-n records] [-r runs] [-f log-file]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wal.h"
+#include "crc32c.h"
+#include "latency.h"
+
+#define WRITE_CHUNK 4096  // Records written per write()
+
+/**
+ * Writes a log of count records and returns the stock they lead to
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int build_log(const char *path, unsigned long long count, AtomStock *expected) {
+    static WalRecord chunk[WRITE_CHUNK];
+    WalHeader header;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return -1;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = WAL_MAGIC;
+    header.version = WAL_VERSION;
+    header.base_lsn = 1;
+    header.time_ns = 1;
+    header.base.carbon = header.base.hydrogen = header.base.oxygen = 1000;
+    header.record_size = sizeof(WalRecord);
+    header.crc = crc32c(&header, offsetof(WalHeader, crc));
+    if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+
+    unsigned long long counters[NUM_ELEMENTS] = {1000, 1000, 1000};
+    unsigned long long lsn = 1;
+    while (lsn <= count) {
+        size_t n = 0;
+        for (; n < WRITE_CHUNK && lsn <= count; n++, lsn++) {
+            WalRecord *record = &chunk[n];
+            memset(record, 0, sizeof(*record));
+            record->lsn = lsn;
+            record->time_ns = 1000 + lsn;
+            record->op = (lsn % 2) ? WAL_OP_ADD : WAL_OP_DELIVER;
+            for (int e = 0; e < NUM_ELEMENTS; e++) {
+                // ADD a few atoms, then DELIVER a few less: the stock grows slowly
+                record->atoms[e] = record->op == WAL_OP_ADD ? 3 + (lsn + e) % 5 : 1 + (lsn + e) % 3;
+                counters[e] += record->op == WAL_OP_ADD ? record->atoms[e] : -record->atoms[e];
+            }
+            record->crc = crc32c(record, offsetof(WalRecord, crc));
+        }
+        if (write(fd, chunk, n * sizeof(WalRecord)) != (ssize_t)(n * sizeof(WalRecord))) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    expected->carbon = counters[ELEMENT_CARBON];
+    expected->hydrogen = counters[ELEMENT_HYDROGEN];
+    expected->oxygen = counters[ELEMENT_OXYGEN];
+    return 0;
+}
+
+/**
+ * Replays a mapped log from its base stock
+ *
+ * @return  1 if the expected stock was rebuilt from every record, 0 otherwise
+ */
+static int replay_all(const char *path, const void *log, size_t size, unsigned long long count,
+                      const AtomStock *expected) {
+    const WalHeader *header = log;
+    AtomStock stock = header->base;
+    WalReplay replay;
+
+    memset(&replay, 0, sizeof(replay));
+    replay.from_lsn = header->base_lsn - 1;
+    replay.to_lsn = UINT64_MAX;
+    replay.to_time_ns = UINT64_MAX;
+    if (wal_replay(path, log, size, &stock, &replay) == -1) return 0;
+    return replay.records == count && replay.reached_end && memcmp(&stock, expected, sizeof(stock)) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = "/tmp/bench_replay.wal";
+    unsigned long long count = 4000000;
+    int runs = 5, opt;
+
+    while ((opt = getopt(argc, argv, "n:r:f:")) != -1) {
+        switch (opt) {
+            case 'n': count = strtoull(optarg, NULL, 10); break;
+            case 'r': runs = atoi(optarg); break;
+            case 'f': path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n records] [-r runs] [-f log-file]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (count == 0 || runs <= 0) {
+        fprintf(stderr, "Usage: %s [-n records] [-r runs] [-f log-file]\n", argv[0]);
+        return 1;
+    }
+
+    AtomStock expected;
+    if (build_log(path, count, &expected) == -1) {
+        perror(path);
+        return 1;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        return 1;
+    }
+    size_t size = st.st_size;
+
+    printf("log %s: %llu records, %.1f MB (crc32c: %s), best of %d runs\n", path, count, size / 1e6,
+           crc32c_implementation(), runs);
+    printf("%-10s %12s %12s %14s\n", "pass", "ms", "GB/s", "M records/s");
+
+    // Mapped once and touched, so the first two passes run from memory
+    void *log = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (log == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    unsigned long long best_read = ~0ULL, best_replay = ~0ULL, best_restore = ~0ULL;
+    volatile uint64_t sink = 0;
+    int ok = 1;
+    for (int r = 0; r < runs; r++) {
+        unsigned long long start = latency_now_ns();
+        const uint64_t *words = log;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < size / sizeof(uint64_t); i++) sum += words[i];
+        sink += sum;
+        unsigned long long elapsed = latency_now_ns() - start;
+        if (elapsed < best_read) best_read = elapsed;
+
+        start = latency_now_ns();
+        ok &= replay_all(path, log, size, count, &expected);
+        elapsed = latency_now_ns() - start;
+        if (elapsed < best_replay) best_replay = elapsed;
+
+        start = latency_now_ns();
+        void *fresh = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (fresh == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+        madvise(fresh, size, MADV_SEQUENTIAL);
+        ok &= replay_all(path, fresh, size, count, &expected);
+        munmap(fresh, size);
+        elapsed = latency_now_ns() - start;
+        if (elapsed < best_restore) best_restore = elapsed;
+    }
+    munmap(log, size);
+    close(fd);
+    unlink(path);
+
+    const char *names[] = {"read", "replay", "restore"};
+    unsigned long long best[] = {best_read, best_replay, best_restore};
+    for (int p = 0; p < 3; p++) {
+        double seconds = best[p] / 1e9;
+        printf("%-10s %12.2f %12.2f %14.1f\n", names[p], best[p] / 1e6, size / seconds / 1e9, count / seconds / 1e6);
+    }
+    printf("replay runs at %.0f%% of the read pass\n", 100.0 * best_read / best_replay);
+    if (!ok) printf("WRONG: a replay did not rebuild the expected stock\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,380 @@
+/*
+ * bench_stock - flock versus process-shared mutex versus lock-free atomic stock updates
+ *
+ * For every process count P and every --lock-mode the benchmark creates a
+ * fresh save file, forks P worker processes that each open and map it on
+ * their own (exactly like P drinks_bar servers sharing -f <save-file>) and
+ * run a fixed number of mixed ADD / DELIVER operations through stock.c.
+ *
+ * Reported per run:
+ *   ops/s   total operations per second over all processes
+ *   ns/op   mean time of one operation inside a worker
+ *   check   atom conservation: initial + added - delivered == final
+ *
+ * A second table runs T threads inside one process without a save file
+ * (flock and mutex then only use their in-process locks) and adds the
+ * sharded mode, whose per-CPU shards are meant to scale with T.
+ *
+ * Finally a child process dies while holding the mutex-mode lock, and the
+ * benchmark checks that the next locker recovers through EOWNERDEAD.
+ *
+ * Usage: bench_stock [-n ops-per-worker] [-a add-percent] [-p P1,P2,...] [-t T1,T2,...] [-f save-file]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "stock.h"
+
+#define MAX_COUNTS 16
+#define MAX_WORKERS 256
+#define INITIAL_ATOMS 1000000ULL
+
+static const char *elements[] = {"CARBON", "HYDROGEN", "OXYGEN"};
+
+/**
+ * Molecule recipes, used to account for delivered atoms
+ */
+typedef struct {
+    const char *name;
+    unsigned long long c, h, o;
+} Molecule;
+
+static const Molecule molecules[] = {
+    {"WATER", 0, 2, 1},
+    {"CARBON DIOXIDE", 1, 0, 2},
+    {"ALCOHOL", 2, 6, 1},
+    {"GLUCOSE", 6, 12, 6},
+};
+
+/**
+ * Per-process results, kept in an anonymous shared mapping
+ */
+typedef struct {
+    unsigned long long added[3];      // Atoms successfully added (C, H, O)
+    unsigned long long delivered[3];  // Atoms successfully delivered (C, H, O)
+    long long elapsed_ns;             // Time spent in the operation loop
+} WorkerResult;
+
+/**
+ * Arguments and results of one worker thread
+ */
+typedef struct {
+    pthread_t thread;
+    long ops;
+    int add_percent;
+    unsigned int seed;
+    WorkerResult result;
+} ThreadWorker;
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Parses a comma separated list of positive integers
+ *
+ * @param list    List such as "1,2,4,8"
+ * @param counts  Receives the parsed values
+ * @return        Number of values parsed
+ */
+static int parse_counts(const char *list, int *counts) {
+    char copy[256];
+    int n = 0;
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (char *tok = strtok(copy, ","); tok != NULL && n < MAX_COUNTS; tok = strtok(NULL, ",")) {
+        int v = atoi(tok);
+        if (v > 0) counts[n++] = v;
+    }
+    return n;
+}
+
+/**
+ * Runs the operation mix on the current stock
+ *
+ * @param ops          Number of operations to run
+ * @param add_percent  Percentage of operations that are ADD
+ * @param seed         Random seed
+ * @param result       Where to store the results
+ */
+static void run_mix(long ops, int add_percent, unsigned int seed, WorkerResult *result) {
+    long long start = now_ns();
+    for (long i = 0; i < ops; i++) {
+        if ((int)(rand_r(&seed) % 100) < add_percent) {
+            int e = rand_r(&seed) % 3;
+            unsigned int amount = 1 + rand_r(&seed) % 10;
+            if (atom_adder(stock_ptr, elements[e], amount)) result->added[e] += amount;
+        } else {
+            const Molecule *m = &molecules[rand_r(&seed) % 4];
+            if (molecule_subtract(stock_ptr, m->name, 1)) {
+                result->delivered[0] += m->c;
+                result->delivered[1] += m->h;
+                result->delivered[2] += m->o;
+            }
+        }
+    }
+    result->elapsed_ns = now_ns() - start;
+}
+
+/**
+ * Body of one worker process: maps the save file and runs the operation mix
+ *
+ * @param path         Save file shared by all workers
+ * @param ops          Number of operations to run
+ * @param add_percent  Percentage of operations that are ADD
+ * @param seed         Random seed
+ * @param result       Where to store the results
+ */
+static void run_worker(const char *path, long ops, int add_percent, unsigned int seed,
+                       WorkerResult *result) {
+    // stock.c reports every failed DELIVER; keep the output readable
+    if (freopen("/dev/null", "w", stdout) == NULL || freopen("/dev/null", "w", stderr) == NULL) {
+        _exit(1);
+    }
+    // Each worker opens the file itself so flock() sees separate open file descriptions
+    if (stock_open_save_file(path) == -1) _exit(1);
+
+    run_mix(ops, add_percent, seed, result);
+    _exit(0);
+}
+
+/**
+ * Body of one worker thread
+ */
+static void *thread_worker(void *arg) {
+    ThreadWorker *worker = arg;
+    run_mix(worker->ops, worker->add_percent, worker->seed, &worker->result);
+    return NULL;
+}
+
+/**
+ * Compares the final stock with initial + added - delivered and prints one report line
+ *
+ * @return  1 if atoms were conserved, 0 otherwise
+ */
+static int report(StockLockMode mode, int workers, long ops, long long wall, const AtomStock *initial,
+                  const AtomStock *final, WorkerResult *const *results, int failed) {
+    unsigned long long expected[3] = {initial->carbon, initial->hydrogen, initial->oxygen};
+    long long busy = 0;
+    for (int i = 0; i < workers; i++) {
+        for (int e = 0; e < 3; e++) expected[e] += results[i]->added[e] - results[i]->delivered[e];
+        busy += results[i]->elapsed_ns;
+    }
+    int ok = !failed && final->carbon == expected[0] && final->hydrogen == expected[1] &&
+             final->oxygen == expected[2];
+
+    double total_ops = (double)ops * workers;
+    printf("%-7s %5d %14.0f %10.1f   %s\n", stock_lock_mode_name(mode), workers,
+           total_ops / (wall / 1e9), (double)busy / total_ops, ok ? "ok" : "MISMATCH");
+    if (!ok) {
+        printf("        final C=%llu H=%llu O=%llu, expected C=%llu H=%llu O=%llu\n",
+               final->carbon, final->hydrogen, final->oxygen, expected[0], expected[1], expected[2]);
+    }
+    return ok;
+}
+
+/**
+ * Runs one configuration and prints its line of the report
+ *
+ * @return  1 if atoms were conserved, 0 otherwise
+ */
+static int run_case(const char *path, StockLockMode mode, int procs, long ops, int add_percent) {
+    WorkerResult *results = mmap(NULL, sizeof(WorkerResult) * procs, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(results, 0, sizeof(WorkerResult) * procs);
+
+    // Start from a fresh save file; the first worker creates it from in_memory_stock
+    unlink(path);
+    in_memory_stock.carbon = in_memory_stock.hydrogen = in_memory_stock.oxygen = INITIAL_ATOMS;
+    stock_lock_mode = mode;
+    fflush(stdout);
+
+    long long start = now_ns();
+    for (int i = 0; i < procs; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) run_worker(path, ops, add_percent, 12345u + i, &results[i]);
+    }
+    int failed = 0, status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+    }
+    long long wall = now_ns() - start;
+
+    // Read the final stock straight from the file (the stock is the last field)
+    AtomStock final;
+    off_t size;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || (size = lseek(fd, 0, SEEK_END)) < (off_t)sizeof(final) ||
+        pread(fd, &final, sizeof(final), size - sizeof(final)) != (ssize_t)sizeof(final)) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+
+    AtomStock initial = {INITIAL_ATOMS, INITIAL_ATOMS, INITIAL_ATOMS};
+    WorkerResult *result_ptrs[MAX_WORKERS];
+    for (int i = 0; i < procs; i++) result_ptrs[i] = &results[i];
+    int ok = report(mode, procs, ops, wall, &initial, &final, result_ptrs, failed);
+
+    munmap(results, sizeof(WorkerResult) * procs);
+    return ok;
+}
+
+/**
+ * Runs one configuration with worker threads in this process (no save file)
+ *
+ * @return  1 if atoms were conserved, 0 otherwise
+ */
+static int run_thread_case(StockLockMode mode, int threads, long ops, int add_percent) {
+    ThreadWorker workers[MAX_WORKERS];
+    WorkerResult *result_ptrs[MAX_WORKERS];
+    AtomStock initial, final;
+
+    stock_lock_mode = mode;
+    stock_snapshot(&initial);
+
+    long long start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        memset(&workers[i], 0, sizeof(workers[i]));
+        workers[i].ops = ops;
+        workers[i].add_percent = add_percent;
+        workers[i].seed = 54321u + i;
+        result_ptrs[i] = &workers[i].result;
+        if (pthread_create(&workers[i].thread, NULL, thread_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) pthread_join(workers[i].thread, NULL);
+    long long wall = now_ns() - start;
+
+    stock_snapshot(&final);
+    return report(mode, threads, ops, wall, &initial, &final, result_ptrs, 0);
+}
+
+/**
+ * Kills a process while it holds the mutex-mode lock and checks that the
+ * next locker gets the lock back and can still update the stock
+ *
+ * @return  1 if the lock was recovered, 0 otherwise
+ */
+static int run_owner_death_check(const char *path) {
+    unlink(path);
+    in_memory_stock.carbon = in_memory_stock.hydrogen = in_memory_stock.oxygen = INITIAL_ATOMS;
+    stock_lock_mode = LOCK_MODE_MUTEX;
+
+    printf("\nowner death (mutex mode):\n");
+    fflush(stdout);
+    if (stock_open_save_file(path) == -1) return 0;
+    fflush(stdout);
+
+    // The child shares the mapping, takes the lock and exits without releasing it
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        stock_lock_exclusive();
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+
+    int ok = atom_adder(stock_ptr, "CARBON", 1) && stock_ptr->carbon == INITIAL_ATOMS + 1;
+    printf("lock recovered after owner death: %s\n", ok ? "ok" : "FAILED");
+    stock_close_save_file();
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    long ops = 200000;
+    int add_percent = 50;
+    int counts[MAX_COUNTS] = {1, 2, 4, 8};
+    int num_counts = 4;
+    int thread_counts[MAX_COUNTS] = {1, 2, 4, 8, 16, 32};
+    int num_thread_counts = 6;
+    char default_path[64];
+    const char *path = default_path;
+    int opt;
+
+    snprintf(default_path, sizeof(default_path), "/tmp/bench_stock_%d.dat", (int)getpid());
+
+    while ((opt = getopt(argc, argv, "n:a:p:t:f:")) != -1) {
+        switch (opt) {
+            case 'n': ops = atol(optarg); break;
+            case 'a': add_percent = atoi(optarg); break;
+            case 'p': num_counts = parse_counts(optarg, counts); break;
+            case 't': num_thread_counts = parse_counts(optarg, thread_counts); break;
+            case 'f': path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n ops-per-worker] [-a add-percent] [-p P1,P2,...] [-t T1,T2,...] [-f save-file]\n", argv[0]);
+                return 1;
+        }
+    }
+    for (int i = 0; i < num_counts; i++) {
+        if (counts[i] > MAX_WORKERS) num_counts = 0;
+    }
+    for (int i = 0; i < num_thread_counts; i++) {
+        if (thread_counts[i] > MAX_WORKERS) num_thread_counts = 0;
+    }
+    if (ops <= 0 || num_counts == 0 || num_thread_counts == 0 || add_percent < 0 || add_percent > 100) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    printf("%ld ops per worker, %d%% ADD, save file %s, %ld CPUs\n", ops, add_percent, path,
+           sysconf(_SC_NPROCESSORS_CONF));
+    printf("%-7s %5s %14s %10s   %s\n", "mode", "procs", "ops/s", "ns/op", "check");
+
+    int all_ok = 1;
+    for (int i = 0; i < num_counts; i++) {
+        all_ok &= run_case(path, LOCK_MODE_FLOCK, counts[i], ops, add_percent);
+        all_ok &= run_case(path, LOCK_MODE_MUTEX, counts[i], ops, add_percent);
+        all_ok &= run_case(path, LOCK_MODE_ATOMIC, counts[i], ops, add_percent);
+    }
+
+    // stock.c reports every failed DELIVER on stderr; silence it while threads run
+    printf("\n%-7s %5s %14s %10s   %s\n", "mode", "thrds", "ops/s", "ns/op", "check");
+    fflush(stdout);
+    fflush(stderr);
+    int saved_stderr = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (saved_stderr == -1 || null_fd == -1 || dup2(null_fd, STDERR_FILENO) == -1) {
+        perror("/dev/null");
+        return 1;
+    }
+    close(null_fd);
+    const StockLockMode thread_modes[] = {LOCK_MODE_FLOCK, LOCK_MODE_MUTEX, LOCK_MODE_ATOMIC, LOCK_MODE_SHARDED};
+    for (int i = 0; i < num_thread_counts; i++) {
+        for (int m = 0; m < 4; m++) {
+            all_ok &= run_thread_case(thread_modes[m], thread_counts[i], ops, add_percent);
+            fflush(stdout);
+        }
+    }
+    fflush(stderr);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+    all_ok &= run_owner_death_check(path);
+    unlink(path);
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,257 @@
+/*
+ * bench_threads - drinks_bar throughput versus number of reactor threads
+ *
+ * For every thread count T the benchmark starts `drinks_bar --threads T`,
+ * runs C closed-loop clients for a fixed duration and reports completed
+ * operations per second for two mixes:
+ *   add-heavy      90% TCP ADD, 10% UDP DELIVER
+ *   deliver-heavy  10% TCP ADD, 90% UDP DELIVER
+ *
+ * Each client owns one TCP connection and one UDP socket, so SO_REUSEPORT
+ * spreads them over the server's reactor threads.
+ *
+ * Usage: bench_threads [-c clients] [-d seconds] [-t T1,T2,...] [-p base-port] <drinks_bar>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_COUNTS 16
+#define BUFFER_SIZE 1024
+
+/**
+ * Operation mix: percentage of operations that are TCP ADD (the rest are UDP DELIVER)
+ */
+typedef struct {
+    const char *name;
+    int add_percent;
+} Mix;
+
+static const Mix mixes[] = {
+    {"add-heavy", 90},
+    {"deliver-heavy", 10},
+};
+
+/**
+ * State of one simulated client thread
+ */
+typedef struct {
+    pthread_t thread;
+    int tcp_port;
+    int add_percent;
+    unsigned int seed;
+    long long ops;        // Completed operations
+    long long errors;     // Failed or timed-out operations
+} Client;
+
+static volatile int running = 0;
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Creates a socket of the given type connected to 127.0.0.1:port
+ *
+ * @param type  SOCK_STREAM or SOCK_DGRAM
+ * @param port  Server port
+ * @return      Connected socket, or -1 on failure
+ */
+static int connect_local(int type, int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, type, 0);
+    if (fd == -1) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Starts drinks_bar with a well-stocked warehouse and the given number of threads
+ *
+ * @param binary      Path of the drinks_bar binary
+ * @param tcp_port    TCP port (UDP uses tcp_port + 1)
+ * @param threads     Value passed to --threads
+ * @param console_fd  Receives the write end of the console pipe
+ * @return            Child pid, or -1 on failure
+ */
+static pid_t start_server(const char *binary, int tcp_port, int threads, int *console_fd) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1) return -1;
+
+    pid_t pid = fork();
+    if (pid == -1) return -1;
+    if (pid == 0) {
+        char tcp[16], udp[16], nthreads[16];
+        const char *plenty = "100000000000000000";
+        snprintf(tcp, sizeof(tcp), "%d", tcp_port);
+        snprintf(udp, sizeof(udp), "%d", tcp_port + 1);
+        snprintf(nthreads, sizeof(nthreads), "%d", threads);
+
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(pipefd[0], STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execl(binary, binary, "-T", tcp, "-U", udp, "--threads", nthreads,
+              "-c", plenty, "-h", plenty, "-o", plenty, (char *)NULL);
+        _exit(127);
+    }
+    close(pipefd[0]);
+    *console_fd = pipefd[1];
+
+    // Wait until the server accepts connections
+    for (int i = 0; i < 200; i++) {
+        int fd = connect_local(SOCK_STREAM, tcp_port);
+        if (fd != -1) {
+            close(fd);
+            return pid;
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(*console_fd);
+    return -1;
+}
+
+/**
+ * Client thread: issues ADD over TCP or DELIVER over UDP until the run ends
+ */
+static void *client_main(void *arg) {
+    Client *c = arg;
+    char reply[BUFFER_SIZE];
+    int one = 1;
+    struct timeval tv = {1, 0};
+
+    int tcp = connect_local(SOCK_STREAM, c->tcp_port);
+    int udp = connect_local(SOCK_DGRAM, c->tcp_port + 1);
+    if (tcp == -1 || udp == -1) {
+        c->errors++;
+        return NULL;
+    }
+    setsockopt(tcp, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(udp, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (running) {
+        int is_add = (int)(rand_r(&c->seed) % 100) < c->add_percent;
+        int fd = is_add ? tcp : udp;
+        const char *cmd = is_add ? "ADD OXYGEN 1\n" : "DELIVER WATER 1";
+
+        if (send(fd, cmd, strlen(cmd), 0) == -1 || recv(fd, reply, sizeof(reply), 0) <= 0) {
+            c->errors++;
+            if (is_add) break;    // A broken TCP connection ends this client
+            continue;
+        }
+        c->ops++;
+    }
+    close(tcp);
+    close(udp);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int counts[MAX_COUNTS] = {1, 2, 4, 8};
+    int ncounts = 4, clients = 32, seconds = 3, base_port = 22000, opt;
+
+    while ((opt = getopt(argc, argv, "c:d:t:p:")) != -1) {
+        switch (opt) {
+            case 'c':
+                clients = atoi(optarg);
+                break;
+            case 'd':
+                seconds = atoi(optarg);
+                break;
+            case 't':
+            {
+                ncounts = 0;
+                for (char *tok = strtok(optarg, ","); tok && ncounts < MAX_COUNTS; tok = strtok(NULL, ",")) {
+                    counts[ncounts++] = atoi(tok);
+                }
+                break;
+            }
+            case 'p':
+                base_port = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c clients] [-d seconds] [-t T1,T2,...] [-p base-port] <drinks_bar>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind >= argc || clients <= 0 || seconds <= 0) {
+        fprintf(stderr, "Usage: %s [-c clients] [-d seconds] [-t T1,T2,...] [-p base-port] <drinks_bar>\n", argv[0]);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    Client *pool = calloc(clients, sizeof(Client));
+    int port = base_port;
+
+    printf("%-14s %8s %8s %14s %8s\n", "mix", "threads", "clients", "ops/s", "errors");
+    for (size_t m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+        for (int t = 0; t < ncounts; t++, port += 2) {
+            int console_fd;
+            pid_t pid = start_server(argv[optind], port, counts[t], &console_fd);
+            if (pid == -1) {
+                printf("%-14s %8d %8s\n", mixes[m].name, counts[t], "failed to start server");
+                continue;
+            }
+
+            running = 1;
+            for (int i = 0; i < clients; i++) {
+                memset(&pool[i], 0, sizeof(Client));
+                pool[i].tcp_port = port;
+                pool[i].add_percent = mixes[m].add_percent;
+                pool[i].seed = (unsigned int)(i * 7919 + t);
+                pthread_create(&pool[i].thread, NULL, client_main, &pool[i]);
+            }
+
+            long long start = now_ns();
+            sleep(seconds);
+            running = 0;
+            long long ops = 0, errors = 0;
+            for (int i = 0; i < clients; i++) {
+                pthread_join(pool[i].thread, NULL);
+                ops += pool[i].ops;
+                errors += pool[i].errors;
+            }
+            double elapsed = (now_ns() - start) / 1e9;
+
+            printf("%-14s %8d %8d %14.0f %8lld\n", mixes[m].name, counts[t], clients, ops / elapsed, errors);
+            fflush(stdout);
+
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+            close(console_fd);
+        }
+    }
+    free(pool);
+    return 0;
+}
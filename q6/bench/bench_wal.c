@@ -0,0 +1,300 @@
+/*
+ * bench_wal - ADD throughput and latency of drinks_bar --wal by group commit window
+ *
+ * For every window W the benchmark starts
+ * `drinks_bar -f <dir>/bench_wal.save --wal --wal-window W --threads T`,
+ * runs C closed-loop clients that send ADD over TCP, and reports completed
+ * operations per second, the median and 99th percentile reply latency and
+ * how many log records shared one fdatasync (from the server's STATS). A
+ * first row without --wal shows the cost of durability itself.
+ *
+ * The save file and its log go to <dir> (default: the current directory),
+ * which should be on the disk being measured rather than on a tmpfs.
+ *
+ * Usage: bench_wal [-c clients] [-n threads] [-d seconds] [-w W1,W2,...] [-D dir] [-p base-port] <drinks_bar>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_WINDOWS 16
+#define MAX_SAMPLES 200000
+#define BUFFER_SIZE 1024
+
+/**
+ * State of one simulated client thread
+ */
+typedef struct {
+    pthread_t thread;
+    int tcp_port;
+    long long ops;          // Completed operations
+    long long errors;       // Failed operations
+    long long *latency_ns;  // Reply latency of the first MAX_SAMPLES operations
+} Client;
+
+static volatile int running = 0;
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Creates a TCP socket connected to 127.0.0.1:port
+ *
+ * @return  Connected socket, or -1 on failure
+ */
+static int connect_local(int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Starts drinks_bar on a fresh save file
+ *
+ * @param binary      Path of the drinks_bar binary
+ * @param tcp_port    TCP port (UDP uses tcp_port + 1)
+ * @param threads     Value passed to --threads
+ * @param window_us   Value passed to --wal-window, -1 to run without --wal
+ * @param save_path   Save file (its log is save_path.wal)
+ * @param out_path    File that receives the server's output
+ * @param console_fd  Receives the write end of the console pipe
+ * @return            Child pid, or -1 on failure
+ */
+static pid_t start_server(const char *binary, int tcp_port, int threads, int window_us, const char *save_path,
+                          const char *out_path, int *console_fd) {
+    char log_path[4200];
+    int pipefd[2];
+
+    snprintf(log_path, sizeof(log_path), "%s.wal", save_path);
+    unlink(save_path);
+    unlink(log_path);
+    if (pipe(pipefd) == -1) return -1;
+
+    pid_t pid = fork();
+    if (pid == -1) return -1;
+    if (pid == 0) {
+        char tcp[16], udp[16], nthreads[16], window[16];
+        snprintf(tcp, sizeof(tcp), "%d", tcp_port);
+        snprintf(udp, sizeof(udp), "%d", tcp_port + 1);
+        snprintf(nthreads, sizeof(nthreads), "%d", threads);
+        snprintf(window, sizeof(window), "%d", window_us);
+
+        int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(pipefd[0], STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (window_us < 0) {
+            execl(binary, binary, "-T", tcp, "-U", udp, "--threads", nthreads, "-f", save_path, (char *)NULL);
+        } else {
+            execl(binary, binary, "-T", tcp, "-U", udp, "--threads", nthreads, "-f", save_path, "--wal",
+                  "--wal-window", window, (char *)NULL);
+        }
+        _exit(127);
+    }
+    close(pipefd[0]);
+    *console_fd = pipefd[1];
+
+    // Wait until the server accepts connections
+    for (int i = 0; i < 200; i++) {
+        int fd = connect_local(tcp_port);
+        if (fd != -1) {
+            close(fd);
+            return pid;
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(*console_fd);
+    return -1;
+}
+
+/**
+ * Client thread: one ADD at a time over TCP until the run ends
+ */
+static void *client_main(void *arg) {
+    Client *c = arg;
+    char reply[BUFFER_SIZE];
+    const char *cmd = "ADD OXYGEN 1\n";
+    int one = 1;
+
+    int tcp = connect_local(c->tcp_port);
+    if (tcp == -1) {
+        c->errors++;
+        return NULL;
+    }
+    setsockopt(tcp, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    while (running) {
+        long long start = now_ns();
+        if (send(tcp, cmd, strlen(cmd), 0) == -1 || recv(tcp, reply, sizeof(reply), 0) <= 0) {
+            c->errors++;
+            break;
+        }
+        if (c->ops < MAX_SAMPLES) c->latency_ns[c->ops] = now_ns() - start;
+        c->ops++;
+    }
+    close(tcp);
+    return NULL;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Reads the records-per-sync figure from the server's STATS output
+ *
+ * @return  Records per fdatasync, or 0 if the server printed none
+ */
+static double records_per_sync(const char *out_path) {
+    char line[512];
+    double value = 0;
+    FILE *out = fopen(out_path, "r");
+    if (out == NULL) return 0;
+    while (fgets(line, sizeof(line), out) != NULL) {
+        char *field = strstr(line, "records-per-sync=");
+        if (strncmp(line, "Log stats:", 10) == 0 && field != NULL) value = atof(field + 17);
+    }
+    fclose(out);
+    return value;
+}
+
+int main(int argc, char *argv[]) {
+    int windows[MAX_WINDOWS] = {-1, 0, 50, 100, 200, 500, 1000, 2000};
+    int nwindows = 8, clients = 32, threads = 4, seconds = 3, base_port = 22400, opt;
+    const char *dir = ".";
+
+    while ((opt = getopt(argc, argv, "c:n:d:w:D:p:")) != -1) {
+        switch (opt) {
+            case 'c': clients = atoi(optarg); break;
+            case 'n': threads = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'w':
+                // The row without --wal always comes first
+                nwindows = 1;
+                for (char *tok = strtok(optarg, ","); tok && nwindows < MAX_WINDOWS; tok = strtok(NULL, ",")) {
+                    windows[nwindows++] = atoi(tok);
+                }
+                break;
+            case 'D': dir = optarg; break;
+            case 'p': base_port = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-c clients] [-n threads] [-d seconds] [-w W1,W2,...] [-D dir] [-p base-port] <drinks_bar>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind >= argc || clients <= 0 || threads <= 0 || seconds <= 0) {
+        fprintf(stderr, "Usage: %s [-c clients] [-n threads] [-d seconds] [-w W1,W2,...] [-D dir] [-p base-port] <drinks_bar>\n", argv[0]);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char save_path[4096], out_path[4096];
+    snprintf(save_path, sizeof(save_path), "%s/bench_wal_%d.save", dir, (int)getpid());
+    snprintf(out_path, sizeof(out_path), "%s/bench_wal_%d.out", dir, (int)getpid());
+
+    Client *pool = calloc(clients, sizeof(Client));
+    long long *samples = malloc((size_t)clients * MAX_SAMPLES * sizeof(long long));
+    if (pool == NULL || samples == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    printf("ADD over TCP, %d clients, %d reactor threads, %d s per window, log in %s\n", clients, threads, seconds,
+           dir);
+    printf("%-12s %12s %10s %10s %14s %8s\n", "window", "ops/s", "p50 us", "p99 us", "records/sync", "errors");
+    int port = base_port;
+    for (int w = 0; w < nwindows; w++, port += 2) {
+        int console_fd;
+        pid_t pid = start_server(argv[optind], port, threads, windows[w], save_path, out_path, &console_fd);
+        if (pid == -1) {
+            printf("%-12d failed to start server\n", windows[w]);
+            continue;
+        }
+
+        running = 1;
+        for (int i = 0; i < clients; i++) {
+            memset(&pool[i], 0, sizeof(Client));
+            pool[i].tcp_port = port;
+            pool[i].latency_ns = samples + (size_t)i * MAX_SAMPLES;
+            pthread_create(&pool[i].thread, NULL, client_main, &pool[i]);
+        }
+        long long start = now_ns();
+        sleep(seconds);
+        running = 0;
+
+        long long ops = 0, errors = 0;
+        size_t nsamples = 0;
+        for (int i = 0; i < clients; i++) {
+            pthread_join(pool[i].thread, NULL);
+            ops += pool[i].ops;
+            errors += pool[i].errors;
+            long long kept = pool[i].ops < MAX_SAMPLES ? pool[i].ops : MAX_SAMPLES;
+            memmove(samples + nsamples, pool[i].latency_ns, kept * sizeof(long long));
+            nsamples += kept;
+        }
+        double elapsed = (now_ns() - start) / 1e9;
+        qsort(samples, nsamples, sizeof(long long), compare_ll);
+
+        // STATS prints the group commit figures, then the server exits
+        // (one console line per wakeup: the console reads with stdio)
+        if (write(console_fd, "STATS\n", 6) != 6) kill(pid, SIGTERM);
+        usleep(200000);
+        if (write(console_fd, "quit\n", 5) != 5) kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        close(console_fd);
+
+        char label[16];
+        if (windows[w] < 0) {
+            snprintf(label, sizeof(label), "no-wal");
+        } else {
+            snprintf(label, sizeof(label), "%dus", windows[w]);
+        }
+        printf("%-12s %12.0f %10.1f %10.1f %14.2f %8lld\n", label, ops / elapsed,
+               nsamples ? samples[nsamples / 2] / 1e3 : 0.0, nsamples ? samples[nsamples * 99 / 100] / 1e3 : 0.0,
+               windows[w] < 0 ? 0.0 : records_per_sync(out_path), errors);
+        fflush(stdout);
+    }
+
+    char log_path[4200];
+    snprintf(log_path, sizeof(log_path), "%s.wal", save_path);
+    unlink(save_path);
+    unlink(log_path);
+    unlink(out_path);
+    free(samples);
+    free(pool);
+    return 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * capacity.c - מטמון כמויות הייצור
+ * --------------------------------
+ * לכל משקה ולכל מולקולה נשמרת הכמות המרבית שאפשר להכין מהמלאי, יחד עם
+ * "אטום צוואר הבקבוק" שקובע אותה (היסוד שהמנה שלו הקטנה ביותר).
+ *
+ * עדכון (ADD / DELIVER של התהליך הזה):
+ * - לכל יסוד שהשתנה עוברים רק על הרשומות שמשתמשות בו
+ * - יסוד שגדל: רק רשומות שהוא צוואר הבקבוק שלהן מחושבות מחדש
+ * - יסוד שקטן: כל רשומה משווה את המנה החדשה שלו לכמות הנוכחית, ב-O(1)
+ * - במצבי הנעילה (flock, mutex) העדכון נעשה בתוך הנעילה הבלעדית עם המלאי המדויק;
+ *   במצבים ללא נעילה (atomic, sharded) הכותב קורא את המלאי מחדש, ועדכונים
+ *   מקבילים מתלכדים: מי שלא השיג את מנעול המטמון משאיר את העבודה למחזיק בו
+ *
+ * קריאה (GEN, GEN ALL):
+ * - seqlock: מונה גרסה שהוא אי-זוגי בזמן עדכון; הקורא מעתיק את הערכים
+ *   ובודק שהגרסה לא השתנתה, ללא נעילה כלל
+ * - עם קובץ שמירה גם תהליכים אחרים משנים את המלאי: הקורא משווה את המונים
+ *   הממופים למלאי שממנו חושב המטמון, ומרענן אותו רק אם הם שונים
+ * - גם עדכון של התהליך הזה שעוד לא הגיע למטמון (מחזיק מנעול המטמון עדיין
+ *   עובד עליו) מחייב רענון; הקורא מחכה למנעול המטמון וקורא את המלאי בעצמו,
+ *   כך שהתשובה לעולם אינה ישנה מהמלאי שהיה בתחילת הקריאה
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "capacity.h"
+
+// Entries hold the drinks first, then the molecules
+static int num_drinks;
+static int num_entries;
+
+static unsigned long long *capacity;        // How many of each entry the stock can make
+static int *bottleneck;                     // Element that limits each entry, -1 if it needs none
+static const unsigned int **needed;         // Atoms of each element needed for one of each entry
+static int *users[NUM_ELEMENTS];            // Entries that need each element
+static int num_users[NUM_ELEMENTS];
+static unsigned long long cached_stock[NUM_ELEMENTS];  // Stock the capacities were computed from
+
+// Snapshot version times two, odd while an update is being written
+static unsigned long long capacity_seq = 0;
+static int capacity_ready = 0;
+
+// Stock updates announced by this process, and how many of them the cache reflects
+static unsigned long long changes_noted = 0;
+static unsigned long long changes_applied = 0;
+
+// Serializes the writers of the cache (readers never take it)
+static pthread_mutex_t capacity_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Computes one entry from the cached stock
+ *
+ * @param i  Entry index
+ */
+static void compute_entry(int i) {
+    unsigned long long best = MAX_ATOMS;
+    int limit = -1;
+
+    for (int e = 0; e < NUM_ELEMENTS; e++) {
+        if (needed[i][e] > 0 && cached_stock[e] / needed[i][e] < best) {
+            best = cached_stock[e] / needed[i][e];
+            limit = e;
+        }
+    }
+    // An entry that needs no atoms at all is not something that can be produced
+    if (limit < 0) best = 0;
+    bottleneck[i] = limit;
+    __atomic_store_n(&capacity[i], best, __ATOMIC_RELAXED);
+}
+
+/**
+ * Allocates the tables and computes every entry (capacity_lock held)
+ * The registry must be complete: the catalog is loaded before the first stock update
+ *
+ * @param now  Stock to compute from
+ */
+static void build_cache(const AtomStock *now) {
+    num_drinks = registry_num_drinks();
+    num_entries = num_drinks + registry_num_molecules();
+
+    capacity = malloc(num_entries * sizeof(*capacity));
+    bottleneck = malloc(num_entries * sizeof(*bottleneck));
+    needed = malloc(num_entries * sizeof(*needed));
+    int allocated = capacity != NULL && bottleneck != NULL && needed != NULL;
+    for (int e = 0; e < NUM_ELEMENTS; e++) {
+        users[e] = malloc(num_entries * sizeof(*users[e]));
+        allocated &= users[e] != NULL;
+    }
+    if (!allocated) {
+        perror("malloc");
+        exit(1);
+    }
+
+    cached_stock[ELEMENT_CARBON] = now->carbon;
+    cached_stock[ELEMENT_HYDROGEN] = now->hydrogen;
+    cached_stock[ELEMENT_OXYGEN] = now->oxygen;
+    for (int i = 0; i < num_entries; i++) {
+        needed[i] = i < num_drinks ? registry_drink_atoms(i) : registry_molecule_formula(i - num_drinks);
+        for (int e = 0; e < NUM_ELEMENTS; e++) {
+            if (needed[i][e] > 0) users[e][num_users[e]++] = i;
+        }
+        compute_entry(i);
+    }
+    __atomic_store_n(&capacity_ready, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Moves the cache to a new stock, touching only the entries that can change
+ * (capacity_lock held)
+ *
+ * @param now  Stock to move to
+ */
+static void apply_stock(const AtomStock *now) {
+    const unsigned long long values[NUM_ELEMENTS] = {now->carbon, now->hydrogen, now->oxygen};
+    int changed = 0;
+
+    if (!capacity_ready) {
+        build_cache(now);
+        return;
+    }
+    for (int e = 0; e < NUM_ELEMENTS; e++) changed |= values[e] != cached_stock[e];
+    if (!changed) return;
+
+    // Odd version: readers retry until the update is complete
+    __atomic_store_n(&capacity_seq, capacity_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    // One element at a time, so the entries stay exact for the stock seen so far
+    for (int e = 0; e < NUM_ELEMENTS; e++) {
+        if (values[e] == cached_stock[e]) continue;
+        int grew = values[e] > cached_stock[e];
+        __atomic_store_n(&cached_stock[e], values[e], __ATOMIC_RELAXED);
+
+        for (int k = 0; k < num_users[e]; k++) {
+            int i = users[e][k];
+            if (grew) {
+                // Only an entry limited by this element can make more now
+                if (bottleneck[i] == e) compute_entry(i);
+            } else {
+                // This element can only become the new, lower limit
+                unsigned long long quota = values[e] / needed[i][e];
+                if (quota < capacity[i]) {
+                    bottleneck[i] = e;
+                    __atomic_store_n(&capacity[i], quota, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+
+    __atomic_store_n(&capacity_seq, capacity_seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Reads the stock and applies it until no update of this process is left
+ * unapplied. A writer returns at once if another thread holds the cache: that
+ * thread sees the new update count and reads the stock again. A reader waits
+ * for the cache instead, so it never answers from a stock older than the one
+ * it saw.
+ *
+ * @param wait  1 to wait for capacity_lock (readers), 0 to leave the work to its holder
+ */
+static void refresh_from_stock(int wait) {
+    unsigned long long seen;
+    AtomStock now;
+
+    do {
+        if (wait) {
+            pthread_mutex_lock(&capacity_lock);
+        } else if (pthread_mutex_trylock(&capacity_lock) != 0) {
+            return;
+        }
+        do {
+            seen = __atomic_load_n(&changes_noted, __ATOMIC_ACQUIRE);
+            stock_snapshot(&now);
+            apply_stock(&now);
+        } while (__atomic_load_n(&changes_noted, __ATOMIC_ACQUIRE) != seen);
+        __atomic_store_n(&changes_applied, seen, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&capacity_lock);
+        // An update noted after the last check found the mutex still held
+    } while (__atomic_load_n(&changes_noted, __ATOMIC_ACQUIRE) != seen);
+}
+
+/**
+ * Brings the cached capacities up to date after a stock update
+ *
+ * @param known  Stock after the update when the caller still holds the
+ *               exclusive stock lock, NULL to read the stock
+ */
+void capacity_stock_changed(const AtomStock *known) {
+    unsigned long long seen = __atomic_add_fetch(&changes_noted, 1, __ATOMIC_ACQ_REL);
+
+    if (known == NULL) {
+        refresh_from_stock(0);
+        return;
+    }
+    // Every other writer of this process waits for the exclusive lock we hold;
+    // a reader refreshing the cache reads the stock once we release it
+    if (pthread_mutex_trylock(&capacity_lock) != 0) return;
+    apply_stock(known);
+    __atomic_store_n(&changes_applied, seen, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&capacity_lock);
+}
+
+/**
+ * Makes sure the cache exists and reflects updates made by other processes
+ * through the save file
+ */
+static void capacity_validate() {
+    if (!__atomic_load_n(&capacity_ready, __ATOMIC_ACQUIRE)) {
+        AtomStock now;
+        pthread_mutex_lock(&capacity_lock);
+        if (!capacity_ready) {
+            stock_snapshot(&now);
+            build_cache(&now);
+        }
+        pthread_mutex_unlock(&capacity_lock);
+        return;
+    }
+
+    // An update of this process may be done but not yet in the cache
+    int stale = __atomic_load_n(&changes_noted, __ATOMIC_ACQUIRE) !=
+                __atomic_load_n(&changes_applied, __ATOMIC_ACQUIRE);
+    // Other processes change a mapped stock (only this process updates an in-memory one)
+    if (!stale && stock_ptr != &in_memory_stock) {
+        stale = __atomic_load_n(&stock_ptr->carbon, __ATOMIC_RELAXED) !=
+                    __atomic_load_n(&cached_stock[ELEMENT_CARBON], __ATOMIC_RELAXED) ||
+                __atomic_load_n(&stock_ptr->hydrogen, __ATOMIC_RELAXED) !=
+                    __atomic_load_n(&cached_stock[ELEMENT_HYDROGEN], __ATOMIC_RELAXED) ||
+                __atomic_load_n(&stock_ptr->oxygen, __ATOMIC_RELAXED) !=
+                    __atomic_load_n(&cached_stock[ELEMENT_OXYGEN], __ATOMIC_RELAXED);
+    }
+    if (stale) refresh_from_stock(1);
+}
+
+/**
+ * Reads one entry from a consistent snapshot
+ *
+ * @param i        Entry index
+ * @param version  Receives the snapshot version, may be NULL
+ * @return         Capacity of the entry
+ */
+static unsigned long long read_entry(int i, unsigned long long *version) {
+    unsigned long long before, after, value;
+
+    do {
+        before = __atomic_load_n(&capacity_seq, __ATOMIC_ACQUIRE);
+        value = __atomic_load_n(&capacity[i], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&capacity_seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+
+    if (version != NULL) *version = before / 2;
+    return value;
+}
+
+/**
+ * Maximum number of drinks the stock can produce, from the cache
+ *
+ * @param drink    Drink id (registry_drink_id())
+ * @param version  Receives the snapshot version, may be NULL
+ * @return         Maximum number of drinks that can be produced
+ */
+unsigned long long capacity_drink(int drink, unsigned long long *version) {
+    capacity_validate();
+    return read_entry(drink, version);
+}
+
+/**
+ * Maximum number of molecules the stock can make, from the cache
+ *
+ * @param molecule  Molecule id (registry_molecule_id())
+ * @param version   Receives the snapshot version, may be NULL
+ * @return          Maximum number of molecules that can be made
+ */
+unsigned long long capacity_molecule(int molecule, unsigned long long *version) {
+    // Validate first: the first call builds the tables, and with them num_drinks
+    capacity_validate();
+    return read_entry(num_drinks + molecule, version);
+}
+
+/**
+ * Copies every capacity from one consistent snapshot
+ *
+ * @param drinks     Receives registry_num_drinks() capacities, may be NULL
+ * @param molecules  Receives registry_num_molecules() capacities, may be NULL
+ * @param stock      Receives the stock the snapshot was computed from, may be NULL
+ * @return           Version of the snapshot
+ */
+unsigned long long capacity_snapshot(unsigned long long *drinks, unsigned long long *molecules, AtomStock *stock) {
+    unsigned long long before, after;
+
+    capacity_validate();
+    do {
+        before = __atomic_load_n(&capacity_seq, __ATOMIC_ACQUIRE);
+        for (int i = 0; drinks != NULL && i < num_drinks; i++) {
+            drinks[i] = __atomic_load_n(&capacity[i], __ATOMIC_RELAXED);
+        }
+        for (int i = num_drinks; molecules != NULL && i < num_entries; i++) {
+            molecules[i - num_drinks] = __atomic_load_n(&capacity[i], __ATOMIC_RELAXED);
+        }
+        if (stock != NULL) {
+            stock->carbon = __atomic_load_n(&cached_stock[ELEMENT_CARBON], __ATOMIC_RELAXED);
+            stock->hydrogen = __atomic_load_n(&cached_stock[ELEMENT_HYDROGEN], __ATOMIC_RELAXED);
+            stock->oxygen = __atomic_load_n(&cached_stock[ELEMENT_OXYGEN], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&capacity_seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+
+    return before / 2;
+}
@@ -0,0 +1,53 @@
+/*
+ * capacity.h - מטמון כמויות הייצור של המשקאות והמולקולות
+ *
+ * How many of every drink and molecule the current stock can make, kept up
+ * to date by the stock updates of this process. Queries read a versioned
+ * snapshot without taking any lock.
+ */
+
+#ifndef CAPACITY_H
+#define CAPACITY_H
+
+#include "stock.h"
+
+/**
+ * Brings the cached capacities up to date after a stock update of this process
+ * Only the entries whose bottleneck element changed are recomputed.
+ * Called after the counters changed; in the locked modes while the exclusive
+ * lock is still held, with the new stock.
+ *
+ * @param known  Stock after the update when the caller still holds the
+ *               exclusive stock lock, NULL to read the stock
+ */
+void capacity_stock_changed(const AtomStock *known);
+
+/**
+ * Maximum number of drinks the stock can produce, from the cache
+ *
+ * @param drink    Drink id (registry_drink_id())
+ * @param version  Receives the snapshot version, may be NULL
+ * @return         Maximum number of drinks that can be produced
+ */
+unsigned long long capacity_drink(int drink, unsigned long long *version);
+
+/**
+ * Maximum number of molecules the stock can make, from the cache
+ *
+ * @param molecule  Molecule id (registry_molecule_id())
+ * @param version   Receives the snapshot version, may be NULL
+ * @return          Maximum number of molecules that can be made
+ */
+unsigned long long capacity_molecule(int molecule, unsigned long long *version);
+
+/**
+ * Copies every capacity from one consistent snapshot
+ *
+ * @param drinks     Receives registry_num_drinks() capacities, may be NULL
+ * @param molecules  Receives registry_num_molecules() capacities, may be NULL
+ * @param stock      Receives the stock the snapshot was computed from, may be NULL
+ * @return           Version of the snapshot
+ */
+unsigned long long capacity_snapshot(unsigned long long *drinks, unsigned long long *molecules, AtomStock *stock);
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ * crc32c.c - CRC32C (Castagnoli) עם האצת חומרה
+ * -------------------------------------------
+ * הפולינום ההפוך 0x82f63b78, אותו חישוב כמו iSCSI/ext4.
+ * בקריאה הראשונה נבחר המימוש לפי המעבד:
+ * - x86-64 עם SSE4.2: הוראת crc32 על 8 בתים בכל צעד
+ * - AArch64 עם הרחבת CRC: הוראת crc32cx על 8 בתים בכל צעד
+ * - אחרת: טבלה של 256 ערכים, בית אחד בכל צעד
+ * כל המימושים מחזירים אותו ערך, כך שקובץ שנכתב במכונה אחת נקרא בכל מכונה.
+ * crc32c_blocks מחשב CRC לכמה בלוקים באותו גודל (רשומות יומן); ב-SSE4.2
+ * ארבעה בלוקים מחושבים במקביל, כי להוראת crc32 יש השהיה של כמה מחזורים.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
+#include "crc32c.h"
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *p, size_t len);
+typedef void (*crc32c_blocks_fn)(const unsigned char *p, size_t stride, size_t len, size_t count, uint32_t *out);
+
+static uint32_t crc_table[256];
+static crc32c_fn crc32c_update = NULL;
+static crc32c_blocks_fn crc32c_blocks_update = NULL;
+static const char *crc32c_name = "table";
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Table-driven update, one byte per step
+ */
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len--) crc = (crc >> 8) ^ crc_table[(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+/**
+ * CRC of equally sized blocks, one block after the other
+ */
+static void crc32c_blocks_serial(const unsigned char *p, size_t stride, size_t len, size_t count, uint32_t *out) {
+    for (size_t i = 0; i < count; i++) out[i] = ~crc32c_update(0xffffffffu, p + i * stride, len);
+}
+
+#if defined(__x86_64__)
+/**
+ * SSE4.2 update, eight bytes per step
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    unsigned long long crc64 = crc;
+    while (len >= 8) {
+        unsigned long long word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len--) crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+
+/**
+ * SSE4.2 CRC of equally sized blocks, four blocks at a time
+ * The crc32 instruction has a latency of several cycles but can start every
+ * cycle, so four independent chains keep it busy where one chain would wait
+ */
+__attribute__((target("sse4.2")))
+static void crc32c_blocks_sse42(const unsigned char *p, size_t stride, size_t len, size_t count, uint32_t *out) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const unsigned char *b0 = p + i * stride, *b1 = b0 + stride, *b2 = b1 + stride, *b3 = b2 + stride;
+        unsigned long long c0 = 0xffffffffu, c1 = 0xffffffffu, c2 = 0xffffffffu, c3 = 0xffffffffu;
+        size_t off = 0;
+        for (; off + 8 <= len; off += 8) {
+            unsigned long long w0, w1, w2, w3;
+            memcpy(&w0, b0 + off, 8);
+            memcpy(&w1, b1 + off, 8);
+            memcpy(&w2, b2 + off, 8);
+            memcpy(&w3, b3 + off, 8);
+            c0 = __builtin_ia32_crc32di(c0, w0);
+            c1 = __builtin_ia32_crc32di(c1, w1);
+            c2 = __builtin_ia32_crc32di(c2, w2);
+            c3 = __builtin_ia32_crc32di(c3, w3);
+        }
+        uint32_t r0 = (uint32_t)c0, r1 = (uint32_t)c1, r2 = (uint32_t)c2, r3 = (uint32_t)c3;
+        if (off + 4 <= len) {
+            unsigned int w0, w1, w2, w3;
+            memcpy(&w0, b0 + off, 4);
+            memcpy(&w1, b1 + off, 4);
+            memcpy(&w2, b2 + off, 4);
+            memcpy(&w3, b3 + off, 4);
+            r0 = __builtin_ia32_crc32si(r0, w0);
+            r1 = __builtin_ia32_crc32si(r1, w1);
+            r2 = __builtin_ia32_crc32si(r2, w2);
+            r3 = __builtin_ia32_crc32si(r3, w3);
+            off += 4;
+        }
+        for (; off < len; off++) {
+            r0 = __builtin_ia32_crc32qi(r0, b0[off]);
+            r1 = __builtin_ia32_crc32qi(r1, b1[off]);
+            r2 = __builtin_ia32_crc32qi(r2, b2[off]);
+            r3 = __builtin_ia32_crc32qi(r3, b3[off]);
+        }
+        out[i] = ~r0;
+        out[i + 1] = ~r1;
+        out[i + 2] = ~r2;
+        out[i + 3] = ~r3;
+    }
+    for (; i < count; i++) out[i] = ~crc32c_sse42(0xffffffffu, p + i * stride, len);
+}
+#endif
+
+#if defined(__aarch64__) && defined(HWCAP_CRC32)
+/**
+ * ARMv8 CRC extension update, eight bytes per step
+ */
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        unsigned long long word;
+        memcpy(&word, p, sizeof(word));
+        crc = __builtin_aarch64_crc32cx(crc, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = __builtin_aarch64_crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+/**
+ * Fills the lookup table and picks the fastest implementation the CPU supports
+ */
+static void init_crc32c() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1)));
+        crc_table[i] = crc;
+    }
+    crc32c_update = crc32c_table;
+    crc32c_blocks_update = crc32c_blocks_serial;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_sse42;
+        crc32c_blocks_update = crc32c_blocks_sse42;
+        crc32c_name = "sse4.2";
+    }
+#elif defined(__aarch64__) && defined(HWCAP_CRC32)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c_update = crc32c_armv8;
+        crc32c_name = "armv8-crc";
+    }
+#endif
+}
+
+/**
+ * CRC32C of a buffer
+ *
+ * @param data  Bytes to checksum
+ * @param len   Number of bytes
+ * @return      The CRC
+ */
+uint32_t crc32c(const void *data, size_t len) {
+    pthread_once(&crc32c_once, init_crc32c);
+    return ~crc32c_update(0xffffffffu, data, len);
+}
+
+/**
+ * CRC32C of each of several equally sized blocks
+ *
+ * @param data    First block
+ * @param stride  Distance in bytes from one block to the next
+ * @param len     Number of bytes to checksum in every block
+ * @param count   Number of blocks
+ * @param out     Receives the CRC of every block
+ */
+void crc32c_blocks(const void *data, size_t stride, size_t len, size_t count, uint32_t *out) {
+    pthread_once(&crc32c_once, init_crc32c);
+    crc32c_blocks_update(data, stride, len, count, out);
+}
+
+/**
+ * Returns the name of the implementation crc32c() uses
+ */
+const char *crc32c_implementation() {
+    pthread_once(&crc32c_once, init_crc32c);
+    return crc32c_name;
+}
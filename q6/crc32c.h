@@ -0,0 +1,41 @@
+/*
+ * crc32c.h - CRC32C (Castagnoli)
+ *
+ * Checksum of the save file slots and of the operation log records. Uses the
+ * CPU's CRC32 instructions (SSE4.2 on x86-64, the CRC extension on AArch64)
+ * when present, and a lookup table otherwise.
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC32C of a buffer
+ *
+ * @param data  Bytes to checksum
+ * @param len   Number of bytes
+ * @return      The CRC
+ */
+uint32_t crc32c(const void *data, size_t len);
+
+/**
+ * CRC32C of each of several equally sized blocks (log records, for example)
+ * Faster than one crc32c() call per block: the hardware path interleaves blocks
+ *
+ * @param data    First block
+ * @param stride  Distance in bytes from one block to the next
+ * @param len     Number of bytes to checksum in every block
+ * @param count   Number of blocks
+ * @param out     Receives the CRC of every block
+ */
+void crc32c_blocks(const void *data, size_t stride, size_t len, size_t count, uint32_t *out);
+
+/**
+ * Returns the name of the implementation crc32c() uses ("sse4.2", "armv8-crc" or "table")
+ */
+const char *crc32c_implementation();
+
+#endif
@@ -9,6 +9,8 @@
  *    - לקוחות יכולים לשלוח פקודות בפורמט: "ADD <סוג האטום> <כמות>"
  *    - סוגי האטומים האפשריים: CARBON, HYDROGEN, OXYGEN
  *    - דוגמה: "ADD CARBON 100"
+ *    - מספר סוגי אטומים בפקודה אחת: "ADD CARBON 10 HYDROGEN 20 OXYGEN 5"
+ *      (הכל או כלום, תחת נעילה אחת, כל סוג נבדק מול MAX_ATOMS לפני העדכון)
  * 
  * 2. חיבור UDP:
  *    - משמש לבקשת יצירת מולקולות
@@ -19,6 +21,8 @@
  *      * ALCOHOL (C2H6O) - דורש 2 פחמן, 6 מימן ו-1 חמצן לכל יחידה
  *      * GLUCOSE (C6H12O6) - דורש 6 פחמן, 12 מימן ו-6 חמצן לכל יחידה
  *    - דוגמה: "DELIVER WATER 10" (ייצור 10 מולקולות מים)
+ *    - מספר מולקולות בפקודה אחת: "DELIVER WATER 10 GLUCOSE 3 ALCOHOL 2"
+ *      (דרישת האטומים מסוכמת פעם אחת ונלקחת הכל או כלום, תחת נעילה אחת)
  * 
  * 3. קונסול (מקלדת):
  *    - משמש לחישוב כמות המשקאות שניתן לייצר
@@ -26,6 +30,23 @@
  *      * GEN SOFT DRINK - חישוב כמות משקאות קלים
  *      * GEN VODKA - חישוב כמות וודקה
  *      * GEN CHAMPAGNE - חישוב כמות שמפניה
+ *      * GEN <מולקולה> - כמה מולקולות אפשר להכין
+ *      * GEN ALL - כל המשקאות וכל המולקולות מאותה תמונת מצב
+ *    - התשובות נקראות ממטמון כמויות שמתעדכן בכל ADD ו-DELIVER, ללא נעילת המלאי
+ *      (ראו capacity.c)
+ *    - SNAPSHOT - צילום מצב של המלאי (ומיקום היומן) לקובץ עם חותמת זמן,
+ *      <save-file>.<זמן UTC>.snap; תהליך בן כותב את הקובץ, והשרת ממשיך לטפל
+ *      בלקוחות בינתיים (ראו snapshot.c)
+ *
+ * 4. שאילתות מרחוק (TCP, UDP ו-UDS, שורה אחת לכל שאילתה):
+ *    - STATUS -> "STATUS <גרסה> CARBON <n> HYDROGEN <n> OXYGEN <n>"
+ *    - GEN <משקה או מולקולה> -> "GEN <גרסה> <שם> <n>"
+ *    - GEN ALL -> "GEN <גרסה> ALL <שם> <n>, <שם> <n>, ..." בשורה אחת מאותה תמונת מצב
+ *      (קטלוג שאינו נכנס בתשובה אחת נענה ב-"ERROR: GEN ALL does not fit in one reply")
+ *    - REPLICATION -> תפקיד השרת בשכפול והפיגור (ראו replication.h)
+ *    - RAFT -> תפקיד הצומת באשכול Raft, הקדנציה והמנהיג (ראו raft.h)
+ *    - נענות מתמונת המצב של מטמון הכמויות, ללא נעילה בלעדית של המלאי,
+ *      כך שמערכות ניטור אינן מאטות את ADD ו-DELIVER
  *    - מתכונים:
  *      * SOFT DRINK: מים + פחמן דו חמצני + גלוקוז (H2O + CO2 + C6H12O6)
  *      * VODKA: מים + אלכוהול + גלוקוז (H2O + C2H6O + C6H12O6)
@@ -55,9 +76,79 @@
  * - עמידות נתונים (המלאי נשמר גם אחרי סגירת השרת)
  * - ביצועים גבוהים (mmap מהיר יותר מקריאה/כתיבה רגילה)
  * 
+ * לולאת האירועים (Event Loop):
+ * ---------------------------
+ * כל מתאר קובץ (fd) נרשם ללולאה יחד עם פונקציית טיפול משלו
+ * (listener, UDP, UDS datagram, לקוח stream, קונסול).
+ * ברירת המחדל היא epoll - עלות כל התעוררות תלויה במספר המתארים המוכנים בלבד.
+ * קומפילציה עם -DUSE_SELECT מחזירה את לולאת ה-select() המקורית כגיבוי.
+ * 
+ * מצב ריבוי תהליכונים (--threads N):
+ * כל תהליכון מחזיק לולאת אירועים משלו ושקעי TCP ו-UDP משלו על אותו פורט
+ * (SO_REUSEPORT), כך שהקרנל מחלק חיבורים ודאטגרמות בין התהליכונים.
+ * כל התהליכונים חולקים את המלאי דרך stock_ptr, המוגן ב-pthread_rwlock
+ * (flock לבדו אינו מסנכרן בין תהליכונים של אותו תהליך).
+ * שקעי UDS והקונסול מטופלים על ידי התהליכון הראשי.
+ * 
+ * מסגור פקודות בחיבורי stream (TCP / UDS stream):
+ * כל חיבור מחזיק חוצץ קבלה וחוצץ שליחה משלו. כל פקודה מסתיימת ב-'\n',
+ * כך שלקוח יכול לשלוח פקודות רבות ברצף (pipelining) ולקבל תשובה לכל אחת לפי הסדר,
+ * ופקודה שהתפצלה בין שני segments מורכבת מחדש.
+ * פקודה רצה רק כשה-'\n' שלה הגיע, ולכן הלקוח חייב לסיים כל פקודה ב-'\n'.
+ * 
+ * פרוטוקול בינארי (protocol.h):
+ * לצד פקודות הטקסט, כל נקודת קצה (TCP, UDP, UDS) מקבלת גם מסגרות בינאריות
+ * קבועות של 16 בתים (opcode, מזהה אטום/מולקולה, כמות 64 ביט, מזהה בקשה).
+ * מסגרת מזוהה לפי בית ה-magic הראשון שלה ונענית במסגרת תשובה באותו מבנה,
+ * ללא sscanf ו-strcmp על מחרוזות.
+ * 
+ * קליטת דאטגרמות באצוות (UDP / UDS datagram):
+ * בכל התעוררות נקראות עד N דאטגרמות בקריאת recvmmsg אחת, וכל התשובות
+ * נשלחות בקריאת sendmmsg אחת. פקודת הקונסול STATS מציגה כמה דאטגרמות
+ * טופלו בכל התעוררות וכמה קריאות מערכת נדרשו לכל אצווה.
+ * 
+ * מצב נעילת המלאי (--lock-mode flock|fcntl|mutex|atomic|sharded):
+ * flock (ברירת מחדל) נועל את המלאי בכל פעולה; fcntl נועל רק את טווח הבתים של
+ * המלאי בקובץ השמירה (נעילת OFD); mutex משתמש ב-mutex משותף
+ * בכותרת קובץ השמירה (ללא קריאת מערכת כשאין תחרות); atomic מעדכן את המונים
+ * בקובץ הממופה בפעולות אטומיות ללא נעילה; sharded (ללא קובץ שמירה) מחלק את המלאי
+ * לרסיסים לפי מעבד שחוכרים אטומים ממאגר גלובלי (ראו stock.c).
+ * 
+ * יומן פעולות (--wal, דורש -f):
+ * כל ADD ו-DELIVER נרשם ב-<save-file>.wal לפני שהוא מוחל, והתשובה נשלחת רק
+ * אחרי שהרשומה הגיעה לדיסק; עדכונים מקבילים חולקים fdatasync אחד (group commit,
+ * --wal-window מאריך את ההמתנה לקבוצה). בעלייה המלאי משוחזר מהיומן (ראו wal.c).
+ * 
+ * עמידות קובץ השמירה (--durability none|periodic|per-op, דורש -f):
+ * none משאיר את הכתיבה לדיסק לקרנל; periodic קורא ל-msync מתהליכון רקע כל
+ * --sync-interval מילי-שניות; per-op קורא ל-msync(MS_SYNC) לפני כל תשובה.
+ * STATS מציג היסטוגרמה של זמני העדכונים ושל קריאות ה-msync במצב הנוכחי.
+ * 
+ * שכפול לשרת גיבוי (--replicate-to <port|path> / --replica-of <host:port|path>, דורש -f):
+ * השרת הראשי שולח לשרתי הגיבוי עותק מלא של קובץ השמירה (sendfile) ואחריו כל
+ * עדכון לפי הסדר; שרת הגיבוי מחיל אותם על קובץ השמירה שלו ועונה לשאילתות
+ * בלבד (ADD ו-DELIVER נדחים). הפיגור מוצג ב-STATS ובשאילתה REPLICATION
+ * (ראו replication.c).
+ * 
+ * אשכול Raft (--raft-id <n> --raft-peers <host:port,...>, דורש -f):
+ * שלושה או חמישה שרתים, כל אחד עם קובץ שמירה משלו, בוחרים מנהיג; ADD ו-DELIVER
+ * מתקבלים רק אצל המנהיג, נרשמים ביומן המשוכפל ומוחלים בכל הצמתים אחרי שרובם
+ * שמרו אותם. התשובה ל-ADD ול-DELIVER מוחזקת עד שהרשומה מוחלת (HeldReply), והלולאה
+ * ממשיכה בינתיים לשרת לקוחות אחרים. STATUS ו-GEN נענים רק אצל מנהיג שרוב הצמתים אישרו לאחרונה (lease);
+ * צומת אחר עונה "ERROR: Not leader" ומציין את המנהיג (ראו raft.c).
+ * 
+ * קטלוג מתכונים (--catalog <file>):
+ * מולקולות ומשקאות נוספים נטענים מקובץ בעלייה, אחרי המובנים (ראו registry.c).
+ * DELIVER ו-GEN מקבלים כל שם שבקטלוג, גם שם של כמה מילים.
+ * 
  * Server Execution:
  * ./drinks_bar (-T <tcp-port> -U <udp-port>) OR (-s <UDS-stream-path> -d <UDS-datagram-path>) 
  *              [--oxygen N] [--carbon N] [--hydrogen N] [--timeout SECS] [-f <save-file>]
+ *              [--max-clients N] [--threads N] [--dgram-batch N] [--lock-mode flock|fcntl|mutex|atomic|sharded]
+ *              [--catalog <file>] [--wal [--wal-window USECS]]
+ *              [--durability none|periodic|per-op] [--sync-interval MS]
+ *              [--replicate-to <port|path> | --replica-of <host:port|path>]
+ *              [--raft-id <n> --raft-peers <host:port,...>]
  */
 
 #include <stdio.h>
@@ -75,48 +166,33 @@
 #include <getopt.h>
 #include <signal.h>
 #include <sys/un.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
 #include <fcntl.h>
-#include <sys/file.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#ifndef USE_SELECT
+#include <sys/epoll.h>
+#endif
 
+#include "stock.h"
+#include "capacity.h"
+#include "wal.h"
+#include "protocol.h"
+#include "snapshot.h"
+#include "replication.h"
+#include "raft.h"
 
-#define MAX_CLIENTS 100       // Maximum number of TCP clients that can be connected simultaneously
-#define BUFFER_SIZE 1024      // Size of the buffer for receiving data
-#define MAX_ATOMS 1000000000000000000ULL  // Maximum number of atoms per type (10^18)
 
-/**
- * Structure to store the current inventory of atoms
- * Using unsigned long long to support the large number requirement (10^18)
- */
-typedef struct {
-    unsigned long long carbon;    // Count of carbon atoms
-    unsigned long long hydrogen;  // Count of hydrogen atoms
-    unsigned long long oxygen;    // Count of oxygen atoms
-} AtomStock;
-
-/**
- * In-memory stock for when no save-file is provided (preserves original Q5 behavior)
- * This serves as the fallback storage and also holds initial values from command line
- */
-AtomStock in_memory_stock = {0, 0, 0};
-
-/**
- * Pointer to the active stock structure
- * By default, points to the in-memory stock for backward compatibility
- * When a save-file is used, this will point to the memory-mapped region
- * All stock operations use this pointer for unified access
- */
-AtomStock *stock_ptr = &in_memory_stock;
-
-/**
- * Global file descriptor for file locking to ensure concurrency safety
- * Used with flock() to coordinate access between multiple server processes:
- * - LOCK_EX for exclusive access during write operations
- * - LOCK_SH for shared access during read operations
- * - LOCK_UN to release locks
- */
-int lock_fd = -1;
+#define MAX_CLIENTS 100       // Default maximum number of stream clients connected simultaneously (--max-clients)
+#define MAX_EVENTS 64         // Maximum number of ready descriptors handled per epoll_wait() call
+#define MAX_THREADS 64        // Maximum number of reactor threads (--threads)
+#define BUFFER_SIZE 1024      // Size of the buffer for receiving data
+#define STREAM_BUFFER_SIZE 16384        // Per-connection receive buffer used for newline framing
+#define MAX_PENDING_OUTPUT (1 << 20)    // Stop reading from a client whose unsent replies exceed this
+#define DGRAM_BATCH 32        // Default number of datagrams drained per wakeup (--dgram-batch)
+#define MAX_DGRAM_BATCH 256   // Upper limit for --dgram-batch
 
 /**
  * Path to the save file for cleanup operations
@@ -125,12 +201,20 @@ int lock_fd = -1;
 char* save_file_path = NULL;
 
 // Counter for the number of connected TCP clients
+// Updated with atomic builtins because every reactor thread accepts clients
 int connected_clients = 0;
 
+// Limit on simultaneously connected stream clients (set with --max-clients)
+int max_clients = MAX_CLIENTS;
+
 // Global variables to track UDS paths for signal handler cleanup
 char *global_stream_path = NULL;
 char *global_datagram_path = NULL;
 
+// Listening/datagram sockets, stored globally so the event handlers and the
+// exit path can reach them (-1 when the socket is not in use)
+int tcp_sock = -1, udp_sock = -1, uds_stream_sock = -1, uds_dgram_sock = -1;
+
 /**
  * Signal handler for SIGALRM
  * This function is called when the alarm timer expires (timeout functionality)
@@ -152,355 +236,1806 @@ void handle_alarm(int signum) {
     exit(0);
 }
 
+void print_server_stats();
+
 /**
- * Prints the current atom inventory to stdout
- * Called after each successful operation to show the updated stock
- * Uses file locking to prevent reading inconsistent data
- * during concurrent write operations by other processes
+ * Prints every drink and molecule capacity from one snapshot of the capacity cache
+ */
+void print_all_capacities() {
+    int num_drinks = registry_num_drinks(), num_molecules = registry_num_molecules();
+    unsigned long long *drinks = malloc(num_drinks * sizeof(*drinks));
+    unsigned long long *molecules = malloc(num_molecules * sizeof(*molecules));
+    AtomStock stock;
+
+    if (drinks == NULL || molecules == NULL) {
+        printf("Error: Out of memory\n");
+        free(drinks);
+        free(molecules);
+        return;
+    }
+
+    unsigned long long version = capacity_snapshot(drinks, molecules, &stock);
+    printf("Capacity snapshot %llu (CARBON: %llu, HYDROGEN: %llu, OXYGEN: %llu)\n", version, stock.carbon,
+           stock.hydrogen, stock.oxygen);
+    for (int d = 0; d < num_drinks; d++) {
+        printf("Can produce %llu %s drinks\n", drinks[d], registry_drink_name(d));
+    }
+    for (int m = 0; m < num_molecules; m++) {
+        printf("Can make %llu %s molecules\n", molecules[m], registry_molecule_name(m));
+    }
+    free(drinks);
+    free(molecules);
+}
+
+/**
+ * Process commands from console input (GEN and STATS operations)
+ * GEN reads the capacity cache, so it never waits for the stock lock
+ * 
+ * @param cmd    The command string from the console
+ * @return       1 on success, 0 on failure or invalid command
  */
-void print_stock() {
-    // Acquire a shared lock for reading to prevent dirty reads
-    // Multiple processes can hold shared locks simultaneously for reading
-    if (lock_fd != -1) flock(lock_fd, LOCK_SH);
+int process_console_command(const char *cmd) {
+    char copy[512], full_name[512], *save = NULL;
+    size_t len = 0;
 
-    printf("Stock: C=%llu, H=%llu, O=%llu\n", stock_ptr->carbon, stock_ptr->hydrogen, stock_ptr->oxygen);
+    // Parse command: GEN <DRINK_TYPE>, where the drink name may have several words
+    snprintf(copy, sizeof(copy), "%s", cmd);
+    char *op = strtok_r(copy, " \t\r\n", &save);
+    char *word = strtok_r(NULL, " \t\r\n", &save);
+
+    // STATS prints the server's datagram batching statistics
+    if (op != NULL && word == NULL && strcmp(op, "STATS") == 0) {
+        print_server_stats();
+        return 1;
+    }
     
-    // Release the lock to allow other processes to access the file
-    if (lock_fd != -1) flock(lock_fd, LOCK_UN);
+    if (op == NULL || word == NULL || strcmp(op, "GEN") != 0) {
+        printf("Error: Invalid console command. Use: GEN SOFT DRINK / GEN VODKA / GEN CHAMPAGNE / GEN ALL / STATS / SNAPSHOT\n");
+        return 0;
+    }
+    
+    // Join the words of the name with single spaces (e.g., "SOFT DRINK")
+    full_name[0] = '\0';
+    for (; word != NULL; word = strtok_r(NULL, " \t\r\n", &save)) {
+        len += snprintf(full_name + len, sizeof(full_name) - len, "%s%s", len ? " " : "", word);
+    }
+
+    if (strcmp(full_name, "ALL") == 0) {
+        print_all_capacities();
+        return 1;
+    }
+
+    // A drink name first, then a molecule name
+    int drink = registry_drink_id(full_name);
+    if (drink >= 0) {
+        printf("Can produce %llu %s drinks\n", capacity_drink(drink, NULL), full_name);
+        return 1;
+    }
+    int molecule = registry_molecule_id(full_name);
+    if (molecule >= 0) {
+        printf("Can make %llu %s molecules\n", capacity_molecule(molecule, NULL), full_name);
+        return 1;
+    }
+
+    printf("Error: Unknown drink type '%s'\n", full_name);
+    return 1;
 }
 
 /**
- * Adds atoms to the stock inventory
+ * Copies a reply message into a caller-provided reply buffer
+ *
+ * @param reply       Destination buffer
+ * @param reply_size  Size of the destination buffer
+ * @param msg         NUL-terminated reply message
+ * @return            Number of bytes copied (without the terminator)
+ */
+size_t copy_reply(char *reply, size_t reply_size, const char *msg) {
+    int len = snprintf(reply, reply_size, "%s", msg);
+    return (len < 0) ? 0 : ((size_t)len < reply_size ? (size_t)len : reply_size - 1);
+}
+
+/**
+ * Answers GEN ALL on a network endpoint: every drink and molecule capacity
+ * from one capacity snapshot, on one line
+ *   "GEN <version> ALL <drink> <n>, ..., <molecule> <n>"
+ *
+ * @param reply       Buffer that receives the reply for the client
+ * @param reply_size  Size of the reply buffer
+ * @return            Length of the reply written into reply
+ */
+size_t process_gen_all(char *reply, size_t reply_size) {
+    int num_drinks = registry_num_drinks(), num_molecules = registry_num_molecules();
+    unsigned long long *drinks = malloc(num_drinks * sizeof(*drinks));
+    unsigned long long *molecules = malloc(num_molecules * sizeof(*molecules));
+    size_t len;
+    int n;
+
+    if (drinks == NULL || molecules == NULL) {
+        free(drinks);
+        free(molecules);
+        return copy_reply(reply, reply_size, "ERROR: Out of memory\n");
+    }
+
+    unsigned long long version = capacity_snapshot(drinks, molecules, NULL);
+    n = snprintf(reply, reply_size, "GEN %llu ALL", version);
+    len = n < 0 ? reply_size : (size_t)n;
+    for (int i = 0; i < num_drinks + num_molecules && len < reply_size; i++) {
+        int is_drink = i < num_drinks;
+        n = snprintf(reply + len, reply_size - len, "%s %s %llu", i > 0 ? "," : "",
+                     is_drink ? registry_drink_name(i) : registry_molecule_name(i - num_drinks),
+                     is_drink ? drinks[i] : molecules[i - num_drinks]);
+        len = n < 0 ? reply_size : len + n;
+    }
+    free(drinks);
+    free(molecules);
+
+    // One line per reply: a catalog too large for it is asked entry by entry
+    if (len + 1 >= reply_size) return copy_reply(reply, reply_size, "ERROR: GEN ALL does not fit in one reply\n");
+    reply[len++] = '\n';
+    reply[len] = '\0';
+    return len;
+}
+
+/**
+ * Answers a STATUS, GEN, REPLICATION or RAFT query from the capacity cache snapshot
+ * Queries never take the stock lock, so pollers do not slow down ADD and DELIVER:
+ *   STATUS      -> "STATUS <version> CARBON <n> HYDROGEN <n> OXYGEN <n>"
+ *   GEN <name>  -> "GEN <version> <name> <n>" (a drink, or else a molecule)
+ *   GEN ALL     -> every capacity from one snapshot (process_gen_all())
+ *   REPLICATION -> role and lag of replication (replication_status())
+ *   RAFT        -> role, term and leader of a Raft node (raft_status())
+ * The version grows with every stock update the snapshot reflects
+ * A Raft node answers STATUS and GEN only while it holds the leader's lease
+ *
+ * @param cmd         One command from the client
+ * @param reply       Buffer that receives the reply for the client
+ * @param reply_size  Size of the reply buffer
+ * @return            Length of the reply written into reply, 0 if cmd is not a query
+ */
+size_t process_query_command(const char *cmd, char *reply, size_t reply_size) {
+    char copy[BUFFER_SIZE], name[BUFFER_SIZE], line[2 * BUFFER_SIZE], *save = NULL;
+    size_t len = 0;
+    unsigned long long version, amount;
+
+    snprintf(copy, sizeof(copy), "%s", cmd);
+    char *op = strtok_r(copy, " \t\r\n", &save);
+    char *word = strtok_r(NULL, " \t\r\n", &save);
+    if (op == NULL) return 0;
+
+    if (strcmp(op, "REPLICATION") == 0 && word == NULL) {
+        return replication_status(reply, reply_size);
+    }
+    if (strcmp(op, "RAFT") == 0 && word == NULL) {
+        return raft_status(reply, reply_size);
+    }
+    if (strcmp(op, "STATUS") == 0 && word == NULL) {
+        AtomStock stock;
+        if (!raft_can_read()) return raft_not_leader(reply, reply_size);
+        version = capacity_snapshot(NULL, NULL, &stock);
+        snprintf(line, sizeof(line), "STATUS %llu CARBON %llu HYDROGEN %llu OXYGEN %llu\n", version, stock.carbon,
+                 stock.hydrogen, stock.oxygen);
+        return copy_reply(reply, reply_size, line);
+    }
+    if (strcmp(op, "GEN") != 0 || word == NULL) return 0;
+    if (!raft_can_read()) return raft_not_leader(reply, reply_size);
+
+    // Join the words of the name with single spaces (e.g., "SOFT DRINK")
+    name[0] = '\0';
+    for (; word != NULL; word = strtok_r(NULL, " \t\r\n", &save)) {
+        len += snprintf(name + len, sizeof(name) - len, "%s%s", len ? " " : "", word);
+    }
+
+    if (strcmp(name, "ALL") == 0) return process_gen_all(reply, reply_size);
+
+    int drink = registry_drink_id(name);
+    int molecule = drink < 0 ? registry_molecule_id(name) : -1;
+    if (drink >= 0) {
+        amount = capacity_drink(drink, &version);
+    } else if (molecule >= 0) {
+        amount = capacity_molecule(molecule, &version);
+    } else {
+        return copy_reply(reply, reply_size, "ERROR: Unknown drink or molecule\n");
+    }
+    snprintf(line, sizeof(line), "GEN %llu %s %llu\n", version, name, amount);
+    return copy_reply(reply, reply_size, line);
+}
+
+/**
+ * Parses an ADD command with one or more atom/amount pairs:
+ * ADD <atom type> <amount> [<atom type> <amount> ...]
+ * An atom type that appears more than once has its amounts summed
+ *
+ * @param cmd      One command line from the client
+ * @param amounts  Receives the amounts, indexed CARBON, HYDROGEN, OXYGEN
+ * @return         1 if the command is valid, 0 if not
+ */
+int parse_add_command(const char *cmd, unsigned long long amounts[NUM_ELEMENTS]) {
+    char copy[BUFFER_SIZE], *save = NULL;
+    int pairs = 0;
+
+    snprintf(copy, sizeof(copy), "%s", cmd);
+    char *token = strtok_r(copy, " \t", &save);
+    if (token == NULL || strcmp(token, "ADD") != 0) return 0;
+
+    for (int e = 0; e < NUM_ELEMENTS; e++) amounts[e] = 0;
+    while ((token = strtok_r(NULL, " \t", &save)) != NULL) {
+        int atom = registry_element_id(token);
+        char *amount_str = strtok_r(NULL, " \t", &save);
+        if (atom < 0 || amount_str == NULL) return 0;
+
+        // The amount must be a plain number that fits in an unsigned int
+        char *end;
+        errno = 0;
+        unsigned long long amount = strtoull(amount_str, &end, 10);
+        if (!isdigit((unsigned char)amount_str[0]) || *end != '\0' || errno != 0 || amount > UINT_MAX) return 0;
+
+        amounts[atom] += amount;
+        pairs++;
+    }
+    return pairs > 0;
+}
+
+/**
+ * Process TCP commands from clients (ADD operations, STATUS and GEN queries)
+ * "ADD CARBON 10 HYDROGEN 20 OXYGEN 5" adds all listed atoms or none of them
+ * The reply is written into a buffer so that pipelined commands can be
+ * answered in order with a single send()
  * 
- * @param stock    Pointer to the atom stock structure (can be memory-mapped)
- * @param element  Type of atom to add ("CARBON", "HYDROGEN", or "OXYGEN")
- * @param amount   Number of atoms to add
- * @return         1 on success, 0 on failure
+ * @param cmd         One command line from the client (without the newline)
+ * @param stock       Pointer to the atom stock structure (memory or memory-mapped)
+ * @param reply       Buffer that receives the reply for the client
+ * @param reply_size  Size of the reply buffer
+ * @return            Length of the reply written into reply, 0 if it waits for a Raft entry (raft_pending())
  */
-int atom_adder(AtomStock *stock, const char *element, unsigned int amount) {
-    // Acquire an exclusive lock for writing
-    // Only one process can hold an exclusive lock at a time
-    if (lock_fd != -1) flock(lock_fd, LOCK_EX);
+size_t process_tcp_command(const char *cmd, AtomStock *stock, char *reply, size_t reply_size) {
+    unsigned long long amounts[NUM_ELEMENTS];
+    const char *msg;
+    size_t query_len;
+    
+    // Parse the command: ADD <atom type> <amount> [<atom type> <amount> ...]
+    if (parse_add_command(cmd, amounts)) {
+        // Try to add all atoms to the stock in one update
+        // Note: atom_adder_multi handles locking internally
+        if (replication_role() == REPL_ROLE_STANDBY) {
+            // A standby's stock changes only through the primary
+            msg = "ERROR: Read-only standby\n";
+        } else if (raft_follower()) {
+            // Only the Raft leader appends to the log
+            return raft_not_leader(reply, reply_size);
+        } else if (atom_adder_multi(stock, amounts)) {
+            // Success message
+            msg = "added to warehouse successfully\n";
+            // Note: print_stock handles locking internally
+            print_stock();
+        } else if (raft_pending()) {
+            // In the Raft log: the reply is written once the entry settles (HeldReply)
+            return 0;
+        } else if (raft_follower()) {
+            // Lost the leadership before the update was appended
+            return raft_not_leader(reply, reply_size);
+        } else {
+            // Error message if adding fails (exceeds max or unknown atom)
+            msg = "ERROR: Exceeds MAX_ATOMS\n";
+        }
+    } else if ((query_len = process_query_command(cmd, reply, reply_size)) > 0) {
+        // STATUS and GEN are answered from the capacity snapshot
+        return query_len;
+    } else {
+        // Invalid command format
+        // Pipelining clients count replies, so every command gets one
+        fprintf(stderr, "Invalid command from client: %s\n", cmd);
+        msg = "ERROR: Invalid command\n";
+    }
+
+    return copy_reply(reply, reply_size, msg);
+}
+
+// Results of parse_deliver_command()
+#define DELIVER_PARSE_OK 0
+#define DELIVER_PARSE_INVALID 1           // Not a DELIVER command, or a molecule without an amount
+#define DELIVER_PARSE_BAD_AMOUNT 2        // Amount is not a number or does not fit in an unsigned int
+#define DELIVER_PARSE_ZERO_AMOUNT 3       // Amount is 0
+#define DELIVER_PARSE_UNKNOWN_MOLECULE 4  // Molecule name is not known
 
-    int success = 1;
+#define DELIVER_MAX_LINES (BUFFER_SIZE / 4)  // A command of BUFFER_SIZE bytes has fewer pairs
+
+/**
+ * Parses a DELIVER command with one or more molecule/amount pairs:
+ * DELIVER <molecule> <amount> [<molecule> <amount> ...]
+ * A molecule name is every word up to the next number, so catalog names
+ * may have any number of words ("CARBON DIOXIDE")
+ *
+ * @param cmd    One command from the client
+ * @param order  Receives the order lines (DELIVER_MAX_LINES entries)
+ * @param count  Receives the number of order lines
+ * @return       DELIVER_PARSE_OK, or the DELIVER_PARSE_* reason the command was rejected
+ */
+int parse_deliver_command(const char *cmd, MoleculeOrder *order, int *count) {
+    char copy[BUFFER_SIZE], *save = NULL;
+    char *tokens[BUFFER_SIZE / 2];
+    int num_tokens = 0, pos = 0, unknown = 0;
+
+    snprintf(copy, sizeof(copy), "%s", cmd);
+    for (char *token = strtok_r(copy, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save)) {
+        tokens[num_tokens++] = token;
+    }
+    if (num_tokens == 0 || strcmp(tokens[0], "DELIVER") != 0) return DELIVER_PARSE_INVALID;
+
+    *count = 0;
+    pos = 1;
+    while (pos < num_tokens) {
+        char name[BUFFER_SIZE];
+        size_t name_len = 0;
+        int words = 0;
+
+        // The name runs up to the next word that starts with a digit
+        while (pos < num_tokens && !isdigit((unsigned char)tokens[pos][0])) {
+            name_len += snprintf(name + name_len, sizeof(name) - name_len, "%s%s", words ? " " : "", tokens[pos]);
+            words++;
+            pos++;
+        }
+        if (pos >= num_tokens) {
+            // No amount: the last word was meant as one ("DELIVER WATER abc")
+            return words > 1 ? DELIVER_PARSE_BAD_AMOUNT : DELIVER_PARSE_INVALID;
+        }
+        if (words == 0) return DELIVER_PARSE_INVALID;
+
+        // The amount must be a plain number that fits in an unsigned int
+        const char *amount_str = tokens[pos++];
+        char *end;
+        errno = 0;
+        unsigned long long amount = strtoull(amount_str, &end, 10);
+        if (*end != '\0' || errno != 0 || amount > UINT_MAX) {
+            return DELIVER_PARSE_BAD_AMOUNT;
+        }
+        if (amount == 0) return DELIVER_PARSE_ZERO_AMOUNT;
+
+        int molecule = registry_molecule_id(name);
+        if (molecule < 0) {
+            unknown = 1;
+        } else {
+            order[*count].molecule = molecule;
+            order[*count].amount = amount;
+            (*count)++;
+        }
+    }
+    if (*count == 0 && !unknown) return DELIVER_PARSE_INVALID;
+    return unknown ? DELIVER_PARSE_UNKNOWN_MOLECULE : DELIVER_PARSE_OK;
+}
+
+/**
+ * Process UDP commands from clients (DELIVER operations, STATUS and GEN queries)
+ * "DELIVER WATER 10 GLUCOSE 3" delivers all listed molecules or none of them
+ * The reply is written into a buffer so that the replies for a whole batch
+ * of datagrams can be sent with a single sendmmsg()
+ * 
+ * @param cmd         The command string from the client
+ * @param stock       Pointer to the atom stock structure (memory or memory-mapped)
+ * @param reply       Buffer that receives the reply for the client
+ * @param reply_size  Size of the reply buffer
+ * @return            Length of the reply written into reply, 0 if it waits for a Raft entry (raft_pending())
+ */
+size_t process_udp_command(const char *cmd, AtomStock *stock, char *reply, size_t reply_size) {
+    MoleculeOrder order[DELIVER_MAX_LINES];
+    int count;
+    size_t query_len;
+
+    // STATUS and GEN are answered from the capacity snapshot
+    if ((query_len = process_query_command(cmd, reply, reply_size)) > 0) return query_len;
     
-    if (strcmp(element, "CARBON") == 0) {
-        // Check if adding would exceed the maximum allowed atoms
-        if ((unsigned long long)stock->carbon + amount > MAX_ATOMS) {
-            fprintf(stderr, "Error: Exceeds MAX_ATOMS for CARBON\n");
-            success = 0;
+    // Parse the command: DELIVER <molecule> <amount> [<molecule> <amount> ...]
+    switch (parse_deliver_command(cmd, order, &count)) {
+        case DELIVER_PARSE_OK:
+            break;
+        case DELIVER_PARSE_BAD_AMOUNT:
+            return copy_reply(reply, reply_size, "ERROR: Invalid amount\n");
+        case DELIVER_PARSE_ZERO_AMOUNT:
+            return copy_reply(reply, reply_size, "ERROR: Amount must be positive\n");
+        case DELIVER_PARSE_UNKNOWN_MOLECULE:
+            return copy_reply(reply, reply_size, "ERROR: Not enough atoms or unknown molecule\n");
+        default:
+            fprintf(stderr, "Invalid command from client: %s\n", cmd);
+            return copy_reply(reply, reply_size, "ERROR: Invalid UDP command\n");
+    }
+
+    // A standby's stock changes only through the primary
+    if (replication_role() == REPL_ROLE_STANDBY) return copy_reply(reply, reply_size, "ERROR: Read-only standby\n");
+    // Only the Raft leader appends to the log
+    if (raft_follower()) return raft_not_leader(reply, reply_size);
+
+    // Try to create all the molecules in one transaction
+    // Note: molecule_subtract_multi handles locking internally
+    if (molecule_subtract_multi(stock, order, count)) {
+        // Note: print_stock handles locking internally
+        print_stock();
+        return copy_reply(reply, reply_size, "Molecule delivered successfully\n");
+    }
+    // In the Raft log: the reply is written once the entry settles (HeldReply)
+    if (raft_pending()) return 0;
+    // Lost the leadership before the update was appended
+    if (raft_follower()) return raft_not_leader(reply, reply_size);
+    // Error message if creating molecules fails
+    return copy_reply(reply, reply_size, "ERROR: Not enough atoms or unknown molecule\n");
+}
+
+/**
+ * Process one binary protocol frame (see protocol.h)
+ * Stream endpoints accept PROTO_OP_ADD and datagram endpoints PROTO_OP_DELIVER,
+ * just like their text commands
+ *
+ * @param frame      The received bytes
+ * @param len        Number of received bytes
+ * @param allowed_op Opcode accepted on this endpoint
+ * @param stock      Pointer to the atom stock structure (memory or memory-mapped)
+ * @param reply      Buffer of at least PROTO_FRAME_SIZE bytes for the reply frame
+ * @return           Length of the reply written into reply
+ */
+size_t process_binary_frame(const unsigned char *frame, size_t len, int allowed_op, AtomStock *stock,
+                            unsigned char *reply) {
+    ProtoFrame req, resp;
+
+    memset(&resp, 0, sizeof(resp));
+    resp.id = PROTO_STATUS_INVALID;
+    if (!proto_decode(frame, len, &req)) {
+        fprintf(stderr, "Invalid binary frame from client (%zu bytes)\n", len);
+        resp.opcode = PROTO_REPLY_FLAG;
+        proto_encode(&resp, reply);
+        return PROTO_FRAME_SIZE;
+    }
+    resp.opcode = req.opcode | PROTO_REPLY_FLAG;
+    resp.request_id = req.request_id;
+    resp.amount = req.amount;
+
+    // The stock operations take unsigned int amounts, as the text commands do
+    // The frame carries the registry id, so no name is looked up
+    int num_ids = (req.opcode == PROTO_OP_ADD) ? NUM_ELEMENTS : registry_num_molecules();
+    if (req.opcode != allowed_op || req.amount == 0 || req.amount > UINT_MAX || req.id >= num_ids) {
+        fprintf(stderr, "Invalid binary request from client (opcode %d, id %d)\n", req.opcode, req.id);
+    } else if (replication_role() == REPL_ROLE_STANDBY) {
+        resp.id = PROTO_STATUS_READ_ONLY;
+    } else if (raft_follower()) {
+        resp.id = PROTO_STATUS_NOT_LEADER;
+    } else {
+        int ok;
+        if (req.opcode == PROTO_OP_ADD) {
+            unsigned long long amounts[NUM_ELEMENTS] = {0};
+            amounts[req.id] = req.amount;
+            ok = atom_adder_multi(stock, amounts);
+        } else {
+            MoleculeOrder order = {req.id, req.amount};
+            ok = molecule_subtract_multi(stock, &order, 1);
+        }
+        if (ok) {
+            resp.id = PROTO_STATUS_OK;
+            print_stock();
         } else {
-            stock->carbon += amount;
+            // In the Raft log, the status is filled in once the entry settles (HeldReply)
+            resp.id = raft_pending() ? PROTO_STATUS_UNKNOWN
+                      : raft_follower() ? PROTO_STATUS_NOT_LEADER : PROTO_STATUS_FAILED;
+        }
+    }
+
+    proto_encode(&resp, reply);
+    return PROTO_FRAME_SIZE;
+}
+
+/**
+ * Counters describing how well the datagram path batches its work
+ * Updated with atomic builtins because every reactor thread drains datagrams
+ */
+typedef struct {
+    unsigned long long wakeups;     // Wakeups of a datagram socket
+    unsigned long long datagrams;   // Datagrams received
+    unsigned long long recv_calls;  // recvmmsg() calls
+    unsigned long long send_calls;  // sendmmsg() calls
+    unsigned long long max_batch;   // Most datagrams drained in a single wakeup
+} DgramStats;
+
+DgramStats dgram_stats = {0, 0, 0, 0, 0};
+
+// Number of datagrams drained per wakeup (set with --dgram-batch)
+int dgram_batch = DGRAM_BATCH;
+
+/**
+ * Prints the datagram batching statistics (console command STATS)
+ */
+void print_server_stats() {
+    unsigned long long wakeups = __atomic_load_n(&dgram_stats.wakeups, __ATOMIC_RELAXED);
+    unsigned long long datagrams = __atomic_load_n(&dgram_stats.datagrams, __ATOMIC_RELAXED);
+    unsigned long long recv_calls = __atomic_load_n(&dgram_stats.recv_calls, __ATOMIC_RELAXED);
+    unsigned long long send_calls = __atomic_load_n(&dgram_stats.send_calls, __ATOMIC_RELAXED);
+    unsigned long long max_batch = __atomic_load_n(&dgram_stats.max_batch, __ATOMIC_RELAXED);
+
+    printf("Datagram stats: wakeups=%llu datagrams=%llu batch-limit=%d\n", wakeups, datagrams, dgram_batch);
+    printf("  datagrams per wakeup: avg=%.2f max=%llu\n",
+           wakeups ? (double)datagrams / wakeups : 0.0, max_batch);
+    printf("  syscalls: recvmmsg=%llu sendmmsg=%llu per-burst=%.2f per-datagram=%.2f\n",
+           recv_calls, send_calls,
+           wakeups ? (double)(recv_calls + send_calls) / wakeups : 0.0,
+           datagrams ? (double)(recv_calls + send_calls) / datagrams : 0.0);
+
+    if (wal_enabled()) {
+        unsigned long long records, syncs;
+        wal_stats(&records, &syncs);
+        printf("Log stats: records=%llu fdatasync=%llu records-per-sync=%.2f window=%dus\n", records, syncs,
+               syncs ? (double)records / syncs : 0.0, wal_window_us);
+    }
+
+    replication_print_stats(stdout);
+    raft_print_stats(stdout);
+
+    // Latency of the stock updates in the running --durability mode
+    char title[64];
+    snprintf(title, sizeof(title), "Update latency (durability=%s)", stock_durability_name(stock_durability));
+    latency_print(stdout, title, &stock_update_latency);
+    if (stock_durability != DURABILITY_NONE) latency_print(stdout, "msync latency", &stock_sync_latency);
+}
+
+/* ===== EVENT LOOP =====
+ * Every watched descriptor is registered together with its own handler, so a
+ * wakeup dispatches straight to the ready descriptors instead of testing every
+ * descriptor between 0 and maxfd. The default backend is epoll; compiling with
+ * -DUSE_SELECT keeps the original select() loop as a build-time fallback.
+ */
+
+#define EV_READ  0x1   // Descriptor is readable (or hung up / in error)
+#define EV_WRITE 0x2   // Descriptor is writable
+#define EV_EXCLUSIVE 0x4  // Socket shared by several loops: wake only one of them (epoll only)
+
+typedef struct EventLoop EventLoop;
+
+/**
+ * Handler invoked for a ready descriptor
+ *
+ * @param loop    The event loop the descriptor is registered with
+ * @param fd      The ready file descriptor
+ * @param events  Mask of EV_READ / EV_WRITE readiness
+ */
+typedef void (*event_handler)(EventLoop *loop, int fd, int events);
+
+/**
+ * Registration of a single descriptor in the event loop
+ */
+typedef struct {
+    event_handler handler;  // NULL when the descriptor is not watched
+    int events;             // Interest mask (EV_READ / EV_WRITE)
+    void *data;             // Per-descriptor state owned by the handler (may be NULL)
+} FdWatch;
+
+#define HELD_ADD 1          // Text ADD (stream endpoints)
+#define HELD_DELIVER 2      // Text DELIVER (datagram endpoints)
+#define HELD_FRAME 3        // Binary frame
+#define HELD_REPLY_SIZE 64  // Room for a held reply: the longest of its texts, or a frame
+
+/**
+ * A reply that waits for its update's Raft entry (--raft-id)
+ * The outcome is known only once the entry settles, so the reply is written then
+ */
+typedef struct {
+    RaftTicket ticket;   // The update's log entry
+    int kind;            // HELD_ADD, HELD_DELIVER or HELD_FRAME, 0 for a reply that does not wait
+    int outcome;         // raft_result() once settled, RAFT_WAITING until then
+    size_t offset;       // Stream clients: the room kept for the reply in the output queue
+    unsigned char frame[PROTO_FRAME_SIZE];  // HELD_FRAME: the reply, its status filled in when settled
+} HeldReply;
+
+/**
+ * Starts a held reply
+ *
+ * @param held    The held reply
+ * @param ticket  The update's log entry (raft_take_pending())
+ * @param kind    HELD_ADD, HELD_DELIVER or HELD_FRAME
+ * @param frame   HELD_FRAME: the reply frame built for the request
+ */
+void held_init(HeldReply *held, const RaftTicket *ticket, int kind, const void *frame) {
+    held->ticket = *ticket;
+    held->kind = kind;
+    held->outcome = RAFT_WAITING;
+    held->offset = 0;
+    if (kind == HELD_FRAME) memcpy(held->frame, frame, PROTO_FRAME_SIZE);
+}
+
+/**
+ * Returns 1 if a held reply's entry settled, remembering its outcome
+ */
+int held_settled(HeldReply *held) {
+    if (held->outcome == RAFT_WAITING) held->outcome = raft_result(&held->ticket);
+    return held->outcome != RAFT_WAITING;
+}
+
+/**
+ * Writes the reply of a settled entry, as the stock operation would have
+ *
+ * @param held   The held reply (held_settled())
+ * @param reply  Buffer of HELD_REPLY_SIZE bytes
+ * @return       Length of the reply
+ */
+size_t held_reply_write(const HeldReply *held, char *reply) {
+    const char *msg;
+
+    if (held->outcome == 1) print_stock();
+    if (held->kind == HELD_FRAME) {
+        ProtoFrame resp;
+        proto_decode(held->frame, PROTO_FRAME_SIZE, &resp);
+        resp.id = held->outcome == 1 ? PROTO_STATUS_OK
+                  : held->outcome == 0 ? PROTO_STATUS_FAILED : PROTO_STATUS_UNKNOWN;
+        proto_encode(&resp, (unsigned char *)reply);
+        return PROTO_FRAME_SIZE;
+    }
+    if (held->outcome == -1) {
+        // In the Raft log but not applied in time: it may still be committed
+        msg = "ERROR: Outcome unknown\n";
+    } else if (held->kind == HELD_ADD) {
+        msg = held->outcome ? "added to warehouse successfully\n" : "ERROR: Exceeds MAX_ATOMS\n";
+    } else {
+        msg = held->outcome ? "Molecule delivered successfully\n" : "ERROR: Not enough atoms or unknown molecule\n";
+    }
+    return copy_reply(reply, HELD_REPLY_SIZE, msg);
+}
+
+/**
+ * Per-loop scratch space for handle_dgram(), sized to dgram_batch
+ * Allocated once by loop_init() so a wakeup does not put a whole batch of
+ * request and reply buffers on the stack
+ */
+typedef struct {
+    char (*buffers)[BUFFER_SIZE];      // Received datagrams
+    char (*replies)[BUFFER_SIZE];      // Replies built for them
+    struct sockaddr_storage *addrs;    // Sender of each datagram
+    struct iovec *in_iov, *out_iov;
+    struct mmsghdr *in_msgs, *out_msgs;
+    HeldReply *held;                   // Raft: the replies that wait for their entries
+} DgramScratch;
+
+struct EventLoop {
+#ifdef USE_SELECT
+    fd_set read_set;        // Descriptors watched for reading
+    fd_set write_set;       // Descriptors watched for writing
+    int maxfd;              // Highest watched descriptor
+#else
+    int epfd;               // The epoll instance
+#endif
+    FdWatch *watches;       // Registrations indexed by file descriptor
+    int watch_cap;          // Number of entries allocated in watches
+    struct CommitQueue *commits;  // Replies waiting for the log (--wal or --raft-id), NULL without it
+    DgramScratch dgram;     // Buffers for handle_dgram()
+};
+
+/**
+ * Initializes an empty event loop
+ *
+ * @param loop  The event loop to initialize
+ * @return      0 on success, -1 on failure
+ */
+int loop_init(EventLoop *loop) {
+    loop->watches = NULL;
+    loop->watch_cap = 0;
+    loop->commits = NULL;
+
+    DgramScratch *d = &loop->dgram;
+    d->buffers = malloc(sizeof(*d->buffers) * dgram_batch);
+    d->replies = malloc(sizeof(*d->replies) * dgram_batch);
+    d->addrs = malloc(sizeof(*d->addrs) * dgram_batch);
+    d->in_iov = malloc(sizeof(*d->in_iov) * dgram_batch);
+    d->out_iov = malloc(sizeof(*d->out_iov) * dgram_batch);
+    d->in_msgs = malloc(sizeof(*d->in_msgs) * dgram_batch);
+    d->out_msgs = malloc(sizeof(*d->out_msgs) * dgram_batch);
+    d->held = malloc(sizeof(*d->held) * dgram_batch);
+    if (d->buffers == NULL || d->replies == NULL || d->addrs == NULL || d->in_iov == NULL ||
+        d->out_iov == NULL || d->in_msgs == NULL || d->out_msgs == NULL || d->held == NULL) {
+        perror("malloc (datagram buffers)");
+        return -1;
+    }
+#ifdef USE_SELECT
+    FD_ZERO(&loop->read_set);
+    FD_ZERO(&loop->write_set);
+    loop->maxfd = -1;
+#else
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Starts watching a descriptor and associates a handler with it
+ *
+ * @param loop     The event loop
+ * @param fd       Descriptor to watch
+ * @param events   Interest mask (EV_READ / EV_WRITE)
+ * @param handler  Function called when the descriptor becomes ready
+ * @param data     Per-descriptor state, available to the handler as loop->watches[fd].data
+ * @return         0 on success, -1 on failure (errno is set)
+ */
+int loop_add(EventLoop *loop, int fd, int events, event_handler handler, void *data) {
+#ifdef USE_SELECT
+    // select() cannot represent descriptors beyond FD_SETSIZE
+    if (fd >= FD_SETSIZE) {
+        errno = EMFILE;
+        return -1;
+    }
+#endif
+    if (fd >= loop->watch_cap) {
+        int new_cap = loop->watch_cap ? loop->watch_cap : 64;
+        while (new_cap <= fd) new_cap *= 2;
+        FdWatch *grown = realloc(loop->watches, new_cap * sizeof(FdWatch));
+        if (grown == NULL) return -1;
+        memset(grown + loop->watch_cap, 0, (new_cap - loop->watch_cap) * sizeof(FdWatch));
+        loop->watches = grown;
+        loop->watch_cap = new_cap;
+    }
+
+#ifdef USE_SELECT
+    if (events & EV_READ) FD_SET(fd, &loop->read_set);
+    if (events & EV_WRITE) FD_SET(fd, &loop->write_set);
+    if (fd > loop->maxfd) loop->maxfd = fd;
+#else
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((events & EV_READ) ? EPOLLIN : 0) | ((events & EV_WRITE) ? EPOLLOUT : 0) |
+                ((events & EV_EXCLUSIVE) ? EPOLLEXCLUSIVE : 0);
+    ev.data.fd = fd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) return -1;
+#endif
+
+    loop->watches[fd].handler = handler;
+    loop->watches[fd].events = events;
+    loop->watches[fd].data = data;
+    return 0;
+}
+
+/**
+ * Changes the interest mask of an already watched descriptor
+ *
+ * @param loop    The event loop
+ * @param fd      Watched descriptor
+ * @param events  New interest mask (EV_READ / EV_WRITE)
+ * @return        0 on success, -1 on failure
+ */
+int loop_modify(EventLoop *loop, int fd, int events) {
+    if (fd >= loop->watch_cap || loop->watches[fd].handler == NULL) return -1;
+    if (loop->watches[fd].events == events) return 0;
+#ifdef USE_SELECT
+    events &= ~EV_EXCLUSIVE;
+    if (events & EV_READ) FD_SET(fd, &loop->read_set); else FD_CLR(fd, &loop->read_set);
+    if (events & EV_WRITE) FD_SET(fd, &loop->write_set); else FD_CLR(fd, &loop->write_set);
+#else
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((events & EV_READ) ? EPOLLIN : 0) | ((events & EV_WRITE) ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) == -1) return -1;
+#endif
+    loop->watches[fd].events = events;
+    return 0;
+}
+
+/**
+ * Stops watching a descriptor (the descriptor itself is not closed)
+ *
+ * @param loop  The event loop
+ * @param fd    Descriptor to remove
+ */
+void loop_remove(EventLoop *loop, int fd) {
+    if (fd >= loop->watch_cap || loop->watches[fd].handler == NULL) return;
+#ifdef USE_SELECT
+    FD_CLR(fd, &loop->read_set);
+    FD_CLR(fd, &loop->write_set);
+#else
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    loop->watches[fd].handler = NULL;
+    loop->watches[fd].events = 0;
+    loop->watches[fd].data = NULL;
+#ifdef USE_SELECT
+    // Recompute maxfd now that this slot is free
+    while (loop->maxfd >= 0 && loop->watches[loop->maxfd].handler == NULL) loop->maxfd--;
+#endif
+}
+
+/**
+ * Waits for activity and dispatches every ready descriptor to its handler
+ *
+ * @param loop  The event loop
+ * @return      Number of ready descriptors, or -1 on failure (errno is set)
+ */
+int loop_wait(EventLoop *loop) {
+#ifdef USE_SELECT
+    fd_set readfds = loop->read_set;
+    fd_set writefds = loop->write_set;
+
+    int n = select(loop->maxfd + 1, &readfds, &writefds, NULL, NULL);
+    if (n == -1) return -1;
+
+    // Check all file descriptors for activity
+    for (int fd = 0; fd <= loop->maxfd; fd++) {
+        int events = 0;
+        if (FD_ISSET(fd, &readfds)) events |= EV_READ;
+        if (FD_ISSET(fd, &writefds)) events |= EV_WRITE;
+        // A previous handler may have closed this descriptor
+        if (events && loop->watches[fd].handler != NULL) {
+            loop->watches[fd].handler(loop, fd, events);
+        }
+    }
+    return n;
+#else
+    struct epoll_event ready[MAX_EVENTS];
+
+    int n = epoll_wait(loop->epfd, ready, MAX_EVENTS, -1);
+    if (n == -1) return -1;
+
+    // Only the ready descriptors are visited
+    for (int i = 0; i < n; i++) {
+        int fd = ready[i].data.fd;
+        int events = 0;
+        if (ready[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) events |= EV_READ;
+        if (ready[i].events & EPOLLOUT) events |= EV_WRITE;
+        // A previous handler in this batch may have closed this descriptor
+        if (fd < loop->watch_cap && loop->watches[fd].handler != NULL) {
+            loop->watches[fd].handler(loop, fd, events);
+        }
+    }
+    return n;
+#endif
+}
+
+/**
+ * Raises the soft limit on open descriptors so that max_clients connections fit
+ * Failing to raise it is not fatal; accept() will simply fail earlier
+ *
+ * @param needed  Number of descriptors the server wants to be able to open
+ */
+void raise_fd_limit(rlim_t needed) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur >= needed) return;
+    rl.rlim_cur = (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < needed) ? rl.rlim_max : needed;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("setrlimit RLIMIT_NOFILE");
+    }
+}
+
+/**
+ * Closes all sockets, removes UDS socket files and exits the server
+ * Used by the console exit/quit commands
+ */
+void shutdown_server() {
+    printf("Exiting...\n");
+    if (lock_fd != -1) close(lock_fd);
+    if (tcp_sock != -1) close(tcp_sock);
+    if (udp_sock != -1) close(udp_sock);
+    if (uds_stream_sock != -1) {
+        close(uds_stream_sock);
+        if (global_stream_path != NULL) unlink(global_stream_path);
+    }
+    if (uds_dgram_sock != -1) {
+        close(uds_dgram_sock);
+        if (global_datagram_path != NULL) unlink(global_datagram_path);
+    }
+    exit(0);
+}
+
+/**
+ * State of one TCP or UDS stream client
+ * Commands are framed by '\n'; replies are queued and sent in order
+ */
+typedef struct Connection {
+    char in[STREAM_BUFFER_SIZE];  // Received bytes not yet framed into a complete command
+    size_t in_len;                // Number of valid bytes in in
+    int discarding;               // Skipping the rest of an over-long line
+    char *out;                    // Replies not yet sent
+    size_t out_len;               // Number of queued reply bytes
+    size_t out_sent;              // Number of queued bytes already sent
+    size_t out_cap;               // Allocated size of out
+    int fd;                       // The client socket
+    unsigned long long commit_ticket;  // Log record the queued replies wait for (--wal), 0 if none
+    HeldReply *held;                   // Replies waiting for Raft entries, in log order (--raft-id)
+    size_t held_count;                 // Number of held replies
+    size_t held_cap;                   // Allocated size of held
+    int stalled;                       // Input stopped at a command that waits for the held replies
+    int commit_waiting;                // Linked into the loop's CommitQueue
+    struct Connection *commit_prev, *commit_next;
+} Connection;
+
+/**
+ * One datagram reply kept until its batch is durable
+ */
+typedef struct {
+    struct sockaddr_storage addr;  // Client address
+    socklen_t addrlen;             // Length of addr
+    char *data;                    // Reply bytes
+    size_t len;                    // Length of the reply
+} DgramReply;
+
+/**
+ * One datagram batch whose replies wait for the log (--wal)
+ * Allocated as one block: the header, count replies, then their bytes
+ */
+typedef struct DgramReplies {
+    struct DgramReplies *next;   // Next batch, in arrival order
+    int fd;                      // Datagram socket the replies go out on
+    int count;                   // Number of replies
+    unsigned long long ticket;   // Log record the replies wait for
+    DgramReply *replies;         // The replies, in the same block
+    HeldReply *held;             // Raft: the replies' entries, in the same block, NULL with --wal
+} DgramReplies;
+
+/**
+ * Replies of one event loop that wait until their updates are on disk (--wal)
+ * or settled by the Raft cluster (--raft-id)
+ * The loop keeps serving other clients meanwhile; the log's sync thread (or
+ * the Raft apply thread) signals efd and handle_commit() sends what is ready
+ */
+struct CommitQueue {
+    int efd;                     // eventfd signalled by the sync or the apply thread
+    Connection *streams;         // Stream clients whose queued replies wait
+    DgramReplies *dgrams;        // Datagram batches that wait, oldest first
+    DgramReplies **dgrams_tail;  // Where the next batch is linked
+};
+
+/**
+ * Appends a reply to a connection's output queue
+ *
+ * @param conn   The client connection
+ * @param reply  Reply bytes
+ * @param len    Number of bytes
+ * @return       0 on success, -1 if memory could not be allocated
+ */
+int connection_queue_reply(Connection *conn, const char *reply, size_t len) {
+    if (conn->out_len + len > conn->out_cap) {
+        size_t new_cap = conn->out_cap ? conn->out_cap : BUFFER_SIZE;
+        while (new_cap < conn->out_len + len) new_cap *= 2;
+        char *grown = realloc(conn->out, new_cap);
+        if (grown == NULL) return -1;
+        conn->out = grown;
+        conn->out_cap = new_cap;
+    }
+    memcpy(conn->out + conn->out_len, reply, len);
+    conn->out_len += len;
+    return 0;
+}
+
+/**
+ * Sends as much of the queued output as the socket accepts without blocking
+ *
+ * @param fd    The client socket
+ * @param conn  The client connection
+ * @return      0 if the connection is still usable, -1 on a send error
+ */
+int connection_flush(int fd, Connection *conn) {
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = send(fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            perror("send to client failed");
+            return -1;
         }
-    } else if (strcmp(element, "HYDROGEN") == 0) {
-        if ((unsigned long long)stock->hydrogen + amount > MAX_ATOMS) {
-            fprintf(stderr, "Error: Exceeds MAX_ATOMS for HYDROGEN\n");
-            success = 0;
+        conn->out_sent += n;
+    }
+    // Everything was sent - reuse the buffer from the start
+    conn->out_len = conn->out_sent = 0;
+    return 0;
+}
+
+/**
+ * Removes a stream client from its loop's CommitQueue
+ *
+ * @param queue  The loop's CommitQueue
+ * @param conn   The client connection
+ */
+void commit_unlink(struct CommitQueue *queue, Connection *conn) {
+    if (!conn->commit_waiting) return;
+    if (conn->commit_prev != NULL) {
+        conn->commit_prev->commit_next = conn->commit_next;
+    } else {
+        queue->streams = conn->commit_next;
+    }
+    if (conn->commit_next != NULL) conn->commit_next->commit_prev = conn->commit_prev;
+    conn->commit_prev = conn->commit_next = NULL;
+    conn->commit_waiting = 0;
+}
+
+/**
+ * Asks the sync thread (--wal) or the Raft apply thread to wake the loop
+ *
+ * @param queue  The loop's CommitQueue
+ * @param index  Raft: oldest entry the loop waits for
+ */
+void commit_request_notify(struct CommitQueue *queue, uint64_t index) {
+    if (raft_enabled()) {
+        raft_request_notify(queue->efd, index);
+    } else {
+        wal_request_sync(queue->efd);
+    }
+}
+
+/**
+ * Keeps room in the output queue for a reply that waits for its Raft entry
+ *
+ * @param conn    The client connection
+ * @param ticket  The update's log entry
+ * @param kind    HELD_ADD or HELD_FRAME
+ * @param frame   HELD_FRAME: the reply frame built for the request
+ * @return        0 on success, -1 if memory could not be allocated
+ */
+int connection_hold_reply(Connection *conn, const RaftTicket *ticket, int kind, const void *frame) {
+    static const char room[HELD_REPLY_SIZE];
+
+    if (conn->held_count == conn->held_cap) {
+        size_t new_cap = conn->held_cap ? conn->held_cap * 2 : 16;
+        HeldReply *grown = realloc(conn->held, new_cap * sizeof(HeldReply));
+        if (grown == NULL) return -1;
+        conn->held = grown;
+        conn->held_cap = new_cap;
+    }
+    HeldReply *held = &conn->held[conn->held_count];
+    held_init(held, ticket, kind, frame);
+    held->offset = conn->out_len;
+    if (connection_queue_reply(conn, room, sizeof(room)) == -1) return -1;
+    conn->held_count++;
+    return 0;
+}
+
+/**
+ * Returns 1 if a stream client's queued replies can be sent: their log
+ * records are on disk (--wal), or their Raft entries settled (entries
+ * settle in log order, so the newest one decides)
+ */
+int connection_committed(Connection *conn) {
+    if (conn->held_count > 0) return held_settled(&conn->held[conn->held_count - 1]);
+    return wal_durable(conn->commit_ticket);
+}
+
+/**
+ * Writes the held replies of a stream client into the room kept for them,
+ * closing up the unused part of each (all of them settled)
+ *
+ * @param conn  The client connection
+ */
+void connection_release_held(Connection *conn) {
+    char reply[HELD_REPLY_SIZE];
+    size_t from = conn->held[0].offset, to = from;
+
+    for (size_t i = 0; i < conn->held_count; i++) {
+        HeldReply *held = &conn->held[i];
+        size_t before = held->offset - from;
+        memmove(conn->out + to, conn->out + from, before);
+        to += before;
+        held_settled(held);
+        size_t len = held_reply_write(held, reply);
+        memcpy(conn->out + to, reply, len);
+        to += len;
+        from = held->offset + HELD_REPLY_SIZE;
+    }
+    memmove(conn->out + to, conn->out + from, conn->out_len - from);
+    conn->out_len = to + (conn->out_len - from);
+    conn->held_count = 0;
+}
+
+/**
+ * Decides whether a stream client's queued replies must wait for the log
+ * Takes the records this thread appended while running the client's commands;
+ * a client that has to wait is linked into the loop's CommitQueue
+ *
+ * @param loop  The event loop
+ * @param conn  The client connection
+ * @return      1 if the replies wait, 0 if they can be sent now
+ */
+int connection_wait_commit(EventLoop *loop, Connection *conn) {
+    unsigned long long ticket = wal_take_pending();
+    if (ticket > conn->commit_ticket) conn->commit_ticket = ticket;
+    if (conn->commit_ticket == 0 && conn->held_count == 0) return 0;
+
+    struct CommitQueue *queue = loop->commits;
+    if (connection_committed(conn)) {
+        conn->commit_ticket = 0;
+        if (conn->held_count > 0) connection_release_held(conn);
+        commit_unlink(queue, conn);
+        return 0;
+    }
+    if (!conn->commit_waiting) {
+        conn->commit_waiting = 1;
+        conn->commit_prev = NULL;
+        conn->commit_next = queue->streams;
+        if (queue->streams != NULL) queue->streams->commit_prev = conn;
+        queue->streams = conn;
+        commit_request_notify(queue, conn->held_count > 0 ? conn->held[conn->held_count - 1].ticket.index : 0);
+    }
+    return 1;
+}
+
+/**
+ * Closes a stream client and releases its state
+ *
+ * @param loop  The event loop the client is registered with
+ * @param fd    The client socket
+ * @param conn  The client connection
+ */
+void close_stream_client(EventLoop *loop, int fd, Connection *conn) {
+    if (loop->commits != NULL) commit_unlink(loop->commits, conn);
+    loop_remove(loop, fd);
+    close(fd);
+    free(conn->out);
+    free(conn->held);
+    free(conn);
+    int remaining = __atomic_sub_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+    printf("Client disconnected (remaining: %d)\n", remaining);
+}
+
+/**
+ * Executes one command line and queues its reply
+ *
+ * @param conn  The client connection
+ * @param line  NUL-terminated command line (a trailing '\r' is ignored)
+ * @return      0 on success, -1 if the reply could not be queued
+ */
+int connection_execute(Connection *conn, char *line) {
+    char reply[BUFFER_SIZE];
+    size_t len = strlen(line);
+    if (len > 0 && line[len-1] == '\r') line[--len] = '\0';
+    if (len == 0) return 0;  // Ignore empty lines
+
+    size_t reply_len = process_tcp_command(line, stock_ptr, reply, sizeof(reply));
+    RaftTicket ticket;
+    if (raft_take_pending(&ticket)) return connection_hold_reply(conn, &ticket, HELD_ADD, NULL);
+    return connection_queue_reply(conn, reply, reply_len);
+}
+
+/**
+ * Executes one binary frame and queues its reply frame
+ *
+ * @param conn   The client connection
+ * @param frame  PROTO_FRAME_SIZE received bytes
+ * @return       0 on success, -1 if the reply could not be queued
+ */
+int connection_execute_frame(Connection *conn, const char *frame) {
+    unsigned char reply[PROTO_FRAME_SIZE];
+    size_t reply_len = process_binary_frame((const unsigned char *)frame, PROTO_FRAME_SIZE, PROTO_OP_ADD,
+                                            stock_ptr, reply);
+    RaftTicket ticket;
+    if (raft_take_pending(&ticket)) return connection_hold_reply(conn, &ticket, HELD_FRAME, reply);
+    return connection_queue_reply(conn, (const char *)reply, reply_len);
+}
+
+/**
+ * Returns 1 if a command line is an ADD
+ */
+int is_add_line(const char *line) {
+    const char *word = line + strspn(line, " \t");
+    return strncmp(word, "ADD", 3) == 0 && (word[3] == ' ' || word[3] == '\t');
+}
+
+/**
+ * Splits the receive buffer into commands and executes them in order:
+ * a command starting with PROTO_MAGIC is a fixed-size binary frame (which may
+ * contain any byte, '\n' included), anything else is a newline-terminated text line
+ * A partial command stays in the buffer until the rest of it arrives
+ * On a Raft node ADDs run ahead while earlier ones wait for their entries, but
+ * any other command stalls the input until they settled, so that a STATUS
+ * sees the client's own ADDs
+ *
+ * @param conn      The client connection
+ * @param prev_len  Number of buffered bytes before the latest recv()
+ * @return          0 on success, -1 if a reply could not be queued
+ */
+int connection_process_input(Connection *conn, size_t prev_len) {
+    size_t start = 0;
+
+    while (start < conn->in_len) {
+        if (!conn->discarding && (unsigned char)conn->in[start] == PROTO_MAGIC) {
+            if (conn->in_len - start < PROTO_FRAME_SIZE) break;  // Wait for the rest of the frame
+            if (connection_execute_frame(conn, conn->in + start) == -1) return -1;
+            start += PROTO_FRAME_SIZE;
+            continue;
+        }
+
+        // Bytes before prev_len belong to a partial line that was already scanned
+        size_t from = start > prev_len ? start : prev_len;
+        char *newline = memchr(conn->in + from, '\n', conn->in_len - from);
+        if (newline == NULL) break;
+
+        *newline = '\0';
+        if (!conn->discarding && conn->held_count > 0 && !is_add_line(conn->in + start)) {
+            *newline = '\n';
+            conn->stalled = 1;
+            break;
+        }
+        if (conn->discarding) {
+            conn->discarding = 0;  // End of an over-long line, resume with the next command
+        } else if (connection_execute(conn, conn->in + start) == -1) {
+            return -1;
+        }
+        start = newline - conn->in + 1;
+    }
+
+    size_t rest = conn->in_len - start;
+    if (rest == 0) {
+        conn->in_len = 0;
+    } else if (rest >= STREAM_BUFFER_SIZE - 1 && !conn->stalled) {
+        // A single line filled the whole buffer: reject it and skip to its end
+        const char *err_msg = "ERROR: Command too long\n";
+        conn->in_len = 0;
+        if (!conn->discarding) {
+            conn->discarding = 1;
+            return connection_queue_reply(conn, err_msg, strlen(err_msg));
+        }
+    } else {
+        // Keep the partial command at the start of the buffer
+        memmove(conn->in, conn->in + start, rest);
+        conn->in_len = rest;
+    }
+    return 0;
+}
+
+/**
+ * Handles an existing TCP or UDS stream client (ADD commands)
+ * Reads whatever arrived, runs every complete command and sends the replies;
+ * while replies are pending the client is also watched for writability
+ * With --wal, replies that report updates not yet on disk stay queued until
+ * handle_commit() calls back with events == 0; so do replies that wait for
+ * Raft entries
+ *
+ * @param loop    The event loop
+ * @param fd      The client socket
+ * @param events  Readiness mask (EV_READ / EV_WRITE), 0 to only send
+ */
+void handle_stream_client(EventLoop *loop, int fd, int events) {
+    Connection *conn = loop->watches[fd].data;
+
+    if ((events & EV_READ) && conn->out_len - conn->out_sent < MAX_PENDING_OUTPUT && !conn->stalled) {
+        size_t prev_len = conn->in_len;
+        ssize_t n = recv(fd, conn->in + conn->in_len, STREAM_BUFFER_SIZE - conn->in_len, 0);
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            // Client disconnected or error occurred
+            close_stream_client(loop, fd, conn);
+            return;
+        }
+        if (n > 0) {
+            conn->in_len += n;
+            if (connection_process_input(conn, prev_len) == -1) {
+                close_stream_client(loop, fd, conn);
+                return;
+            }
+        }
+    }
+
+    // With --wal, replies go out only once the updates they report are on disk,
+    // and on a Raft node once their entries settled
+    int waiting = loop->commits != NULL && connection_wait_commit(loop, conn);
+    while (!waiting && conn->stalled) {
+        // The held replies were written: run the commands that waited for them
+        conn->stalled = 0;
+        if (connection_process_input(conn, 0) == -1) {
+            close_stream_client(loop, fd, conn);
+            return;
+        }
+        waiting = connection_wait_commit(loop, conn);
+    }
+    if (!waiting && connection_flush(fd, conn) == -1) {
+        close_stream_client(loop, fd, conn);
+        return;
+    }
+
+    // Watch for writability only while replies can be sent, and stop reading
+    // from a client that does not consume its replies or whose input is stalled
+    size_t pending = conn->out_len - conn->out_sent;
+    int interest = (pending < MAX_PENDING_OUTPUT && !conn->stalled ? EV_READ : 0) |
+                   (pending > 0 && !waiting ? EV_WRITE : 0);
+    loop_modify(loop, fd, interest);
+}
+
+/**
+ * Accepts a new client on the TCP or UDS stream listening socket
+ *
+ * @param loop    The event loop
+ * @param fd      The listening socket
+ * @param events  Readiness mask (unused)
+ */
+void handle_stream_listener(EventLoop *loop, int fd, int events) {
+    struct sockaddr_storage client_addr;
+    socklen_t addrlen = sizeof(client_addr);
+    (void)events;
+
+    // Client sockets are non-blocking so a slow reader cannot stall the loop
+    int new_fd = accept4(fd, (struct sockaddr*)&client_addr, &addrlen, SOCK_NONBLOCK);
+    if (new_fd == -1) {
+        // Listening sockets are non-blocking: another thread may have taken the connection
+        if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+        return;
+    }
+    const char *kind = (client_addr.ss_family == AF_UNIX) ? "UDS stream" : "TCP";
+
+    // Reserve a client slot; every reactor thread shares the same limit
+    int total = __atomic_add_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+    Connection *conn = NULL;
+    if (total > max_clients) {
+        __atomic_sub_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+        printf("%s connection rejected: maximum clients limit reached\n", kind);
+        close(new_fd);
+    } else if ((conn = calloc(1, sizeof(Connection))) == NULL ||
+               loop_add(loop, new_fd, EV_READ, handle_stream_client, conn) == -1) {
+        __atomic_sub_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "%s connection rejected: cannot watch descriptor %d: %s\n", kind, new_fd, strerror(errno));
+        free(conn);
+        close(new_fd);
+    } else {
+        conn->fd = new_fd;
+        printf("New %s client connected (total: %d)\n", kind, total);
+    }
+}
+
+/**
+ * Sends a batch of datagram replies; sendmmsg may stop early, so continue
+ * from where it stopped
+ *
+ * @param fd    The datagram socket
+ * @param msgs  The replies, with their destination addresses
+ * @param n     Number of replies
+ */
+void send_dgram_replies(int fd, struct mmsghdr *msgs, int n) {
+    int sent = 0;
+    while (sent < n) {
+        int r = sendmmsg(fd, msgs + sent, n - sent, MSG_DONTWAIT);
+        __atomic_fetch_add(&dgram_stats.send_calls, 1, __ATOMIC_RELAXED);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            perror("sendmmsg to client failed");
+            // Replies are best effort, as with sendto(): when the socket buffer is
+            // full drop the rest, otherwise skip only the datagram that failed
+            // (e.g. the client's socket is gone)
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            sent++;
+            continue;
+        }
+        sent += r;
+    }
+}
+
+/**
+ * Keeps a datagram batch's replies until its log records are on disk (--wal)
+ *
+ * @param queue   The loop's CommitQueue
+ * @param fd      The datagram socket
+ * @param msgs    The replies, with their destination addresses
+ * @param n       Number of replies
+ * @param ticket  Log record the replies wait for
+ * @return        0 on success, -1 if the replies could not be kept
+ */
+int commit_wait_dgrams(struct CommitQueue *queue, int fd, const struct mmsghdr *msgs, int n,
+                       unsigned long long ticket) {
+    size_t total = 0;
+    for (int i = 0; i < n; i++) total += msgs[i].msg_hdr.msg_iov->iov_len;
+
+    DgramReplies *batch = malloc(sizeof(DgramReplies) + n * sizeof(DgramReply) + total);
+    if (batch == NULL) return -1;
+    batch->next = NULL;
+    batch->fd = fd;
+    batch->count = n;
+    batch->ticket = ticket;
+    batch->replies = (DgramReply *)(batch + 1);
+
+    char *data = (char *)(batch->replies + n);
+    for (int i = 0; i < n; i++) {
+        DgramReply *reply = &batch->replies[i];
+        reply->addrlen = msgs[i].msg_hdr.msg_namelen;
+        memcpy(&reply->addr, msgs[i].msg_hdr.msg_name, reply->addrlen);
+        reply->data = data;
+        reply->len = msgs[i].msg_hdr.msg_iov->iov_len;
+        memcpy(data, msgs[i].msg_hdr.msg_iov->iov_base, reply->len);
+        data += reply->len;
+    }
+
+    batch->held = NULL;
+
+    *queue->dgrams_tail = batch;
+    queue->dgrams_tail = &batch->next;
+    wal_request_sync(queue->efd);
+    return 0;
+}
+
+/**
+ * Keeps the replies of a datagram batch that wait for their Raft entries
+ * Only their destinations are kept: the replies are written once the entries settle
+ *
+ * @param queue     The loop's CommitQueue
+ * @param fd        The datagram socket
+ * @param msgs      The batch's replies, with their destination addresses
+ * @param held      The batch's held replies, kind 0 for the replies that do not wait
+ * @param n         Number of replies in the batch
+ * @param num_held  Number of them that wait
+ * @return          0 on success, -1 if the replies could not be kept
+ */
+int commit_hold_dgrams(struct CommitQueue *queue, int fd, const struct mmsghdr *msgs, const HeldReply *held, int n,
+                       int num_held) {
+    DgramReplies *batch = malloc(sizeof(DgramReplies) + num_held * (sizeof(DgramReply) + sizeof(HeldReply)));
+    if (batch == NULL) return -1;
+    batch->next = NULL;
+    batch->fd = fd;
+    batch->count = num_held;
+    batch->ticket = 0;
+    batch->replies = (DgramReply *)(batch + 1);
+    batch->held = (HeldReply *)(batch->replies + num_held);
+
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        if (held[i].kind == 0) continue;
+        DgramReply *reply = &batch->replies[k];
+        reply->addrlen = msgs[i].msg_hdr.msg_namelen;
+        memcpy(&reply->addr, msgs[i].msg_hdr.msg_name, reply->addrlen);
+        reply->data = NULL;
+        reply->len = 0;
+        batch->held[k++] = held[i];
+    }
+
+    *queue->dgrams_tail = batch;
+    queue->dgrams_tail = &batch->next;
+    commit_request_notify(queue, batch->held[num_held - 1].ticket.index);
+    return 0;
+}
+
+/**
+ * Returns 1 if a waiting datagram batch can be sent: its log records are on
+ * disk (--wal), or its Raft entries settled (the newest one decides)
+ */
+int dgram_batch_ready(DgramReplies *batch) {
+    if (batch->held != NULL) return held_settled(&batch->held[batch->count - 1]);
+    return wal_durable(batch->ticket);
+}
+
+/**
+ * Drains up to dgram_batch datagrams from the UDP or UDS datagram socket with
+ * one recvmmsg() and answers all of them with one sendmmsg() (DELIVER commands)
+ *
+ * @param loop    The event loop
+ * @param fd      The datagram socket
+ * @param events  Readiness mask (unused)
+ */
+void handle_dgram(EventLoop *loop, int fd, int events) {
+    char (*buffers)[BUFFER_SIZE] = loop->dgram.buffers;
+    char (*replies)[BUFFER_SIZE] = loop->dgram.replies;
+    struct sockaddr_storage *addrs = loop->dgram.addrs;
+    struct iovec *in_iov = loop->dgram.in_iov, *out_iov = loop->dgram.out_iov;
+    struct mmsghdr *in_msgs = loop->dgram.in_msgs, *out_msgs = loop->dgram.out_msgs;
+    HeldReply *held = loop->dgram.held;
+    (void)events;
+
+    memset(in_msgs, 0, sizeof(struct mmsghdr) * dgram_batch);
+    for (int i = 0; i < dgram_batch; i++) {
+        in_iov[i].iov_base = buffers[i];
+        in_iov[i].iov_len = BUFFER_SIZE - 1;  // Leave room for the terminator
+        in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+        in_msgs[i].msg_hdr.msg_iovlen = 1;
+        in_msgs[i].msg_hdr.msg_name = &addrs[i];
+        in_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+
+    int n = recvmmsg(fd, in_msgs, dgram_batch, MSG_DONTWAIT, NULL);
+    __atomic_fetch_add(&dgram_stats.recv_calls, 1, __ATOMIC_RELAXED);
+    if (n <= 0) {
+        // Datagram sockets are non-blocking: another thread may have taken the datagrams
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("recvmmsg");
+        return;
+    }
+
+    // Process every datagram in arrival order and build its reply
+    memset(out_msgs, 0, sizeof(struct mmsghdr) * n);
+    int num_held = 0;
+    for (int i = 0; i < n; i++) {
+        int binary = in_msgs[i].msg_len > 0 && (unsigned char)buffers[i][0] == PROTO_MAGIC;
+        buffers[i][in_msgs[i].msg_len] = '\0';  // Null-terminate the received data
+        out_iov[i].iov_base = replies[i];
+        if (binary) {
+            // Binary frame: one per datagram
+            out_iov[i].iov_len = process_binary_frame((unsigned char *)buffers[i], in_msgs[i].msg_len,
+                                                      PROTO_OP_DELIVER, stock_ptr, (unsigned char *)replies[i]);
         } else {
-            stock->hydrogen += amount;
+            out_iov[i].iov_len = process_udp_command(buffers[i], stock_ptr, replies[i], BUFFER_SIZE);
+        }
+        // A DELIVER in the Raft log is answered once its entry settles
+        RaftTicket entry;
+        held[i].kind = 0;
+        if (raft_take_pending(&entry)) {
+            held_init(&held[i], &entry, binary ? HELD_FRAME : HELD_DELIVER, replies[i]);
+            num_held++;
         }
-    } else if (strcmp(element, "OXYGEN") == 0) {
-        if ((unsigned long long)stock->oxygen + amount > MAX_ATOMS) {
-            fprintf(stderr, "Error: Exceeds MAX_ATOMS for OXYGEN\n");
-            success = 0;
+        out_msgs[i].msg_hdr.msg_iov = &out_iov[i];
+        out_msgs[i].msg_hdr.msg_iovlen = 1;
+        out_msgs[i].msg_hdr.msg_name = &addrs[i];
+        out_msgs[i].msg_hdr.msg_namelen = in_msgs[i].msg_hdr.msg_namelen;
+    }
+
+    // With --wal, the whole batch waits for its records to reach the disk;
+    // on a Raft node only the DELIVERs wait, for their entries to settle
+    unsigned long long ticket = loop->commits != NULL ? wal_take_pending() : 0;
+    if (num_held > 0) {
+        if (commit_hold_dgrams(loop->commits, fd, out_msgs, held, n, num_held) == -1) {
+            perror("malloc (datagram replies)");
+        }
+        int ready = 0;
+        for (int i = 0; i < n; i++) {
+            if (held[i].kind == 0) out_msgs[ready++] = out_msgs[i];
+        }
+        send_dgram_replies(fd, out_msgs, ready);
+    } else if (ticket == 0 || wal_durable(ticket)) {
+        send_dgram_replies(fd, out_msgs, n);
+    } else if (commit_wait_dgrams(loop->commits, fd, out_msgs, n, ticket) == -1) {
+        // Replies are best effort: without memory to keep them, drop them
+        perror("malloc (datagram replies)");
+    }
+
+    // Update the batching statistics
+    __atomic_fetch_add(&dgram_stats.wakeups, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dgram_stats.datagrams, n, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&dgram_stats.max_batch, __ATOMIC_RELAXED);
+    while ((unsigned long long)n > max &&
+           !__atomic_compare_exchange_n(&dgram_stats.max_batch, &max, n, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Sends the replies whose log records reached the disk (--wal), or whose
+ * Raft entries settled (--raft-id)
+ * Called when the sync or the apply thread signals the loop's eventfd;
+ * replies still waiting ask to be woken again
+ *
+ * @param loop    The event loop
+ * @param fd      The loop's eventfd
+ * @param events  Readiness mask (unused)
+ */
+void handle_commit(EventLoop *loop, int fd, int events) {
+    struct CommitQueue *queue = loop->commits;
+    struct mmsghdr msgs[MAX_DGRAM_BATCH];
+    struct iovec iov[MAX_DGRAM_BATCH];
+    char written[MAX_DGRAM_BATCH][HELD_REPLY_SIZE];
+    uint64_t signals;
+    uint64_t wait_index = UINT64_MAX;  // Raft: oldest entry a waiting reply needs
+    int again = 0;
+    (void)events;
+
+    if (read(fd, &signals, sizeof(signals)) == -1 && errno != EAGAIN) perror("read eventfd");
+
+    // Stream clients: handle_stream_client() with no events only sends
+    Connection *conn = queue->streams;
+    while (conn != NULL) {
+        Connection *next = conn->commit_next;
+        if (connection_committed(conn)) {
+            handle_stream_client(loop, conn->fd, 0);
         } else {
-            stock->oxygen += amount;
+            again = 1;
+            if (conn->held_count > 0 && conn->held[conn->held_count - 1].ticket.index < wait_index) {
+                wait_index = conn->held[conn->held_count - 1].ticket.index;
+            }
         }
-    } else {
-        // Invalid atom type
-        fprintf(stderr, "Error: Unknown atom type '%s'\n", element);
-        success = 0;
+        conn = next;
     }
 
-    // Release the lock before returning to allow other processes to access
-    if (lock_fd != -1) flock(lock_fd, LOCK_UN);
-    return success;
-}
+    // Datagram batches, oldest first
+    while (queue->dgrams != NULL && dgram_batch_ready(queue->dgrams)) {
+        DgramReplies *batch = queue->dgrams;
+        memset(msgs, 0, sizeof(struct mmsghdr) * batch->count);
+        for (int i = 0; i < batch->count; i++) {
+            if (batch->held != NULL) {
+                held_settled(&batch->held[i]);
+                batch->replies[i].data = written[i];
+                batch->replies[i].len = held_reply_write(&batch->held[i], written[i]);
+            }
+            iov[i].iov_base = batch->replies[i].data;
+            iov[i].iov_len = batch->replies[i].len;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &batch->replies[i].addr;
+            msgs[i].msg_hdr.msg_namelen = batch->replies[i].addrlen;
+        }
+        send_dgram_replies(batch->fd, msgs, batch->count);
 
-/**
- * Subtracts atoms from the stock to create molecules
- * 
- * @param stock     Pointer to the atom stock structure (can be memory-mapped)
- * @param molecule  Type of molecule to create
- * @param amount    Number of molecules to create
- * @return          1 on success, 0 on failure (insufficient atoms or unknown molecule)
- */
-int molecule_subtract(AtomStock *stock, const char *molecule, unsigned int amount) {
-    // Acquire an exclusive lock for writing
-    // This ensures atomic read-check-write operations across processes
-    if (lock_fd != -1) flock(lock_fd, LOCK_EX);
-
-    unsigned long long need_c = 0, need_h = 0, need_o = 0;
-    int success = 1;
-
-    // Calculate required atoms based on molecule type
-    if (strcmp(molecule, "WATER") == 0) { // H2O
-        need_h = 2 * (unsigned long long)amount; 
-        need_o = 1 * (unsigned long long)amount;
-    } else if (strcmp(molecule, "CARBON DIOXIDE") == 0) { // CO2
-        need_c = 1 * (unsigned long long)amount; 
-        need_o = 2 * (unsigned long long)amount;
-    } else if (strcmp(molecule, "ALCOHOL") == 0) { // C2H6O
-        need_c = 2 * (unsigned long long)amount; 
-        need_h = 6 * (unsigned long long)amount; 
-        need_o = 1 * (unsigned long long)amount;
-    } else if (strcmp(molecule, "GLUCOSE") == 0) { // C6H12O6
-        need_c = 6 * (unsigned long long)amount; 
-        need_h = 12 * (unsigned long long)amount; 
-        need_o = 6 * (unsigned long long)amount;
-    } else {
-        // Unknown molecule type
-        fprintf(stderr, "Error: Unknown molecule type '%s'\n", molecule);
-        success = 0;
+        queue->dgrams = batch->next;
+        if (queue->dgrams == NULL) queue->dgrams_tail = &queue->dgrams;
+        free(batch);
     }
-
-    if (success) {
-        // Check if we have enough atoms (atomic check under lock)
-        if (stock->carbon < need_c || stock->hydrogen < need_h || stock->oxygen < need_o) {
-            fprintf(stderr, "Error: Not enough atoms for molecule %s\n", molecule);
-            success = 0;
-        } else {
-            // Subtract the required atoms from stock (atomic operation)
-            stock->carbon -= need_c;
-            stock->hydrogen -= need_h;
-            stock->oxygen -= need_o;
+    if (queue->dgrams != NULL) {
+        again = 1;
+        DgramReplies *batch = queue->dgrams;
+        if (batch->held != NULL && batch->held[batch->count - 1].ticket.index < wait_index) {
+            wait_index = batch->held[batch->count - 1].ticket.index;
         }
     }
 
-    // Release the lock before returning to allow other processes to access
-    if (lock_fd != -1) flock(lock_fd, LOCK_UN);
-    return success;
+    if (again) commit_request_notify(queue, wait_index);
 }
 
+// The background snapshot in progress (console command SNAPSHOT), pid 0 when idle
+Snapshot snapshot;
+
 /**
- * Calculates the maximum number of drinks that can be produced from the current inventory
- * This function computes the minimum between the required molecules for the recipe
- * and what is actually available in the inventory, without modifying the inventory itself
- * Uses shared locking to ensure consistent reads during concurrent operations
- * 
- * @param stock       Pointer to the atom stock structure (can be memory-mapped)
- * @param drink_type  Type of drink to calculate ("SOFT DRINK", "VODKA", or "CHAMPAGNE")
- * @return            Maximum number of drinks that can be produced
- */
-unsigned long long calculate_drink_production(AtomStock *stock, const char *drink_type) {
-    // Acquire a shared lock for reading to ensure consistent snapshot of stock
-    // Multiple processes can read simultaneously but writes are blocked
-    if (lock_fd != -1) flock(lock_fd, LOCK_SH);
-    
-    unsigned long long total_c_needed = 0, total_h_needed = 0, total_o_needed = 0;
-
-    // Calculate total atoms needed per drink for each drink type
-    if (strcmp(drink_type, "SOFT DRINK") == 0) {
-        // SOFT DRINK: H2O + CO2 + C6H12O6
-        // H2O: 2H + 1O
-        // CO2: 1C + 2O  
-        // C6H12O6: 6C + 12H + 6O
-        // Total per drink: 7C + 14H + 9O
-        total_c_needed = 7; 
-        total_h_needed = 14; 
-        total_o_needed = 9;
-    } else if (strcmp(drink_type, "VODKA") == 0) {
-        // VODKA: H2O + C2H6O + C6H12O6
-        // H2O: 2H + 1O
-        // C2H6O: 2C + 6H + 1O
-        // C6H12O6: 6C + 12H + 6O
-        // Total per drink: 8C + 20H + 8O
-        total_c_needed = 8; 
-        total_h_needed = 20; 
-        total_o_needed = 8;
-    } else if (strcmp(drink_type, "CHAMPAGNE") == 0) {
-        // CHAMPAGNE: H2O + CO2 + C2H6O
-        // H2O: 2H + 1O
-        // CO2: 1C + 2O
-        // C2H6O: 2C + 6H + 1O
-        // Total per drink: 3C + 8H + 4O
-        total_c_needed = 3; 
-        total_h_needed = 8; 
-        total_o_needed = 4;
-    } else {
-        // Unknown drink type - release lock before returning
-        if (lock_fd != -1) flock(lock_fd, LOCK_UN);
-        return 0;
-    }
+ * Reports a finished snapshot once its child has written its result
+ *
+ * @param loop    The event loop
+ * @param fd      Read end of the snapshot's result pipe
+ * @param events  Readiness mask (unused)
+ */
+void handle_snapshot(EventLoop *loop, int fd, int events) {
+    SnapshotResult result;
+    (void)events;
 
-    // Calculate maximum drinks based on available atoms
-    unsigned long long max_drinks = MAX_ATOMS;
-    
-    if (total_c_needed > 0) {
-        unsigned long long drinks_by_carbon = stock->carbon / total_c_needed;
-        if (drinks_by_carbon < max_drinks) max_drinks = drinks_by_carbon;
+    loop_remove(loop, fd);
+    unsigned long long total_ns = latency_now_ns() - snapshot.started_ns;
+    if (snapshot_finish(&snapshot, &result) == -1) {
+        printf("Snapshot %s failed (%s: %s)\n", snapshot.path, snapshot_step_name(result.step),
+               strerror(result.error));
+        return;
     }
-    
-    if (total_h_needed > 0) {
-        unsigned long long drinks_by_hydrogen = stock->hydrogen / total_h_needed;
-        if (drinks_by_hydrogen < max_drinks) max_drinks = drinks_by_hydrogen;
+    printf("Snapshot %s: C=%llu, H=%llu, O=%llu, log position %llu\n", snapshot.path,
+           snapshot.contents.stock.carbon, snapshot.contents.stock.hydrogen, snapshot.contents.stock.oxygen,
+           (unsigned long long)snapshot.contents.log_lsn);
+    printf("  snapshot took %.3f ms (child write+fsync %.3f ms); parent paused %.1f us (copy %.1f us, fork %.1f us)\n",
+           total_ns / 1e6, result.write_ns / 1e6, snapshot.pause_ns / 1e3, snapshot.copy_ns / 1e3,
+           snapshot.fork_ns / 1e3);
+}
+
+/**
+ * Starts a background snapshot of the stock (console command SNAPSHOT)
+ * The file is written by a forked child; this loop only waits for its report
+ *
+ * @param loop  The event loop that runs the console
+ */
+void start_snapshot(EventLoop *loop) {
+    if (snapshot.pid != 0) {
+        printf("Error: Snapshot %s is still being written\n", snapshot.path);
+        return;
     }
-    
-    if (total_o_needed > 0) {
-        unsigned long long drinks_by_oxygen = stock->oxygen / total_o_needed;
-        if (drinks_by_oxygen < max_drinks) max_drinks = drinks_by_oxygen;
+    if (snapshot_start(save_file_path != NULL ? save_file_path : "drinks_bar", &snapshot) == -1) return;
+    if (loop_add(loop, snapshot.result_fd, EV_READ, handle_snapshot, NULL) == -1) {
+        // Without a watch nobody would reap the child: wait for it here instead
+        perror("watch snapshot");
+        SnapshotResult result;
+        fcntl(snapshot.result_fd, F_SETFL, 0);
+        snapshot_finish(&snapshot, &result);
+        return;
     }
-
-    // Release the lock before returning
-    if (lock_fd != -1) flock(lock_fd, LOCK_UN);
-    
-    return (max_drinks == MAX_ATOMS) ? 0 : max_drinks;
+    printf("Snapshot started (child pid %d), writing %s\n", (int)snapshot.pid, snapshot.path);
 }
 
 /**
- * Process commands from console input (GEN operations)
- * 
- * @param cmd    The command string from the console
- * @param stock  Pointer to the atom stock structure (memory or memory-mapped)
- * @return       1 on success, 0 on failure or invalid command
+ * Reads one line from the administrator console (GEN / STATS / SNAPSHOT / exit / quit)
+ *
+ * @param loop    The event loop
+ * @param fd      STDIN_FILENO
+ * @param events  Readiness mask (unused)
  */
-int process_console_command(const char *cmd, AtomStock *stock) {
-    char op[256], drink_type1[256], drink_type2[256];
+void handle_console(EventLoop *loop, int fd, int events) {
+    char buffer[BUFFER_SIZE];
+    (void)events;
 
-    // Parse command: GEN <DRINK_TYPE> or GEN <DRINK_TYPE1> <DRINK_TYPE2>
-    int n = sscanf(cmd, "%255s %255s %255s", op, drink_type1, drink_type2);
-    
-    if (n < 2 || strcmp(op, "GEN") != 0) {
-        printf("Error: Invalid console command. Use: GEN SOFT DRINK / GEN VODKA / GEN CHAMPAGNE\n");
-        return 0;
+    if (fgets(buffer, sizeof(buffer), stdin) == NULL) {
+        // Console closed (EOF) - stop watching it instead of spinning on it
+        loop_remove(loop, fd);
+        return;
     }
-    
-    char full_drink_type[512];
-    if (n == 3) {
-        // Two words (e.g., "SOFT DRINK")
-        snprintf(full_drink_type, sizeof(full_drink_type), "%s %s", drink_type1, drink_type2);
-    } else {
-        // One word (e.g., "VODKA", "CHAMPAGNE")
-        strncpy(full_drink_type, drink_type1, sizeof(full_drink_type));
-        full_drink_type[sizeof(full_drink_type)-1] = '\0';
+
+    size_t len = strlen(buffer);
+    if (len > 0 && buffer[len-1] == '\n') buffer[len-1] = '\0';  // Remove newline
+
+    // Handle exit commands
+    if (strcmp(buffer, "exit") == 0 || strcmp(buffer, "quit") == 0) {
+        shutdown_server();
     }
-    
-    // Calculate and display the number of drinks that can be produced
-    // Note: calculate_drink_production handles locking internally
-    unsigned long long drinks_possible = calculate_drink_production(stock, full_drink_type);
-    
-    if (strcmp(full_drink_type, "SOFT DRINK") == 0 || 
-        strcmp(full_drink_type, "VODKA") == 0 || 
-        strcmp(full_drink_type, "CHAMPAGNE") == 0) {
-        printf("Can produce %llu %s drinks\n", drinks_possible, full_drink_type);
-    } else {
-        printf("Error: Unknown drink type '%s'\n", full_drink_type);
+    // SNAPSHOT forks a writer and registers its report with this loop
+    if (strcmp(buffer, "SNAPSHOT") == 0) {
+        start_snapshot(loop);
+        return;
     }
-    
-    return 1;
+    process_console_command(buffer);
 }
 
+/* ===== REACTOR THREADS ===== */
+
 /**
- * Process TCP commands from clients (ADD operations)
- * 
- * @param cmd       The command string from the client
- * @param stock     Pointer to the atom stock structure (memory or memory-mapped)
- * @param client_fd The client socket file descriptor
- * @return          0 on completion
- */
-int process_tcp_command(const char *cmd, AtomStock *stock, int client_fd) {
-    char op[16], atom[16];
-    unsigned int amount;
-    
-    // Parse the command: ADD <atom type> <amount>
-    if (sscanf(cmd, "%15s %15s %u", op, atom, &amount) == 3 && strcmp(op, "ADD") == 0) {
-        // Try to add atoms to the stock
-        // Note: atom_adder handles locking internally
-        if (atom_adder(stock, atom, amount)) {
-            // Success message
-            const char *ok_msg = "added to warehouse successfully\n";
-            if (send(client_fd, ok_msg, strlen(ok_msg), 0) == -1) {
-                perror("send to client failed");
-            }
-            // Note: print_stock handles locking internally
-            print_stock();
-        } else {
-            // Error message if adding fails (exceeds max or unknown atom)
-            const char *err_msg = "ERROR: Exceeds MAX_ATOMS\n";
-            if (send(client_fd, err_msg, strlen(err_msg), 0) == -1) {
-                perror("send to client failed");
-            }
-        }
-    } else {
-        // Invalid command format
-        fprintf(stderr, "Invalid command from client: %s\n", cmd);
-    }
-    return 0;
-}
+ * One reactor thread: its own event loop and, in TCP/UDP mode, its own
+ * SO_REUSEPORT listening and datagram sockets
+ */
+typedef struct {
+    int id;              // Worker index (worker 0 runs on the main thread)
+    pthread_t thread;    // Thread handle (unused for worker 0)
+    EventLoop loop;      // Event loop owned by this worker
+    int tcp_sock;        // This worker's TCP listener (-1 in UDS mode)
+    int udp_sock;        // This worker's UDP socket (-1 in UDS mode)
+} Worker;
+
+// Inactivity timeout in seconds (0 = disabled), shared by all reactor threads
+int inactivity_timeout = 0;
 
 /**
- * Process UDP commands from clients (DELIVER operations)
- * 
- * @param cmd         The command string from the client
- * @param stock       Pointer to the atom stock structure (memory or memory-mapped)
- * @param udp_sock    The UDP socket file descriptor
- * @param client_addr Client address structure for sending responses
- * @param addrlen     Length of the client address structure
- * @return            0 on completion
- */
-int process_udp_command(const char *cmd, AtomStock *stock, int udp_sock, struct sockaddr *client_addr, socklen_t addrlen) {
-    char op[256], molecule1[256], molecule2[256], amount_str[256];
-    unsigned int amount;
-    char molecule[512];
-    
-    // Parse the command: DELIVER <molecule> <amount> or DELIVER <molecule1> <molecule2> <amount>
-    int n = sscanf(cmd, "%255s %255s %255s %255s", op, molecule1, molecule2, amount_str);
+ * Creates a non-blocking IPv4 socket bound to INADDR_ANY:port
+ * With reuseport set, several sockets (one per reactor thread) may bind the
+ * same port and the kernel spreads connections/datagrams between them
+ *
+ * @param type       SOCK_STREAM or SOCK_DGRAM
+ * @param port       Port to bind
+ * @param reuseport  Non-zero to set SO_REUSEPORT before binding
+ * @return           Bound socket, or -1 on failure (error already printed)
+ */
+int open_inet_socket(int type, int port, int reuseport) {
+    const char *kind = (type == SOCK_STREAM) ? "TCP" : "UDP";
+    struct sockaddr_in addr;
+    int one = 1;
 
-    // Validate command format
-    if (n < 3 || strcmp(op, "DELIVER") != 0) {
-        fprintf(stderr, "Invalid command from client: %s\n", cmd);
-        const char *err_msg = "ERROR: Invalid UDP command\n";
-        sendto(udp_sock, err_msg, strlen(err_msg), 0, (struct sockaddr*)client_addr, addrlen);
-        return 0;
+    int fd = socket(AF_INET, type | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        fprintf(stderr, "%s socket creation failed: %s\n", kind, strerror(errno));
+        return -1;
     }
 
-    // Handle both formats: "DELIVER WATER 5" or "DELIVER CARBON DIOXIDE 10"
-    if (n == 4) {
-        // Two-word molecule name (e.g., "CARBON DIOXIDE")
-        snprintf(molecule, sizeof(molecule), "%s %s", molecule1, molecule2);
-    } else {
-        // One-word molecule name (e.g., "WATER")
-        strncpy(molecule, molecule1, sizeof(molecule));
-        molecule[sizeof(molecule)-1] = '\0';
-        strncpy(amount_str, molecule2, sizeof(amount_str));
-        amount_str[sizeof(amount_str)-1] = '\0';
-    }
-
-    // Validate that amount is numeric
-    for (int i = 0; amount_str[i]; ++i) {
-        if (!isdigit((unsigned char)amount_str[i])) {
-            const char *err_msg = "ERROR: Invalid amount\n";
-            sendto(udp_sock, err_msg, strlen(err_msg), 0, client_addr, addrlen);
-            return 0;
-        }
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "%s setsockopt SO_REUSEPORT failed: %s\n", kind, strerror(errno));
+        close(fd);
+        return -1;
     }
-    
-    // Convert amount string to unsigned int
-    amount = (unsigned int)strtoul(amount_str, NULL, 10);
-    if (amount == 0) {
-        const char *err_msg = "ERROR: Amount must be positive\n";
-        sendto(udp_sock, err_msg, strlen(err_msg), 0, client_addr, addrlen);
-        return 0;
+
+    // Configure socket address
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;  // Listen on all available interfaces
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "%s bind failed: %s\n", kind, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // Set TCP socket to listen mode
+    // SOMAXCONN lets bursts of connecting clients queue instead of being dropped
+    if (type == SOCK_STREAM && listen(fd, SOMAXCONN) < 0) {
+        perror("TCP listen failed");
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    // Try to create the molecules
-    // Note: molecule_subtract handles locking internally
-    if (molecule_subtract(stock, molecule, amount)) {
-        // Success message
-        const char *ok_msg = "Molecule delivered successfully\n";
-        if (sendto(udp_sock, ok_msg, strlen(ok_msg), 0, client_addr, addrlen) == -1) {
-            perror("sendto to client failed");
+/**
+ * Runs an event loop forever, handling the inactivity timeout
+ *
+ * @param loop  The event loop to run
+ */
+void run_event_loop(EventLoop *loop) {
+    while (1) {
+        // Set alarm only if timeout is defined
+        if (inactivity_timeout > 0) {
+            alarm(inactivity_timeout);  // Set alarm to trigger after timeout seconds of inactivity
         }
-        // Note: print_stock handles locking internally
-        print_stock();
-    } else {
-        // Error message if creating molecules fails
-        const char *err_msg = "ERROR: Not enough atoms or unknown molecule\n";
-        if (sendto(udp_sock, err_msg, strlen(err_msg), 0, client_addr, addrlen) == -1) {
-            perror("sendto to client failed");
+        
+        // Wait for activity on any of the sockets (including stdin) and dispatch it
+        if (loop_wait(loop) == -1) {
+            // Check if the error was caused by the signal interrupt
+            if (errno == EINTR) {
+                continue;  // If interrupted by signal, just continue the loop
+            }
+            perror("event loop wait");
+            exit(1);
+        }
+        
+        // Activity detected, cancel the alarm
+        // (handlers already ran, so the next iteration re-arms it)
+        if (inactivity_timeout > 0) {
+            alarm(0);  // Cancel the alarm since we had activity
         }
     }
-    return 0;
+}
+
+/**
+ * Entry point of reactor threads 1..N-1
+ *
+ * @param arg  The Worker this thread runs
+ * @return     Never returns
+ */
+void *worker_main(void *arg) {
+    Worker *worker = arg;
+    run_event_loop(&worker->loop);
+    return NULL;
 }
 
 
@@ -511,9 +2046,12 @@ int process_udp_command(const char *cmd, AtomStock *stock, int udp_sock, struct
  * @param argv Array of command line arguments
  * @return     Exit code
  */
+#ifndef DRINKS_BAR_NO_MAIN
 int main(int argc, char *argv[]) {
-    int opt, timeout = 0, UDP_port = -1, TCP_port = -1;
-    char *stream_path = NULL, *datagram_path = NULL;
+    int opt, timeout = 0, UDP_port = -1, TCP_port = -1, num_threads = 1;
+    char *stream_path = NULL, *datagram_path = NULL, *replicate_to = NULL, *replica_of = NULL;
+    char *raft_peer_list = NULL;
+    int raft_node = 0;
     // save_file_path is declared globally for cleanup access
 
     static struct option long_options[] = {
@@ -526,13 +2064,26 @@ int main(int argc, char *argv[]) {
         {"stream-path",  required_argument, 0, 's'},
         {"datagram-path",required_argument, 0, 'd'},
         {"save-file",    required_argument, 0, 'f'}, 
+        {"max-clients",  required_argument, 0, 'm'},
+        {"threads",      required_argument, 0, 'n'},
+        {"dgram-batch",  required_argument, 0, 'b'},
+        {"lock-mode",    required_argument, 0, 'l'},
+        {"catalog",      required_argument, 0, 'r'},
+        {"wal",          no_argument,       0, 'w'},
+        {"wal-window",   required_argument, 0, 'W'},
+        {"durability",   required_argument, 0, 'D'},
+        {"sync-interval",required_argument, 0, 'i'},
+        {"replicate-to", required_argument, 0, 'R'},
+        {"replica-of",   required_argument, 0, 'P'},
+        {"raft-id",      required_argument, 0, 'N'},
+        {"raft-peers",   required_argument, 0, 'C'},
         {0, 0, 0, 0}
     };
 
     // Parse command line arguments
     // Note: Initial stock values are stored in in_memory_stock first
     // If a save file is used, we might overwrite these or use them to initialize a new file
-    while ((opt = getopt_long(argc, argv, "o:c:h:t:T:U:s:d:f:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "o:c:h:t:T:U:s:d:f:m:n:b:l:r:wW:D:i:R:P:N:C:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'o':
             {
@@ -612,70 +2163,170 @@ int main(int argc, char *argv[]) {
             case 'f': 
                 save_file_path = optarg;
                 break;
+            case 'm':
+                {
+                    long v = strtol(optarg, NULL, 10);
+                    if(v <= 0) {
+                        fprintf(stderr, "invalid max-clients\n");
+                        exit(1);
+                    }
+                    max_clients = v;
+                    break;
+                }
+            case 'n':
+                {
+                    long v = strtol(optarg, NULL, 10);
+                    if(v <= 0 || v > MAX_THREADS) {
+                        fprintf(stderr, "invalid threads (1-%d)\n", MAX_THREADS);
+                        exit(1);
+                    }
+                    num_threads = v;
+                    break;
+                }
+            case 'b':
+                {
+                    long v = strtol(optarg, NULL, 10);
+                    if(v <= 0 || v > MAX_DGRAM_BATCH) {
+                        fprintf(stderr, "invalid dgram-batch (1-%d)\n", MAX_DGRAM_BATCH);
+                        exit(1);
+                    }
+                    dgram_batch = v;
+                    break;
+                }
+            case 'l':
+                if (!stock_parse_lock_mode(optarg, &stock_lock_mode)) {
+                    fprintf(stderr, "invalid lock-mode (flock, fcntl, mutex, atomic or sharded)\n");
+                    exit(1);
+                }
+                break;
+            case 'r':
+                // Load the recipe catalog before any thread looks a name up
+                if (registry_load_catalog(optarg) == -1) {
+                    exit(1);
+                }
+                printf("Loaded catalog %s: %d molecules, %d drinks\n", optarg, registry_num_molecules(),
+                       registry_num_drinks());
+                break;
+            case 'w':
+                stock_wal = 1;
+                break;
+            case 'W':
+                {
+                    char *endptr;
+                    long v = strtol(optarg, &endptr, 10);
+                    if (*endptr != '\0' || v < 0 || v > 1000000) {
+                        fprintf(stderr, "invalid wal-window (0-1000000 microseconds)\n");
+                        exit(1);
+                    }
+                    wal_window_us = v;
+                    break;
+                }
+            case 'D':
+                if (!stock_parse_durability(optarg, &stock_durability)) {
+                    fprintf(stderr, "invalid durability (none, periodic or per-op)\n");
+                    exit(1);
+                }
+                break;
+            case 'i':
+                {
+                    char *endptr;
+                    long v = strtol(optarg, &endptr, 10);
+                    if (*endptr != '\0' || v <= 0 || v > 3600000) {
+                        fprintf(stderr, "invalid sync-interval (1-3600000 milliseconds)\n");
+                        exit(1);
+                    }
+                    stock_sync_interval_ms = v;
+                    break;
+                }
+            case 'R':
+                replicate_to = optarg;
+                break;
+            case 'P':
+                replica_of = optarg;
+                break;
+            case 'N':
+                {
+                    char *endptr;
+                    long v = strtol(optarg, &endptr, 10);
+                    if (*endptr != '\0' || v < 1 || v > RAFT_MAX_NODES) {
+                        fprintf(stderr, "invalid raft-id (1-%d)\n", RAFT_MAX_NODES);
+                        exit(1);
+                    }
+                    raft_node = v;
+                    break;
+                }
+            case 'C':
+                raft_peer_list = optarg;
+                break;
             default:
-                fprintf(stderr, "Usage: %s (-T <tcp-port> -U <udp-port>) OR (-s <UDS-stream-path> -d <UDS-datagram-path>) [--oxygen N] [--carbon N] [--hydrogen N] [--timeout SECS] [-f <save-file>]\n", argv[0]);
+                fprintf(stderr, "Usage: %s (-T <tcp-port> -U <udp-port>) OR (-s <UDS-stream-path> -d <UDS-datagram-path>) [--oxygen N] [--carbon N] [--hydrogen N] [--timeout SECS] [-f <save-file>] [--max-clients N] [--threads N] [--dgram-batch N] [--lock-mode flock|fcntl|mutex|atomic|sharded] [--catalog <file>] [--wal [--wal-window USECS]] [--durability none|periodic|per-op] [--sync-interval MS] [--replicate-to <port|path> | --replica-of <host:port|path>] [--raft-id N --raft-peers <host:port,...>]\n", argv[0]);
                 fprintf(stderr, "Note: You must specify either BOTH TCP and UDP ports OR BOTH UDS stream and datagram paths\n");
                 exit(1);
         }
     }
 
-   
-    if (save_file_path != NULL) {
-        printf("Using save file: %s\n", save_file_path);
-        
-        // Open the file for read/write, create it if it doesn't exist
-        // The file descriptor will be used for both mmap and flock operations
-        lock_fd = open(save_file_path, O_RDWR | O_CREAT, 0666);
-        if (lock_fd == -1) {
-            perror("Failed to open or create save file");
+    if (stock_wal && save_file_path == NULL) {
+        fprintf(stderr, "--wal needs a save file (-f); the log is kept next to it\n");
+        exit(1);
+    }
+    if (stock_durability != DURABILITY_NONE && save_file_path == NULL) {
+        fprintf(stderr, "--durability %s needs a save file (-f)\n", stock_durability_name(stock_durability));
+        exit(1);
+    }
+
+    if (replicate_to != NULL || replica_of != NULL) {
+        if (replicate_to != NULL && replica_of != NULL) {
+            fprintf(stderr, "A server is either a primary (--replicate-to) or a standby (--replica-of)\n");
             exit(1);
         }
-
-        // Get file status to check if it's a new or existing file
-        struct stat file_stat;
-        if (fstat(lock_fd, &file_stat) == -1) {
-            perror("fstat");
-            close(lock_fd);
+        if (save_file_path == NULL) {
+            fprintf(stderr, "Replication needs a save file (-f)\n");
             exit(1);
         }
+        // Updates are replicated in the order the exclusive lock gives them
+        if (stock_lock_mode != LOCK_MODE_FLOCK && stock_lock_mode != LOCK_MODE_FCNTL &&
+            stock_lock_mode != LOCK_MODE_MUTEX) {
+            fprintf(stderr, "Replication needs a locked --lock-mode (flock, fcntl or mutex)\n");
+            exit(1);
+        }
+        if (replica_of != NULL && stock_wal) {
+            fprintf(stderr, "A standby takes its stock from the primary; run it without --wal\n");
+            exit(1);
+        }
+        // Updates of another process on the same file would not be replicated
+        stock_exclusive = 1;
+    }
 
-        // Check if the file is new (size is 0)
-        if (file_stat.st_size == 0) {
-            printf("Save file is new. Initializing with provided stock values.\n");
-            
-            // Expand the new file to the size of our struct
-            if (ftruncate(lock_fd, sizeof(AtomStock)) == -1) {
-                perror("ftruncate");
-                close(lock_fd);
-                exit(1);
-            }
-
-            // Map the new file to memory with read/write permissions
-            // MAP_SHARED ensures changes are visible to other processes
-            stock_ptr = mmap(NULL, sizeof(AtomStock), PROT_READ | PROT_WRITE, MAP_SHARED, lock_fd, 0);
-            if (stock_ptr == MAP_FAILED) {
-                perror("mmap failed on new file");
-                close(lock_fd);
-                exit(1);
-            }
-            
-            // Initialize the memory-mapped stock with values from command line
-            *stock_ptr = in_memory_stock;
-
-        } else {
-            printf("Loading stock from existing save file. Ignoring command-line stock values.\n");
-            
-            // Map the existing file to memory
-            stock_ptr = mmap(NULL, sizeof(AtomStock), PROT_READ | PROT_WRITE, MAP_SHARED, lock_fd, 0);
-            if (stock_ptr == MAP_FAILED) {
-                perror("mmap failed on existing file");
-                close(lock_fd);
-                exit(1);
-            }
+    if (raft_node != 0 || raft_peer_list != NULL) {
+        if (raft_node == 0 || raft_peer_list == NULL) {
+            fprintf(stderr, "A Raft node needs both --raft-id and --raft-peers\n");
+            exit(1);
+        }
+        if (save_file_path == NULL) {
+            fprintf(stderr, "A Raft node needs a save file (-f); its log is kept next to it\n");
+            exit(1);
+        }
+        if (stock_lock_mode != LOCK_MODE_FLOCK && stock_lock_mode != LOCK_MODE_FCNTL &&
+            stock_lock_mode != LOCK_MODE_MUTEX) {
+            fprintf(stderr, "A Raft node needs a locked --lock-mode (flock, fcntl or mutex)\n");
+            exit(1);
+        }
+        if (stock_wal || replicate_to != NULL || replica_of != NULL) {
+            fprintf(stderr, "The Raft log replaces --wal and replication; run the node without them\n");
+            exit(1);
         }
+        // Every node applies the log to a save file of its own
+        stock_exclusive = 1;
     }
 
-    
+    // Map the stock from the save file if one was given
+    if (save_file_path != NULL && stock_open_save_file(save_file_path) == -1) {
+        exit(1);
+    }
+    if (replicate_to != NULL && replication_start_primary(replicate_to) == -1) exit(1);
+    if (replica_of != NULL && replication_start_standby(replica_of) == -1) exit(1);
+    if (raft_node != 0 && raft_start(raft_node, raft_peer_list, save_file_path) == -1) exit(1);
+
     // Check that either both TCP and UDP are provided OR both UDS stream and datagram are provided
     if (!((TCP_port != -1 && UDP_port != -1) || 
           (stream_path != NULL && datagram_path != NULL))) {
@@ -687,62 +2338,31 @@ int main(int argc, char *argv[]) {
     }
 
     
-    int tcp_sock = -1, udp_sock = -1, uds_stream_sock = -1, uds_dgram_sock = -1;
-    struct sockaddr_in tcp_addr, udp_addr;
     struct sockaddr_un uds_stream_addr, uds_dgram_addr;
-    char buffer[BUFFER_SIZE];
+    static Worker workers[MAX_THREADS];
+
+    // Make room for max_clients connections plus the server's own descriptors
+    raise_fd_limit((rlim_t)max_clients + 16 + 2 * num_threads);
 
     // TCP/UDP mode
     if (TCP_port != -1 && UDP_port != -1) {
-        // Create and configure TCP socket
-        if ((tcp_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-            perror("TCP socket creation failed");
-            exit(1);
-        }
-        
-        // Configure TCP socket address
-        memset(&tcp_addr, 0, sizeof(tcp_addr));
-        tcp_addr.sin_family = AF_INET;
-        tcp_addr.sin_addr.s_addr = INADDR_ANY;  // Listen on all available interfaces
-        tcp_addr.sin_port = htons(TCP_port);    // Set the TCP port
-        
-        // Bind TCP socket
-        if (bind(tcp_sock, (struct sockaddr*)&tcp_addr, sizeof(tcp_addr)) < 0) {
-            perror("TCP bind failed");
-            // Clean up resources before exit
-            close(tcp_sock);
-            exit(1);
-        }
-        
-        // Create and configure UDP socket
-        if ((udp_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-            perror("UDP socket creation failed");
-            // Clean up resources before exit
-            close(tcp_sock);
-            exit(1);
-        }
-        
-        // Configure UDP socket address
-        memset(&udp_addr, 0, sizeof(udp_addr));
-        udp_addr.sin_family = AF_INET;
-        udp_addr.sin_addr.s_addr = INADDR_ANY;  // Listen on all available interfaces
-        udp_addr.sin_port = htons(UDP_port);    // Set the UDP port
-        
-        // Bind UDP socket
-        if (bind(udp_sock, (struct sockaddr*)&udp_addr, sizeof(udp_addr)) < 0) {
-            perror("UDP bind failed");
-            // Clean up resources before exit
-            close(tcp_sock);
-            close(udp_sock);
-            exit(1);
+        // Every reactor thread gets its own TCP listener and UDP socket on the same ports
+        // SO_REUSEPORT is only needed (and only set) when there is more than one
+        for (int i = 0; i < num_threads; i++) {
+            workers[i].tcp_sock = open_inet_socket(SOCK_STREAM, TCP_port, num_threads > 1);
+            if (workers[i].tcp_sock == -1) exit(1);
+            workers[i].udp_sock = open_inet_socket(SOCK_DGRAM, UDP_port, num_threads > 1);
+            if (workers[i].udp_sock == -1) exit(1);
         }
+        tcp_sock = workers[0].tcp_sock;
+        udp_sock = workers[0].udp_sock;
         
         printf("TCP/UDP mode initialized successfully\n");
     }
     // UDS mode
     else if (stream_path != NULL && datagram_path != NULL) {
         // Create and configure UDS stream socket
-        if ((uds_stream_sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        if ((uds_stream_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
             perror("UDS stream socket creation failed");
             exit(1);
         }
@@ -764,7 +2384,7 @@ int main(int argc, char *argv[]) {
         }
         
         // Create and configure UDS datagram socket
-        if ((uds_dgram_sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+        if ((uds_dgram_sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
             perror("UDS datagram socket creation failed");
             // Clean up resources before exit
             close(uds_stream_sock);
@@ -790,23 +2410,17 @@ int main(int argc, char *argv[]) {
             exit(1);
         }
         
-        printf("UDS mode initialized successfully\n");
-    }
-    
-    // Set TCP socket to listen mode with a backlog of 10 connections if in TCP/UDP mode
-    if (tcp_sock != -1) {
-        if (listen(tcp_sock, 10) < 0) {
-            perror("TCP listen failed");
-            // Clean up resources before exit
-            close(tcp_sock);
-            close(udp_sock);
-            exit(1);
+        for (int i = 0; i < num_threads; i++) {
+            workers[i].tcp_sock = -1;
+            workers[i].udp_sock = -1;
         }
+        
+        printf("UDS mode initialized successfully\n");
     }
     
-    // Set UDS stream socket to listen mode with a backlog of 10 connections if in UDS mode
+    // Set UDS stream socket to listen mode if in UDS mode
     if (uds_stream_sock != -1) {
-        if (listen(uds_stream_sock, 10) < 0) {
+        if (listen(uds_stream_sock, SOMAXCONN) < 0) {
             perror("UDS stream listen failed");
             // Clean up resources before exit
             close(uds_stream_sock);
@@ -824,36 +2438,59 @@ int main(int argc, char *argv[]) {
     if (stream_path != NULL) printf(", UDS stream on %s", stream_path);
     if (datagram_path != NULL) printf(", UDS datagram on %s", datagram_path);
     printf("\n");
-    printf("Console commands: GEN SOFT DRINK / GEN VODKA / GEN CHAMPAGNE\n");
+    printf("Console commands: GEN SOFT DRINK / GEN VODKA / GEN CHAMPAGNE / GEN ALL / STATS / SNAPSHOT\n");
     printf("Type exit/quit to exit\n");
     
     print_stock();
 
-    // Initialize file descriptor sets for select()
-    fd_set readfds, master_set;
-    FD_ZERO(&master_set);
-    FD_SET(STDIN_FILENO, &master_set);  // Add stdin to monitoring set for console input
-    int maxfd = STDIN_FILENO;  // Start with stdin
-   
-    // Add all active sockets to monitoring set
-    if (tcp_sock != -1) {
-        FD_SET(tcp_sock, &master_set);
-        maxfd = (tcp_sock > maxfd) ? tcp_sock : maxfd;
-    }
-    
-    if (udp_sock != -1) {
-        FD_SET(udp_sock, &master_set);
-        maxfd = (udp_sock > maxfd) ? udp_sock : maxfd;
+    if (num_threads > 1) printf("Running %d reactor threads\n", num_threads);
+
+    // Register every listening/datagram socket with the handler of its worker
+    for (int i = 0; i < num_threads; i++) {
+        Worker *w = &workers[i];
+        w->id = i;
+        if (loop_init(&w->loop) == -1) exit(1);
+
+        if (w->tcp_sock != -1 && loop_add(&w->loop, w->tcp_sock, EV_READ, handle_stream_listener, NULL) == -1) {
+            perror("watch TCP socket");
+            exit(1);
+        }
+        if (w->udp_sock != -1 && loop_add(&w->loop, w->udp_sock, EV_READ, handle_dgram, NULL) == -1) {
+            perror("watch UDP socket");
+            exit(1);
+        }
+        // UDS sockets cannot use SO_REUSEPORT, so every worker watches the same
+        // pair and EV_EXCLUSIVE wakes only one of them per connection/datagram
+        if (uds_stream_sock != -1 && loop_add(&w->loop, uds_stream_sock, EV_READ | EV_EXCLUSIVE, handle_stream_listener, NULL) == -1) {
+            perror("watch UDS stream socket");
+            exit(1);
+        }
+        if (uds_dgram_sock != -1 && loop_add(&w->loop, uds_dgram_sock, EV_READ | EV_EXCLUSIVE, handle_dgram, NULL) == -1) {
+            perror("watch UDS datagram socket");
+            exit(1);
+        }
     }
-    
-    if (uds_stream_sock != -1) {
-        FD_SET(uds_stream_sock, &master_set);
-        maxfd = (uds_stream_sock > maxfd) ? uds_stream_sock : maxfd;
+
+    // With --wal or --raft-id every loop gets a CommitQueue, woken by the log's
+    // sync thread or by the Raft apply thread
+    for (int i = 0; i < num_threads && (wal_enabled() || raft_enabled()); i++) {
+        static struct CommitQueue queues[MAX_THREADS];
+        struct CommitQueue *queue = &queues[i];
+        queue->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        queue->streams = NULL;
+        queue->dgrams = NULL;
+        queue->dgrams_tail = &queue->dgrams;
+        if (queue->efd == -1 || loop_add(&workers[i].loop, queue->efd, EV_READ, handle_commit, NULL) == -1) {
+            perror("eventfd");
+            exit(1);
+        }
+        workers[i].loop.commits = queue;
     }
-    
-    if (uds_dgram_sock != -1) {
-        FD_SET(uds_dgram_sock, &master_set);
-        maxfd = (uds_dgram_sock > maxfd) ? uds_dgram_sock : maxfd;
+
+    // The console is handled by the main thread (worker 0) only
+    // stdin may be a regular file or /dev/null, which epoll refuses; run without a console then
+    if (loop_add(&workers[0].loop, STDIN_FILENO, EV_READ, handle_console, NULL) == -1) {
+        printf("Console input is not pollable; running without console commands\n");
     }
 
     // Store UDS paths in global variables for signal handler cleanup
@@ -861,146 +2498,23 @@ int main(int argc, char *argv[]) {
     global_datagram_path = datagram_path;
     
     // If timeout is set, configure signal handler
+    inactivity_timeout = timeout;
     if (timeout > 0) {
         signal(SIGALRM, handle_alarm); 
         printf("Server will automatically shut down after %d seconds of inactivity\n", timeout);
     }
-    
-    // Main server loop
-    while (1) {
-        // Make a copy of the master set for select()
-        readfds = master_set;
 
-        // Set alarm only if timeout is defined
-        if (timeout > 0) {
-            alarm(timeout);  // Set alarm to trigger after timeout seconds of inactivity
-        }
-        
-        // Wait for activity on any of the sockets (including stdin)
-        if (select(maxfd + 1, &readfds, NULL, NULL, NULL) == -1) {
-            // Check if the error was caused by the signal interrupt
-            if (errno == EINTR) {
-                continue;  // If interrupted by signal, just continue the loop
-            }
-            perror("select");
+    // Start reactor threads 1..N-1; the main thread runs worker 0
+    for (int i = 1; i < num_threads; i++) {
+        int rc = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
             exit(1);
         }
-        
-        // Activity detected, cancel the alarm
-        if (timeout > 0) {
-            alarm(0);  // Cancel the alarm since we had activity
-        }
-        
-        // Check all file descriptors for activity
-        for (int i = 0; i <= maxfd; i++) {
-            if (FD_ISSET(i, &readfds)) {
-                // ===== TCP CONNECTION HANDLING =====
-                if (tcp_sock != -1 && i == tcp_sock) {
-                    // New TCP client connection
-                    struct sockaddr_in client_addr;
-                    socklen_t addrlen = sizeof(client_addr);
-                    int new_fd = accept(tcp_sock, (struct sockaddr*)&client_addr, &addrlen);
-                    if (new_fd == -1) {
-                        perror("TCP accept");
-                    } else if (connected_clients >= MAX_CLIENTS) {
-                        printf("TCP connection rejected: maximum clients limit reached\n");
-                        close(new_fd);
-                    } else {
-                        // Add new client to the monitoring set
-                        FD_SET(new_fd, &master_set);
-                        if (new_fd > maxfd) maxfd = new_fd;
-                        connected_clients++;
-                        printf("New TCP client connected (total: %d)\n", connected_clients);
-                    }
-                } 
-                // ===== UDS STREAM CONNECTION HANDLING =====
-                else if (uds_stream_sock != -1 && i == uds_stream_sock) {
-                    // New UDS stream client connection
-                    struct sockaddr_un client_addr;
-                    socklen_t addrlen = sizeof(client_addr);
-                    int new_fd = accept(uds_stream_sock, (struct sockaddr*)&client_addr, &addrlen);
-                    if (new_fd == -1) {
-                        perror("UDS stream accept");
-                    } else if (connected_clients >= MAX_CLIENTS) {
-                        printf("UDS stream connection rejected: maximum clients limit reached\n");
-                        close(new_fd);
-                    } else {
-                        // Add new client to the monitoring set
-                        FD_SET(new_fd, &master_set);
-                        if (new_fd > maxfd) maxfd = new_fd;
-                        connected_clients++;
-                        printf("New UDS stream client connected (total: %d)\n", connected_clients);
-                    }
-                }
-                // ===== UDP DATAGRAM HANDLING =====
-                else if (udp_sock != -1 && i == udp_sock) {
-                    // UDP datagram received
-                    struct sockaddr_in client_addr;
-                    socklen_t addrlen = sizeof(client_addr);
-                    int n = recvfrom(udp_sock, buffer, sizeof(buffer), 0,
-                                    (struct sockaddr*)&client_addr, &addrlen);
-                    if (n < 0) {
-                        perror("UDP recvfrom");
-                    } else {
-                        buffer[n] = '\0';  // Null-terminate the received data
-                        process_udp_command(buffer, stock_ptr, udp_sock, (struct sockaddr*)&client_addr, addrlen);
-                    }
-                }
-                // ===== UDS DATAGRAM HANDLING =====
-                else if (uds_dgram_sock != -1 && i == uds_dgram_sock) {
-                    // UDS datagram received
-                    struct sockaddr_un client_addr;
-                    socklen_t addrlen = sizeof(client_addr);
-                    int n = recvfrom(uds_dgram_sock, buffer, sizeof(buffer), 0,
-                                    (struct sockaddr*)&client_addr, &addrlen);
-                    if (n < 0) {
-                        perror("UDS datagram recvfrom");
-                    } else {
-                        buffer[n] = '\0';  // Null-terminate the received data
-                        process_udp_command(buffer, stock_ptr, uds_dgram_sock, (struct sockaddr*)&client_addr, addrlen);
-                    }
-                } 
-                // ===== CONSOLE INPUT HANDLING =====
-                else if (i == STDIN_FILENO) {
-                    if (fgets(buffer, sizeof(buffer), stdin) != NULL) {
-                        size_t len = strlen(buffer);
-                        if (len > 0 && buffer[len-1] == '\n') buffer[len-1] = '\0';  // Remove newline
-                        
-                        // Handle exit commands
-                        if (strcmp(buffer, "exit") == 0 || strcmp(buffer, "quit") == 0) {
-                            printf("Exiting...\n");
-                            if (lock_fd != -1) close(lock_fd);
-                            if (tcp_sock != -1) close(tcp_sock);
-                            if (udp_sock != -1) close(udp_sock);
-                            if (uds_stream_sock != -1) { 
-                                close(uds_stream_sock); 
-                                if (stream_path != NULL) unlink(stream_path); 
-                            }
-                            if (uds_dgram_sock != -1) { 
-                                close(uds_dgram_sock); 
-                                if (datagram_path != NULL) unlink(datagram_path); 
-                            }
-                            exit(0);
-                        }
-                        process_console_command(buffer, stock_ptr);
-                    }
-                }
-                // ===== EXISTING CLIENT CONNECTION HANDLING =====
-                else if (i != STDIN_FILENO) {
-                    // Data received from an existing TCP or UDS stream client
-                    ssize_t n = recv(i, buffer, sizeof(buffer) - 1, 0);
-                    if (n <= 0) {
-                        // Client disconnected or error occurred
-                        close(i);
-                        FD_CLR(i, &master_set);
-                        connected_clients--;
-                        printf("Client disconnected (remaining: %d)\n", connected_clients);
-                    } else {
-                        buffer[n] = '\0';  // Null-terminate the received data
-                        process_tcp_command(buffer, stock_ptr, i);
-                    }
-                }
-            }
-        }
     }
-}
\ No newline at end of file
+    
+    // Main server loop
+    run_event_loop(&workers[0].loop);
+    return 0;
+}
+#endif
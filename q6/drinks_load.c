@@ -0,0 +1,902 @@
+/*
+ * drinks_load - מחולל עומס לשרתי המחסן
+ * -------------------------------------
+ * מדמה לקוחות רבים במקביל שמוסיפים אטומים (ADD בחיבור stream, TCP או UDS)
+ * ומבקשים מולקולות (DELIVER ב-datagram, UDP או UDS), ומודד תפוקה וזמני תגובה:
+ * - לולאה סגורה (ברירת מחדל): כל לקוח שולח בקשה חדשה מיד כשהתשובה הקודמת
+ *   מגיעה (עד --pipeline בקשות פתוחות)
+ * - לולאה פתוחה (--rate): הבקשות מתוזמנות בתהליך פואסון בקצב הכולל הנתון,
+ *   בלי קשר לקצב התשובות. זמן התגובה נמדד מהרגע שבו הבקשה הייתה אמורה
+ *   להישלח ולא מהרגע שבו נשלחה (תיקון coordinated omission): שרת שנתקע לא
+ *   "מסתיר" את הבקשות שלא נשלחו בזמן ההיתקעות. הזמן הלא מתוקן מודפס להשוואה
+ * - התמהיל: --add-percent קובע את חלק ה-ADD; המולקולות נבחרות באחידות או
+ *   בהתפלגות Zipf (--zipf), לפי הסדר ברישום (מולקולה 1 היא הנפוצה ביותר),
+ *   כולל מתכונים מקטלוג (--catalog)
+ * - כל תהליכון מטפל בקבוצת לקוחות בלולאת epoll, עם timerfd לבקשה המתוזמנת
+ *   הבאה; כל תהליכון אוסף היסטוגרמה משלו, והן מאוחדות בסוף
+ * - תשובה שמתחילה ב-"added" או ב-"Molecule delivered" היא הצלחה, וכל תשובה
+ *   אחרת היא שגיאה; בקשה שלא נענתה תוך --timeout נספרת כאבודה
+ * עם --pipeline 1 (ברירת המחדל) הכלי עובד מול כל דורות השרת (q1-q6); עומק
+ * גדול יותר מתאים ל-drinks_bar של q6, שמפריד פקודות לפי שורות.
+ * --json מדפיס במקום הטבלה שורת JSON אחת, לתוכניות שאוספות תוצאות
+ * (bench/bench_matrix.c).
+ *
+ * Usage:
+ * ./drinks_load (-T <tcp-port> | -s <UDS-stream-path>) (-U <udp-port> | -d <UDS-datagram-path>) [-h host]
+ *               [--clients N] [--threads N] [--duration SECS] [--rate OPS] [--pipeline N]
+ *               [--add-percent P] [--zipf S] [--add-amount N] [--deliver-amount N]
+ *               [--timeout MS] [--catalog <file>] [--json]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include "latency.h"
+#include "registry.h"
+
+#define LOAD_ADD 0
+#define LOAD_DELIVER 1
+#define LOAD_OPS 2
+
+#define MAX_THREADS 64
+#define MAX_PIPELINE 1024
+#define MAX_EVENTS 64
+#define BUFFER_SIZE 1024
+#define MAX_CLIENTS 10000
+#define RETRY_NS (10 * 1000000ULL)         // Closed loop: wait before reconnecting after a failure
+
+#define SUB_BITS 5                          // 32 sub-buckets per power of two: values within about 3%
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define FINE_BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+/**
+ * Latency histogram with 32 linear sub-buckets per power of two
+ * (latency.h keeps only powers of two, too coarse for p99.9 of one run)
+ */
+typedef struct {
+    unsigned long long buckets[FINE_BUCKETS];
+    unsigned long long count;
+    unsigned long long max_ns;
+} FineHistogram;
+
+/**
+ * Counters of one operation type
+ */
+typedef struct {
+    unsigned long long sent;
+    unsigned long long ok;        // Replies that report success
+    unsigned long long errors;    // Error replies and failed sends
+    unsigned long long timeouts;  // Requests without a reply within --timeout
+    FineHistogram corrected;      // From the time the schedule meant to send the request
+    FineHistogram uncorrected;    // From the time it was actually sent
+} OpStats;
+
+/**
+ * A request waiting for its reply
+ */
+typedef struct {
+    unsigned long long intended_ns;  // When the schedule meant to send it (closed loop: when it was sent)
+    unsigned long long sent_ns;      // When it was sent
+} Pending;
+
+/**
+ * One socket of a simulated client: the stream for ADD or the datagram socket for DELIVER
+ * Replies come back in request order, so they are matched first in, first out
+ */
+typedef struct {
+    int fd;                          // -1 until first used, or after a failure
+    int op;                          // LOAD_ADD or LOAD_DELIVER
+    Pending *ring;                   // --pipeline slots
+    unsigned int head;
+    unsigned int count;
+    char buffer[BUFFER_SIZE];        // Stream: received bytes not yet split into lines
+    size_t len;
+    char local_path[108];            // UDS datagram: the path replies are sent to
+} Channel;
+
+/**
+ * A simulated client
+ */
+typedef struct {
+    Channel channels[LOAD_OPS];
+    unsigned long long next_ns;  // Open loop: intended time of the next request; closed loop: no request before
+} SimClient;
+
+/**
+ * A thread and the clients it drives
+ */
+typedef struct {
+    pthread_t thread;
+    int index;
+    SimClient *clients;
+    int num_clients;
+    uint64_t rng;
+    OpStats stats[LOAD_OPS];
+} Worker;
+
+// Settings (command line)
+static const char *host = "127.0.0.1";
+static int tcp_port = -1, udp_port = -1;
+static const char *stream_path = NULL, *datagram_path = NULL;
+static int num_clients = 16, num_threads = 4, duration_s = 10, pipeline = 1, add_percent = 50;
+static double rate = 0;  // Requests per second of all clients; 0 runs a closed loop
+static double zipf_s = 0;
+static unsigned int add_amount = 10, deliver_amount = 1;
+static unsigned long long timeout_ns = 1000ULL * 1000000ULL;
+static int json_output = 0;
+
+static struct sockaddr_storage stream_addr, datagram_addr;
+static socklen_t stream_addr_len, datagram_addr_len;
+static double *molecule_cdf = NULL;  // Cumulative probability of molecule ids 0..i
+static int num_molecules = 0;
+static unsigned long long start_ns, end_ns;
+
+static const char *op_names[LOAD_OPS] = {"ADD", "DELIVER"};
+
+/* ===== HISTOGRAMS ===== */
+
+/**
+ * Returns the bucket of a duration
+ */
+static int fine_index(unsigned long long ns) {
+    if (ns < SUB_BUCKETS) return (int)ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int group = msb - SUB_BITS + 1;
+    return (group << SUB_BITS) | (int)((ns >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/**
+ * Returns the largest duration that falls in a bucket
+ */
+static unsigned long long fine_upper(int index) {
+    int group = index >> SUB_BITS, sub = index & (SUB_BUCKETS - 1);
+    if (group == 0) return sub;
+    unsigned long long width = 1ULL << (group - 1);
+    return ((unsigned long long)(SUB_BUCKETS + sub) << (group - 1)) + width - 1;
+}
+
+/**
+ * Adds one duration to a histogram (owned by one thread)
+ */
+static void fine_record(FineHistogram *hist, unsigned long long ns) {
+    hist->buckets[fine_index(ns)]++;
+    hist->count++;
+    if (ns > hist->max_ns) hist->max_ns = ns;
+}
+
+/**
+ * Adds the counts of one histogram to another
+ */
+static void fine_merge(FineHistogram *into, const FineHistogram *from) {
+    for (int i = 0; i < FINE_BUCKETS; i++) into->buckets[i] += from->buckets[i];
+    into->count += from->count;
+    if (from->max_ns > into->max_ns) into->max_ns = from->max_ns;
+}
+
+/**
+ * Returns a percentile of a histogram (upper bound of its bucket, at most the maximum)
+ *
+ * @param percent  Percentile, 0-100
+ * @return         Duration in nanoseconds (0 if the histogram is empty)
+ */
+static unsigned long long fine_percentile(const FineHistogram *hist, double percent) {
+    unsigned long long rank = (unsigned long long)ceil(hist->count * percent / 100.0), seen = 0;
+    if (hist->count == 0) return 0;
+    if (rank == 0) rank = 1;
+    for (int i = 0; i < FINE_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) return fine_upper(i) < hist->max_ns ? fine_upper(i) : hist->max_ns;
+    }
+    return hist->max_ns;
+}
+
+/* ===== WORKLOAD ===== */
+
+/**
+ * Returns the next value of a thread's xorshift64* generator
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Returns a uniform double in (0, 1]
+ */
+static double next_uniform(uint64_t *state) {
+    return ((next_random(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Returns the gap to the next request of one client in a Poisson process
+ * of rate / num_clients requests per second
+ */
+static unsigned long long next_gap_ns(uint64_t *state) {
+    return (unsigned long long)(-log(next_uniform(state)) * 1e9 * num_clients / rate);
+}
+
+/**
+ * Builds the molecule distribution: uniform, or Zipf with exponent zipf_s by registry order
+ *
+ * @return  0 on success, -1 on failure (error already printed)
+ */
+static int build_molecule_cdf() {
+    double total = 0;
+
+    num_molecules = registry_num_molecules();
+    molecule_cdf = malloc(num_molecules * sizeof(double));
+    if (molecule_cdf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (int i = 0; i < num_molecules; i++) {
+        total += 1.0 / pow(i + 1, zipf_s);
+        molecule_cdf[i] = total;
+    }
+    for (int i = 0; i < num_molecules; i++) molecule_cdf[i] /= total;
+    return 0;
+}
+
+/**
+ * Draws a molecule id from the distribution
+ */
+static int pick_molecule(uint64_t *state) {
+    double u = next_uniform(state);
+    int low = 0, high = num_molecules - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (molecule_cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * Writes the next command line of a client
+ *
+ * @param op  Receives LOAD_ADD or LOAD_DELIVER
+ * @return    Length of the command
+ */
+static size_t build_command(uint64_t *state, char *cmd, size_t cmd_size, int *op) {
+    int len;
+    if ((int)(next_random(state) % 100) < add_percent) {
+        *op = LOAD_ADD;
+        len = snprintf(cmd, cmd_size, "ADD %s %u\n", registry_element_name(next_random(state) % NUM_ELEMENTS),
+                       add_amount);
+    } else {
+        *op = LOAD_DELIVER;
+        len = snprintf(cmd, cmd_size, "DELIVER %s %u\n", registry_molecule_name(pick_molecule(state)),
+                       deliver_amount);
+    }
+    return (len < 0) ? 0 : ((size_t)len < cmd_size ? (size_t)len : cmd_size - 1);
+}
+
+/* ===== CONNECTIONS ===== */
+
+/**
+ * Resolves the server endpoints given on the command line
+ *
+ * @return  0 on success, -1 on failure (error already printed)
+ */
+static int resolve_endpoints() {
+    struct addrinfo hints, *result;
+    char port[16];
+
+    if (stream_path != NULL) {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&stream_addr;
+        addr->sun_family = AF_UNIX;
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", stream_path);
+        stream_addr_len = sizeof(*addr);
+    } else if (tcp_port != -1) {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(port, sizeof(port), "%d", tcp_port);
+        int rc = getaddrinfo(host, port, &hints, &result);
+        if (rc != 0) {
+            fprintf(stderr, "%s: %s\n", host, gai_strerror(rc));
+            return -1;
+        }
+        memcpy(&stream_addr, result->ai_addr, result->ai_addrlen);
+        stream_addr_len = result->ai_addrlen;
+        freeaddrinfo(result);
+    }
+
+    if (datagram_path != NULL) {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&datagram_addr;
+        addr->sun_family = AF_UNIX;
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", datagram_path);
+        datagram_addr_len = sizeof(*addr);
+    } else if (udp_port != -1) {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        snprintf(port, sizeof(port), "%d", udp_port);
+        int rc = getaddrinfo(host, port, &hints, &result);
+        if (rc != 0) {
+            fprintf(stderr, "%s: %s\n", host, gai_strerror(rc));
+            return -1;
+        }
+        memcpy(&datagram_addr, result->ai_addr, result->ai_addrlen);
+        datagram_addr_len = result->ai_addrlen;
+        freeaddrinfo(result);
+    }
+    return 0;
+}
+
+/**
+ * Opens the socket of a channel and watches it for replies
+ * A UDS datagram socket is bound to its own path so the server can answer
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int open_channel(Channel *chan, int epoll_fd, int worker, int client) {
+    struct epoll_event ev;
+    int one = 1;
+
+    if (chan->op == LOAD_ADD) {
+        chan->fd = socket(stream_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (chan->fd == -1) return -1;
+        if (stream_addr.ss_family == AF_INET) setsockopt(chan->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(chan->fd, (struct sockaddr *)&stream_addr, stream_addr_len) == -1) goto fail;
+    } else {
+        chan->fd = socket(datagram_addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (chan->fd == -1) return -1;
+        if (datagram_addr.ss_family == AF_UNIX) {
+            struct sockaddr_un local;
+            memset(&local, 0, sizeof(local));
+            local.sun_family = AF_UNIX;
+            snprintf(local.sun_path, sizeof(local.sun_path), "/tmp/drinks_load_%d_%d_%d", (int)getpid(), worker,
+                     client);
+            unlink(local.sun_path);
+            if (bind(chan->fd, (struct sockaddr *)&local, sizeof(local)) == -1) goto fail;
+            snprintf(chan->local_path, sizeof(chan->local_path), "%s", local.sun_path);
+        }
+        if (connect(chan->fd, (struct sockaddr *)&datagram_addr, datagram_addr_len) == -1) goto fail;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = chan;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, chan->fd, &ev) == -1) goto fail;
+    chan->head = chan->count = 0;
+    chan->len = 0;
+    return 0;
+
+fail:
+    close(chan->fd);
+    chan->fd = -1;
+    if (chan->local_path[0] != '\0') {
+        unlink(chan->local_path);
+        chan->local_path[0] = '\0';
+    }
+    return -1;
+}
+
+/**
+ * Closes the socket of a channel; its outstanding requests count as timed out
+ */
+static void close_channel(Channel *chan, OpStats *stats) {
+    if (chan->fd == -1) return;
+    close(chan->fd);  // Also removes it from the epoll set
+    chan->fd = -1;
+    if (chan->local_path[0] != '\0') {
+        unlink(chan->local_path);
+        chan->local_path[0] = '\0';
+    }
+    stats->timeouts += chan->count;
+    chan->head = chan->count = 0;
+    chan->len = 0;
+}
+
+/* ===== WORKER ===== */
+
+/**
+ * Returns the requests of a client that have not been answered
+ */
+static unsigned int outstanding(const SimClient *client) {
+    return client->channels[LOAD_ADD].count + client->channels[LOAD_DELIVER].count;
+}
+
+/**
+ * Sends one request of a client
+ *
+ * @param intended_ns  Time the schedule meant to send it
+ * @return             0 if the request was sent, -1 if it failed
+ */
+static int send_request(Worker *w, SimClient *client, int epoll_fd, unsigned long long intended_ns) {
+    char cmd[BUFFER_SIZE];
+    int op;
+    size_t len = build_command(&w->rng, cmd, sizeof(cmd), &op);
+    Channel *chan = &client->channels[op];
+    OpStats *stats = &w->stats[op];
+
+    stats->sent++;
+    if (chan->fd == -1 && open_channel(chan, epoll_fd, w->index, (int)(client - w->clients)) == -1) {
+        stats->errors++;
+        return -1;
+    }
+    unsigned long long now = latency_now_ns();
+    if (send(chan->fd, cmd, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        stats->errors++;
+        if (op == LOAD_ADD) close_channel(chan, stats);
+        return -1;
+    }
+    Pending *pending = &chan->ring[(chan->head + chan->count) % pipeline];
+    pending->intended_ns = intended_ns;
+    pending->sent_ns = now;
+    chan->count++;
+    return 0;
+}
+
+/**
+ * Matches one reply with the oldest outstanding request of its channel
+ */
+static void complete_request(Worker *w, Channel *chan, const char *reply, unsigned long long now) {
+    OpStats *stats = &w->stats[chan->op];
+    if (chan->count == 0) return;  // Late reply of a request already counted as timed out
+
+    Pending *pending = &chan->ring[chan->head];
+    chan->head = (chan->head + 1) % pipeline;
+    chan->count--;
+    if (strncmp(reply, "added", 5) == 0 || strncmp(reply, "Molecule delivered", 18) == 0) {
+        stats->ok++;
+    } else {
+        stats->errors++;
+    }
+    fine_record(&stats->corrected, now - pending->intended_ns);
+    fine_record(&stats->uncorrected, now - pending->sent_ns);
+}
+
+/**
+ * Reads the replies waiting on a channel
+ */
+static void read_replies(Worker *w, Channel *chan) {
+    char datagram[BUFFER_SIZE];
+
+    while (chan->fd != -1) {
+        unsigned long long now;
+        if (chan->op == LOAD_DELIVER) {
+            ssize_t n = recv(chan->fd, datagram, sizeof(datagram) - 1, MSG_DONTWAIT);
+            if (n < 0) {
+                // A refused datagram (nobody on the port) fails the request it answers
+                if (errno == ECONNREFUSED && chan->count > 0) {
+                    chan->head = (chan->head + 1) % pipeline;
+                    chan->count--;
+                    w->stats[LOAD_DELIVER].errors++;
+                    continue;
+                }
+                return;
+            }
+            datagram[n] = '\0';
+            complete_request(w, chan, datagram, latency_now_ns());
+            continue;
+        }
+
+        ssize_t n = recv(chan->fd, chan->buffer + chan->len, sizeof(chan->buffer) - 1 - chan->len, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            close_channel(chan, &w->stats[LOAD_ADD]);
+            return;
+        }
+        if (n < 0) return;
+        now = latency_now_ns();
+        chan->len += n;
+        chan->buffer[chan->len] = '\0';
+
+        // One reply per line
+        char *line = chan->buffer, *newline;
+        while ((newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+            complete_request(w, chan, line, now);
+            line = newline + 1;
+        }
+        chan->len -= line - chan->buffer;
+        memmove(chan->buffer, line, chan->len);
+        if (chan->len == sizeof(chan->buffer) - 1) chan->len = 0;  // A reply longer than the buffer
+    }
+}
+
+/**
+ * Counts the requests that waited longer than --timeout
+ * A datagram reply may be lost, so only that request is dropped; a stream
+ * that stops answering is closed, since later replies would be mismatched
+ *
+ * @return  Earliest time another request can time out, ULLONG_MAX if none is outstanding
+ */
+static unsigned long long expire_requests(Worker *w, unsigned long long now) {
+    unsigned long long earliest = ULLONG_MAX;
+    for (int i = 0; i < w->num_clients; i++) {
+        for (int op = 0; op < LOAD_OPS; op++) {
+            Channel *chan = &w->clients[i].channels[op];
+            while (chan->count > 0 && now - chan->ring[chan->head].sent_ns >= timeout_ns) {
+                if (op == LOAD_ADD) {
+                    close_channel(chan, &w->stats[op]);
+                } else {
+                    chan->head = (chan->head + 1) % pipeline;
+                    chan->count--;
+                    w->stats[op].timeouts++;
+                }
+            }
+            if (chan->count > 0 && chan->ring[chan->head].sent_ns + timeout_ns < earliest) {
+                earliest = chan->ring[chan->head].sent_ns + timeout_ns;
+            }
+        }
+    }
+    return earliest;
+}
+
+/**
+ * Sends every request that is due
+ *
+ * @return  Earliest time the next request is due, ULLONG_MAX if none waits for a time
+ */
+static unsigned long long send_due(Worker *w, int epoll_fd, unsigned long long now) {
+    unsigned long long earliest = ULLONG_MAX;
+    for (int i = 0; i < w->num_clients; i++) {
+        SimClient *client = &w->clients[i];
+        if (rate > 0) {
+            // Late requests keep their intended time, so a stall counts against the server
+            while (client->next_ns <= now && outstanding(client) < (unsigned int)pipeline) {
+                send_request(w, client, epoll_fd, client->next_ns);
+                client->next_ns += next_gap_ns(&w->rng);
+            }
+        } else {
+            while (client->next_ns <= now && outstanding(client) < (unsigned int)pipeline) {
+                if (send_request(w, client, epoll_fd, latency_now_ns()) == -1) client->next_ns = now + RETRY_NS;
+            }
+        }
+        if (client->next_ns > now && client->next_ns < earliest) earliest = client->next_ns;
+    }
+    return earliest;
+}
+
+/**
+ * Arms a timerfd for an absolute CLOCK_MONOTONIC time
+ */
+static void arm_timer(int timer_fd, unsigned long long at_ns) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = at_ns / 1000000000ULL;
+    spec.it_value.tv_nsec = at_ns % 1000000000ULL;
+    if (at_ns == 0) spec.it_value.tv_nsec = 1;  // 0 would disarm the timer
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/**
+ * Drives a group of clients until the run ends and their replies are in
+ */
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    struct epoll_event events[MAX_EVENTS], ev;
+    int draining = 0;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (epoll_fd == -1 || timer_fd == -1) {
+        perror("drinks_load worker");
+        return NULL;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+
+    for (int i = 0; i < w->num_clients; i++) {
+        for (int op = 0; op < LOAD_OPS; op++) {
+            w->clients[i].channels[op].fd = -1;
+            w->clients[i].channels[op].op = op;
+            w->clients[i].channels[op].ring = calloc(pipeline, sizeof(Pending));
+            if (w->clients[i].channels[op].ring == NULL) {
+                perror("drinks_load worker");
+                exit(1);
+            }
+        }
+        if (rate > 0) w->clients[i].next_ns = start_ns + next_gap_ns(&w->rng);
+    }
+
+    while (1) {
+        unsigned long long now = latency_now_ns();
+        unsigned long long wake = ULLONG_MAX;
+
+        if (!draining && now >= end_ns) draining = 1;
+        if (!draining) {
+            wake = send_due(w, epoll_fd, now);
+            if (end_ns < wake) wake = end_ns;
+        }
+        unsigned long long expiry = expire_requests(w, latency_now_ns());
+        if (draining && expiry == ULLONG_MAX) break;  // Every reply is in
+        if (expiry < wake) wake = expiry;
+
+        arm_timer(timer_fd, wake);
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) break;
+            } else {
+                read_replies(w, events[i].data.ptr);
+            }
+        }
+    }
+
+    for (int i = 0; i < w->num_clients; i++) {
+        for (int op = 0; op < LOAD_OPS; op++) {
+            close_channel(&w->clients[i].channels[op], &w->stats[op]);
+            free(w->clients[i].channels[op].ring);
+        }
+    }
+    close(timer_fd);
+    close(epoll_fd);
+    return NULL;
+}
+
+/* ===== REPORT ===== */
+
+/**
+ * Prints one row of the results table
+ */
+static void print_row(const char *name, const OpStats *stats, double elapsed_s) {
+    const FineHistogram *hist = &stats->corrected;
+    printf("%-8s %10llu %10llu %8llu %8llu %10.0f %9.1f %9.1f %9.1f %9.1f\n", name, stats->sent, stats->ok,
+           stats->errors, stats->timeouts, hist->count / elapsed_s,
+           fine_percentile(hist, 50) / 1e3, fine_percentile(hist, 99) / 1e3, fine_percentile(hist, 99.9) / 1e3,
+           hist->max_ns / 1e3);
+}
+
+/**
+ * Prints the results of one operation as a JSON object
+ */
+static void print_json_stats(const OpStats *stats, double elapsed_s) {
+    const FineHistogram *hist = &stats->corrected, *raw = &stats->uncorrected;
+    printf("{\"sent\": %llu, \"ok\": %llu, \"errors\": %llu, \"timeouts\": %llu, \"replies_per_s\": %.1f, "
+           "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f, "
+           "\"uncorrected_p99_us\": %.1f}", stats->sent, stats->ok, stats->errors, stats->timeouts,
+           hist->count / elapsed_s, fine_percentile(hist, 50) / 1e3, fine_percentile(hist, 99) / 1e3,
+           fine_percentile(hist, 99.9) / 1e3, hist->max_ns / 1e3, fine_percentile(raw, 99) / 1e3);
+}
+
+/**
+ * Prints the whole run as one line of JSON (--json)
+ */
+static void print_json(const OpStats *total, double elapsed_s) {
+    printf("{\"mode\": \"%s\", \"rate\": %.0f, \"clients\": %d, \"pipeline\": %d, \"duration_s\": %.3f, "
+           "\"add_percent\": %d, \"zipf\": %.2f", rate > 0 ? "open" : "closed", rate, num_clients, pipeline,
+           elapsed_s, add_percent, zipf_s);
+    for (int op = 0; op < LOAD_OPS; op++) {
+        if (total[op].sent == 0) continue;
+        printf(", \"%s\": ", op_names[op]);
+        print_json_stats(&total[op], elapsed_s);
+    }
+    printf(", \"total\": ");
+    print_json_stats(&total[LOAD_OPS], elapsed_s);
+    printf("}\n");
+}
+
+/**
+ * Adds the counters and histograms of one OpStats to another
+ */
+static void merge_stats(OpStats *into, const OpStats *from) {
+    into->sent += from->sent;
+    into->ok += from->ok;
+    into->errors += from->errors;
+    into->timeouts += from->timeouts;
+    fine_merge(&into->corrected, &from->corrected);
+    fine_merge(&into->uncorrected, &from->uncorrected);
+}
+
+/**
+ * Prints the usage line
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s (-T <tcp-port> | -s <UDS-stream-path>) (-U <udp-port> | -d <UDS-datagram-path>) [-h host] [--clients N] [--threads N] [--duration SECS] [--rate OPS] [--pipeline N] [--add-percent P] [--zipf S] [--add-amount N] [--deliver-amount N] [--timeout MS] [--catalog <file>] [--json]\n", prog);
+    fprintf(stderr, "Note: ADD needs a stream endpoint (-T or -s) and DELIVER a datagram endpoint (-U or -d); --add-percent 100 or 0 needs only one\n");
+}
+
+/**
+ * Parses a whole-number option within [min, max]
+ */
+static long parse_long(const char *text, const char *name, long min, long max) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || errno != 0 || value < min || value > max) {
+        fprintf(stderr, "invalid %s (%ld-%ld)\n", name, min, max);
+        exit(1);
+    }
+    return value;
+}
+
+/**
+ * Main function of the load generator
+ *
+ * @param argc Number of command line arguments
+ * @param argv Array of command line arguments
+ * @return     Exit code
+ */
+int main(int argc, char *argv[]) {
+    int opt;
+    static struct option long_options[] = {
+        {"host",           required_argument, 0, 'h'},
+        {"tcp-port",       required_argument, 0, 'T'},
+        {"udp-port",       required_argument, 0, 'U'},
+        {"stream-path",    required_argument, 0, 's'},
+        {"datagram-path",  required_argument, 0, 'd'},
+        {"clients",        required_argument, 0, 'c'},
+        {"threads",        required_argument, 0, 'n'},
+        {"duration",       required_argument, 0, 'D'},
+        {"rate",           required_argument, 0, 'R'},
+        {"pipeline",       required_argument, 0, 'P'},
+        {"add-percent",    required_argument, 0, 'a'},
+        {"zipf",           required_argument, 0, 'z'},
+        {"add-amount",     required_argument, 0, 'A'},
+        {"deliver-amount", required_argument, 0, 'm'},
+        {"timeout",        required_argument, 0, 't'},
+        {"catalog",        required_argument, 0, 'r'},
+        {"json",           no_argument,       0, 'j'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "h:T:U:s:d:c:n:D:R:P:a:z:A:m:t:r:j", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'T': tcp_port = parse_long(optarg, "tcp-port", 1, 65535); break;
+            case 'U': udp_port = parse_long(optarg, "udp-port", 1, 65535); break;
+            case 's': stream_path = optarg; break;
+            case 'd': datagram_path = optarg; break;
+            case 'c': num_clients = parse_long(optarg, "clients", 1, MAX_CLIENTS); break;
+            case 'n': num_threads = parse_long(optarg, "threads", 1, MAX_THREADS); break;
+            case 'D': duration_s = parse_long(optarg, "duration", 1, 86400); break;
+            case 'R':
+                {
+                    char *end;
+                    rate = strtod(optarg, &end);
+                    if (*end != '\0' || rate < 0) {
+                        fprintf(stderr, "invalid rate (requests per second, 0 for a closed loop)\n");
+                        exit(1);
+                    }
+                    break;
+                }
+            case 'P': pipeline = parse_long(optarg, "pipeline", 1, MAX_PIPELINE); break;
+            case 'a': add_percent = parse_long(optarg, "add-percent", 0, 100); break;
+            case 'z':
+                {
+                    char *end;
+                    zipf_s = strtod(optarg, &end);
+                    if (*end != '\0' || zipf_s < 0 || zipf_s > 10) {
+                        fprintf(stderr, "invalid zipf exponent (0-10, 0 for uniform)\n");
+                        exit(1);
+                    }
+                    break;
+                }
+            case 'A': add_amount = parse_long(optarg, "add-amount", 1, 1000000); break;
+            case 'm': deliver_amount = parse_long(optarg, "deliver-amount", 1, 1000000); break;
+            case 't': timeout_ns = parse_long(optarg, "timeout", 1, 600000) * 1000000ULL; break;
+            case 'r':
+                if (registry_load_catalog(optarg) == -1) exit(1);
+                break;
+            case 'j': json_output = 1; break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    int has_stream = tcp_port != -1 || stream_path != NULL;
+    int has_datagram = udp_port != -1 || datagram_path != NULL;
+    if ((add_percent > 0 && !has_stream) || (add_percent < 100 && !has_datagram) || optind < argc) {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (num_threads > num_clients) num_threads = num_clients;
+    if (resolve_endpoints() == -1 || build_molecule_cdf() == -1) exit(1);
+    signal(SIGPIPE, SIG_IGN);
+
+    Worker *workers = calloc(num_threads, sizeof(Worker));
+    SimClient *clients = calloc(num_clients, sizeof(SimClient));
+    if (workers == NULL || clients == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    if (json_output) {
+        // Only the result line
+    } else if (rate > 0) {
+        printf("drinks_load: %d clients on %d threads, open loop at %.0f requests/s (Poisson), pipeline %d, %d s\n",
+               num_clients, num_threads, rate, pipeline, duration_s);
+    } else {
+        printf("drinks_load: %d clients on %d threads, closed loop, pipeline %d, %d s\n", num_clients, num_threads,
+               pipeline, duration_s);
+    }
+    if (!json_output) {
+        printf("Mix: %d%% ADD (%u atoms), %d%% DELIVER (%u molecules, %s over %d molecules)\n", add_percent,
+               add_amount, 100 - add_percent, deliver_amount, zipf_s > 0 ? "zipf" : "uniform", num_molecules);
+    }
+    if (zipf_s > 0 && !json_output) printf("Zipf exponent %.2f: %s gets %.1f%% of the deliveries\n", zipf_s,
+                           registry_molecule_name(0), molecule_cdf[0] * 100);
+    fflush(stdout);
+
+    start_ns = latency_now_ns();
+    end_ns = start_ns + duration_s * 1000000000ULL;
+    uint64_t seed = start_ns ^ ((uint64_t)getpid() << 32);
+    for (int t = 0, first = 0; t < num_threads; t++) {
+        Worker *w = &workers[t];
+        w->index = t;
+        w->num_clients = num_clients / num_threads + (t < num_clients % num_threads);
+        w->clients = clients + first;
+        w->rng = (seed + 0x9E3779B97F4A7C15ULL * (t + 1)) | 1;
+        first += w->num_clients;
+        int rc = pthread_create(&w->thread, NULL, worker_main, w);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            exit(1);
+        }
+    }
+
+    OpStats *total = calloc(LOAD_OPS + 1, sizeof(OpStats));
+    if (total == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        for (int op = 0; op < LOAD_OPS; op++) {
+            merge_stats(&total[op], &workers[t].stats[op]);
+            merge_stats(&total[LOAD_OPS], &workers[t].stats[op]);
+        }
+    }
+    double elapsed_s = (latency_now_ns() - start_ns) / 1e9;
+    if (elapsed_s > duration_s) elapsed_s = duration_s;  // The drain after the run sends nothing new
+
+    if (json_output) {
+        print_json(total, elapsed_s);
+        free(total);
+        free(clients);
+        free(workers);
+        free(molecule_cdf);
+        return 0;
+    }
+    printf("%-8s %10s %10s %8s %8s %10s %9s %9s %9s %9s\n", "op", "sent", "ok", "errors", "timeouts", "replies/s",
+           "p50 us", "p99 us", "p99.9 us", "max us");
+    for (int op = 0; op < LOAD_OPS; op++) {
+        if (total[op].sent > 0) print_row(op_names[op], &total[op], elapsed_s);
+    }
+    print_row("total", &total[LOAD_OPS], elapsed_s);
+
+    if (rate > 0) {
+        const FineHistogram *raw = &total[LOAD_OPS].uncorrected;
+        printf("Offered %.0f requests/s, sent %.0f/s\n", rate, total[LOAD_OPS].sent / elapsed_s);
+        printf("Latency from the actual send (without coordinated-omission correction): p50 %.1f us, p99 %.1f us, "
+               "p99.9 %.1f us, max %.1f us\n", fine_percentile(raw, 50) / 1e3, fine_percentile(raw, 99) / 1e3,
+               fine_percentile(raw, 99.9) / 1e3, raw->max_ns / 1e3);
+    }
+
+    free(total);
+    free(clients);
+    free(workers);
+    free(molecule_cdf);
+    return 0;
+}
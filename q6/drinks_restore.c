@@ -0,0 +1,280 @@
+/*
+ * drinks_restore - שחזור מלאי לנקודת זמן מיומן הפעולות
+ * ----------------------------------------------------
+ * בונה קובץ שמירה חדש (staging) עם המלאי כפי שהיה ברשומה מסוימת ביומן
+ * (<save-file>.wal של drinks_bar --wal), או ברגע מסוים:
+ * - נקודת ההתחלה: מלאי הבסיס שבכותרת היומן, או צילום מצב (SNAPSHOT) יחד
+ *   עם מיקום היומן שנשמר בו, כך שרק הרשומות שאחריו מוחלות
+ * - היומן ממופה לזיכרון (mmap) ונסרק פעם אחת לפי הסדר; כל רשומה נבדקת
+ *   (מספר רצף, סוג, CRC32C) ומוחלת על מונים מקומיים, ללא קריאת מערכת
+ *   לכל רשומה, והמלאי נכתב פעם אחת בסוף (ראו wal_replay ב-wal.c)
+ * - הקובץ נוצר בפורמט הנוכחי (stock.c) ומסונכרן לדיסק; קובץ קיים לא נדרס
+ * אחרי בדיקה, הקובץ מקודם ידנית: מחליפים בו את קובץ השמירה ומזיזים הצידה
+ * את היומן הישן (drinks_bar --wal היה משחזר ממנו את המלאי שוב).
+ *
+ * Usage:
+ * ./drinks_restore -l <log> -o <staging-file> [-s <snapshot>] [-n <record> | -t <time>]
+ *                  [--lock-mode flock|fcntl|mutex|atomic]
+ * <time>: seconds since the epoch (1792193387.637) or UTC (2026-10-16T23:29:47.637Z)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stock.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "latency.h"
+
+/**
+ * Prints the usage line and exits
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -l <log> -o <staging-file> [-s <snapshot>] [-n <record> | -t <time>] "
+                    "[--lock-mode flock|fcntl|mutex|atomic]\n", prog);
+    fprintf(stderr, "<time>: seconds since the epoch (1792193387.637) or UTC (2026-10-16T23:29:47.637Z)\n");
+    exit(1);
+}
+
+/**
+ * Parses a --time argument into CLOCK_REALTIME nanoseconds
+ * Accepts seconds since the epoch with an optional fraction, or a UTC time
+ * YYYY-MM-DDTHH:MM:SS with an optional fraction and an optional 'Z'
+ *
+ * @param text  The argument
+ * @param out   Receives the time in nanoseconds
+ * @return      1 on success, 0 if the argument is not a time
+ */
+static int parse_time(const char *text, uint64_t *out) {
+    unsigned long long seconds, fraction = 0;
+    const char *rest;
+    struct tm utc;
+
+    if (strchr(text, 'T') != NULL) {
+        memset(&utc, 0, sizeof(utc));
+        rest = strptime(text, "%Y-%m-%dT%H:%M:%S", &utc);
+        if (rest == NULL) return 0;
+        time_t t = timegm(&utc);
+        if (t < 0) return 0;
+        seconds = (unsigned long long)t;
+    } else {
+        char *end;
+        if (!isdigit((unsigned char)text[0])) return 0;
+        seconds = strtoull(text, &end, 10);
+        rest = end;
+    }
+
+    // Up to nine digits of fraction: nanoseconds
+    if (*rest == '.') {
+        int digits = 0;
+        for (rest++; isdigit((unsigned char)*rest); rest++) {
+            if (digits++ < 9) fraction = fraction * 10 + (*rest - '0');
+        }
+        if (digits == 0) return 0;
+        for (; digits < 9; digits++) fraction *= 10;
+    }
+    if (*rest == 'Z') rest++;
+    if (*rest != '\0' || seconds > UINT64_MAX / 1000000000ULL - 1) return 0;
+
+    *out = seconds * 1000000000ULL + fraction;
+    return 1;
+}
+
+/**
+ * Formats a CLOCK_REALTIME time in nanoseconds as UTC with milliseconds
+ */
+static void format_time(char *buf, size_t size, uint64_t ns) {
+    time_t seconds = ns / 1000000000ULL;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    snprintf(buf, size, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+             utc.tm_hour, utc.tm_min, utc.tm_sec, (int)(ns / 1000000 % 1000));
+}
+
+/**
+ * Flushes a newly written file and its directory entry to disk
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int sync_file(const char *path) {
+    char copy[4096];
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    if (rc == -1) return -1;
+
+    snprintf(copy, sizeof(copy), "%s", path);
+    fd = open(dirname(copy), O_RDONLY);
+    if (fd == -1) return -1;
+    rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    const char *log_path = NULL, *out_path = NULL, *snapshot_path = NULL;
+    uint64_t to_lsn = UINT64_MAX, to_time_ns = UINT64_MAX;
+    int opt;
+
+    static struct option long_options[] = {
+        {"log",       required_argument, 0, 'l'},
+        {"output",    required_argument, 0, 'o'},
+        {"snapshot",  required_argument, 0, 's'},
+        {"lsn",       required_argument, 0, 'n'},
+        {"time",      required_argument, 0, 't'},
+        {"lock-mode", required_argument, 0, 'L'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "l:o:s:n:t:L:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                log_path = optarg;
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            case 's':
+                snapshot_path = optarg;
+                break;
+            case 'n':
+                {
+                    char *endptr;
+                    to_lsn = strtoull(optarg, &endptr, 10);
+                    if (*endptr != '\0' || endptr == optarg || optarg[0] == '-') {
+                        fprintf(stderr, "invalid lsn\n");
+                        exit(1);
+                    }
+                    break;
+                }
+            case 't':
+                if (!parse_time(optarg, &to_time_ns)) {
+                    fprintf(stderr, "invalid time (seconds since the epoch, or YYYY-MM-DDTHH:MM:SS[.fff]Z)\n");
+                    exit(1);
+                }
+                break;
+            case 'L':
+                if (!stock_parse_lock_mode(optarg, &stock_lock_mode) || stock_lock_mode == LOCK_MODE_SHARDED) {
+                    fprintf(stderr, "invalid lock-mode (flock, fcntl, mutex or atomic)\n");
+                    exit(1);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (log_path == NULL || out_path == NULL || optind != argc) usage(argv[0]);
+    if (to_lsn != UINT64_MAX && to_time_ns != UINT64_MAX) {
+        fprintf(stderr, "Give either a record (-n) or a time (-t), not both\n");
+        exit(1);
+    }
+
+    // The staging file is created from scratch; never overwrite a save file
+    if (access(out_path, F_OK) == 0) {
+        fprintf(stderr, "%s already exists; restore to a new staging file\n", out_path);
+        exit(1);
+    }
+
+    // Map the whole log for one sequential pass
+    int log_fd = open(log_path, O_RDONLY);
+    struct stat st;
+    if (log_fd == -1 || fstat(log_fd, &st) == -1) {
+        perror(log_path);
+        exit(1);
+    }
+    if (st.st_size < (off_t)sizeof(WalHeader)) {
+        fprintf(stderr, "Unrecognized log format: %s\n", log_path);
+        exit(1);
+    }
+    void *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, log_fd, 0);
+    if (log == MAP_FAILED) {
+        perror("mmap log");
+        exit(1);
+    }
+    madvise(log, st.st_size, MADV_SEQUENTIAL);
+    close(log_fd);
+
+    const WalHeader *header = log;
+    if (!wal_header_valid(header)) {
+        fprintf(stderr, "Unrecognized log format: %s\n", log_path);
+        exit(1);
+    }
+
+    // Starting point: the log's base stock, or a snapshot and its log position
+    AtomStock stock = header->base;
+    WalReplay replay;
+    memset(&replay, 0, sizeof(replay));
+    replay.from_lsn = header->base_lsn - 1;
+    if (snapshot_path != NULL) {
+        SnapshotFile snapshot;
+        if (snapshot_read(snapshot_path, &snapshot) == -1) exit(1);
+        if (snapshot.log_lsn == 0) {
+            fprintf(stderr, "%s was taken without --wal; it has no log position to replay from\n", snapshot_path);
+            exit(1);
+        }
+        if (to_lsn < snapshot.log_lsn || to_time_ns < snapshot.time_ns) {
+            fprintf(stderr, "The target is before the snapshot (record %llu); restore without -s\n",
+                    (unsigned long long)snapshot.log_lsn);
+            exit(1);
+        }
+        stock = snapshot.stock;
+        replay.from_lsn = snapshot.log_lsn;
+    }
+    if (snapshot_path == NULL && to_time_ns < header->time_ns) {
+        char created[64];
+        format_time(created, sizeof(created), header->time_ns);
+        fprintf(stderr, "The target is before the log was created (%s)\n", created);
+        exit(1);
+    }
+    replay.to_lsn = to_lsn;
+    replay.to_time_ns = to_time_ns;
+
+    unsigned long long start = latency_now_ns();
+    if (wal_replay(log_path, log, st.st_size, &stock, &replay) == -1) exit(1);
+    unsigned long long replay_ns = latency_now_ns() - start;
+
+    if (to_lsn != UINT64_MAX && replay.last_lsn != to_lsn) {
+        fprintf(stderr, "%s ends at record %llu; record %llu is not in the log\n", log_path,
+                (unsigned long long)replay.last_lsn, (unsigned long long)to_lsn);
+        exit(1);
+    }
+    if (to_lsn == UINT64_MAX && to_time_ns == UINT64_MAX && replay.valid_size < (size_t)st.st_size) {
+        printf("Log %s: ignoring %lld bytes of incomplete records after record %llu\n", log_path,
+               (long long)(st.st_size - replay.valid_size), (unsigned long long)replay.last_lsn);
+    }
+    munmap(log, st.st_size);
+
+    // Write the staging file in the current save file format
+    in_memory_stock = stock;
+    if (stock_open_save_file(out_path) == -1) exit(1);
+    stock_close_save_file();
+    if (sync_file(out_path) == -1) {
+        perror("Failed to sync the staging file");
+        exit(1);
+    }
+
+    char when[64] = "base stock";
+    if (replay.last_time_ns != 0) format_time(when, sizeof(when), replay.last_time_ns);
+    double seconds = replay_ns / 1e9;
+    double bytes = (double)replay.valid_size;
+    printf("Restored %s as of record %llu (%s): C=%llu, H=%llu, O=%llu\n", out_path,
+           (unsigned long long)replay.last_lsn, when, stock.carbon, stock.hydrogen, stock.oxygen);
+    printf("Replayed %llu records, scanned %.1f MB in %.3f ms (%.1f M records/s, %.2f GB/s)\n",
+           (unsigned long long)replay.records, bytes / 1e6, replay_ns / 1e6,
+           seconds > 0 ? replay.records / seconds / 1e6 : 0.0, seconds > 0 ? bytes / seconds / 1e9 : 0.0);
+    printf("To promote it: stop drinks_bar, move the log (%s) aside and rename %s to the save file\n", log_path,
+           out_path);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * latency.c - היסטוגרמות זמני תגובה
+ * ---------------------------------
+ * כל משך נספר בתא של החזקה של 2 שלו (בננו-שניות), בהוספה אטומית אחת,
+ * כך שתהליכונים רבים רושמים לאותה היסטוגרמה בלי נעילה.
+ * אחוזונים מחושבים מהתאים, ולכן הם חסם עליון (עד פי 2) של הערך המדויק.
+ */
+
+#include <time.h>
+
+#include "latency.h"
+
+/**
+ * Returns the CLOCK_MONOTONIC time in nanoseconds
+ */
+unsigned long long latency_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Adds one duration to a histogram (safe from any thread)
+ *
+ * @param hist  The histogram
+ * @param ns    Duration in nanoseconds
+ */
+void latency_record(LatencyHistogram *hist, unsigned long long ns) {
+    int bucket = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+    __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copies a histogram that other threads may still be recording into
+ *
+ * @param hist  The histogram
+ * @param out   Receives the counts
+ * @return      Number of recorded durations in out
+ */
+unsigned long long latency_snapshot(const LatencyHistogram *hist, LatencyHistogram *out) {
+    unsigned long long total = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        out->buckets[b] = __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+        total += out->buckets[b];
+    }
+    return total;
+}
+
+/**
+ * Upper bound of the bucket that holds a percentile
+ *
+ * @param hist     The histogram (a snapshot)
+ * @param percent  Percentile, 0-100
+ * @return         Duration in nanoseconds (0 if the histogram is empty)
+ */
+unsigned long long latency_percentile(const LatencyHistogram *hist, double percent) {
+    unsigned long long total = 0, seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) total += hist->buckets[b];
+    if (total == 0) return 0;
+
+    // Rank of the percentile, counted from 1
+    double exact = total * percent / 100.0;
+    unsigned long long rank = (unsigned long long)exact;
+    if (rank < exact || rank == 0) rank++;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen >= rank) return 2ULL << b;
+    }
+    return 2ULL << (LATENCY_BUCKETS - 1);
+}
+
+/**
+ * Formats a duration with a readable unit
+ */
+static void format_ns(char *buf, size_t size, unsigned long long ns) {
+    if (ns < 1000) {
+        snprintf(buf, size, "%lluns", ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.1fs", ns / 1e9);
+    }
+}
+
+/**
+ * Prints a histogram: count and percentiles on the first line, then one
+ * line per non-empty bucket
+ *
+ * @param out    Output stream
+ * @param title  Label of the first line
+ * @param hist   The histogram
+ */
+void latency_print(FILE *out, const char *title, const LatencyHistogram *hist) {
+    LatencyHistogram copy;
+    char p50[16], p99[16], p999[16], low[16], high[16];
+    unsigned long long total = latency_snapshot(hist, &copy);
+
+    format_ns(p50, sizeof(p50), latency_percentile(&copy, 50));
+    format_ns(p99, sizeof(p99), latency_percentile(&copy, 99));
+    format_ns(p999, sizeof(p999), latency_percentile(&copy, 99.9));
+    fprintf(out, "%s: count=%llu p50<=%s p99<=%s p99.9<=%s\n", title, total, p50, p99, p999);
+
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        if (copy.buckets[b] == 0) continue;
+        format_ns(low, sizeof(low), b == 0 ? 0 : 1ULL << b);
+        format_ns(high, sizeof(high), 2ULL << b);
+        fprintf(out, "  %8s - %-8s %12llu  %5.1f%%\n", low, high, copy.buckets[b], 100.0 * copy.buckets[b] / total);
+    }
+}
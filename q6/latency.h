@@ -0,0 +1,63 @@
+/*
+ * latency.h - היסטוגרמות זמני תגובה
+ *
+ * Log2 latency histograms that many threads can record into without a lock:
+ * bucket b counts durations of [2^b, 2^(b+1)) nanoseconds.
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+
+#define LATENCY_BUCKETS 40   // Up to 2^40 ns (about 18 minutes); longer goes in the last bucket
+
+/**
+ * Counts of recorded durations by power of two
+ */
+typedef struct {
+    unsigned long long buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+/**
+ * Returns the CLOCK_MONOTONIC time in nanoseconds
+ */
+unsigned long long latency_now_ns();
+
+/**
+ * Adds one duration to a histogram (safe from any thread)
+ *
+ * @param hist  The histogram
+ * @param ns    Duration in nanoseconds
+ */
+void latency_record(LatencyHistogram *hist, unsigned long long ns);
+
+/**
+ * Copies a histogram that other threads may still be recording into
+ *
+ * @param hist  The histogram
+ * @param out   Receives the counts
+ * @return      Number of recorded durations in out
+ */
+unsigned long long latency_snapshot(const LatencyHistogram *hist, LatencyHistogram *out);
+
+/**
+ * Upper bound of the bucket that holds a percentile
+ *
+ * @param hist     The histogram (a snapshot)
+ * @param percent  Percentile, 0-100
+ * @return         Duration in nanoseconds (0 if the histogram is empty)
+ */
+unsigned long long latency_percentile(const LatencyHistogram *hist, double percent);
+
+/**
+ * Prints a histogram: count and percentiles on the first line, then one
+ * line per non-empty bucket
+ *
+ * @param out    Output stream
+ * @param title  Label of the first line
+ * @param hist   The histogram
+ */
+void latency_print(FILE *out, const char *title, const LatencyHistogram *hist);
+
+#endif
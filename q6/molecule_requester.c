@@ -11,42 +11,25 @@
 #include <getopt.h>
 #include <sys/un.h>
 
+#include "protocol.h"
+#include "registry.h"
+
 #define BUFFER_SIZE 1024
 
 /**
- * Validates if a UDP command is in the correct format: DELIVER <MOLECULE> <AMOUNT>
+ * Validates a molecule name and amount pair
  * 
- * @param command   Command string to validate
- * @return          1 if the command is valid, 0 if not
+ * @param molecule    Molecule name ("WATER", "CARBON DIOXIDE", "ALCOHOL", "GLUCOSE" or from --catalog)
+ * @param amount_str  Amount string to validate
+ * @param amount_out  Receives the amount
+ * @return            1 if the pair is valid, 0 if not
  */
-int validate_udp_command(const char *command) {
-    char deliver[256], molecule1[256], molecule2[256], amount_str[256];
-    unsigned int amount;
-    int n = sscanf(command, "%255s %255s %255s %255s", deliver, molecule1, molecule2, amount_str);
-    if (n < 3) return 0;
-
-    // Check that the command starts with DELIVER
-    if (strcmp(deliver, "DELIVER") != 0) return 0;
-
-    // Determine molecule name and amount string
-    char molecule[512]; 
-    if (n == 4) {
-        // Molecule name is two words
-        snprintf(molecule, sizeof(molecule), "%s %s", molecule1, molecule2);
-        // No need to copy amount_str, it's already in the right variable
-    } else if (n == 3) {
-        // Molecule name is one word
-        strncpy(molecule, molecule1, sizeof(molecule) - 1);
-        molecule[sizeof(molecule) - 1] = '\0';
-        
-        // Copy amount from molecule2 into amount_str
-        strncpy(amount_str, molecule2, sizeof(amount_str) - 1);
-        amount_str[sizeof(amount_str) - 1] = '\0';
-    } else {
-        return 0;
-    }
+int validate_molecule_pair(const char *molecule, const char *amount_str, unsigned int *amount_out) {
+    // Check that the molecule is known
+    if (registry_molecule_id(molecule) < 0) return 0;
 
     // Check if amount_str contains only digits
+    if (amount_str[0] == '\0') return 0;
     for (int i = 0; amount_str[i]; ++i) {
         if (!isdigit((unsigned char)amount_str[i])) {
             return 0;
@@ -58,18 +41,112 @@ int validate_udp_command(const char *command) {
         return 0;
     }
     
-    amount = (unsigned int)strtoul(amount_str, NULL, 10);
+    // Check that the amount is greater than zero
+    *amount_out = (unsigned int)strtoul(amount_str, NULL, 10);
+    return *amount_out > 0;
+}
 
-    // Check if molecule is valid and amount is greater than zero
-    if ((strcmp(molecule, "WATER") == 0 ||
-         strcmp(molecule, "CARBON DIOXIDE") == 0 ||
-         strcmp(molecule, "ALCOHOL") == 0 ||
-         strcmp(molecule, "GLUCOSE") == 0) &&
-        amount > 0) {
-        return 1;
+/**
+ * Parses and validates a UDP command in the format:
+ * DELIVER <MOLECULE> <AMOUNT> [<MOLECULE> <AMOUNT> ...]
+ * A molecule name is every word up to the next number ("CARBON DIOXIDE")
+ * 
+ * @param command       Command string to parse
+ * @param molecule_out  Receives the molecule id of the first pair
+ * @param amount_out    Receives the amount of the first pair
+ * @return              Number of molecule/amount pairs, 0 if the command is invalid
+ */
+int parse_udp_command(const char *command, int *molecule_out, unsigned int *amount_out) {
+    char copy[BUFFER_SIZE], *save = NULL;
+    int pairs = 0;
+
+    snprintf(copy, sizeof(copy), "%s", command);
+
+    // Check that the command starts with DELIVER
+    char *token = strtok_r(copy, " \t", &save);
+    if (token == NULL || strcmp(token, "DELIVER") != 0) return 0;
+
+    token = strtok_r(NULL, " \t", &save);
+    while (token != NULL) {
+        char molecule[BUFFER_SIZE];
+        size_t len = 0;
+        unsigned int amount;
+
+        // Collect the words of the molecule name
+        while (token != NULL && !isdigit((unsigned char)token[0])) {
+            len += snprintf(molecule + len, sizeof(molecule) - len, "%s%s", len ? " " : "", token);
+            token = strtok_r(NULL, " \t", &save);
+        }
+        if (len == 0 || token == NULL || !validate_molecule_pair(molecule, token, &amount)) return 0;
+
+        if (pairs++ == 0) {
+            *molecule_out = registry_molecule_id(molecule);
+            *amount_out = amount;
+        }
+        token = strtok_r(NULL, " \t", &save);
     }
-    
-    return 0;
+    return pairs;
+}
+
+/**
+ * Checks for a query the server answers from its stock snapshot:
+ * STATUS, REPLICATION, RAFT, or GEN <DRINK or MOLECULE> (the server checks the name)
+ *
+ * @param command   Command string to check
+ * @return          1 if the command is a query, 0 if not
+ */
+int is_query_command(const char *command) {
+    char copy[BUFFER_SIZE], *save = NULL;
+
+    snprintf(copy, sizeof(copy), "%s", command);
+    char *op = strtok_r(copy, " \t", &save);
+    char *word = strtok_r(NULL, " \t", &save);
+    if (op == NULL) return 0;
+    return ((strcmp(op, "STATUS") == 0 || strcmp(op, "REPLICATION") == 0 ||
+             strcmp(op, "RAFT") == 0) && word == NULL) ||
+           (strcmp(op, "GEN") == 0 && word != NULL);
+}
+
+/**
+ * Validates if a UDP command is in the correct format:
+ * DELIVER <MOLECULE> <AMOUNT> [<MOLECULE> <AMOUNT> ...], or a STATUS / GEN query
+ * 
+ * @param command   Command string to validate
+ * @return          1 if the command is valid, 0 if not
+ */
+int validate_udp_command(const char *command) {
+    int molecule;
+    unsigned int amount;
+    return is_query_command(command) || parse_udp_command(command, &molecule, &amount) > 0;
+}
+
+/**
+ * Builds the request datagram for a validated command
+ * In binary mode this is a fixed-size protocol frame, otherwise the command text
+ *
+ * @param command     Validated DELIVER command
+ * @param binary      Non-zero to build a binary frame
+ * @param request_id  Request id to put in a binary frame
+ * @param out         Receives the datagram (at least BUFFER_SIZE bytes)
+ * @return            Length of the datagram
+ */
+size_t build_request(const char *command, int binary, uint32_t request_id, unsigned char *out) {
+    if (!binary) {
+        size_t len = strlen(command);
+        memcpy(out, command, len);
+        return len;
+    }
+
+    int molecule;
+    unsigned int amount;
+    ProtoFrame req;
+    parse_udp_command(command, &molecule, &amount);
+    req.opcode = PROTO_OP_DELIVER;
+    req.id = (uint8_t)molecule;
+    req.request_id = request_id;
+    req.amount = amount;
+    proto_encode(&req, out);
+    return PROTO_FRAME_SIZE;
 }
 
 /**
@@ -168,9 +245,20 @@ int main (int argc ,char* argv[]){
     const char *host = NULL;
     const char *port = NULL;
     const char *socket_path = NULL;
+    int binary = 0;
+    uint32_t request_id = 0;
+
+    static struct option long_options[] = {
+        {"host",   required_argument, 0, 'h'},
+        {"port",   required_argument, 0, 'p'},
+        {"file",   required_argument, 0, 'f'},
+        {"binary", no_argument,       0, 'b'},
+        {"catalog", required_argument, 0, 'r'},
+        {0, 0, 0, 0}
+    };
 
     // Process command line options
-    while ((opt = getopt(argc, argv, "h:p:f:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "h:p:f:br:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'h':
                 host = optarg;
@@ -181,8 +269,17 @@ int main (int argc ,char* argv[]){
             case 'f':
                 socket_path = optarg;
                 break; 
+            case 'b':
+                binary = 1;
+                break;
+            case 'r':
+                // Accept the molecules of the server's recipe catalog
+                if (registry_load_catalog(optarg) == -1) {
+                    exit(1);
+                }
+                break;
             default:
-                fprintf(stderr, "Usage: %s -h <hostname/IP> -p <port> OR %s -f <UDS socket file path>\n", 
+                fprintf(stderr, "Usage: %s -h <hostname/IP> -p <port> OR %s -f <UDS socket file path> [--binary] [--catalog <file>]\n", 
                         argv[0], argv[0]);
                 exit(1);
         }
@@ -224,8 +321,9 @@ int main (int argc ,char* argv[]){
     }
 
     printf("Enter command: DELIVER <MOLECULE> <AMOUNT>\n");
-    printf("Examples: DELIVER WATER 10\n");
+    printf("Examples: DELIVER WATER 10, DELIVER WATER 10 GLUCOSE 3 ALCOHOL 2\n");
     printf("Available molecules: WATER, CARBON DIOXIDE, ALCOHOL, GLUCOSE\n");
+    printf("Queries: STATUS, REPLICATION, RAFT, GEN <DRINK or MOLECULE>\n");
     
     while (1) {
         char command[256];
@@ -242,8 +340,15 @@ int main (int argc ,char* argv[]){
             }
             
             if (validate_udp_command(command)) {
-                // Send command to server
-                if (sendto(sock, command, strlen(command), 0, server_addr, addr_len) != -1) {
+                // Send command to server (as text, or as a binary frame with --binary;
+                // a frame carries one molecule type with a one-byte id, so multi-molecule DELIVER
+                // and catalog molecules past id 255 are sent as text)
+                int molecule;
+                unsigned int amount;
+                int as_binary = binary && parse_udp_command(command, &molecule, &amount) == 1 && molecule <= UINT8_MAX;
+                unsigned char request[BUFFER_SIZE];
+                size_t request_len = build_request(command, as_binary, ++request_id, request);
+                if (sendto(sock, request, request_len, 0, server_addr, addr_len) != -1) {
                     printf("Request sent to molecule supplier.\n");
                     
                     // Set up for receiving response
@@ -274,7 +379,14 @@ int main (int argc ,char* argv[]){
                     // Receive response
                     ssize_t n = recvfrom(sock, buffer, BUFFER_SIZE-1, 0, 
                                         (struct sockaddr *)&from_addr, &from_len);
-                    if (n > 0) {
+                    ProtoFrame reply;
+                    if (n > 0 && as_binary) {
+                        if (proto_decode((unsigned char *)buffer, n, &reply) && reply.request_id == request_id) {
+                            printf("Server response: %s\n", proto_reply_text(&reply));
+                        } else {
+                            printf("Invalid reply from server\n");
+                        }
+                    } else if (n > 0) {
                         buffer[n] = '\0';
                         printf("Server response: %s\n", buffer);
                     } else {
@@ -285,7 +397,7 @@ int main (int argc ,char* argv[]){
                 }
             } else {
                 printf("Invalid command format or values.\n");
-                printf("Valid format: DELIVER <MOLECULE> <AMOUNT>\n");
+                printf("Valid format: DELIVER <MOLECULE> <AMOUNT> [<MOLECULE> <AMOUNT> ...]\n");
                 printf("Available molecules: WATER, CARBON DIOXIDE, ALCOHOL, GLUCOSE\n");
             }
         }
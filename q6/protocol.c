@@ -0,0 +1,80 @@
+/*
+ * protocol.c - קידוד ופענוח של מסגרות הפרוטוקול הבינארי
+ * ------------------------------------------------------
+ * משותף לשרת (drinks_bar) וללקוחות (atom_supplier, molecule_requester).
+ * ראו protocol.h למבנה המסגרת. המזהים של האטומים והמולקולות הם המזהים של registry.h.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+/**
+ * Encodes a frame into its 16-byte wire form
+ *
+ * @param frame  Frame to encode
+ * @param out    Receives PROTO_FRAME_SIZE bytes
+ */
+void proto_encode(const ProtoFrame *frame, unsigned char *out) {
+    uint32_t request_id = htonl(frame->request_id);
+
+    out[0] = PROTO_MAGIC;
+    out[1] = PROTO_VERSION;
+    out[2] = frame->opcode;
+    out[3] = frame->id;
+    memcpy(out + 4, &request_id, sizeof(request_id));
+    for (int i = 0; i < 8; i++) {
+        out[8 + i] = (unsigned char)(frame->amount >> (56 - 8 * i));
+    }
+}
+
+/**
+ * Decodes a frame from its wire form
+ *
+ * @param in     Received bytes
+ * @param len    Number of received bytes
+ * @param frame  Receives the decoded frame
+ * @return       1 on success, 0 if the length, magic or version is wrong
+ */
+int proto_decode(const unsigned char *in, size_t len, ProtoFrame *frame) {
+    uint32_t request_id;
+
+    if (len != PROTO_FRAME_SIZE || in[0] != PROTO_MAGIC || in[1] != PROTO_VERSION) {
+        return 0;
+    }
+    frame->opcode = in[2];
+    frame->id = in[3];
+    memcpy(&request_id, in + 4, sizeof(request_id));
+    frame->request_id = ntohl(request_id);
+    frame->amount = 0;
+    for (int i = 0; i < 8; i++) {
+        frame->amount = (frame->amount << 8) | in[8 + i];
+    }
+    return 1;
+}
+
+/**
+ * Text equivalent of a reply, matching the messages of the text protocol
+ *
+ * @param reply  Decoded reply frame
+ * @return       Message without trailing newline
+ */
+const char *proto_reply_text(const ProtoFrame *reply) {
+    int is_add = (reply->opcode & ~PROTO_REPLY_FLAG) == PROTO_OP_ADD;
+
+    switch (reply->id) {
+        case PROTO_STATUS_OK:
+            return is_add ? "added to warehouse successfully" : "Molecule delivered successfully";
+        case PROTO_STATUS_FAILED:
+            return is_add ? "ERROR: Exceeds MAX_ATOMS" : "ERROR: Not enough atoms or unknown molecule";
+        case PROTO_STATUS_READ_ONLY:
+            return "ERROR: Read-only standby";
+        case PROTO_STATUS_NOT_LEADER:
+            return "ERROR: Not leader";
+        case PROTO_STATUS_UNKNOWN:
+            return "ERROR: Outcome unknown";
+        default:
+            return "ERROR: Invalid command";
+    }
+}
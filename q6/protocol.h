@@ -0,0 +1,75 @@
+/*
+ * protocol.h - פרוטוקול בינארי קומפקטי לצד פקודות הטקסט
+ *
+ * Fixed 16-byte frames, all integers in network byte order:
+ *
+ *   offset  size  field
+ *   0       1     magic (PROTO_MAGIC, never the first byte of a text command)
+ *   1       1     version (PROTO_VERSION)
+ *   2       1     opcode (PROTO_OP_*; replies set PROTO_REPLY_FLAG)
+ *   3       1     element or molecule id (registry.h) in requests, PROTO_STATUS_* in replies
+ *   4       4     request id, echoed in the reply
+ *   8       8     amount
+ *
+ * The server tells frames from text by the first byte, on the same TCP,
+ * UDP and UDS endpoints as the text commands.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTO_MAGIC 0xDB
+#define PROTO_VERSION 1
+#define PROTO_FRAME_SIZE 16
+
+#define PROTO_OP_ADD 1          // Add atoms (stream endpoints)
+#define PROTO_OP_DELIVER 2      // Deliver molecules (datagram endpoints)
+#define PROTO_REPLY_FLAG 0x80   // Set in the opcode of every reply
+
+#define PROTO_STATUS_OK 0       // Request carried out
+#define PROTO_STATUS_FAILED 1   // Exceeds MAX_ATOMS / not enough atoms
+#define PROTO_STATUS_INVALID 2  // Malformed frame, unknown id or opcode, bad amount
+#define PROTO_STATUS_READ_ONLY 3  // The server is a replication standby
+#define PROTO_STATUS_NOT_LEADER 4 // The server is a Raft node that is not the leader
+#define PROTO_STATUS_UNKNOWN 5    // Raft: the update is in the log but was not applied in time (it may still commit)
+
+/**
+ * A decoded frame (request or reply)
+ */
+typedef struct {
+    uint8_t opcode;       // PROTO_OP_*, | PROTO_REPLY_FLAG in replies
+    uint8_t id;           // Atom/molecule id in requests, status in replies
+    uint32_t request_id;  // Chosen by the client, echoed by the server
+    uint64_t amount;      // Number of atoms or molecules
+} ProtoFrame;
+
+/**
+ * Encodes a frame into its 16-byte wire form
+ *
+ * @param frame  Frame to encode
+ * @param out    Receives PROTO_FRAME_SIZE bytes
+ */
+void proto_encode(const ProtoFrame *frame, unsigned char *out);
+
+/**
+ * Decodes a frame from its wire form
+ *
+ * @param in     Received bytes
+ * @param len    Number of received bytes
+ * @param frame  Receives the decoded frame
+ * @return       1 on success, 0 if the length, magic or version is wrong
+ */
+int proto_decode(const unsigned char *in, size_t len, ProtoFrame *frame);
+
+/**
+ * Text equivalent of a reply, matching the messages of the text protocol
+ *
+ * @param reply  Decoded reply frame
+ * @return       Message without trailing newline
+ */
+const char *proto_reply_text(const ProtoFrame *reply);
+
+#endif
@@ -0,0 +1,1491 @@
+/*
+ * raft.c - אשכול drinks_bar בקונצנזוס Raft
+ * ----------------------------------------
+ * שלושה או חמישה תהליכי drinks_bar (--raft-id <n> --raft-peers <host:port,...>),
+ * כל אחד עם קובץ שמירה משלו, מסכימים על סדר העדכונים לפני שהם מוחלים:
+ * - מנהיג (leader) נבחר ברוב קולות. צומת שלא שמע מהמנהיג זמן בחירות אקראי
+ *   (250-500ms) מתחיל בחירות בקדנציה (term) חדשה; הקדנציה וההצבעה נשמרות
+ *   בדיסק (<save-file>.raft-state) לפני כל תשובה
+ * - ADD ו-DELIVER נמסרים למנהיג (stock_update_proposer): הוא מוסיף רשומה
+ *   ליומן (<save-file>.raft), שולח אותה לשאר הצמתים, והרשומה "מחויבת" כשרוב
+ *   הצמתים כתבו אותה לדיסק (fdatasync). תהליכון ההחלה מחיל כל רשומה מחויבת,
+ *   לפי הסדר ובכל הצמתים, ב-stock_apply_update, ורק אז הלקוח מקבל תשובה.
+ *   תהליכון ה-reactor אינו ממתין: התשובה מוחזקת בתור של הלולאה (כמו ב---wal),
+ *   והלולאה ממשיכה לשרת לקוחות אחרים ומוסיפה רשומות בזמן שהקודמות בדרך
+ * - לכל צומת עמית תהליכון שליחה משלו; רשומות שהצטברו בזמן שהשליחה הקודמת
+ *   הייתה בדרך נשלחות יחד (עד 512 בהודעה), ו-fdatasync אחד של המנהיג מכסה
+ *   את כל מה שנוסף עד אליו (group commit)
+ * - דחיסת היומן: כל 100,000 רשומות מוחלות המלאי נשמר בקובץ צילום המצב
+ *   (snapshot.h, <save-file>.raft.snap, עם מיקום היומן והקדנציה), הרשומות
+ *   שלפניו נמחקות מהזיכרון ומהקובץ (punch hole), וצומת שפיגר מאחוריהן
+ *   מקבל את צילום המצב במקומן (InstallSnapshot)
+ * - קריאות בחכירה (lease): המנהיג עונה ל-STATUS ו-GEN מהמלאי המקומי רק כל עוד
+ *   רוב הצמתים אישרו אותו בפרק הזמן האחרון (90% מזמן הבחירות המינימלי). צומת
+ *   ששמע מהמנהיג בזמן הזה אינו מצביע לאחר, ולכן אין מנהיג חדש לפני שהחכירה
+ *   פגה. צומת שאינו מנהיג דוחה עדכונים ושאילתות ("ERROR: Not leader")
+ * - רשומה שלא הוחלה תוך RAFT_COMMIT_TIMEOUT_MS, או שהמנהיג איבד את ההנהגה לפני
+ *   שהוחלה, עדיין עלולה להיות מחויבת; הלקוח מקבל "ERROR: Outcome unknown"
+ *   (בפרוטוקול הבינארי PROTO_STATUS_UNKNOWN) ולא תשובת כישלון
+ * - בעלייה המלאי נבנה מצילום המצב, והרשומות שאחריו מוחלות שוב כשהאשכול
+ *   מאשר שהן מחויבות; ערכי --carbon/--hydrogen/--oxygen אינם בשימוש
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "raft.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "crc32c.h"
+#include "latency.h"
+
+#define RAFT_HEARTBEAT_MS 50         // A leader with nothing to send appends nothing this often
+#define RAFT_ELECTION_MS 250         // Minimum election timeout; a random 0-100% is added
+#define RAFT_LEASE_MS 225            // Read lease of a leader: 90% of the minimum election timeout
+#define RAFT_RETRY_MS 100            // Delay between connection attempts to a peer
+#define RAFT_IO_TIMEOUT_MS 1000      // A peer that does not answer for this long is disconnected
+#define RAFT_COMMIT_TIMEOUT_MS 2000  // Longest an update waits to be committed
+#define RAFT_TICK_MS 10              // Period of the election timer
+#define RAFT_BATCH 512               // Entries sent in one append
+#define RAFT_COMPACT_ENTRIES 100000  // Applied entries kept in the log before a snapshot replaces them
+#define RAFT_RESULTS 65536           // Outcomes of the last applied entries, for the waiting updates
+#define RAFT_MAX_WAITERS 256         // Event loops waiting for applied entries (raft_request_notify)
+#define RAFT_NAME_SIZE 128
+#define RAFT_PATH_SIZE 4200
+#define RAFT_HOLE_ALIGN 4096         // The log file header stays in the first page
+
+#define MS 1000000ULL
+
+/**
+ * Term and vote, kept in <save-file>.raft-state
+ */
+typedef struct {
+    uint32_t magic;      // RAFT_MAGIC
+    uint32_t version;    // RAFT_VERSION
+    uint64_t term;       // Current term
+    uint32_t voted_for;  // Node voted for in that term, 0 if none
+    uint32_t crc;        // CRC32C of the record up to this field
+} RaftState;
+
+/**
+ * Header of <save-file>.raft, in the slot of entry 0
+ */
+typedef struct {
+    uint32_t magic;          // RAFT_MAGIC
+    uint32_t version;        // RAFT_VERSION
+    uint32_t record_size;    // sizeof(RaftEntry)
+    uint32_t num_elements;   // NUM_ELEMENTS
+    uint32_t node;           // Node id that owns the log
+    unsigned char reserved[24];
+    uint32_t crc;            // CRC32C of the header up to this field
+} RaftLogHeader;
+
+/**
+ * A Raft message and the entries that follow it, sent with one send()
+ */
+typedef struct {
+    RaftMessage header;
+    RaftEntry entries[RAFT_BATCH];
+} RaftPacket;
+
+/**
+ * Another node, and the leader's view of it
+ * Guarded by raft_lock, except out (its sender thread only)
+ */
+typedef struct {
+    char name[RAFT_NAME_SIZE];           // host:port from --raft-peers
+    struct sockaddr_in addr;
+    uint64_t next_index;                 // Next entry to send
+    uint64_t match_index;                // Last entry known to be in its log
+    uint64_t vote_term;                  // Term its vote was asked for
+    unsigned long long heartbeat_due_ns; // latency_now_ns() when the next append is due
+    unsigned long long ack_sent_ns;      // Send time of the last message it answered in this term
+    unsigned long long retry_ns;         // No connection attempt before this time
+    int connected;
+    unsigned long long appends;          // Appends sent
+    unsigned long long entries_sent;     // Entries they carried
+    RaftPacket out;                      // Message being sent
+} RaftPeer;
+
+/**
+ * Outcome of an applied entry, for the update waiting on it
+ */
+typedef struct {
+    uint64_t index;
+    uint64_t term;
+    int ok;  // 1 applied, 0 did not fit the stock
+} RaftResult;
+
+static int raft_id = 0;     // This node, 0 without --raft-id
+static int raft_nodes = 0;
+static RaftPeer raft_peers[RAFT_MAX_NODES];  // Indexed by node id - 1; this node's slot only names it
+
+static pthread_mutex_t raft_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond;     // Senders: something to send
+static pthread_cond_t commit_cond;   // Apply thread: the commit index moved
+static pthread_cond_t applied_cond;  // Snapshot install: the apply thread finished a batch
+static pthread_cond_t sync_cond;     // Log syncer: the leader appended entries
+
+// Kept in <save-file>.raft-state before any reply depends on them
+static uint64_t current_term = 0;
+static int voted_for = 0;
+
+static int role = RAFT_FOLLOWER;
+static int leader_id = 0;                           // Leader of the current term, 0 if not known
+static int votes = 0;                               // Candidate: votes received
+static uint64_t term_start = 0;                     // Leader: the NOOP entry that opened its term
+static unsigned long long election_deadline_ns = 0; // Not leader: start an election at this time
+static unsigned long long leader_contact_ns = 0;    // Follower: last append or snapshot from the leader
+static unsigned long long leader_since_ns = 0;      // Leader: when it was elected
+static unsigned long long quorum_ns = 0;            // Leader: a majority acknowledged messages sent at this time
+static unsigned long long lease_until_ns = 0;       // Leader: queries are answered until then, 0 if not at all
+static unsigned long long leader_epoch = 0;         // Counts the times this node became leader
+static unsigned int random_seed;
+
+// The log in memory: log_entries[0] is entry log_base, the last entry the snapshot includes
+static RaftEntry *log_entries = NULL;
+static size_t log_capacity = 0;
+static uint64_t log_base = 0;
+static uint64_t last_index = 0;
+static uint64_t commit_index = 0;
+static uint64_t applied_index = 0;
+static uint64_t durable_index = 0;    // Leader: entries synced to its own log file
+static int applying = 0;              // The apply thread works outside the lock
+static SnapshotFile raft_snapshot;    // Stock after entry log_base
+static RaftResult raft_results[RAFT_RESULTS];
+static int waiters[RAFT_MAX_WAITERS];  // eventfds of the loops whose replies wait for entries
+static int num_waiters = 0;
+
+static int log_fd = -1;
+static int state_fd = -1;
+static int raft_listen_fd = -1;
+static char log_path[RAFT_PATH_SIZE];
+static char state_path[RAFT_PATH_SIZE];
+static char snapshot_path[RAFT_PATH_SIZE];
+
+// Statistics (guarded by raft_lock)
+static unsigned long long elections = 0;
+static unsigned long long snapshots_taken = 0;
+static unsigned long long snapshots_installed = 0;
+static unsigned long long log_syncs = 0;
+static unsigned long long synced_entries = 0;
+static LatencyHistogram commit_latency;  // Leader: update handed to the log until applied
+
+/* ===== LOG AND PERSISTENT STATE ===== */
+
+/**
+ * Returns entry index of the log (log_base <= index <= last_index)
+ */
+static RaftEntry *entry_at(uint64_t index) {
+    return &log_entries[index - log_base];
+}
+
+/**
+ * Returns the offset of entry index in the log file
+ */
+static off_t entry_offset(uint64_t index) {
+    return (off_t)(index * sizeof(RaftEntry));
+}
+
+/**
+ * Returns the CLOCK_REALTIME time in nanoseconds
+ */
+static uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Returns a random election timeout in nanoseconds
+ */
+static unsigned long long election_timeout_ns() {
+    return (RAFT_ELECTION_MS + rand_r(&random_seed) % RAFT_ELECTION_MS) * MS;
+}
+
+/**
+ * Stops the process after a failed write of the log or of the vote
+ * A node that cannot keep what it promised its peers must not answer them
+ */
+static void fail_stop(const char *what) {
+    fprintf(stderr, "Raft: %s failed: %s; stopping\n", what, strerror(errno));
+    exit(1);
+}
+
+/**
+ * Writes the term and vote to disk
+ */
+static void save_state() {
+    RaftState state;
+
+    memset(&state, 0, sizeof(state));
+    state.magic = RAFT_MAGIC;
+    state.version = RAFT_VERSION;
+    state.term = current_term;
+    state.voted_for = voted_for;
+    state.crc = crc32c(&state, offsetof(RaftState, crc));
+    if (pwrite(state_fd, &state, sizeof(state), 0) != (ssize_t)sizeof(state) || fdatasync(state_fd) == -1) {
+        fail_stop("Saving the term and vote");
+    }
+}
+
+/**
+ * Empties the log: entry base (term) becomes its only, already applied, entry
+ */
+static void log_reset(uint64_t base, uint64_t term) {
+    if (log_capacity == 0) {
+        log_capacity = 4096;
+        log_entries = malloc(log_capacity * sizeof(RaftEntry));
+        if (log_entries == NULL) {
+            fprintf(stderr, "Raft: out of memory for the log\n");
+            exit(1);
+        }
+    }
+    memset(&log_entries[0], 0, sizeof(RaftEntry));
+    log_entries[0].index = base;
+    log_entries[0].term = term;
+    log_base = last_index = base;
+}
+
+/**
+ * Appends an entry to the log in memory
+ */
+static void log_push(const RaftEntry *entry) {
+    size_t used = last_index - log_base + 1;
+    if (used == log_capacity) {
+        RaftEntry *grown = realloc(log_entries, 2 * log_capacity * sizeof(RaftEntry));
+        if (grown == NULL) {
+            fprintf(stderr, "Raft: out of memory for the log\n");
+            exit(1);
+        }
+        log_entries = grown;
+        log_capacity *= 2;
+    }
+    log_entries[used] = *entry;
+    last_index = entry->index;
+}
+
+/**
+ * Writes entries first .. first + count - 1 of the log to the log file
+ */
+static void write_entries(uint64_t first, size_t count) {
+    size_t len = count * sizeof(RaftEntry);
+    if (pwrite(log_fd, entry_at(first), len, entry_offset(first)) != (ssize_t)len) fail_stop("Writing the log");
+}
+
+/**
+ * Flushes the log file to disk
+ */
+static void sync_log() {
+    if (fdatasync(log_fd) == -1) fail_stop("Syncing the log");
+    log_syncs++;
+}
+
+/**
+ * Frees the disk blocks of the entries before log_base
+ * The file keeps its offsets, so entry i stays at entry_offset(i)
+ */
+static void release_log_prefix() {
+    static int reported = 0;
+    off_t end = entry_offset(log_base) / RAFT_HOLE_ALIGN * RAFT_HOLE_ALIGN;
+    if (end <= RAFT_HOLE_ALIGN) return;
+    if (fallocate(log_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, RAFT_HOLE_ALIGN, end - RAFT_HOLE_ALIGN) == -1 &&
+        !reported) {
+        fprintf(stderr, "Raft: cannot free compacted log entries (%s); %s keeps growing\n", strerror(errno),
+                log_path);
+        reported = 1;
+    }
+}
+
+/**
+ * Removes the entries from index on, in memory and in the file
+ */
+static void truncate_log(uint64_t index) {
+    last_index = index - 1;
+    if (ftruncate(log_fd, entry_offset(index)) == -1) fail_stop("Truncating the log");
+}
+
+/**
+ * Reads the term and vote of a restarting node
+ *
+ * @return  0 on success, -1 on failure (error already printed)
+ */
+static int load_state() {
+    RaftState state;
+
+    state_fd = open(state_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (state_fd == -1) {
+        perror(state_path);
+        return -1;
+    }
+    ssize_t got = pread(state_fd, &state, sizeof(state), 0);
+    if (got == 0) return 0;
+    if (got != (ssize_t)sizeof(state) || state.magic != RAFT_MAGIC || state.version != RAFT_VERSION ||
+        state.crc != crc32c(&state, offsetof(RaftState, crc))) {
+        fprintf(stderr, "%s is damaged; the node cannot rejoin without its term and vote\n", state_path);
+        return -1;
+    }
+    current_term = state.term;
+    voted_for = state.voted_for;
+    return 0;
+}
+
+/**
+ * Opens the log file and loads the entries after the snapshot
+ * A torn or damaged tail (a crash during a write) is cut off
+ *
+ * @return  0 on success, -1 on failure (error already printed)
+ */
+static int load_log() {
+    static RaftEntry chunk[RAFT_BATCH];
+    RaftLogHeader header;
+    struct stat st;
+
+    log_fd = open(log_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd == -1 || fstat(log_fd, &st) == -1) {
+        perror(log_path);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        header.magic = RAFT_MAGIC;
+        header.version = RAFT_VERSION;
+        header.record_size = sizeof(RaftEntry);
+        header.num_elements = NUM_ELEMENTS;
+        header.node = raft_id;
+        header.crc = crc32c(&header, offsetof(RaftLogHeader, crc));
+        if (pwrite(log_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || fdatasync(log_fd) == -1) {
+            perror(log_path);
+            return -1;
+        }
+        return 0;
+    }
+    if (pread(log_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || header.magic != RAFT_MAGIC ||
+        header.version != RAFT_VERSION || header.record_size != sizeof(RaftEntry) ||
+        header.num_elements != NUM_ELEMENTS || header.crc != crc32c(&header, offsetof(RaftLogHeader, crc))) {
+        fprintf(stderr, "Unrecognized Raft log: %s\n", log_path);
+        return -1;
+    }
+    if (header.node != (uint32_t)raft_id) {
+        fprintf(stderr, "%s is the log of node %u, not of node %d\n", log_path, header.node, raft_id);
+        return -1;
+    }
+
+    // Entries follow the snapshot in order, with terms that never go down
+    off_t offset = entry_offset(log_base + 1);
+    int damaged = 0;
+    while (!damaged) {
+        ssize_t got = pread(log_fd, chunk, sizeof(chunk), offset);
+        if (got <= 0) break;
+        size_t count = got / sizeof(RaftEntry);
+        for (size_t i = 0; i < count && !damaged; i++) {
+            const RaftEntry *entry = &chunk[i];
+            damaged = entry->index != last_index + 1 || entry->term < entry_at(last_index)->term ||
+                      entry->op > WAL_OP_DELIVER || entry->crc != crc32c(entry, offsetof(RaftEntry, crc));
+            if (!damaged) log_push(entry);
+        }
+        if (count < RAFT_BATCH) break;
+        offset += got;
+    }
+    off_t valid = entry_offset(last_index + 1);
+    if (st.st_size > valid) {
+        printf("Raft log %s: ignoring %lld bytes of incomplete entries after entry %llu\n", log_path,
+               (long long)(st.st_size - valid), (unsigned long long)last_index);
+        if (ftruncate(log_fd, valid) == -1) {
+            perror(log_path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* ===== ROLES ===== */
+
+/**
+ * Wakes the event loops whose replies wait for entries (raft_request_notify)
+ * Each loop checks its entries with raft_result() and asks again if needed
+ */
+static void wake_waiters() {
+    uint64_t one = 1;
+    for (int i = 0; i < num_waiters; i++) {
+        if (write(waiters[i], &one, sizeof(one)) == -1 && errno != EAGAIN) perror("wake event loop");
+    }
+    num_waiters = 0;
+}
+
+/**
+ * Sorts a few values in descending order
+ */
+static void sort_descending(unsigned long long *values, int count) {
+    for (int i = 1; i < count; i++) {
+        unsigned long long value = values[i];
+        int j = i;
+        for (; j > 0 && values[j - 1] < value; j--) values[j] = values[j - 1];
+        values[j] = value;
+    }
+}
+
+/**
+ * Recomputes the leader's lease from the send times of the messages its
+ * peers answered: a majority (this node included) has acknowledged it since
+ * the time the majority-th latest of them was sent
+ */
+static void update_lease() {
+    unsigned long long acks[RAFT_MAX_NODES];
+    int count = 0;
+
+    if (role != RAFT_LEADER) {
+        __atomic_store_n(&lease_until_ns, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    acks[count++] = ULLONG_MAX;  // This node
+    for (int i = 0; i < raft_nodes; i++) {
+        if (i != raft_id - 1) acks[count++] = raft_peers[i].ack_sent_ns;
+    }
+    sort_descending(acks, count);
+    unsigned long long majority = acks[raft_nodes / 2];
+    quorum_ns = majority == ULLONG_MAX ? latency_now_ns() : majority;
+
+    // Queries wait until the entries committed by earlier leaders are applied here
+    unsigned long long until = 0;
+    if (applied_index >= term_start && majority != 0) {
+        until = majority == ULLONG_MAX ? ULLONG_MAX : majority + RAFT_LEASE_MS * MS;
+    }
+    __atomic_store_n(&lease_until_ns, until, __ATOMIC_RELEASE);
+}
+
+/**
+ * Commits the newest entry of this term that a majority has in its log
+ */
+static void advance_commit() {
+    unsigned long long matches[RAFT_MAX_NODES];
+
+    for (int i = 0; i < raft_nodes; i++) {
+        matches[i] = i == raft_id - 1 ? durable_index : raft_peers[i].match_index;
+    }
+    sort_descending(matches, raft_nodes);
+    uint64_t majority = matches[raft_nodes / 2];
+
+    // Entries of earlier terms are committed only through one of this term
+    if (majority > commit_index && entry_at(majority)->term == current_term) {
+        commit_index = majority;
+        pthread_cond_signal(&commit_cond);
+    }
+}
+
+/**
+ * Becomes a follower, in a newer term if term is higher
+ */
+static void become_follower(uint64_t term) {
+    if (term > current_term) {
+        current_term = term;
+        voted_for = 0;
+        leader_id = 0;
+        save_state();
+    }
+    if (role != RAFT_FOLLOWER) {
+        if (role == RAFT_LEADER) {
+            printf("Raft: node %d steps down in term %llu\n", raft_id, (unsigned long long)current_term);
+            if (leader_id == raft_id) leader_id = 0;
+        }
+        role = RAFT_FOLLOWER;
+        update_lease();
+        // Replies waiting for this leader give up
+        wake_waiters();
+    }
+    election_deadline_ns = latency_now_ns() + election_timeout_ns();
+}
+
+/**
+ * Becomes the leader of the current term
+ * The term opens with a NOOP entry: once it is committed, so is everything
+ * earlier leaders committed
+ */
+static void become_leader(unsigned long long now) {
+    RaftEntry noop;
+
+    role = RAFT_LEADER;
+    leader_id = raft_id;
+    leader_since_ns = now;
+    quorum_ns = 0;
+    leader_epoch++;
+    durable_index = log_base;  // Entries written as a follower are synced again
+    for (int i = 0; i < raft_nodes; i++) {
+        RaftPeer *peer = &raft_peers[i];
+        peer->next_index = last_index + 1;
+        peer->match_index = 0;
+        peer->ack_sent_ns = 0;
+        peer->heartbeat_due_ns = 0;
+    }
+
+    memset(&noop, 0, sizeof(noop));
+    noop.index = last_index + 1;
+    noop.term = current_term;
+    noop.op = RAFT_OP_NOOP;
+    noop.crc = crc32c(&noop, offsetof(RaftEntry, crc));
+    log_push(&noop);
+    write_entries(noop.index, 1);
+    term_start = noop.index;
+    update_lease();
+
+    printf("Raft: node %d is the leader of term %llu\n", raft_id, (unsigned long long)current_term);
+    pthread_cond_broadcast(&work_cond);
+    pthread_cond_signal(&sync_cond);
+}
+
+/**
+ * Starts an election in the next term, voting for this node
+ */
+static void start_election(unsigned long long now) {
+    role = RAFT_CANDIDATE;
+    current_term++;
+    voted_for = raft_id;
+    leader_id = 0;
+    save_state();
+    votes = 1;
+    elections++;
+    election_deadline_ns = now + election_timeout_ns();
+    for (int i = 0; i < raft_nodes; i++) raft_peers[i].vote_term = 0;
+
+    if (votes * 2 > raft_nodes) {
+        become_leader(now);
+    } else {
+        pthread_cond_broadcast(&work_cond);
+    }
+}
+
+/* ===== RECEIVING ===== */
+
+/**
+ * Answers a RequestVote
+ */
+static void handle_vote(const RaftMessage *msg, RaftMessage *reply) {
+    unsigned long long now = latency_now_ns();
+
+    // While the leader is known to be alive nobody replaces it: this keeps its lease valid
+    int leader_alive = role == RAFT_LEADER ||
+                       (leader_id != 0 && now - leader_contact_ns < RAFT_ELECTION_MS * MS);
+    if (msg->term > current_term && leader_alive) return;
+
+    if (msg->term > current_term) become_follower(msg->term);
+    if (msg->term < current_term) return;
+
+    // Only a candidate whose log is at least as up to date may win
+    const RaftEntry *last = entry_at(last_index);
+    int up_to_date = msg->log_term > last->term || (msg->log_term == last->term && msg->index >= last_index);
+    if ((voted_for == 0 || voted_for == (int)msg->from) && up_to_date) {
+        voted_for = msg->from;
+        save_state();
+        reply->success = 1;
+        election_deadline_ns = now + election_timeout_ns();
+    }
+}
+
+/**
+ * Checks that an APPEND or SNAPSHOT comes from the leader of the current
+ * term, and follows that leader
+ *
+ * @return  1 if it does, 0 if the message is from an older term
+ */
+static int accept_leader(const RaftMessage *msg) {
+    if (msg->term < current_term) return 0;
+    if (msg->term > current_term || role != RAFT_FOLLOWER) become_follower(msg->term);
+    if (leader_id != (int)msg->from) {
+        leader_id = msg->from;
+        printf("Raft: node %d follows node %d in term %llu\n", raft_id, leader_id, (unsigned long long)current_term);
+    }
+    leader_contact_ns = latency_now_ns();
+    election_deadline_ns = leader_contact_ns + election_timeout_ns();
+    return 1;
+}
+
+/**
+ * Answers an AppendEntries: the entries are written and synced before the reply
+ */
+static void handle_append(const RaftMessage *msg, const RaftEntry *entries, RaftMessage *reply) {
+    uint64_t prev = msg->index, prev_term = msg->log_term;
+    uint32_t count = msg->count;
+
+    reply->index = last_index;
+    if (!accept_leader(msg)) return;
+    for (uint32_t i = 0; i < count; i++) {
+        if (entries[i].index != prev + 1 + i || entries[i].crc != crc32c(&entries[i], offsetof(RaftEntry, crc))) {
+            fprintf(stderr, "Raft: damaged entry %llu from node %u\n", (unsigned long long)entries[i].index,
+                    msg->from);
+            return;
+        }
+    }
+
+    // Entries up to the snapshot are committed, and the same on every node
+    if (prev < log_base) {
+        uint64_t skip = log_base - prev;
+        if (skip >= count) {
+            reply->success = 1;
+            reply->index = log_base;
+            return;
+        }
+        entries += skip;
+        count -= skip;
+        prev = log_base;
+        prev_term = entry_at(log_base)->term;
+    }
+    if (prev > last_index) return;
+    if (entry_at(prev)->term != prev_term) {
+        // Skip back over the whole conflicting term in one round trip
+        uint64_t conflict = entry_at(prev)->term, hint = prev - 1;
+        while (hint > commit_index && entry_at(hint)->term == conflict) hint--;
+        reply->index = hint;
+        return;
+    }
+
+    uint64_t first_new = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t index = prev + 1 + i;
+        if (index <= last_index) {
+            if (entry_at(index)->term == entries[i].term) continue;
+            if (index <= commit_index) {
+                fprintf(stderr, "Raft: node %u conflicts with committed entry %llu\n", msg->from,
+                        (unsigned long long)index);
+                return;
+            }
+            // Entries an earlier leader could not commit
+            truncate_log(index);
+        }
+        if (first_new == 0) first_new = index;
+        log_push(&entries[i]);
+    }
+    if (first_new != 0) {
+        write_entries(first_new, last_index - first_new + 1);
+        sync_log();
+        synced_entries += last_index - first_new + 1;
+    }
+
+    reply->success = 1;
+    reply->index = prev + count;
+    uint64_t commit = msg->commit < reply->index ? msg->commit : reply->index;
+    if (commit > commit_index) {
+        commit_index = commit;
+        pthread_cond_signal(&commit_cond);
+    }
+}
+
+/**
+ * Answers an InstallSnapshot: the leader compacted entries this node still needs
+ */
+static void handle_snapshot(const RaftMessage *msg, RaftMessage *reply) {
+    SnapshotFile snap;
+
+    reply->index = last_index;
+    if (!accept_leader(msg)) return;
+
+    // The apply thread must not work on the log being replaced
+    uint64_t term = current_term;
+    while (applying) pthread_cond_wait(&applied_cond, &raft_lock);
+    if (current_term != term || role != RAFT_FOLLOWER) return;
+    if (msg->index <= commit_index) {
+        // Everything the snapshot holds is committed here already
+        reply->success = 1;
+        reply->index = commit_index;
+        return;
+    }
+
+    memset(&snap, 0, sizeof(snap));
+    snap.time_ns = realtime_ns();
+    snap.log_lsn = msg->index;
+    snap.log_term = msg->log_term;
+    snap.stock = msg->stock;
+    if (snapshot_write(snapshot_path, &snap) == -1) {
+        fprintf(stderr, "Raft: cannot keep the leader's snapshot; stopping\n");
+        exit(1);
+    }
+    raft_snapshot = snap;
+    log_reset(msg->index, msg->log_term);
+    if (ftruncate(log_fd, entry_offset(log_base + 1)) == -1) fail_stop("Truncating the log");
+    release_log_prefix();
+    stock_replace(&snap.stock);
+    commit_index = applied_index = log_base;
+    snapshots_installed++;
+    printf("Raft: installed the snapshot of node %u at entry %llu: C=%llu, H=%llu, O=%llu\n", msg->from,
+           (unsigned long long)log_base, snap.stock.carbon, snap.stock.hydrogen, snap.stock.oxygen);
+
+    reply->success = 1;
+    reply->index = log_base;
+}
+
+/**
+ * Sends a whole buffer on a blocking socket
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Receives exactly len bytes from a blocking socket
+ *
+ * @return  0 on success, -1 on failure or end of stream
+ */
+static int recv_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Serves the messages of one peer's connection, one reply per message
+ */
+static void *handler_main(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    RaftMessage msg, reply;
+    RaftEntry *entries = malloc(RAFT_BATCH * sizeof(RaftEntry));
+
+    while (entries != NULL && recv_all(fd, &msg, sizeof(msg)) == 0) {
+        if (msg.magic != RAFT_MAGIC || msg.count > RAFT_BATCH || msg.from < 1 || (int)msg.from > raft_nodes ||
+            (int)msg.from == raft_id ||
+            (msg.type != RAFT_MSG_VOTE && msg.type != RAFT_MSG_APPEND && msg.type != RAFT_MSG_SNAPSHOT)) {
+            fprintf(stderr, "Raft: unexpected message (type %u) on a peer connection\n", msg.type);
+            break;
+        }
+        if (msg.count > 0 && recv_all(fd, entries, msg.count * sizeof(RaftEntry)) == -1) break;
+
+        memset(&reply, 0, sizeof(reply));
+        reply.magic = RAFT_MAGIC;
+        reply.type = msg.type + 1;
+        reply.from = raft_id;
+        pthread_mutex_lock(&raft_lock);
+        if (msg.type == RAFT_MSG_VOTE) {
+            handle_vote(&msg, &reply);
+        } else if (msg.type == RAFT_MSG_APPEND) {
+            handle_append(&msg, entries, &reply);
+        } else {
+            handle_snapshot(&msg, &reply);
+        }
+        reply.term = current_term;
+        pthread_mutex_unlock(&raft_lock);
+
+        if (send_all(fd, &reply, sizeof(reply)) == -1) break;
+    }
+    free(entries);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Accepts the connections of the other nodes
+ */
+static void *acceptor_main(void *arg) {
+    pthread_attr_t attr;
+    int one = 1;
+
+    (void)arg;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (1) {
+        int fd = accept4(raft_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("Raft accept");
+                usleep(RAFT_RETRY_MS * 1000);
+            }
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, handler_main, (void *)(intptr_t)fd) != 0) close(fd);
+    }
+    return NULL;
+}
+
+/* ===== SENDING ===== */
+
+/**
+ * Waits on a condition until it is signalled or deadline_ns (latency_now_ns() clock) passes
+ *
+ * @return  0, or ETIMEDOUT
+ */
+static int timed_wait(pthread_cond_t *cond, unsigned long long deadline_ns) {
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / 1000000000ULL;
+    ts.tv_nsec = deadline_ns % 1000000000ULL;
+    return pthread_cond_timedwait(cond, &raft_lock, &ts);
+}
+
+/**
+ * Returns the message a peer should get now: RAFT_MSG_VOTE, RAFT_MSG_APPEND,
+ * RAFT_MSG_SNAPSHOT, or 0 if none
+ */
+static int peer_work(const RaftPeer *peer, unsigned long long now) {
+    if (now < peer->retry_ns) return 0;
+    if (role == RAFT_CANDIDATE && peer->vote_term != current_term) return RAFT_MSG_VOTE;
+    if (role != RAFT_LEADER) return 0;
+    if (peer->next_index <= log_base) return RAFT_MSG_SNAPSHOT;
+    if (peer->next_index <= last_index || now >= peer->heartbeat_due_ns) return RAFT_MSG_APPEND;
+    return 0;
+}
+
+/**
+ * Fills peer->out with the next message for the peer
+ *
+ * @return  Number of entries in the message
+ */
+static size_t build_message(RaftPeer *peer, int type, unsigned long long now) {
+    RaftMessage *msg = &peer->out.header;
+    size_t count = 0;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->magic = RAFT_MAGIC;
+    msg->type = type;
+    msg->term = current_term;
+    msg->from = raft_id;
+    if (type == RAFT_MSG_VOTE) {
+        msg->index = last_index;
+        msg->log_term = entry_at(last_index)->term;
+        peer->vote_term = current_term;
+        return 0;
+    }
+    if (type == RAFT_MSG_SNAPSHOT) {
+        msg->index = raft_snapshot.log_lsn;
+        msg->log_term = raft_snapshot.log_term;
+        msg->stock = raft_snapshot.stock;
+    } else {
+        uint64_t prev = peer->next_index - 1;
+        count = last_index - prev < RAFT_BATCH ? last_index - prev : RAFT_BATCH;
+        msg->index = prev;
+        msg->log_term = entry_at(prev)->term;
+        msg->commit = commit_index;
+        msg->count = count;
+        memcpy(peer->out.entries, entry_at(prev + 1), count * sizeof(RaftEntry));
+        peer->appends++;
+        peer->entries_sent += count;
+    }
+    peer->heartbeat_due_ns = now + RAFT_HEARTBEAT_MS * MS;
+    return count;
+}
+
+/**
+ * Acts on a peer's reply to a message sent at sent_ns
+ */
+static void handle_reply(RaftPeer *peer, const RaftMessage *msg, const RaftMessage *reply, unsigned long long sent_ns) {
+    if (reply->term > current_term) {
+        become_follower(reply->term);
+        return;
+    }
+    if (msg->term != current_term) return;  // Sent in an earlier term
+
+    if (msg->type == RAFT_MSG_VOTE) {
+        if (role == RAFT_CANDIDATE && reply->success && ++votes * 2 > raft_nodes) become_leader(latency_now_ns());
+        return;
+    }
+    if (role != RAFT_LEADER) return;
+
+    // Any answer in this term acknowledges this node as the leader
+    if (sent_ns > peer->ack_sent_ns) {
+        peer->ack_sent_ns = sent_ns;
+        update_lease();
+    }
+    if (reply->success) {
+        if (reply->index > peer->match_index) peer->match_index = reply->index;
+        peer->next_index = peer->match_index + 1;
+        advance_commit();
+    } else {
+        // The peer's log does not match before next_index: retry from its hint
+        uint64_t next = reply->index + 1;
+        if (next >= peer->next_index) next = peer->next_index - 1;
+        peer->next_index = next > 0 ? next : 1;
+    }
+}
+
+/**
+ * Connects to a peer
+ *
+ * @return  Connected socket, or -1 on failure
+ */
+static int connect_peer(const RaftPeer *peer) {
+    struct timeval timeout = {RAFT_IO_TIMEOUT_MS / 1000, (RAFT_IO_TIMEOUT_MS % 1000) * 1000};
+    int one = 1;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (const struct sockaddr *)&peer->addr, sizeof(peer->addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/**
+ * Sender thread of one peer: one message in flight, answered before the next
+ * Entries appended while a message is on its way go out together in the next one
+ */
+static void *peer_main(void *arg) {
+    RaftPeer *peer = arg;
+    RaftMessage reply;
+    int fd = -1;
+
+    pthread_mutex_lock(&raft_lock);
+    while (1) {
+        unsigned long long now = latency_now_ns();
+        int type = peer_work(peer, now);
+        if (type == 0) {
+            unsigned long long deadline = now + RAFT_TICK_MS * MS;
+            if (role == RAFT_LEADER && peer->heartbeat_due_ns < deadline) deadline = peer->heartbeat_due_ns;
+            if (peer->retry_ns > now) deadline = peer->retry_ns;
+            timed_wait(&work_cond, deadline);
+            continue;
+        }
+
+        if (fd == -1) {
+            pthread_mutex_unlock(&raft_lock);
+            fd = connect_peer(peer);
+            pthread_mutex_lock(&raft_lock);
+            if (fd == -1) peer->retry_ns = latency_now_ns() + RAFT_RETRY_MS * MS;
+            peer->connected = fd != -1;
+            continue;
+        }
+
+        size_t count = build_message(peer, type, now);
+        pthread_mutex_unlock(&raft_lock);
+        unsigned long long sent_ns = latency_now_ns();
+        int ok = send_all(fd, &peer->out, sizeof(RaftMessage) + count * sizeof(RaftEntry)) == 0 &&
+                 recv_all(fd, &reply, sizeof(reply)) == 0 && reply.magic == RAFT_MAGIC &&
+                 reply.type == (uint32_t)type + 1;
+        pthread_mutex_lock(&raft_lock);
+
+        if (!ok) {
+            close(fd);
+            fd = -1;
+            peer->connected = 0;
+            peer->retry_ns = latency_now_ns() + RAFT_RETRY_MS * MS;
+            if (type == RAFT_MSG_VOTE) peer->vote_term = 0;
+            continue;
+        }
+        handle_reply(peer, &peer->out.header, &reply, sent_ns);
+    }
+    return NULL;
+}
+
+/**
+ * Election timer, and the leader's check that a majority still answers it
+ */
+static void *ticker_main(void *arg) {
+    struct timespec tick = {0, RAFT_TICK_MS * 1000000L};
+
+    (void)arg;
+    while (1) {
+        nanosleep(&tick, NULL);
+        pthread_mutex_lock(&raft_lock);
+        unsigned long long now = latency_now_ns();
+        if (role != RAFT_LEADER && now >= election_deadline_ns) {
+            start_election(now);
+        } else if (role == RAFT_LEADER && raft_nodes > 1) {
+            // Clients should look for the leader the majority can reach
+            unsigned long long contact = quorum_ns > leader_since_ns ? quorum_ns : leader_since_ns;
+            if (now - contact > 2 * RAFT_ELECTION_MS * MS) {
+                printf("Raft: node %d lost contact with the majority\n", raft_id);
+                become_follower(current_term);
+            }
+        }
+        // Replies still waiting check the commit timeout
+        wake_waiters();
+        pthread_mutex_unlock(&raft_lock);
+    }
+    return NULL;
+}
+
+/**
+ * Leader: syncs its own log file; one fdatasync covers every entry appended before it
+ */
+static void *sync_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&raft_lock);
+    while (1) {
+        while (role != RAFT_LEADER || durable_index >= last_index) pthread_cond_wait(&sync_cond, &raft_lock);
+        uint64_t target = last_index;
+        unsigned long long epoch = leader_epoch;
+        pthread_mutex_unlock(&raft_lock);
+        if (fdatasync(log_fd) == -1) fail_stop("Syncing the log");
+        pthread_mutex_lock(&raft_lock);
+        log_syncs++;
+        if (role == RAFT_LEADER && leader_epoch == epoch && target > durable_index) {
+            synced_entries += target - durable_index;
+            durable_index = target;
+            advance_commit();
+        }
+    }
+    return NULL;
+}
+
+/* ===== APPLYING ===== */
+
+/**
+ * Writes the stock after the last applied entry to the snapshot file and
+ * drops the entries it includes (called by the apply thread, applying set)
+ */
+static void compact_log() {
+    SnapshotFile snap;
+    unsigned long long start = latency_now_ns();
+
+    memset(&snap, 0, sizeof(snap));
+    snap.time_ns = realtime_ns();
+    snap.log_lsn = applied_index;
+    snap.log_term = entry_at(applied_index)->term;
+    stock_snapshot(&snap.stock);  // Only the apply thread changes the stock
+    pthread_mutex_unlock(&raft_lock);
+    int rc = snapshot_write(snapshot_path, &snap);
+    pthread_mutex_lock(&raft_lock);
+    if (rc == -1) return;  // The entries stay in the log
+
+    size_t keep = last_index - snap.log_lsn + 1;
+    memmove(log_entries, entry_at(snap.log_lsn), keep * sizeof(RaftEntry));
+    log_base = snap.log_lsn;
+    raft_snapshot = snap;
+    release_log_prefix();
+    snapshots_taken++;
+    printf("Raft: log compacted into %s at entry %llu (%.1f ms)\n", snapshot_path, (unsigned long long)log_base,
+           (latency_now_ns() - start) / 1e6);
+}
+
+/**
+ * Applies the committed entries in order, on every node
+ */
+static void *apply_main(void *arg) {
+    static RaftEntry batch[RAFT_BATCH];
+    static int outcome[RAFT_BATCH];
+
+    (void)arg;
+    pthread_mutex_lock(&raft_lock);
+    while (1) {
+        while (commit_index <= applied_index) pthread_cond_wait(&commit_cond, &raft_lock);
+        uint64_t first = applied_index + 1;
+        size_t count = commit_index - applied_index < RAFT_BATCH ? commit_index - applied_index : RAFT_BATCH;
+        memcpy(batch, entry_at(first), count * sizeof(RaftEntry));
+        applying = 1;
+        pthread_mutex_unlock(&raft_lock);
+
+        // The same entries give the same outcome everywhere: a DELIVER that does not fit is refused by every node
+        for (size_t i = 0; i < count; i++) {
+            outcome[i] = batch[i].op == RAFT_OP_NOOP || stock_apply_update(batch[i].op, batch[i].atoms) == 0;
+        }
+
+        pthread_mutex_lock(&raft_lock);
+        for (size_t i = 0; i < count; i++) {
+            RaftResult *result = &raft_results[batch[i].index % RAFT_RESULTS];
+            result->index = batch[i].index;
+            result->term = batch[i].term;
+            result->ok = outcome[i];
+        }
+        applied_index = first + count - 1;
+        if (role == RAFT_LEADER) update_lease();
+        if (applied_index - log_base >= RAFT_COMPACT_ENTRIES) compact_log();
+        applying = 0;
+        pthread_cond_broadcast(&applied_cond);
+        wake_waiters();
+    }
+    return NULL;
+}
+
+// The last update this thread appended, until raft_take_pending()
+static __thread RaftTicket pending_ticket;
+static __thread int pending = 0;
+
+/**
+ * Hands an ADD or DELIVER to the log (stock_update_proposer)
+ * It does not wait for the commit: the reactor thread takes the entry with
+ * raft_take_pending(), keeps serving other clients, and holds the reply
+ * until raft_result() settles it, so one loop keeps many entries in flight
+ *
+ * @return  1 if the entry was appended, 0 if this node is not the leader
+ */
+static int raft_propose(int op, const unsigned long long atoms[NUM_ELEMENTS]) {
+    unsigned long long start = latency_now_ns();
+    RaftEntry entry;
+
+    pending = 0;
+    pthread_mutex_lock(&raft_lock);
+    if (role != RAFT_LEADER) {
+        pthread_mutex_unlock(&raft_lock);
+        return 0;
+    }
+    memset(&entry, 0, sizeof(entry));
+    entry.index = last_index + 1;
+    entry.term = current_term;
+    entry.op = op;
+    memcpy(entry.atoms, atoms, sizeof(entry.atoms));
+    entry.crc = crc32c(&entry, offsetof(RaftEntry, crc));
+    log_push(&entry);
+    write_entries(entry.index, 1);
+    pthread_cond_signal(&sync_cond);
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&raft_lock);
+
+    pending_ticket.index = entry.index;
+    pending_ticket.term = entry.term;
+    pending_ticket.start_ns = start;
+    pending = 1;
+    return 1;
+}
+
+/**
+ * Returns the outcome of an appended update, RAFT_WAITING until it settles
+ */
+int raft_result(const RaftTicket *ticket) {
+    unsigned long long now = latency_now_ns();
+    int outcome = RAFT_WAITING;
+
+    pthread_mutex_lock(&raft_lock);
+    const RaftResult *result = &raft_results[ticket->index % RAFT_RESULTS];
+    int still_leading = role == RAFT_LEADER && current_term == ticket->term;
+    if (applied_index >= ticket->index) {
+        // Another entry at this index means this one was dropped by a later leader
+        outcome = result->index == ticket->index && result->term == ticket->term ? result->ok : -1;
+    } else if (!still_leading || now - ticket->start_ns >= RAFT_COMMIT_TIMEOUT_MS * MS) {
+        outcome = -1;
+    }
+    pthread_mutex_unlock(&raft_lock);
+
+    if (outcome == -1) {
+        if (still_leading) {
+            fprintf(stderr, "Error: Raft entry %llu of term %llu was not applied within %d ms; it may still be committed\n",
+                    (unsigned long long)ticket->index, (unsigned long long)ticket->term, RAFT_COMMIT_TIMEOUT_MS);
+        } else {
+            fprintf(stderr, "Error: Raft entry %llu of term %llu was not applied before this node stopped leading; "
+                    "it may still be committed\n", (unsigned long long)ticket->index, (unsigned long long)ticket->term);
+        }
+    } else if (outcome != RAFT_WAITING) {
+        latency_record(&commit_latency, now - ticket->start_ns);
+    }
+    return outcome;
+}
+
+/**
+ * Asks to be woken when waiting replies may be released
+ *
+ * @param notify_fd  Descriptor of the calling event loop
+ * @param index      Oldest entry the loop waits for
+ */
+void raft_request_notify(int notify_fd, uint64_t index) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&raft_lock);
+    if (applied_index >= index || role != RAFT_LEADER) {
+        // Settled before the loop asked: the apply thread will not wake it for this entry
+        if (write(notify_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) perror("wake event loop");
+    } else {
+        int listed = 0;
+        for (int i = 0; i < num_waiters && !listed; i++) listed = (waiters[i] == notify_fd);
+        if (!listed && num_waiters < RAFT_MAX_WAITERS) waiters[num_waiters++] = notify_fd;
+    }
+    pthread_mutex_unlock(&raft_lock);
+}
+
+/* ===== STARTUP ===== */
+
+/**
+ * Returns non-zero if text is a plain port number
+ */
+static int is_port(const char *text) {
+    if (*text == '\0') return 0;
+    for (const char *p = text; *p != '\0'; p++) {
+        if (!isdigit((unsigned char)*p)) return 0;
+    }
+    long port = strtol(text, NULL, 10);
+    return port > 0 && port <= 65535;
+}
+
+/**
+ * Parses --raft-peers into raft_peers
+ *
+ * @return  0 on success, -1 on failure (error already printed)
+ */
+static int parse_peers(const char *peers) {
+    char copy[RAFT_MAX_NODES * RAFT_NAME_SIZE], host[RAFT_NAME_SIZE], *save = NULL;
+
+    if (strlen(peers) >= sizeof(copy)) {
+        fprintf(stderr, "--raft-peers is too long\n");
+        return -1;
+    }
+    snprintf(copy, sizeof(copy), "%s", peers);
+    for (char *token = strtok_r(copy, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+        struct addrinfo hints, *result;
+        if (raft_nodes == RAFT_MAX_NODES) {
+            fprintf(stderr, "A Raft cluster has at most %d nodes\n", RAFT_MAX_NODES);
+            return -1;
+        }
+        const char *colon = strrchr(token, ':');
+        const char *port = colon != NULL ? colon + 1 : token;
+        if (!is_port(port) || strlen(token) >= RAFT_NAME_SIZE) {
+            fprintf(stderr, "Invalid Raft node address: %s (host:port or port)\n", token);
+            return -1;
+        }
+        snprintf(host, sizeof(host), "%.*s", colon != NULL ? (int)(colon - token) : 0, token);
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        int rc = getaddrinfo(host[0] != '\0' ? host : "127.0.0.1", port, &hints, &result);
+        if (rc != 0) {
+            fprintf(stderr, "Raft node %s: %s\n", token, gai_strerror(rc));
+            return -1;
+        }
+        RaftPeer *peer = &raft_peers[raft_nodes++];
+        snprintf(peer->name, sizeof(peer->name), "%s", token);
+        memcpy(&peer->addr, result->ai_addr, sizeof(peer->addr));
+        freeaddrinfo(result);
+    }
+    return 0;
+}
+
+/**
+ * Starts a detached thread
+ *
+ * @return  0 on success, -1 on failure (error already printed)
+ */
+static int start_thread(void *(*main)(void *), void *arg) {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, main, arg);
+    if (rc != 0) {
+        fprintf(stderr, "pthread_create (raft): %s\n", strerror(rc));
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * Joins the cluster as node id and starts the Raft threads
+ *
+ * @param id         This node, 1-based position in peers
+ * @param peers      Comma-separated host:port (or port on this host) of every node, in id order
+ * @param save_path  The save file; the log and the snapshot are kept next to it
+ * @return           0 on success, -1 on failure (error already printed)
+ */
+int raft_start(int id, const char *peers, const char *save_path) {
+    pthread_condattr_t attr;
+    int one = 1;
+
+    if (parse_peers(peers) == -1) return -1;
+    if (id < 1 || id > raft_nodes) {
+        fprintf(stderr, "--raft-id %d is not in --raft-peers (%d nodes)\n", id, raft_nodes);
+        return -1;
+    }
+    raft_id = id;
+    random_seed = (unsigned int)(latency_now_ns() ^ ((unsigned long long)getpid() << 16) ^ id);
+    snprintf(log_path, sizeof(log_path), "%s.raft", save_path);
+    snprintf(state_path, sizeof(state_path), "%s.raft-state", save_path);
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s.raft.snap", save_path);
+
+    // Term and vote, then the snapshot, then the entries after it
+    if (load_state() == -1) return -1;
+    memset(&raft_snapshot, 0, sizeof(raft_snapshot));
+    if (access(snapshot_path, F_OK) == 0 && snapshot_read(snapshot_path, &raft_snapshot) == -1) return -1;
+    log_reset(raft_snapshot.log_lsn, raft_snapshot.log_term);
+    if (load_log() == -1) return -1;
+
+    // The stock is rebuilt from the snapshot and the entries the cluster commits
+    stock_replace(&raft_snapshot.stock);
+    commit_index = applied_index = log_base;
+
+    raft_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (raft_listen_fd == -1) {
+        perror("Raft socket");
+        return -1;
+    }
+    setsockopt(raft_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(raft_listen_fd, (struct sockaddr *)&raft_peers[id - 1].addr, sizeof(raft_peers[id - 1].addr)) == -1 ||
+        listen(raft_listen_fd, RAFT_MAX_NODES * 2) == -1) {
+        fprintf(stderr, "Raft endpoint %s: %s\n", raft_peers[id - 1].name, strerror(errno));
+        return -1;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&work_cond, &attr);
+    pthread_cond_init(&commit_cond, &attr);
+    pthread_cond_init(&applied_cond, &attr);
+    pthread_cond_init(&sync_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    printf("Raft: node %d of %d on %s, term %llu, log entries %llu-%llu after the snapshot at entry %llu\n", raft_id,
+           raft_nodes, raft_peers[id - 1].name, (unsigned long long)current_term,
+           (unsigned long long)log_base + 1, (unsigned long long)last_index, (unsigned long long)log_base);
+
+    pthread_mutex_lock(&raft_lock);
+    election_deadline_ns = latency_now_ns() + election_timeout_ns();
+    pthread_mutex_unlock(&raft_lock);
+    stock_update_proposer = raft_propose;
+
+    if (start_thread(acceptor_main, NULL) == -1 || start_thread(apply_main, NULL) == -1 ||
+        start_thread(sync_main, NULL) == -1 || start_thread(ticker_main, NULL) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < raft_nodes; i++) {
+        if (i != id - 1 && start_thread(peer_main, &raft_peers[i]) == -1) return -1;
+    }
+    return 0;
+}
+
+/* ===== STATE ===== */
+
+/**
+ * Returns 1 if this process is a Raft node (--raft-id)
+ */
+int raft_enabled() {
+    return raft_id != 0;
+}
+
+/**
+ * Returns 1 if this process is a Raft node and not the leader
+ */
+int raft_follower() {
+    return raft_id != 0 && __atomic_load_n(&role, __ATOMIC_ACQUIRE) != RAFT_LEADER;
+}
+
+/**
+ * Returns 1 if the last ADD or DELIVER of the calling thread waits for its entry
+ */
+int raft_pending() {
+    return pending;
+}
+
+/**
+ * Takes the update the calling thread appended last
+ *
+ * @param ticket  Receives the entry
+ * @return        1 if there was one, 0 if not
+ */
+int raft_take_pending(RaftTicket *ticket) {
+    if (!pending) return 0;
+    *ticket = pending_ticket;
+    pending = 0;
+    return 1;
+}
+
+/**
+ * Returns 1 if a query may be answered from the local stock
+ * A leader's lease ends RAFT_LEASE_MS after the messages a majority last
+ * answered were sent; until then no other node can have been elected
+ */
+int raft_can_read() {
+    if (raft_id == 0) return 1;
+    unsigned long long until = __atomic_load_n(&lease_until_ns, __ATOMIC_ACQUIRE);
+    return until != 0 && latency_now_ns() < until;
+}
+
+/**
+ * Writes the reply to a request this node cannot serve
+ *
+ * @param reply       Buffer that receives the line (with its newline)
+ * @param reply_size  Size of the buffer
+ * @return            Length of the line
+ */
+size_t raft_not_leader(char *reply, size_t reply_size) {
+    int leader = __atomic_load_n(&leader_id, __ATOMIC_ACQUIRE);
+    int len;
+
+    if (leader != 0 && leader != raft_id) {
+        len = snprintf(reply, reply_size, "ERROR: Not leader (leader: node %d)\n", leader);
+    } else if (leader == raft_id) {
+        // The leader itself, before its lease is confirmed by a majority
+        len = snprintf(reply, reply_size, "ERROR: Not leader (lease not confirmed)\n");
+    } else {
+        len = snprintf(reply, reply_size, "ERROR: Not leader (no leader)\n");
+    }
+    return (len < 0) ? 0 : ((size_t)len < reply_size ? (size_t)len : reply_size - 1);
+}
+
+static const char *role_names[] = {"FOLLOWER", "CANDIDATE", "LEADER"};
+
+/**
+ * Answers the RAFT query with one line
+ *
+ * @param reply       Buffer that receives the line (with its newline)
+ * @param reply_size  Size of the buffer
+ * @return            Length of the line
+ */
+size_t raft_status(char *reply, size_t reply_size) {
+    int len;
+
+    if (raft_id == 0) {
+        len = snprintf(reply, reply_size, "RAFT NONE\n");
+    } else {
+        pthread_mutex_lock(&raft_lock);
+        len = snprintf(reply, reply_size, "RAFT %d %s TERM %llu LEADER %d COMMIT %llu APPLIED %llu\n", raft_id,
+                       role_names[role], (unsigned long long)current_term, leader_id,
+                       (unsigned long long)commit_index, (unsigned long long)applied_index);
+        pthread_mutex_unlock(&raft_lock);
+    }
+    return (len < 0) ? 0 : ((size_t)len < reply_size ? (size_t)len : reply_size - 1);
+}
+
+/**
+ * Prints the node's state, its peers and the commit latency (console command STATS)
+ */
+void raft_print_stats(FILE *out) {
+    if (raft_id == 0) return;
+
+    pthread_mutex_lock(&raft_lock);
+    unsigned long long now = latency_now_ns();
+    fprintf(out, "Raft: node %d of %d, %s in term %llu, leader %d\n", raft_id, raft_nodes, role_names[role],
+            (unsigned long long)current_term, leader_id);
+    fprintf(out, "  log: entries %llu-%llu after the snapshot at %llu, commit %llu, applied %llu\n",
+            (unsigned long long)log_base + 1, (unsigned long long)last_index, (unsigned long long)log_base,
+            (unsigned long long)commit_index, (unsigned long long)applied_index);
+    fprintf(out, "  elections started %llu, snapshots taken %llu / installed %llu, log syncs %llu (%.2f entries each)\n",
+            elections, snapshots_taken, snapshots_installed, log_syncs,
+            log_syncs ? (double)synced_entries / log_syncs : 0.0);
+    if (role == RAFT_LEADER) {
+        if (lease_until_ns == ULLONG_MAX) {
+            fprintf(out, "  lease: single node\n");
+        } else if (lease_until_ns > now) {
+            fprintf(out, "  lease: valid for %.1f ms\n", (lease_until_ns - now) / 1e6);
+        } else {
+            fprintf(out, "  lease: none\n");
+        }
+        for (int i = 0; i < raft_nodes; i++) {
+            const RaftPeer *peer = &raft_peers[i];
+            if (i == raft_id - 1) continue;
+            fprintf(out, "  node %d (%s): %s, match %llu, next %llu, appends %llu (%.2f entries each)\n", i + 1,
+                    peer->name, peer->connected ? "connected" : "disconnected",
+                    (unsigned long long)peer->match_index, (unsigned long long)peer->next_index, peer->appends,
+                    peer->appends ? (double)peer->entries_sent / peer->appends : 0.0);
+        }
+    }
+    pthread_mutex_unlock(&raft_lock);
+    latency_print(out, "Raft commit latency (update handed to the log until applied)", &commit_latency);
+}
@@ -0,0 +1,176 @@
+/*
+ * raft.h - אשכול drinks_bar בקונצנזוס Raft
+ *
+ * Optional consensus mode (--raft-id, --raft-peers): three or five drinks_bar
+ * processes, each with its own save file, replicate every ADD and DELIVER
+ * through a Raft log over TCP before applying it. The nodes elect a leader,
+ * compact the log into a snapshot file, and the leader answers queries
+ * under a lease.
+ */
+
+#ifndef RAFT_H
+#define RAFT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stock.h"
+
+#define RAFT_MAGIC 0x46524244u   // "DBRF"
+#define RAFT_VERSION 1
+#define RAFT_MAX_NODES 7
+
+#define RAFT_OP_NOOP 0   // Entry a new leader appends to commit its term (WAL_OP_ADD and WAL_OP_DELIVER otherwise)
+
+#define RAFT_FOLLOWER 0
+#define RAFT_CANDIDATE 1
+#define RAFT_LEADER 2
+
+#define RAFT_MSG_VOTE 1            // Candidate -> node: RequestVote
+#define RAFT_MSG_VOTE_REPLY 2
+#define RAFT_MSG_APPEND 3          // Leader -> follower: AppendEntries (count entries follow)
+#define RAFT_MSG_APPEND_REPLY 4
+#define RAFT_MSG_SNAPSHOT 5        // Leader -> follower: InstallSnapshot (the stock is in the message)
+#define RAFT_MSG_SNAPSHOT_REPLY 6
+
+/**
+ * One entry of the Raft log, in memory, on the wire and in <save-file>.raft
+ * Entry i is stored at offset i * sizeof(RaftEntry); slot 0 holds the file header
+ */
+typedef struct {
+    uint64_t index;                          // Position in the log, from 1
+    uint64_t term;                           // Term of the leader that created the entry
+    unsigned long long atoms[NUM_ELEMENTS];  // Atoms added or taken, indexed like the element ids
+    uint32_t op;                             // RAFT_OP_NOOP, WAL_OP_ADD or WAL_OP_DELIVER
+    uint32_t crc;                            // CRC32C of the entry up to this field
+} RaftEntry;
+
+/**
+ * Header of every Raft message and reply, in host byte order (every node
+ * runs the same build)
+ */
+typedef struct {
+    uint32_t magic;      // RAFT_MAGIC
+    uint32_t type;       // RAFT_MSG_*
+    uint64_t term;       // Sender's current term
+    uint32_t from;       // Sender's node id
+    uint32_t count;      // RAFT_MSG_APPEND: entries following the header
+    uint64_t index;      // Last log index (VOTE), entry before the entries (APPEND), last entry in the
+                         // snapshot (SNAPSHOT); in replies the last matching entry, or a hint where to retry
+    uint64_t log_term;   // Term of entry index (VOTE, APPEND, SNAPSHOT)
+    uint64_t commit;     // RAFT_MSG_APPEND: leader's commit index
+    uint32_t success;    // Replies: vote granted, entries or snapshot accepted
+    uint32_t reserved;
+    AtomStock stock;     // RAFT_MSG_SNAPSHOT: the stock after entry index
+} RaftMessage;
+
+/**
+ * Joins the cluster as node id and starts the Raft threads
+ * The stock is rebuilt from <save-file>.raft.snap and the entries the
+ * cluster commits; ADD and DELIVER then go through the log
+ * (stock_update_proposer). The save file must be open and kept by this
+ * process alone
+ *
+ * @param id         This node, 1-based position in peers
+ * @param peers      Comma-separated host:port (or port on this host) of every node, in id order
+ * @param save_path  The save file; the log and the snapshot are kept next to it
+ * @return           0 on success, -1 on failure (error already printed)
+ */
+int raft_start(int id, const char *peers, const char *save_path);
+
+/**
+ * Returns 1 if this process is a Raft node (--raft-id)
+ */
+int raft_enabled();
+
+/**
+ * Returns 1 if this process is a Raft node and not the leader, so it must
+ * refuse ADD and DELIVER
+ */
+int raft_follower();
+
+#define RAFT_WAITING -2  // raft_result(): the entry is neither applied nor given up yet
+
+/**
+ * An ADD or DELIVER in the leader's log whose reply waits until it is applied
+ */
+typedef struct {
+    uint64_t index;                // Log entry of the update
+    uint64_t term;                 // Term it was appended in
+    unsigned long long start_ns;   // latency_now_ns() when it was appended
+} RaftTicket;
+
+/**
+ * Returns 1 if the last ADD or DELIVER of the calling thread was appended to
+ * the log and its reply must wait (stock_update_proposer does not wait for
+ * the commit, so the stock operation reported it as not done)
+ */
+int raft_pending();
+
+/**
+ * Takes the update the calling thread appended last, like wal_take_pending()
+ *
+ * @param ticket  Receives the entry
+ * @return        1 if there was one, 0 if the thread appended nothing since the last call
+ */
+int raft_take_pending(RaftTicket *ticket);
+
+/**
+ * Returns the outcome of an appended update
+ * An entry that is still unapplied after RAFT_COMMIT_TIMEOUT_MS, or when this
+ * node stops leading its term, may yet be committed (by this leader or the
+ * next one): its outcome is unknown, and the client must not be told that it
+ * failed ("ERROR: Outcome unknown")
+ *
+ * @param ticket  The entry, from raft_take_pending()
+ * @return        1 if applied, 0 if it did not fit the stock, -1 if unknown,
+ *                RAFT_WAITING if not settled yet
+ */
+int raft_result(const RaftTicket *ticket);
+
+/**
+ * Asks to be woken when waiting replies may be released: notify_fd (an
+ * eventfd) is written to after the next applied entries (at once if entry
+ * index is applied already), when this node stops leading, or on the next
+ * tick of the election timer (for the commit timeout)
+ *
+ * @param notify_fd  Descriptor of the calling event loop
+ * @param index      Oldest entry the loop waits for
+ */
+void raft_request_notify(int notify_fd, uint64_t index);
+
+/**
+ * Returns 1 if a query may be answered from the local stock: always without
+ * --raft, otherwise only on a leader that holds a lease from a majority and
+ * has applied every entry committed before its term
+ */
+int raft_can_read();
+
+/**
+ * Writes the reply to a request this node cannot serve:
+ * "ERROR: Not leader (leader: node <id>)" or "ERROR: Not leader (no leader)"
+ *
+ * @param reply       Buffer that receives the line (with its newline)
+ * @param reply_size  Size of the buffer
+ * @return            Length of the line
+ */
+size_t raft_not_leader(char *reply, size_t reply_size);
+
+/**
+ * Answers the RAFT query with one line:
+ *   "RAFT NONE"
+ *   "RAFT <id> <LEADER|CANDIDATE|FOLLOWER> TERM <t> LEADER <id|0> COMMIT <index> APPLIED <index>"
+ *
+ * @param reply       Buffer that receives the line (with its newline)
+ * @param reply_size  Size of the buffer
+ * @return            Length of the line
+ */
+size_t raft_status(char *reply, size_t reply_size);
+
+/**
+ * Prints the node's state, its peers and the commit latency (console command STATS)
+ */
+void raft_print_stats(FILE *out);
+
+#endif
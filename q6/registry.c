@@ -0,0 +1,535 @@
+/*
+ * registry.c - טבלאות הרישום ואינדקס השמות
+ * -----------------------------------------
+ * הטבלאות נוצרות בזמן הקומפילציה מרשימות ה-X ב-registry.h.
+ *
+ * חיפוש שם נעשה בגיבוב מושלם (perfect hash) בשיטת hash-and-displace:
+ * - כל שם מגובב פעם אחת (FNV-1a של 64 ביט)
+ * - הגיבוב בוחר "דלי", ולכל דלי נשמרת היסט (displacement) שנבחר בבנייה
+ *   כך שכל השמות מקבלים תא נפרד בטבלה - ללא התנגשויות וללא סריקה
+ * - השוואת מחרוזת אחת בלבד מוודאת שהשם אכן קיים
+ * האינדקס נבנה פעם אחת, בשימוש הראשון (pthread_once).
+ *
+ * קטלוג מתכונים (registry_load_catalog, --catalog):
+ * קובץ טקסט שמוסיף מולקולות ומשקאות לטבלאות המובנות:
+ *     # הערה
+ *     molecule HYDROGEN PEROXIDE: 0 2 2
+ *     drink LEMONADE: 2 WATER, GLUCOSE
+ * מולקולה: כמות הפחמן, המימן והחמצן. משקה: רשימת מולקולות, עם כמות אופציונלית.
+ * המולקולות והמשקאות נשמרים במטריצה רציפה של אטומים לכל שורה, כך שלכל משקה
+ * כבר מחושב סך האטומים שהוא דורש. שורה שגויה אחת מבטלת את כל הקובץ.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "registry.h"
+
+#define REGISTRY_ELEMENT_NAME(id, name) name,
+#define REGISTRY_MOLECULE_ENTRY(id, name, c, h, o) {name, {c, h, o}},
+#define REGISTRY_DRINK_ENTRY(id, name, m1, m2, m3) {name, {MOLECULE_##m1, MOLECULE_##m2, MOLECULE_##m3}},
+
+#define CATALOG_MAX_COEFFICIENT 1000000  // Largest atom or molecule count in one catalog entry
+#define CATALOG_MAX_NAME 255             // Longest molecule or drink name in a catalog
+
+static const char *element_names[NUM_ELEMENTS] = { REGISTRY_ELEMENTS(REGISTRY_ELEMENT_NAME) };
+static const struct {
+    const char *name;
+    unsigned int atoms[NUM_ELEMENTS];
+} builtin_molecules[NUM_BUILTIN_MOLECULES] = { REGISTRY_MOLECULES(REGISTRY_MOLECULE_ENTRY) };
+static const struct {
+    const char *name;
+    int molecules[3];
+} builtin_drinks[NUM_BUILTIN_DRINKS] = { REGISTRY_DRINKS(REGISTRY_DRINK_ENTRY) };
+
+/**
+ * Perfect-hash index from names to dense ids
+ */
+typedef struct {
+    const char *const *names;  // Name of each id
+    uint32_t bucket_mask;      // Number of buckets - 1 (power of two)
+    uint32_t slot_mask;        // Number of slots - 1 (power of two)
+    uint32_t *displacements;   // Displacement chosen for each bucket
+    int32_t *slots;            // Id stored in each slot, -1 if empty
+} NameIndex;
+
+/**
+ * Molecules or drinks: names and a compact matrix of atoms per entry
+ */
+typedef struct {
+    const char **names;     // Name of each id
+    unsigned int *atoms;    // NUM_ELEMENTS atom counts per id, row after row
+    int count;              // Number of entries
+    int capacity;           // Allocated entries
+    int first_loaded;       // First id whose name was allocated by the catalog loader
+    NameIndex index;        // Name -> id
+} RegistryTable;
+
+static NameIndex element_index;
+static RegistryTable molecules, drinks;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+/**
+ * FNV-1a hash of a name
+ */
+static uint64_t name_hash(const char *name) {
+    uint64_t h = 14695981039346656037ULL;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Slot of a name hash for a given displacement
+ * Each displacement remixes the hash (splitmix64 finalizer), so a name gets
+ * an independent slot per displacement and is still hashed only once
+ */
+static uint32_t name_slot(uint64_t h, uint32_t displacement, uint32_t slot_mask) {
+    uint64_t mixed = h + (displacement + 1) * 0x9E3779B97F4A7C15ULL;
+    mixed = (mixed ^ (mixed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    mixed = (mixed ^ (mixed >> 27)) * 0x94D049BB133111EBULL;
+    mixed ^= mixed >> 31;
+    return (uint32_t)mixed & slot_mask;
+}
+
+/**
+ * Smallest power of two that is at least n (and at least 1)
+ */
+static uint32_t round_up_pow2(uint32_t n) {
+    uint32_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+/**
+ * Builds a perfect-hash index over a list of distinct names
+ * Buckets are placed largest first; each tries displacements until all of
+ * its names land in free slots
+ *
+ * @param index      Index to build (any previous tables are freed)
+ * @param names      Name of each id
+ * @param count      Number of names
+ * @param duplicate  Receives the id of a name listed twice, or -1
+ * @return           0 on success, -1 on allocation failure or duplicate names
+ */
+static int name_index_build(NameIndex *index, const char *const *names, int count, int *duplicate) {
+    uint32_t num_buckets = round_up_pow2((uint32_t)(count + 3) / 4);
+    uint32_t num_slots = round_up_pow2((uint32_t)count * 2);
+    uint64_t *hashes = malloc(sizeof(uint64_t) * (count + 1));
+    uint32_t *bucket_start = calloc(num_buckets + 1, sizeof(uint32_t));
+    int32_t *members = malloc(sizeof(int32_t) * (count + 1));
+    uint32_t *order = malloc(sizeof(uint32_t) * num_buckets);
+    uint32_t *fill = calloc(num_buckets, sizeof(uint32_t));
+    uint32_t *tried = malloc(sizeof(uint32_t) * (count + 1));
+    int result = -1;
+
+    *duplicate = -1;
+    free(index->displacements);
+    free(index->slots);
+    index->names = names;
+    index->bucket_mask = num_buckets - 1;
+    index->slot_mask = num_slots - 1;
+    index->displacements = calloc(num_buckets, sizeof(uint32_t));
+    index->slots = malloc(sizeof(int32_t) * num_slots);
+    if (hashes == NULL || bucket_start == NULL || members == NULL || order == NULL || fill == NULL || tried == NULL ||
+        index->displacements == NULL || index->slots == NULL) {
+        goto done;
+    }
+    memset(index->slots, 0xff, sizeof(int32_t) * num_slots);
+
+    // Group the names by bucket (counting sort)
+    for (int i = 0; i < count; i++) {
+        hashes[i] = name_hash(names[i]);
+        bucket_start[(hashes[i] & index->bucket_mask) + 1]++;
+    }
+    for (uint32_t b = 0; b < num_buckets; b++) bucket_start[b + 1] += bucket_start[b];
+    for (int i = 0; i < count; i++) {
+        uint32_t b = hashes[i] & index->bucket_mask;
+        members[bucket_start[b] + fill[b]++] = i;
+    }
+
+    // Largest buckets first (counting sort on the bucket size, reusing fill)
+    uint32_t max_size = 0, next = 0;
+    for (uint32_t b = 0; b < num_buckets; b++) {
+        if (fill[b] > max_size) max_size = fill[b];
+    }
+    for (uint32_t size = max_size; size > 0; size--) {
+        for (uint32_t b = 0; b < num_buckets; b++) {
+            if (fill[b] == size) order[next++] = b;
+        }
+    }
+
+    for (uint32_t k = 0; k < next; k++) {
+        uint32_t b = order[k], first = bucket_start[b], size = fill[b];
+        uint32_t displacement;
+
+        // Equal names have equal hashes and could never be placed apart
+        for (uint32_t i = 0; i < size && *duplicate < 0; i++) {
+            for (uint32_t j = i + 1; j < size; j++) {
+                int id_i = members[first + i], id_j = members[first + j];
+                if (hashes[id_i] == hashes[id_j] && strcmp(names[id_i], names[id_j]) == 0) {
+                    *duplicate = id_j;
+                    break;
+                }
+            }
+        }
+        if (*duplicate >= 0) goto done;
+
+        // Try displacements until every name of the bucket gets its own free slot
+        for (displacement = 0; displacement < (1u << 20); displacement++) {
+            uint32_t placed = 0;
+            for (; placed < size; placed++) {
+                uint32_t slot = name_slot(hashes[members[first + placed]], displacement, index->slot_mask);
+                if (index->slots[slot] != -1) break;
+                index->slots[slot] = members[first + placed];
+                tried[placed] = slot;
+            }
+            if (placed == size) break;
+            while (placed > 0) index->slots[tried[--placed]] = -1;
+        }
+        if (displacement == (1u << 20)) goto done;  // Identical 64-bit hashes of different names
+        index->displacements[b] = displacement;
+    }
+    result = 0;
+
+done:
+    free(hashes);
+    free(bucket_start);
+    free(members);
+    free(order);
+    free(fill);
+    free(tried);
+    if (result == -1) {
+        free(index->displacements);
+        free(index->slots);
+        index->displacements = NULL;
+        index->slots = NULL;
+    }
+    return result;
+}
+
+/**
+ * Looks a name up in a perfect-hash index
+ *
+ * @return  Id of the name, or -1 if the name is unknown
+ */
+static int name_index_lookup(const NameIndex *index, const char *name) {
+    if (index->slots == NULL) return -1;
+    uint64_t h = name_hash(name);
+    uint32_t slot = name_slot(h, index->displacements[h & index->bucket_mask], index->slot_mask);
+    int32_t id = index->slots[slot];
+    return (id >= 0 && strcmp(index->names[id], name) == 0) ? id : -1;
+}
+
+/**
+ * Appends an entry to a molecule or drink table
+ *
+ * @param table  Table to append to
+ * @param name   Name of the entry (kept, not copied)
+ * @param atoms  NUM_ELEMENTS atom counts
+ * @return       0 on success, -1 if out of memory
+ */
+static int table_append(RegistryTable *table, const char *name, const unsigned int *atoms) {
+    if (table->count == table->capacity) {
+        int capacity = table->capacity ? table->capacity * 2 : 16;
+        const char **names = realloc(table->names, sizeof(*names) * capacity);
+        if (names == NULL) return -1;
+        table->names = names;
+        unsigned int *rows = realloc(table->atoms, sizeof(*rows) * NUM_ELEMENTS * capacity);
+        if (rows == NULL) return -1;
+        table->atoms = rows;
+        table->capacity = capacity;
+    }
+    table->names[table->count] = name;
+    memcpy(table->atoms + (size_t)table->count * NUM_ELEMENTS, atoms, sizeof(*atoms) * NUM_ELEMENTS);
+    table->count++;
+    return 0;
+}
+
+/**
+ * Drops the entries appended from first on, freeing the names the loader allocated
+ */
+static void table_truncate(RegistryTable *table, int first) {
+    for (int id = first; id < table->count; id++) {
+        if (id >= table->first_loaded) free((char *)table->names[id]);
+    }
+    table->count = first;
+}
+
+/**
+ * (Re)builds the name index of a table
+ *
+ * @return  Id of a duplicate name, -1 if there is none (or on allocation failure)
+ */
+static int table_index(RegistryTable *table) {
+    int duplicate;
+    name_index_build(&table->index, table->names, table->count, &duplicate);
+    return duplicate;
+}
+
+/**
+ * Builds the built-in tables and their name indexes (once)
+ */
+static void registry_init() {
+    int duplicate;
+    name_index_build(&element_index, element_names, NUM_ELEMENTS, &duplicate);
+
+    for (int m = 0; m < NUM_BUILTIN_MOLECULES; m++) {
+        table_append(&molecules, builtin_molecules[m].name, builtin_molecules[m].atoms);
+    }
+    for (int d = 0; d < NUM_BUILTIN_DRINKS; d++) {
+        // A drink needs the sum of the atoms of its molecules
+        unsigned int atoms[NUM_ELEMENTS] = {0};
+        for (int i = 0; i < 3; i++) {
+            for (int e = 0; e < NUM_ELEMENTS; e++) {
+                atoms[e] += builtin_molecules[builtin_drinks[d].molecules[i]].atoms[e];
+            }
+        }
+        table_append(&drinks, builtin_drinks[d].name, atoms);
+    }
+    molecules.first_loaded = molecules.count;
+    drinks.first_loaded = drinks.count;
+    table_index(&molecules);
+    table_index(&drinks);
+}
+
+/**
+ * Copies a catalog name, joining its words with single spaces
+ * Words may not start with a digit, so a name never looks like an amount
+ *
+ * @param text  Name as written in the catalog
+ * @param out   Receives the name (CATALOG_MAX_NAME + 1 bytes)
+ * @return      1 on success, 0 if the name is empty, too long or has a numeric word
+ */
+static int catalog_name(const char *text, char *out) {
+    size_t len = 0;
+
+    while (*text != '\0') {
+        while (isspace((unsigned char)*text)) text++;
+        if (*text == '\0') break;
+        if (isdigit((unsigned char)*text)) return 0;
+        if (len > 0) {
+            if (len >= CATALOG_MAX_NAME) return 0;
+            out[len++] = ' ';
+        }
+        while (*text != '\0' && !isspace((unsigned char)*text)) {
+            if (len >= CATALOG_MAX_NAME) return 0;
+            out[len++] = *text++;
+        }
+    }
+    out[len] = '\0';
+    return len > 0;
+}
+
+/**
+ * Parses a catalog count (1 to CATALOG_MAX_COEFFICIENT, or 0 when zero is allowed)
+ *
+ * @param text  Text to parse; receives the position after the number
+ * @param out   Receives the count
+ * @return      1 on success, 0 if the text does not start with a valid count
+ */
+static int catalog_count(char **text, unsigned int *out) {
+    char *end;
+    while (isspace((unsigned char)**text)) (*text)++;
+    if (!isdigit((unsigned char)**text)) return 0;
+    errno = 0;
+    unsigned long value = strtoul(*text, &end, 10);
+    if (errno != 0 || value > CATALOG_MAX_COEFFICIENT) return 0;
+    *out = (unsigned int)value;
+    *text = end;
+    return 1;
+}
+
+/**
+ * Parses the part after the ':' of a molecule line: "<carbon> <hydrogen> <oxygen>"
+ *
+ * @return  NULL on success, otherwise the reason the line is invalid
+ */
+static const char *catalog_molecule(char *text, unsigned int atoms[NUM_ELEMENTS]) {
+    unsigned int total = 0;
+    for (int e = 0; e < NUM_ELEMENTS; e++) {
+        if (!catalog_count(&text, &atoms[e])) return "expected three atom counts";
+        total += atoms[e];
+    }
+    while (isspace((unsigned char)*text)) text++;
+    if (*text != '\0') return "unexpected text after the atom counts";
+    return total > 0 ? NULL : "a molecule needs at least one atom";
+}
+
+/**
+ * Parses the part after the ':' of a drink line: "[<count>] <MOLECULE>, ..."
+ *
+ * @return  NULL on success, otherwise the reason the line is invalid
+ */
+static const char *catalog_drink(char *text, unsigned int atoms[NUM_ELEMENTS]) {
+    unsigned long long total[NUM_ELEMENTS] = {0};
+    char name[CATALOG_MAX_NAME + 1], *save = NULL;
+
+    for (char *item = strtok_r(text, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        unsigned int count = 1;
+        while (isspace((unsigned char)*item)) item++;
+        if (isdigit((unsigned char)*item) && (!catalog_count(&item, &count) || count == 0)) {
+            return "invalid molecule count";
+        }
+        if (!catalog_name(item, name)) return "invalid molecule name";
+        int m = name_index_lookup(&molecules.index, name);
+        if (m < 0) return "unknown molecule";
+        for (int e = 0; e < NUM_ELEMENTS; e++) {
+            total[e] += (unsigned long long)count * molecules.atoms[(size_t)m * NUM_ELEMENTS + e];
+        }
+    }
+
+    unsigned long long sum = 0;
+    for (int e = 0; e < NUM_ELEMENTS; e++) {
+        if (total[e] > UINT_MAX) return "recipe needs too many atoms";
+        atoms[e] = (unsigned int)total[e];
+        sum += total[e];
+    }
+    return sum > 0 ? NULL : "a drink needs at least one molecule";
+}
+
+/**
+ * Loads molecule formulas and drink recipes from a catalog file
+ * Molecules are read in a first pass, so drinks may use molecules defined
+ * anywhere in the file. Nothing is added if any line is invalid.
+ *
+ * @param path  Path of the catalog file
+ * @return      0 on success, -1 on failure (error already printed)
+ */
+int registry_load_catalog(const char *path) {
+    pthread_once(&registry_once, registry_init);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("fopen catalog");
+        return -1;
+    }
+
+    int first_molecule = molecules.count, first_drink = drinks.count;
+    char *line = NULL, name[CATALOG_MAX_NAME + 1];
+    size_t line_size = 0;
+    const char *error = NULL;
+    int line_number = 0;
+
+    for (int pass = 0; pass < 2 && error == NULL; pass++) {
+        rewind(file);
+        line_number = 0;
+        while (error == NULL && getline(&line, &line_size, file) != -1) {
+            char *text = line, *colon;
+            unsigned int atoms[NUM_ELEMENTS];
+            int is_molecule;
+
+            line_number++;
+            text[strcspn(text, "\r\n#")] = '\0';
+            while (isspace((unsigned char)*text)) text++;
+            if (*text == '\0') continue;
+
+            if (strncmp(text, "molecule", 8) == 0 && isspace((unsigned char)text[8])) {
+                is_molecule = 1;
+            } else if (strncmp(text, "drink", 5) == 0 && isspace((unsigned char)text[5])) {
+                is_molecule = 0;
+            } else {
+                error = "expected 'molecule <NAME>: C H O' or 'drink <NAME>: <MOLECULE>, ...'";
+                break;
+            }
+            if (is_molecule != (pass == 0)) continue;
+
+            text += is_molecule ? 8 : 5;
+            colon = strchr(text, ':');
+            if (colon == NULL) {
+                error = "missing ':' after the name";
+                break;
+            }
+            *colon = '\0';
+            if (!catalog_name(text, name)) {
+                error = "invalid name";
+                break;
+            }
+            error = is_molecule ? catalog_molecule(colon + 1, atoms) : catalog_drink(colon + 1, atoms);
+            if (error != NULL) break;
+
+            char *copy = strdup(name);
+            if (copy == NULL || table_append(is_molecule ? &molecules : &drinks, copy, atoms) == -1) {
+                free(copy);
+                error = "out of memory";
+            }
+        }
+
+        // Index the molecules before the drink pass resolves their names
+        RegistryTable *table = (pass == 0) ? &molecules : &drinks;
+        int duplicate = (error == NULL) ? table_index(table) : -1;
+        if (duplicate >= 0) {
+            fprintf(stderr, "%s: %s '%s' is defined twice\n", path, pass == 0 ? "molecule" : "drink",
+                    table->names[duplicate]);
+            error = "";
+        }
+    }
+    free(line);
+    fclose(file);
+
+    if (error != NULL) {
+        if (*error != '\0') fprintf(stderr, "%s:%d: %s\n", path, line_number, error);
+        table_truncate(&molecules, first_molecule);
+        table_truncate(&drinks, first_drink);
+        table_index(&molecules);
+        table_index(&drinks);
+        return -1;
+    }
+    return 0;
+}
+
+int registry_element_id(const char *name) {
+    pthread_once(&registry_once, registry_init);
+    return name_index_lookup(&element_index, name);
+}
+
+const char *registry_element_name(int id) {
+    return (id >= 0 && id < NUM_ELEMENTS) ? element_names[id] : NULL;
+}
+
+int registry_num_molecules() {
+    pthread_once(&registry_once, registry_init);
+    return molecules.count;
+}
+
+int registry_molecule_id(const char *name) {
+    pthread_once(&registry_once, registry_init);
+    return name_index_lookup(&molecules.index, name);
+}
+
+const char *registry_molecule_name(int id) {
+    pthread_once(&registry_once, registry_init);
+    return (id >= 0 && id < molecules.count) ? molecules.names[id] : NULL;
+}
+
+const unsigned int *registry_molecule_formula(int id) {
+    pthread_once(&registry_once, registry_init);
+    return molecules.atoms + (size_t)id * NUM_ELEMENTS;
+}
+
+int registry_num_drinks() {
+    pthread_once(&registry_once, registry_init);
+    return drinks.count;
+}
+
+int registry_drink_id(const char *name) {
+    pthread_once(&registry_once, registry_init);
+    return name_index_lookup(&drinks.index, name);
+}
+
+const char *registry_drink_name(int id) {
+    pthread_once(&registry_once, registry_init);
+    return (id >= 0 && id < drinks.count) ? drinks.names[id] : NULL;
+}
+
+const unsigned int *registry_drink_atoms(int id) {
+    pthread_once(&registry_once, registry_init);
+    return drinks.atoms + (size_t)id * NUM_ELEMENTS;
+}
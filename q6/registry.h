@@ -0,0 +1,96 @@
+/*
+ * registry.h - רישום האטומים, המולקולות והמשקאות
+ *
+ * One table of elements, molecule formulas and drink recipes, shared by the
+ * server, the clients and the protocol. Names resolve to dense integer ids
+ * through a perfect hash, and the coefficients live in contiguous arrays, so
+ * after parsing every stock operation is an indexed lookup.
+ * A catalog file can add molecules and drinks at startup.
+ */
+
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+/**
+ * Built-in catalog
+ * X(id, name[, coefficients]) entries, expanded into the enums below and into
+ * the tables in registry.c. Elements must stay in AtomStock field order.
+ */
+#define REGISTRY_ELEMENTS(X) \
+    X(CARBON, "CARBON") \
+    X(HYDROGEN, "HYDROGEN") \
+    X(OXYGEN, "OXYGEN")
+
+// X(id, name, carbon, hydrogen, oxygen)
+#define REGISTRY_MOLECULES(X) \
+    X(WATER, "WATER", 0, 2, 1)                    /* H2O */ \
+    X(CARBON_DIOXIDE, "CARBON DIOXIDE", 1, 0, 2)  /* CO2 */ \
+    X(ALCOHOL, "ALCOHOL", 2, 6, 1)                /* C2H6O */ \
+    X(GLUCOSE, "GLUCOSE", 6, 12, 6)               /* C6H12O6 */
+
+// X(id, name, molecule, molecule, molecule)
+#define REGISTRY_DRINKS(X) \
+    X(SOFT_DRINK, "SOFT DRINK", WATER, CARBON_DIOXIDE, GLUCOSE) \
+    X(VODKA, "VODKA", WATER, ALCOHOL, GLUCOSE) \
+    X(CHAMPAGNE, "CHAMPAGNE", WATER, CARBON_DIOXIDE, ALCOHOL)
+
+#define REGISTRY_ELEMENT_ENUM(id, name) ELEMENT_##id,
+#define REGISTRY_MOLECULE_ENUM(id, name, c, h, o) MOLECULE_##id,
+#define REGISTRY_DRINK_ENUM(id, name, m1, m2, m3) DRINK_##id,
+
+enum { REGISTRY_ELEMENTS(REGISTRY_ELEMENT_ENUM) NUM_ELEMENTS };
+enum { REGISTRY_MOLECULES(REGISTRY_MOLECULE_ENUM) NUM_BUILTIN_MOLECULES };
+enum { REGISTRY_DRINKS(REGISTRY_DRINK_ENUM) NUM_BUILTIN_DRINKS };
+
+/**
+ * Adds the molecules and drinks of a catalog file after the built-in ones
+ * Built-in ids stay the same. Must be called before other threads use the registry.
+ * Format, one entry per line ('#' starts a comment):
+ *   molecule <NAME>: <carbon> <hydrogen> <oxygen>
+ *   drink <NAME>: [<count>] <MOLECULE>[, [<count>] <MOLECULE> ...]
+ *
+ * @param path  Path of the catalog file
+ * @return      0 on success, -1 on failure (error already printed, nothing added)
+ */
+int registry_load_catalog(const char *path);
+
+/**
+ * Element id <-> name ("CARBON", "HYDROGEN", "OXYGEN")
+ * Names return NULL and ids return -1 when unknown
+ */
+int registry_element_id(const char *name);
+const char *registry_element_name(int id);
+
+/**
+ * Molecule id <-> name ("WATER", "CARBON DIOXIDE", "ALCOHOL", "GLUCOSE", then the catalog)
+ * Ids run from 0 to registry_num_molecules() - 1
+ */
+int registry_num_molecules();
+int registry_molecule_id(const char *name);
+const char *registry_molecule_name(int id);
+
+/**
+ * Atoms of each element needed for one molecule
+ *
+ * @param id  Valid molecule id
+ * @return    NUM_ELEMENTS coefficients, indexed like the element ids
+ */
+const unsigned int *registry_molecule_formula(int id);
+
+/**
+ * Drink id <-> name ("SOFT DRINK", "VODKA", "CHAMPAGNE", then the catalog)
+ * Ids run from 0 to registry_num_drinks() - 1
+ */
+int registry_num_drinks();
+int registry_drink_id(const char *name);
+const char *registry_drink_name(int id);
+
+/**
+ * Atoms of each element needed for one drink (the sum of its molecules)
+ *
+ * @param id  Valid drink id
+ * @return    NUM_ELEMENTS coefficients, indexed like the element ids
+ */
+const unsigned int *registry_drink_atoms(int id);
+
+#endif
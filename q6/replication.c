@@ -0,0 +1,759 @@
+/*
+ * replication.c - שכפול המלאי לשרת גיבוי
+ * --------------------------------------
+ * השרת הראשי (--replicate-to <port|path>):
+ * - כל ADD ו-DELIVER שהוחל נרשם, תחת הנעילה הבלעדית של המלאי, כמסגרת קומפקטית
+ *   (48 בתים: מספר עדכון, זמן, סוג וכמויות) בטבעת בזיכרון, כך שסדר המסגרות
+ *   הוא סדר העדכונים
+ * - לכל שרת גיבוי תהליכון שליחה משלו. בחיבור חדש הוא שולח עותק מלא של קובץ
+ *   השמירה ב-sendfile, תחת נעילה משותפת (העותק הוא בדיוק המלאי אחרי העדכון
+ *   שמספרו נשלח לפניו), ואחר כך את המסגרות מהטבעת באצוות, send אחד לכל אצווה
+ * - כשאין עדכונים נשלח heartbeat כל 100ms; תהליכון ממתין מתעורר (eventfd)
+ *   רק אם הוא ישן, כך שבעומס עדכון אינו עולה קריאת מערכת
+ * - שרת הגיבוי מאשר (ACK) את העדכון האחרון שהחיל. הפיגור הוא מספר העדכונים
+ *   שטרם אושרו והזמן שעבר מאז הוותיק שבהם (STATS והשאילתה REPLICATION)
+ * - שרת גיבוי שפיגר ביותר מגודל הטבעת מנותק, ומקבל עותק מלא כשהוא חוזר
+ * שרת הגיבוי (--replica-of <host:port|path>):
+ * - תהליכון רקע מתחבר לשרת הראשי (ומתחבר מחדש אם החיבור נפל), טוען את
+ *   העותק המלא ומחיל כל עדכון על קובץ השמירה הממופה שלו (stock_apply_update)
+ * - עדכון שאינו מתאים למלאי (העותקים נפרדו) מנתק את החיבור, וההתחברות
+ *   הבאה מתחילה בעותק מלא
+ * - ADD ו-DELIVER נדחים; STATUS, GEN ו-REPLICATION נענים כרגיל
+ * קובץ שמירה משוכפל אינו משותף עם תהליכים אחרים (stock_exclusive): עדכונים
+ * של תהליך אחר לא היו עוברים בטבעת.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+
+#include "replication.h"
+#include "wal.h"
+#include "crc32c.h"
+#include "latency.h"
+
+#define REPL_RING 65536         // Updates kept for standbys that are behind (48 bytes each)
+#define REPL_BATCH 256          // Frames sent with one send()
+#define REPL_MAX_STANDBYS 8     // Standbys served at the same time
+#define REPL_HEARTBEAT_MS 100   // Idle time after which the primary sends a heartbeat
+#define REPL_TIMEOUT_MS 3000    // A peer silent for this long is gone
+#define REPL_RETRY_MS 1000      // Delay between connection attempts of a standby
+#define REPL_NAME_SIZE 128
+
+static int repl_role = REPL_ROLE_NONE;
+static char repl_endpoint[REPL_NAME_SIZE];  // --replicate-to or --replica-of, for messages
+
+/* ===== PRIMARY ===== */
+
+/**
+ * A connected standby, served by its own sender thread
+ */
+typedef struct {
+    int in_use;                 // Slot taken (guarded by repl_ring_lock)
+    int fd;                     // The standby's socket
+    int wake_fd;                // eventfd written when an update arrives while the sender sleeps
+    int sleeping;               // The sender waits for updates (guarded by repl_ring_lock)
+    char name[REPL_NAME_SIZE];  // Address of the standby
+    uint64_t sent;              // Last update sent
+    uint64_t acked;             // Last update the standby applied
+    unsigned long long last_ack_ns;     // latency_now_ns() of the last ACK
+    unsigned char ack_buf[sizeof(ReplFrame)];  // Partly received ACK
+    size_t ack_len;
+} ReplPeer;
+
+// Frames of the last REPL_RING updates; update seq is at (seq - 1) % REPL_RING
+static ReplFrame repl_ring[REPL_RING];
+static uint64_t repl_head = 0;  // Last update published
+static pthread_mutex_t repl_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static ReplPeer repl_peers[REPL_MAX_STANDBYS];
+static int repl_listen_fd = -1;
+
+/**
+ * Returns the CLOCK_REALTIME time in nanoseconds
+ */
+static uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Sends a whole buffer on a blocking socket
+ *
+ * @return  0 on success, -1 on failure (errno is set)
+ */
+static int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Receives exactly len bytes from a blocking socket
+ *
+ * @return  0 on success, -1 on failure or end of stream
+ */
+static int recv_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n == 0) errno = ECONNRESET;
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Sets the timeouts of a replication socket, and TCP_NODELAY on TCP
+ */
+static void tune_socket(int fd) {
+    struct timeval timeout = {REPL_TIMEOUT_MS / 1000, (REPL_TIMEOUT_MS % 1000) * 1000};
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    // A single update must not wait for more data (fails harmlessly on UDS)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/**
+ * Publishes one update to the standbys (stock_update_observer)
+ * Called under the exclusive stock lock, so updates are numbered in the order
+ * they were applied
+ *
+ * @param op     WAL_OP_ADD or WAL_OP_DELIVER
+ * @param atoms  Atoms added or taken, indexed like the element ids
+ */
+static void publish_update(int op, const unsigned long long atoms[NUM_ELEMENTS]) {
+    pthread_mutex_lock(&repl_ring_lock);
+    ReplFrame *frame = &repl_ring[repl_head % REPL_RING];
+    frame->magic = REPL_MAGIC;
+    frame->type = op == WAL_OP_ADD ? REPL_ADD : REPL_DELIVER;
+    frame->seq = repl_head + 1;
+    frame->time_ns = realtime_ns();
+    memcpy(frame->atoms, atoms, sizeof(frame->atoms));
+    __atomic_store_n(&repl_head, repl_head + 1, __ATOMIC_RELEASE);
+
+    // Only a sender that waits is woken; a busy one finds the update on its next round
+    for (int i = 0; i < REPL_MAX_STANDBYS; i++) {
+        if (repl_peers[i].in_use && repl_peers[i].sleeping) {
+            uint64_t one = 1;
+            repl_peers[i].sleeping = 0;
+            ssize_t rc = write(repl_peers[i].wake_fd, &one, sizeof(one));
+            (void)rc;
+        }
+    }
+    pthread_mutex_unlock(&repl_ring_lock);
+}
+
+/**
+ * Reads the ACKs that arrived from a standby, without waiting
+ *
+ * @return  0 on success, -1 if the standby closed the connection or misbehaved
+ */
+static int read_acks(ReplPeer *peer) {
+    while (1) {
+        ssize_t n = recv(peer->fd, peer->ack_buf + peer->ack_len, sizeof(ReplFrame) - peer->ack_len, MSG_DONTWAIT);
+        if (n == 0) return -1;
+        if (n == -1) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        peer->ack_len += n;
+        if (peer->ack_len < sizeof(ReplFrame)) continue;
+
+        ReplFrame ack;
+        memcpy(&ack, peer->ack_buf, sizeof(ack));
+        peer->ack_len = 0;
+        if (ack.magic != REPL_MAGIC || ack.type != REPL_ACK || ack.seq > peer->sent) {
+            fprintf(stderr, "Standby %s sent an invalid frame\n", peer->name);
+            return -1;
+        }
+        __atomic_store_n(&peer->acked, ack.seq, __ATOMIC_RELEASE);
+        peer->last_ack_ns = latency_now_ns();
+    }
+}
+
+/**
+ * Sends a full copy of the save file to a new standby
+ * The shared lock holds every update back while the file is sent, so the copy
+ * is exactly the stock after the update numbered in the REPL_SYNC frame
+ *
+ * @return  0 on success, -1 on failure (error already printed)
+ */
+static int full_sync(ReplPeer *peer) {
+    ReplFrame header;
+    unsigned long long start = latency_now_ns();
+    int rc;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = REPL_MAGIC;
+    header.type = REPL_SYNC;
+    header.atoms[0] = sizeof(StockFile);
+
+    stock_lock_shared();
+    header.seq = __atomic_load_n(&repl_head, __ATOMIC_ACQUIRE);
+    header.time_ns = realtime_ns();
+    rc = send_all(peer->fd, &header, sizeof(header));
+    off_t offset = 0;
+    while (rc == 0 && offset < (off_t)sizeof(StockFile)) {
+        ssize_t n = sendfile(peer->fd, lock_fd, &offset, sizeof(StockFile) - offset);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == 0) errno = EIO;
+        if (n <= 0) rc = -1;
+    }
+    stock_unlock();
+
+    if (rc == -1) {
+        fprintf(stderr, "Full sync to standby %s failed: %s\n", peer->name, strerror(errno));
+        return -1;
+    }
+    peer->sent = header.seq;
+    __atomic_store_n(&peer->acked, header.seq, __ATOMIC_RELEASE);
+    peer->last_ack_ns = latency_now_ns();
+    printf("Standby %s: full sync at update %llu (%zu bytes of save file with sendfile, %.1f us)\n", peer->name,
+           (unsigned long long)header.seq, sizeof(StockFile), (latency_now_ns() - start) / 1e3);
+    return 0;
+}
+
+/**
+ * Streams the published updates to a standby until it disconnects
+ */
+static void stream_updates(ReplPeer *peer) {
+    ReplFrame frames[REPL_BATCH];
+    unsigned long long last_send = latency_now_ns();
+
+    while (1) {
+        // Copy the updates the standby has not been sent yet
+        int n = 0;
+        pthread_mutex_lock(&repl_ring_lock);
+        uint64_t head = repl_head;
+        if (head - peer->sent > REPL_RING) {
+            pthread_mutex_unlock(&repl_ring_lock);
+            printf("Standby %s fell more than %d updates behind; it gets a full sync when it reconnects\n",
+                   peer->name, REPL_RING);
+            return;
+        }
+        for (; n < REPL_BATCH && peer->sent + n < head; n++) frames[n] = repl_ring[(peer->sent + n) % REPL_RING];
+        if (n == 0) peer->sleeping = 1;
+        pthread_mutex_unlock(&repl_ring_lock);
+
+        if (n > 0) {
+            if (send_all(peer->fd, frames, n * sizeof(ReplFrame)) == -1) {
+                fprintf(stderr, "Sending to standby %s failed: %s\n", peer->name, strerror(errno));
+                return;
+            }
+            __atomic_store_n(&peer->sent, peer->sent + n, __ATOMIC_RELEASE);
+            last_send = latency_now_ns();
+            if (read_acks(peer) == -1) return;
+            continue;
+        }
+
+        // Nothing to send: wait for an update, an ACK or the time of the next heartbeat
+        unsigned long long idle_ms = (latency_now_ns() - last_send) / 1000000;
+        struct pollfd fds[2] = {{peer->fd, POLLIN, 0}, {peer->wake_fd, POLLIN, 0}};
+        int ready = poll(fds, 2, idle_ms >= REPL_HEARTBEAT_MS ? 0 : (int)(REPL_HEARTBEAT_MS - idle_ms));
+        pthread_mutex_lock(&repl_ring_lock);
+        peer->sleeping = 0;
+        pthread_mutex_unlock(&repl_ring_lock);
+        if (ready == -1 && errno != EINTR) return;
+        if (ready > 0 && (fds[1].revents & POLLIN)) {
+            uint64_t count;
+            ssize_t rc = read(peer->wake_fd, &count, sizeof(count));
+            (void)rc;
+        }
+        if (ready > 0 && fds[0].revents != 0 && read_acks(peer) == -1) return;
+
+        unsigned long long now = latency_now_ns();
+        if (now - peer->last_ack_ns > REPL_TIMEOUT_MS * 1000000ULL) {
+            printf("Standby %s stopped answering\n", peer->name);
+            return;
+        }
+        if (now - last_send >= REPL_HEARTBEAT_MS * 1000000ULL) {
+            ReplFrame heartbeat;
+            memset(&heartbeat, 0, sizeof(heartbeat));
+            heartbeat.magic = REPL_MAGIC;
+            heartbeat.type = REPL_HEARTBEAT;
+            heartbeat.seq = peer->sent;
+            heartbeat.time_ns = realtime_ns();
+            if (send_all(peer->fd, &heartbeat, sizeof(heartbeat)) == -1) {
+                fprintf(stderr, "Sending to standby %s failed: %s\n", peer->name, strerror(errno));
+                return;
+            }
+            last_send = now;
+        }
+    }
+}
+
+/**
+ * Sender thread of one standby
+ */
+static void *sender_main(void *arg) {
+    ReplPeer *peer = arg;
+    ReplFrame hello;
+
+    if (recv_all(peer->fd, &hello, sizeof(hello)) == -1 || hello.magic != REPL_MAGIC || hello.type != REPL_HELLO) {
+        fprintf(stderr, "Standby %s did not introduce itself (not a drinks_bar standby?)\n", peer->name);
+    } else if (full_sync(peer) == 0) {
+        stream_updates(peer);
+    }
+    printf("Standby %s disconnected\n", peer->name);
+
+    pthread_mutex_lock(&repl_ring_lock);
+    close(peer->fd);
+    close(peer->wake_fd);
+    peer->sleeping = 0;
+    __atomic_store_n(&peer->in_use, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&repl_ring_lock);
+    return NULL;
+}
+
+/**
+ * Accepts standbys and starts a sender thread for each
+ */
+static void *acceptor_main(void *arg) {
+    (void)arg;
+    while (1) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        int fd = accept4(repl_listen_fd, (struct sockaddr *)&addr, &addrlen, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) perror("accept standby");
+            continue;
+        }
+
+        char name[REPL_NAME_SIZE];
+        if (addr.ss_family == AF_INET) {
+            struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+            char host[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+            snprintf(name, sizeof(name), "%s:%d", host, ntohs(in->sin_port));
+        } else {
+            snprintf(name, sizeof(name), "on %.100s", repl_endpoint);
+        }
+
+        ReplPeer *peer = NULL;
+        pthread_mutex_lock(&repl_ring_lock);
+        for (int i = 0; i < REPL_MAX_STANDBYS && peer == NULL; i++) {
+            if (!repl_peers[i].in_use) peer = &repl_peers[i];
+        }
+        if (peer != NULL) {
+            peer->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (peer->wake_fd == -1) {
+                perror("eventfd");
+                peer = NULL;
+            } else {
+                peer->fd = fd;
+                peer->sleeping = 0;
+                peer->sent = peer->acked = 0;
+                peer->ack_len = 0;
+                snprintf(peer->name, sizeof(peer->name), "%s", name);
+                __atomic_store_n(&peer->in_use, 1, __ATOMIC_RELEASE);
+            }
+        }
+        pthread_mutex_unlock(&repl_ring_lock);
+        if (peer == NULL) {
+            printf("Standby %s rejected: %d standbys are already connected\n", name, REPL_MAX_STANDBYS);
+            close(fd);
+            continue;
+        }
+
+        tune_socket(fd);
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int rc = pthread_create(&thread, &attr, sender_main, peer);
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create (standby sender): %s\n", strerror(rc));
+            pthread_mutex_lock(&repl_ring_lock);
+            close(peer->fd);
+            close(peer->wake_fd);
+            __atomic_store_n(&peer->in_use, 0, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&repl_ring_lock);
+            continue;
+        }
+        printf("Standby %s connected\n", name);
+    }
+    return NULL;
+}
+
+/**
+ * Returns non-zero if text is a plain port number
+ */
+static int is_port(const char *text) {
+    if (*text == '\0') return 0;
+    for (const char *p = text; *p != '\0'; p++) {
+        if (!isdigit((unsigned char)*p)) return 0;
+    }
+    long port = strtol(text, NULL, 10);
+    return port > 0 && port <= 65535;
+}
+
+/**
+ * Starts serving standbys (--replicate-to)
+ *
+ * @param endpoint  TCP port, or path of a UDS stream socket
+ * @return          0 on success, -1 on failure (error already printed)
+ */
+int replication_start_primary(const char *endpoint) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int one = 1;
+
+    snprintf(repl_endpoint, sizeof(repl_endpoint), "%s", endpoint);
+    memset(&addr, 0, sizeof(addr));
+    if (is_port(endpoint)) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = INADDR_ANY;
+        in->sin_port = htons((int)strtol(endpoint, NULL, 10));
+        addrlen = sizeof(*in);
+    } else {
+        struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+        if (strlen(endpoint) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "Replication socket path is too long: %s\n", endpoint);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, endpoint);
+        addrlen = sizeof(*un);
+        unlink(endpoint);
+    }
+
+    repl_listen_fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (repl_listen_fd == -1) {
+        perror("Replication socket creation failed");
+        return -1;
+    }
+    if (addr.ss_family == AF_INET) setsockopt(repl_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(repl_listen_fd, (struct sockaddr *)&addr, addrlen) == -1 || listen(repl_listen_fd, REPL_MAX_STANDBYS) == -1) {
+        fprintf(stderr, "Replication endpoint %s: %s\n", endpoint, strerror(errno));
+        close(repl_listen_fd);
+        repl_listen_fd = -1;
+        return -1;
+    }
+
+    // Publish every update from now on, then accept standbys
+    stock_update_observer = publish_update;
+    repl_role = REPL_ROLE_PRIMARY;
+    printf("Replicating to standbys on %s%s\n", is_port(endpoint) ? "TCP port " : "", endpoint);
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, acceptor_main, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "pthread_create (replication): %s\n", strerror(rc));
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/* ===== STANDBY ===== */
+
+static struct sockaddr_storage primary_addr;
+static socklen_t primary_addrlen;
+static uint64_t standby_applied = 0;      // Last update applied (numbered by the primary)
+static int standby_connected = 0;         // Following the primary right now
+static unsigned long long standby_syncs = 0;          // Full syncs received
+static unsigned long long standby_last_delay_ns = 0;  // Delay of the last applied update
+static LatencyHistogram standby_delay;    // Primary's update to its application here
+
+/**
+ * Receives the full copy of the primary's save file and makes it the stock
+ *
+ * @return  0 on success, -1 on failure (error already printed)
+ */
+static int receive_full_sync(int fd) {
+    ReplFrame header;
+    StockFile file;
+    unsigned long long start = latency_now_ns();
+
+    if (recv_all(fd, &header, sizeof(header)) == -1 || header.magic != REPL_MAGIC || header.type != REPL_SYNC ||
+        header.atoms[0] != sizeof(StockFile)) {
+        fprintf(stderr, "Primary %s did not send a full sync (is it a drinks_bar --replicate-to of this build?)\n",
+                repl_endpoint);
+        return -1;
+    }
+    if (recv_all(fd, &file, sizeof(file)) == -1) {
+        fprintf(stderr, "Full sync from primary %s failed: %s\n", repl_endpoint, strerror(errno));
+        return -1;
+    }
+    if (file.magic != STOCK_FILE_MAGIC || file.version != STOCK_FILE_VERSION || file.num_elements != NUM_ELEMENTS ||
+        file.header_crc != crc32c(&file, offsetof(StockFile, header_crc))) {
+        fprintf(stderr, "Primary %s sent an unrecognized save file\n", repl_endpoint);
+        return -1;
+    }
+
+    stock_replace(&file.stock);
+    __atomic_store_n(&standby_applied, header.seq, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&standby_syncs, 1, __ATOMIC_RELAXED);
+    printf("Full sync from primary %s at update %llu (%zu bytes, %.1f us): C=%llu, H=%llu, O=%llu\n", repl_endpoint,
+           (unsigned long long)header.seq, sizeof(file), (latency_now_ns() - start) / 1e3, file.stock.carbon,
+           file.stock.hydrogen, file.stock.oxygen);
+    return 0;
+}
+
+/**
+ * Applies the primary's updates until the connection ends
+ */
+static void follow_primary(int fd) {
+    ReplFrame frames[REPL_BATCH], hello;
+    size_t have = 0;
+
+    memset(&hello, 0, sizeof(hello));
+    hello.magic = REPL_MAGIC;
+    hello.type = REPL_HELLO;
+    hello.time_ns = realtime_ns();
+    if (send_all(fd, &hello, sizeof(hello)) == -1 || receive_full_sync(fd) == -1) return;
+    __atomic_store_n(&standby_connected, 1, __ATOMIC_RELEASE);
+
+    uint64_t applied = standby_applied;
+    while (1) {
+        ssize_t n = recv(fd, (char *)frames + have, sizeof(frames) - have, 0);
+        if (n == 0) {
+            printf("Primary %s closed the connection\n", repl_endpoint);
+            return;
+        }
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                printf("Primary %s sent nothing for %d ms\n", repl_endpoint, REPL_TIMEOUT_MS);
+            } else {
+                fprintf(stderr, "Receiving from primary %s failed: %s\n", repl_endpoint, strerror(errno));
+            }
+            return;
+        }
+        have += n;
+
+        // Apply every whole frame, in order
+        size_t count = have / sizeof(ReplFrame);
+        for (size_t i = 0; i < count; i++) {
+            const ReplFrame *frame = &frames[i];
+            if (frame->magic == REPL_MAGIC && frame->type == REPL_HEARTBEAT && frame->seq == applied) continue;
+            if (frame->magic != REPL_MAGIC || (frame->type != REPL_ADD && frame->type != REPL_DELIVER) ||
+                frame->seq != applied + 1) {
+                fprintf(stderr, "Primary %s sent an unexpected frame (type %u, update %llu after %llu)\n",
+                        repl_endpoint, frame->type, (unsigned long long)frame->seq, (unsigned long long)applied);
+                return;
+            }
+            if (stock_apply_update(frame->type == REPL_ADD ? WAL_OP_ADD : WAL_OP_DELIVER, frame->atoms) == -1) {
+                fprintf(stderr, "Update %llu from primary %s does not fit the stock; resyncing\n",
+                        (unsigned long long)frame->seq, repl_endpoint);
+                return;
+            }
+            applied = frame->seq;
+            uint64_t now = realtime_ns();
+            unsigned long long delay = now > frame->time_ns ? now - frame->time_ns : 0;
+            latency_record(&standby_delay, delay);
+            __atomic_store_n(&standby_last_delay_ns, delay, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&standby_applied, applied, __ATOMIC_RELEASE);
+        have -= count * sizeof(ReplFrame);
+        memmove(frames, (char *)frames + count * sizeof(ReplFrame), have);
+
+        // One ACK per receive, also for heartbeats, so the primary sees the standby alive
+        if (count > 0) {
+            ReplFrame ack;
+            memset(&ack, 0, sizeof(ack));
+            ack.magic = REPL_MAGIC;
+            ack.type = REPL_ACK;
+            ack.seq = applied;
+            ack.time_ns = realtime_ns();
+            if (send_all(fd, &ack, sizeof(ack)) == -1) {
+                fprintf(stderr, "Sending to primary %s failed: %s\n", repl_endpoint, strerror(errno));
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Standby thread: follows the primary, reconnecting whenever the connection ends
+ */
+static void *standby_main(void *arg) {
+    struct timespec retry = {REPL_RETRY_MS / 1000, (REPL_RETRY_MS % 1000) * 1000000L};
+    int reported = 0;
+    (void)arg;
+
+    while (1) {
+        int fd = socket(primary_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr *)&primary_addr, primary_addrlen) == 0) {
+            reported = 0;
+            tune_socket(fd);
+            follow_primary(fd);
+            __atomic_store_n(&standby_connected, 0, __ATOMIC_RELEASE);
+            printf("Replication from %s stopped; reconnecting\n", repl_endpoint);
+        } else if (!reported) {
+            printf("Waiting for primary %s (%s)\n", repl_endpoint, strerror(errno));
+            reported = 1;
+        }
+        if (fd != -1) close(fd);
+        nanosleep(&retry, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * Starts following a primary (--replica-of)
+ *
+ * @param primary  host:port, port (on this host), or path of a UDS stream socket
+ * @return         0 on success, -1 on failure (error already printed)
+ */
+int replication_start_standby(const char *primary) {
+    char host[REPL_NAME_SIZE];
+    const char *colon = strrchr(primary, ':');
+
+    snprintf(repl_endpoint, sizeof(repl_endpoint), "%s", primary);
+    memset(&primary_addr, 0, sizeof(primary_addr));
+    if (is_port(primary) || (colon != NULL && strchr(primary, '/') == NULL && is_port(colon + 1))) {
+        struct addrinfo hints, *result;
+        const char *port = colon != NULL ? colon + 1 : primary;
+        snprintf(host, sizeof(host), "%.*s", colon != NULL ? (int)(colon - primary) : 0, primary);
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        int rc = getaddrinfo(host[0] != '\0' ? host : "127.0.0.1", port, &hints, &result);
+        if (rc != 0) {
+            fprintf(stderr, "Primary %s: %s\n", primary, gai_strerror(rc));
+            return -1;
+        }
+        memcpy(&primary_addr, result->ai_addr, result->ai_addrlen);
+        primary_addrlen = result->ai_addrlen;
+        freeaddrinfo(result);
+    } else {
+        struct sockaddr_un *un = (struct sockaddr_un *)&primary_addr;
+        if (strlen(primary) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "Replication socket path is too long: %s\n", primary);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, primary);
+        primary_addrlen = sizeof(*un);
+    }
+
+    repl_role = REPL_ROLE_STANDBY;
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, standby_main, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "pthread_create (replication): %s\n", strerror(rc));
+        return -1;
+    }
+    pthread_detach(thread);
+    printf("Standby of %s: read-only, ADD and DELIVER are refused\n", primary);
+    return 0;
+}
+
+/* ===== STATE AND LAG ===== */
+
+/**
+ * Returns REPL_ROLE_NONE, REPL_ROLE_PRIMARY or REPL_ROLE_STANDBY
+ */
+int replication_role() {
+    return repl_role;
+}
+
+/**
+ * Lag of one standby: updates it has not applied yet, and how long ago the
+ * oldest of them was applied on the primary
+ *
+ * @param peer     The standby (in use)
+ * @param head     Last update published
+ * @param updates  Receives the number of updates behind
+ * @return         Lag in nanoseconds, 0 if the standby is up to date
+ */
+static unsigned long long peer_lag(const ReplPeer *peer, uint64_t head, unsigned long long *updates) {
+    uint64_t acked = __atomic_load_n(&peer->acked, __ATOMIC_ACQUIRE);
+    *updates = head > acked ? head - acked : 0;
+    if (*updates == 0) return 0;
+
+    // The oldest update not applied is acked + 1, still in the ring unless the standby is far behind
+    uint64_t oldest_ns = 0;
+    pthread_mutex_lock(&repl_ring_lock);
+    if (repl_head - acked <= REPL_RING) oldest_ns = repl_ring[acked % REPL_RING].time_ns;
+    pthread_mutex_unlock(&repl_ring_lock);
+    uint64_t now = realtime_ns();
+    return oldest_ns != 0 && now > oldest_ns ? now - oldest_ns : 0;
+}
+
+/**
+ * Answers the REPLICATION query with one line
+ *
+ * @param reply       Buffer that receives the line (with its newline)
+ * @param reply_size  Size of the buffer
+ * @return            Length of the line
+ */
+size_t replication_status(char *reply, size_t reply_size) {
+    int len;
+
+    if (repl_role == REPL_ROLE_PRIMARY) {
+        uint64_t head = __atomic_load_n(&repl_head, __ATOMIC_ACQUIRE);
+        unsigned long long max_updates = 0, max_ns = 0;
+        int standbys = 0;
+        for (int i = 0; i < REPL_MAX_STANDBYS; i++) {
+            if (!__atomic_load_n(&repl_peers[i].in_use, __ATOMIC_ACQUIRE)) continue;
+            unsigned long long updates, ns = peer_lag(&repl_peers[i], head, &updates);
+            if (updates > max_updates) max_updates = updates;
+            if (ns > max_ns) max_ns = ns;
+            standbys++;
+        }
+        len = snprintf(reply, reply_size, "REPLICATION PRIMARY %llu STANDBYS %d LAG %llu %llu\n",
+                       (unsigned long long)head, standbys, max_updates, max_ns / 1000);
+    } else if (repl_role == REPL_ROLE_STANDBY) {
+        len = snprintf(reply, reply_size, "REPLICATION STANDBY %llu CONNECTED %d DELAY %llu\n",
+                       (unsigned long long)__atomic_load_n(&standby_applied, __ATOMIC_ACQUIRE),
+                       __atomic_load_n(&standby_connected, __ATOMIC_ACQUIRE),
+                       __atomic_load_n(&standby_last_delay_ns, __ATOMIC_RELAXED) / 1000);
+    } else {
+        len = snprintf(reply, reply_size, "REPLICATION NONE\n");
+    }
+    return (len < 0) ? 0 : ((size_t)len < reply_size ? (size_t)len : reply_size - 1);
+}
+
+/**
+ * Prints the replication state and lag (console command STATS)
+ */
+void replication_print_stats(FILE *out) {
+    if (repl_role == REPL_ROLE_PRIMARY) {
+        uint64_t head = __atomic_load_n(&repl_head, __ATOMIC_ACQUIRE);
+        fprintf(out, "Replication: primary on %s, last update %llu\n", repl_endpoint, (unsigned long long)head);
+        for (int i = 0; i < REPL_MAX_STANDBYS; i++) {
+            const ReplPeer *peer = &repl_peers[i];
+            if (!__atomic_load_n(&peer->in_use, __ATOMIC_ACQUIRE)) continue;
+            unsigned long long updates, ns = peer_lag(peer, head, &updates);
+            fprintf(out, "  standby %s: sent %llu, applied %llu, lag %llu updates / %.1f us\n", peer->name,
+                    (unsigned long long)__atomic_load_n(&peer->sent, __ATOMIC_ACQUIRE),
+                    (unsigned long long)__atomic_load_n(&peer->acked, __ATOMIC_ACQUIRE), updates, ns / 1e3);
+        }
+    } else if (repl_role == REPL_ROLE_STANDBY) {
+        fprintf(out, "Replication: standby of %s, %s, last applied update %llu, full syncs %llu\n", repl_endpoint,
+                __atomic_load_n(&standby_connected, __ATOMIC_ACQUIRE) ? "connected" : "disconnected",
+                (unsigned long long)__atomic_load_n(&standby_applied, __ATOMIC_ACQUIRE),
+                __atomic_load_n(&standby_syncs, __ATOMIC_RELAXED));
+        latency_print(out, "Replication delay (primary update to standby apply)", &standby_delay);
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ * replication.h - שכפול המלאי לשרת גיבוי (primary/standby)
+ *
+ * A primary drinks_bar (--replicate-to) streams its stock updates, in order,
+ * to standby servers (--replica-of) over TCP or a UDS stream socket. Every
+ * connection starts with a full copy of the primary's save file; the standby
+ * then applies the updates to its own save file and answers queries only.
+ */
+
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stock.h"
+
+#define REPL_MAGIC 0x31524244u   // "DBR1"
+
+#define REPL_HELLO 1       // Standby -> primary: first frame of a connection
+#define REPL_SYNC 2        // Primary -> standby: atoms[0] bytes of the save file follow
+#define REPL_ADD 3         // Primary -> standby: atoms added to the stock
+#define REPL_DELIVER 4     // Primary -> standby: atoms taken from the stock
+#define REPL_HEARTBEAT 5   // Primary -> standby: no update for a while; seq is the last one
+#define REPL_ACK 6         // Standby -> primary: seq is the last update applied
+
+#define REPL_ROLE_NONE 0
+#define REPL_ROLE_PRIMARY 1
+#define REPL_ROLE_STANDBY 2
+
+/**
+ * One frame of the replication stream, in host byte order (primary and
+ * standby run the same build)
+ */
+typedef struct {
+    uint32_t magic;                          // REPL_MAGIC
+    uint32_t type;                           // REPL_*
+    uint64_t seq;                            // Update number, consecutive from the full sync on
+    uint64_t time_ns;                        // CLOCK_REALTIME when the primary applied it (or sent the frame)
+    unsigned long long atoms[NUM_ELEMENTS];  // Atoms added or taken, indexed like the element ids
+} ReplFrame;
+
+/**
+ * Starts serving standbys (--replicate-to)
+ * Every update of this process is then published to the connected standbys;
+ * the save file must be open and kept by this process alone
+ *
+ * @param endpoint  TCP port, or path of a UDS stream socket
+ * @return          0 on success, -1 on failure (error already printed)
+ */
+int replication_start_primary(const char *endpoint);
+
+/**
+ * Starts following a primary (--replica-of)
+ * A background thread connects (and reconnects) to the primary and applies
+ * its updates to the stock of this process
+ *
+ * @param primary  host:port, port (on this host), or path of a UDS stream socket
+ * @return         0 on success, -1 on failure (error already printed)
+ */
+int replication_start_standby(const char *primary);
+
+/**
+ * Returns REPL_ROLE_NONE, REPL_ROLE_PRIMARY or REPL_ROLE_STANDBY
+ */
+int replication_role();
+
+/**
+ * Answers the REPLICATION query with one line:
+ *   "REPLICATION NONE"
+ *   "REPLICATION PRIMARY <last update> STANDBYS <n> LAG <updates> <us>" (the slowest standby)
+ *   "REPLICATION STANDBY <last applied> CONNECTED <0|1> DELAY <us>" (of the last update applied)
+ *
+ * @param reply       Buffer that receives the line (with its newline)
+ * @param reply_size  Size of the buffer
+ * @return            Length of the line
+ */
+size_t replication_status(char *reply, size_t reply_size);
+
+/**
+ * Prints the replication state and lag (console command STATS)
+ */
+void replication_print_stats(FILE *out);
+
+#endif
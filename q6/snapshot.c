@@ -0,0 +1,291 @@
+/*
+ * snapshot.c - צילומי מצב של המלאי ברקע
+ * -------------------------------------
+ * פקודת הקונסול SNAPSHOT שומרת עותק של המלאי, יחד עם מיקום היומן (--wal),
+ * לקובץ עם חותמת זמן, בלי לעצור את הטיפול ב-ADD ו-DELIVER:
+ * - האב מעתיק את המלאי ואת מספר הרשומה האחרונה ביומן תחת נעילה משותפת אחת
+ *   (מאות ננו-שניות), ומכין מראש את תוכן הקובץ ואת שמותיו
+ * - fork(): המלאי בקובץ השמירה ממופה MAP_SHARED, ודפים משותפים אינם
+ *   מועתקים ב-copy-on-write, ולכן העותק נלקח לפני ה-fork, בזיכרון הפרטי של האב
+ * - הילד כותב את הקובץ בשם זמני, קורא ל-fsync, משנה את שמו לשם הסופי
+ *   ומסנכרן את התיקייה, ומדווח לאב בצינור (pipe); הוא משתמש רק בקריאות
+ *   מערכת (התהליך מרובה תהליכונים, ומנעולי stdio/malloc עלולים להיות תפוסים)
+ * - לולאת האירועים של האב מקבלת את הדיווח כמו כל מתאר אחר
+ * זמן ההשהיה של האב (העתקה + fork) וזמן הכתיבה של הילד מודפסים בסיום.
+ * snapshot_write() כותבת קובץ באותה דרך בלי fork, לדחיסת היומן של Raft
+ * (raft.c), שגם שומרת בקובץ את הקדנציה של הרשומה האחרונה (גרסה 2).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "snapshot.h"
+#include "latency.h"
+#include "crc32c.h"
+
+#define STEP_OPEN 0
+#define STEP_WRITE 1
+#define STEP_FSYNC 2
+#define STEP_RENAME 3
+#define STEP_SYNC_DIR 4
+#define STEP_REPORT 5
+
+static const char *step_names[] = {"open", "write", "fsync", "rename", "directory fsync", "report"};
+
+/**
+ * Returns the name of a step a snapshot child can fail in
+ */
+const char *snapshot_step_name(int step) {
+    return step >= 0 && step <= STEP_REPORT ? step_names[step] : "unknown step";
+}
+
+/**
+ * Writes a snapshot file under a temporary name, syncs it, renames it and
+ * syncs the directory
+ * Only system calls are used, so a forked child can call it too
+ *
+ * @return  -1 on success, or the STEP_* that failed (errno is set)
+ */
+static int write_snapshot_file(const SnapshotFile *contents, const char *tmp_path, const char *path,
+                               const char *dir_path) {
+    int failed = -1;  // Step that failed, -1 if none
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        failed = STEP_OPEN;
+    } else if (write(fd, contents, sizeof(*contents)) != (ssize_t)sizeof(*contents)) {
+        failed = STEP_WRITE;
+    } else if (fsync(fd) == -1) {
+        failed = STEP_FSYNC;
+    } else if (rename(tmp_path, path) == -1) {
+        failed = STEP_RENAME;
+    } else {
+        // The new directory entry must survive a crash too
+        int dir_fd = open(dir_path, O_RDONLY | O_CLOEXEC);
+        if (dir_fd == -1 || fsync(dir_fd) == -1) failed = STEP_SYNC_DIR;
+        if (dir_fd != -1) close(dir_fd);
+    }
+    if (failed != -1) {
+        int saved = errno ? errno : EIO;
+        if (failed > STEP_OPEN && failed < STEP_SYNC_DIR) unlink(tmp_path);
+        errno = saved;
+    }
+    if (fd != -1) close(fd);
+    return failed;
+}
+
+/**
+ * Child process: writes the prepared contents and reports on the pipe
+ * Only system calls are used: another thread of the parent may have held a
+ * stdio or malloc lock at the moment of the fork
+ */
+static void snapshot_child(const Snapshot *snap, const char *tmp_path, const char *dir_path, int report_fd) {
+    SnapshotResult result = {0, 0, 0};
+    unsigned long long start = latency_now_ns();
+
+#ifdef SYS_close_range
+    // Client sockets must close when the parent closes them, not when this child exits
+    if (report_fd != 3 && dup2(report_fd, 3) != -1) report_fd = 3;
+    if (report_fd == 3) syscall(SYS_close_range, 4, ~0U, 0);
+#endif
+
+    int failed = write_snapshot_file(&snap->contents, tmp_path, snap->path, dir_path);
+    if (failed != -1) {
+        result.step = failed;
+        result.error = errno;
+    }
+    result.write_ns = latency_now_ns() - start;
+
+    ssize_t sent = write(report_fd, &result, sizeof(result));
+    _exit(sent == (ssize_t)sizeof(result) && result.error == 0 ? 0 : 1);
+}
+
+/**
+ * Copies the stock and forks a child that writes it to a timestamped file
+ *
+ * @param prefix  Path prefix of the file (the save file, or "drinks_bar")
+ * @param snap    Receives the running snapshot
+ * @return        0 on success, -1 on failure (error already printed)
+ */
+int snapshot_start(const char *prefix, Snapshot *snap) {
+    char tmp_path[SNAPSHOT_PATH_SIZE + 8], dir_path[SNAPSHOT_PATH_SIZE], copy[SNAPSHOT_PATH_SIZE];
+    struct timespec now;
+    struct tm utc;
+    int fds[2];
+
+    // Everything the child needs is prepared here, before the fork
+    unsigned long long start = latency_now_ns(), log_lsn;
+    memset(&snap->contents, 0, sizeof(snap->contents));
+    stock_snapshot_at(&snap->contents.stock, &log_lsn);
+    clock_gettime(CLOCK_REALTIME, &now);
+    snap->copy_ns = latency_now_ns() - start;
+    snap->started_ns = start;
+
+    snap->contents.magic = SNAPSHOT_MAGIC;
+    snap->contents.version = SNAPSHOT_VERSION;
+    snap->contents.time_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    snap->contents.log_lsn = log_lsn;
+    snap->contents.num_elements = NUM_ELEMENTS;
+    snap->contents.crc = crc32c(&snap->contents, offsetof(SnapshotFile, crc));
+
+    gmtime_r(&now.tv_sec, &utc);
+    int len = snprintf(snap->path, sizeof(snap->path), "%s.%04d%02d%02dT%02d%02d%02d.%03ldZ.snap", prefix,
+                       utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec,
+                       now.tv_nsec / 1000000);
+    if (len < 0 || (size_t)len >= sizeof(snap->path)) {
+        fprintf(stderr, "Snapshot path is too long\n");
+        return -1;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snap->path);
+    snprintf(copy, sizeof(copy), "%s", snap->path);
+    snprintf(dir_path, sizeof(dir_path), "%s", dirname(copy));
+
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("Snapshot pipe");
+        return -1;
+    }
+
+    // Output still buffered in stdio must not be written twice
+    fflush(stdout);
+    fflush(stderr);
+    unsigned long long before_fork = latency_now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        snapshot_child(snap, tmp_path, dir_path, fds[1]);
+    }
+    snap->fork_ns = latency_now_ns() - before_fork;
+    snap->pause_ns = latency_now_ns() - start;
+    close(fds[1]);
+    if (pid == -1) {
+        perror("Snapshot fork");
+        close(fds[0]);
+        return -1;
+    }
+
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    snap->pid = pid;
+    snap->result_fd = fds[0];
+    return 0;
+}
+
+/**
+ * Collects the child's report and reaps it
+ * Called once result_fd is readable: the child writes its report as its
+ * last action, so waiting for it to exit takes no longer than its exit
+ *
+ * @param snap    The snapshot started with snapshot_start()
+ * @param result  Receives the child's report
+ * @return        0 if the file was written, -1 otherwise
+ */
+int snapshot_finish(Snapshot *snap, SnapshotResult *result) {
+    ssize_t got;
+    int status;
+
+    do {
+        got = read(snap->result_fd, result, sizeof(*result));
+    } while (got == -1 && errno == EINTR);
+    if (got != (ssize_t)sizeof(*result)) {
+        // The child died before reporting
+        result->step = STEP_REPORT;
+        result->error = got == -1 ? errno : EPIPE;
+        result->write_ns = 0;
+    }
+    close(snap->result_fd);
+    while (waitpid(snap->pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    snap->pid = 0;
+    snap->result_fd = -1;
+    return result->error == 0 ? 0 : -1;
+}
+
+/**
+ * Writes a snapshot file synchronously (Raft log compaction)
+ *
+ * @param path      Path of the file
+ * @param contents  Time, log position and stock to write
+ * @return          0 on success, -1 on failure (error already printed)
+ */
+int snapshot_write(const char *path, SnapshotFile *contents) {
+    char tmp_path[SNAPSHOT_PATH_SIZE + 8], dir_path[SNAPSHOT_PATH_SIZE];
+
+    if (strlen(path) >= SNAPSHOT_PATH_SIZE) {
+        fprintf(stderr, "Snapshot path is too long\n");
+        return -1;
+    }
+    contents->magic = SNAPSHOT_MAGIC;
+    contents->version = SNAPSHOT_VERSION;
+    contents->num_elements = NUM_ELEMENTS;
+    contents->crc = crc32c(contents, offsetof(SnapshotFile, crc));
+
+    // A temporary file left by a crash is replaced
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    snprintf(dir_path, sizeof(dir_path), "%s", path);
+    unlink(tmp_path);
+    int failed = write_snapshot_file(contents, tmp_path, path, dirname(dir_path));
+    if (failed != -1) {
+        fprintf(stderr, "Snapshot %s: %s failed: %s\n", path, step_names[failed], strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Layout of version 1 snapshot files, before log_term
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t time_ns;
+    uint64_t log_lsn;
+    AtomStock stock;
+    uint32_t num_elements;
+    uint32_t crc;
+} SnapshotFileV1;
+
+/**
+ * Reads and checks a snapshot file
+ * Version 1 files are read with log_term 0
+ *
+ * @param path  Path of the file
+ * @param out   Receives the contents
+ * @return      0 on success, -1 on failure (error already printed)
+ */
+int snapshot_read(const char *path, SnapshotFile *out) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    ssize_t got = read(fd, out, sizeof(*out));
+    close(fd);
+
+    if (got == (ssize_t)sizeof(SnapshotFileV1) && out->magic == SNAPSHOT_MAGIC && out->version == 1) {
+        SnapshotFileV1 old;
+        memcpy(&old, out, sizeof(old));
+        if (old.num_elements == NUM_ELEMENTS && old.crc == crc32c(&old, offsetof(SnapshotFileV1, crc))) {
+            memset(out, 0, sizeof(*out));
+            out->magic = old.magic;
+            out->version = old.version;
+            out->time_ns = old.time_ns;
+            out->log_lsn = old.log_lsn;
+            out->stock = old.stock;
+            out->num_elements = old.num_elements;
+            return 0;
+        }
+    }
+    if (got != (ssize_t)sizeof(*out) || out->magic != SNAPSHOT_MAGIC || out->version != SNAPSHOT_VERSION ||
+        out->num_elements != NUM_ELEMENTS || out->crc != crc32c(out, offsetof(SnapshotFile, crc))) {
+        fprintf(stderr, "%s is not a valid snapshot\n", path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * snapshot.h - צילומי מצב של המלאי ברקע (SNAPSHOT)
+ *
+ * Point-in-time copies of the stock, written to a timestamped file by a
+ * forked child so that the server's event loops never wait for the disk.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "stock.h"
+
+#define SNAPSHOT_MAGIC 0x53534244u   // "DBSS"
+#define SNAPSHOT_VERSION 2   // Version 1 had no log_term; it is still read
+#define SNAPSHOT_PATH_SIZE 4096
+
+/**
+ * Contents of a snapshot file
+ */
+typedef struct {
+    uint32_t magic;           // SNAPSHOT_MAGIC
+    uint32_t version;         // SNAPSHOT_VERSION
+    uint64_t time_ns;         // CLOCK_REALTIME when the copy was taken
+    uint64_t log_lsn;         // Last log record (--wal) or Raft log entry (--raft) included in stock, 0 if none
+    uint64_t log_term;        // Raft term of entry log_lsn, 0 without --raft
+    AtomStock stock;          // The stock
+    uint32_t num_elements;    // NUM_ELEMENTS
+    uint32_t crc;             // CRC32C of the file up to this field
+} SnapshotFile;
+
+/**
+ * A snapshot being written by a child process
+ */
+typedef struct {
+    pid_t pid;                        // The child, 0 when no snapshot is running
+    int result_fd;                    // Read end of the pipe the child reports on
+    char path[SNAPSHOT_PATH_SIZE];    // File the child writes
+    SnapshotFile contents;            // What the child writes
+    unsigned long long copy_ns;       // Parent: time spent copying the stock
+    unsigned long long fork_ns;       // Parent: time spent in fork()
+    unsigned long long pause_ns;      // Parent: whole time the calling thread was held up
+    unsigned long long started_ns;    // CLOCK_MONOTONIC when the copy was taken
+} Snapshot;
+
+/**
+ * Outcome reported by the child
+ */
+typedef struct {
+    int error;                      // errno of the failed step, 0 on success
+    int step;                       // Failed step (index into the step names)
+    unsigned long long write_ns;    // Time the child spent writing and syncing the file
+} SnapshotResult;
+
+/**
+ * Copies the stock and forks a child that writes it to a timestamped file
+ * The file is <prefix>.<UTC time>.snap, written under a temporary name,
+ * synced and renamed, so it is either complete or absent.
+ * The caller watches snap->result_fd and calls snapshot_finish() when it is
+ * readable; nothing here waits for the disk.
+ *
+ * @param prefix  Path prefix of the file (the save file, or "drinks_bar")
+ * @param snap    Receives the running snapshot
+ * @return        0 on success, -1 on failure (error already printed)
+ */
+int snapshot_start(const char *prefix, Snapshot *snap);
+
+/**
+ * Collects the child's report and reaps it
+ *
+ * @param snap    The snapshot started with snapshot_start()
+ * @param result  Receives the child's report
+ * @return        0 if the file was written, -1 otherwise (result->step and
+ *                result->error tell why)
+ */
+int snapshot_finish(Snapshot *snap, SnapshotResult *result);
+
+/**
+ * Returns the name of a step a snapshot child can fail in
+ */
+const char *snapshot_step_name(int step);
+
+/**
+ * Writes a snapshot file synchronously (Raft log compaction)
+ * The file is written under a temporary name, synced and renamed, so it is
+ * either complete or the previous file is kept; the header fields and the
+ * CRC of contents are filled in here
+ *
+ * @param path      Path of the file
+ * @param contents  Time, log position and stock to write
+ * @return          0 on success, -1 on failure (error already printed)
+ */
+int snapshot_write(const char *path, SnapshotFile *contents);
+
+/**
+ * Reads and checks a snapshot file
+ *
+ * @param path  Path of the file
+ * @param out   Receives the contents
+ * @return      0 on success, -1 on failure (error already printed)
+ */
+int snapshot_read(const char *path, SnapshotFile *out);
+
+#endif
@@ -0,0 +1,1476 @@
+/*
+ * stock.c - ניהול מלאי האטומים
+ * ----------------------------
+ * המלאי נמצא בזיכרון רגיל, או באזור ממופה של קובץ השמירה (-f/--save-file)
+ * כשמספר תהליכי drinks_bar חולקים אותו.
+ *
+ * מצבי נעילה (--lock-mode):
+ * 1. flock (ברירת מחדל):
+ *    - pthread_rwlock בין תהליכונים של אותו תהליך
+ *    - flock() על קובץ השמירה בין תהליכים (LOCK_EX לכתיבה, LOCK_SH לקריאה)
+ *    - הנעילה שייכת לתיאור הקובץ הפתוח שכל התהליכונים חולקים: התהליכון הקורא
+ *      הראשון לוקח LOCK_SH והאחרון משחרר אותו, כדי שקורא שסיים לא ישחרר את
+ *      הנעילה מתחת לקוראים אחרים של אותו תהליך
+ * 2. atomic:
+ *    - ללא נעילות כלל: המונים בקובץ הממופה מעודכנים בפעולות אטומיות
+ *    - לכל סוג אטום נשמר גם "המקום הפנוי" עד MAX_ATOMS (ברשומת ה-undo שבכותרת,
+ *      שאינה בשימוש במצב זה), כמו במצב sharded
+ *    - ADD: תופס קודם את המקום הפנוי לכל הסוגים (CAS לכל סוג), ורק אחר כך
+ *      מוסיף את האטומים; אם לסוג אחד אין מקום, רק המקום שנתפס מוחזר, ולכן
+ *      ADD של כמה סוגים אינו יכול להצליח בחלקו
+ *    - DELIVER: בודק קודם את שלושת המונים, ואז לולאת CAS לכל אטום נדרש; אם
+ *      DELIVER מקביל לקח אחד מהם קודם, מה שכבר נלקח מוחזר (המקום שלו עדיין
+ *      תפוס, ולכן ההחזרה אינה יכולה לעבור את MAX_ATOMS), ורק אחרי שכל האטומים
+ *      נלקחו המקום שלהם משתחרר
+ *    - עדכון של כמה סוגי אטומים אינו אטומי במצב זה: קורא (STATUS, GEN, כתיבת
+ *      תא בקובץ) עלול לראות ADD או DELIVER שהוחל בחלקו, ו-DELIVER שהפסיד
+ *      במרוץ מחזיק לרגע אטומים שיוחזרו, כך ש-DELIVER אחר עלול להידחות בטעות
+ *    - פעולות אטומיות על זיכרון MAP_SHARED תקפות גם בין תהליכים שונים
+ * 3. mutex:
+ *    - pthread_mutex עם PTHREAD_PROCESS_SHARED ו-PTHREAD_MUTEX_ROBUST בכותרת הקובץ
+ *    - נעילה ושחרור ללא תחרות נשארים במרחב המשתמש (ללא קריאת מערכת)
+ *    - אם תהליך מת בזמן שהחזיק את המנעול, התהליך הבא מקבל EOWNERDEAD,
+ *      משחזר את המלאי מרשומת ה-undo שבכותרת ומסמן את המנעול כתקין
+ * 
+ * 4. sharded (ללא קובץ שמירה בלבד):
+ *    - רסיס (shard) לכל מעבד, שמחזיק "חכירה" של אטומים ושל מקום פנוי עד MAX_ATOMS
+ *      מתוך מאגר גלובלי (escrow)
+ *    - ADD ו-DELIVER פועלים על הרסיס המקומי בלבד, כך ש-OXYGEN אינו נקודה חמה משותפת
+ *    - רסיס שחסר לו חוכר נתח נוסף מהמאגר; אם גם המאגר חסר, כל הרסיסים
+ *      מתרוקנים חזרה למאגר תחת כל המנעולים ורק אז הפעולה נכשלת
+ *    - הסכומים הכוללים (print_stock, GEN) מחושבים במדויק: המאגר ועוד כל הרסיסים
+ * 5. fcntl:
+ *    - כמו flock, אבל בין תהליכים נעשית נעילת טווח (F_OFD_SETLKW) על הבתים של
+ *      המלאי החי בלבד, F_RDLCK לקריאה ו-F_WRLCK לכתיבה
+ *    - נעילת OFD שייכת לתיאור הקובץ הפתוח כמו flock, ולכן גם כאן ה-rwlock
+ *      מפריד בין התהליכונים של אותו תהליך, והקורא הראשון לוקח את F_RDLCK
+ *      והאחרון משחרר אותו
+ * 
+ * עמידות (--durability), כשיש קובץ שמירה:
+ * - none: הדפים הממופים נכתבים לדיסק כשהקרנל מחליט (כמו קודם)
+ * - periodic: תהליכון רקע קורא ל-msync כל --sync-interval מילי-שניות, אם היו
+ *   עדכונים מאז הפעם הקודמת; עדכון שאושר עלול ללכת לאיבוד רק בחלון הזה
+ * - per-op: msync(MS_SYNC) אחרי כל עדכון ולפני התשובה עליו
+ * - msync שנכשל עוצר את התהליך (כמו fdatasync שנכשל ביומן): לא ידוע אם העדכון
+ *   הגיע לדיסק, ולכן אסור לאשר אותו ללקוח
+ * זמן כל עדכון (כולל ה-msync) וזמן כל msync נספרים בהיסטוגרמות (STATS).
+ * 
+ * מבנה קובץ השמירה (גרסה 2):
+ * כותרת (magic, גרסה, מספר היסודות ו-CRC32C שלהם, מצב נעילה, mutex, רשומת undo),
+ * שני "תאים" (slots) עם מספר עדכון ו-CRC32C, ואחריהם המלאי החי.
+ * - כל עדכון כותב את המלאי החדש לתא הישן מבין השניים (לסירוגין), כך שכתיבה
+ *   קרועה יכולה לפגוע רק בעותק שמוחלף, והעותק השני נשאר תקין
+ *   (במצב atomic התא נכתב אחרי העדכון, על ידי מי שמחזיק את ה-mutex שבכותרת)
+ * - התהליך הראשון שפותח את הקובץ בודק את הכותרת; אם הקובץ נכתב באתחול אחר
+ *   של המחשב (boot id שונה, כלומר אחרי נפילת חשמל) המלאי החי אינו אמין,
+ *   והתא התקין האחרון מחליף אותו. באותו אתחול המלאי החי שלם (במטמון הדפים)
+ * - קובץ זר, קטוע או ששני התאים בו פגומים נדחה
+ * קבצים ישנים (AtomStock בלבד, או גרסה 1) משודרגים אוטומטית בפתיחה הראשונה.
+ * מצב הנעילה נשמר בכותרת: כל התהליכים החולקים את הקובץ חייבים לרוץ באותו מצב,
+ * ותהליך שמנסה להצטרף במצב אחר נדחה. נוכחות תהליכים פעילים מזוהה בעזרת
+ * נעילת fcntl() על הבית הראשון של הקובץ (בלינוקס היא אינה תלויה ב-flock).
+ * תהליך ששומר את הקובץ לעצמו (שכפול, Raft, stock_exclusive) נועל גם את הבית
+ * השני, ותהליכים אחרים אינם יכולים להצטרף לקובץ כל עוד הוא פועל.
+ * במצב Raft (stock_update_proposer) ADD ו-DELIVER אינם מוחלים כאן: הם נמסרים
+ * ליומן של האשכול, ומוחלים ב-stock_apply_update כשרוב הצמתים שמרו אותם.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sched.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/file.h>
+
+#include "stock.h"
+#include "capacity.h"
+#include "latency.h"
+#include "crc32c.h"
+#include "wal.h"
+
+// The registry's element ids index the counters of AtomStock
+typedef char registry_matches_atom_stock[(NUM_ELEMENTS == 3 && ELEMENT_CARBON == 0 && ELEMENT_HYDROGEN == 1 &&
+                                          ELEMENT_OXYGEN == 2) ? 1 : -1];
+
+/**
+ * Layout of version 1 save files, upgraded when a process opens one alone
+ */
+typedef struct {
+    uint32_t magic;           // STOCK_FILE_MAGIC
+    uint32_t version;         // 1
+    uint32_t lock_mode;
+    uint32_t undo_valid;
+    pthread_mutex_t mutex;
+    AtomStock undo;
+    AtomStock stock;
+} StockFileV1;
+
+/**
+ * In-memory stock for when no save-file is provided (preserves original Q5 behavior)
+ * This serves as the fallback storage and also holds initial values from command line
+ */
+AtomStock in_memory_stock = {0, 0, 0};
+
+/**
+ * Pointer to the active stock structure
+ * By default, points to the in-memory stock for backward compatibility
+ * When a save-file is used, this will point to the memory-mapped region
+ * All stock operations use this pointer for unified access
+ */
+AtomStock *stock_ptr = &in_memory_stock;
+
+/**
+ * Global file descriptor for file locking to ensure concurrency safety
+ * Used with flock() to coordinate access between multiple server processes:
+ * - LOCK_EX for exclusive access during write operations
+ * - LOCK_SH for shared access during read operations
+ * - LOCK_UN to release locks
+ */
+int lock_fd = -1;
+
+// Synchronization used by the stock operations (set with --lock-mode)
+StockLockMode stock_lock_mode = LOCK_MODE_FLOCK;
+
+// Log updates to <save-file>.wal (set with --wal)
+int stock_wal = 0;
+
+// When the mapped save file is flushed (set with --durability and --sync-interval)
+StockDurability stock_durability = DURABILITY_NONE;
+int stock_sync_interval_ms = 100;
+
+// Latency of every ADD/DELIVER update and of every msync() (console command STATS)
+LatencyHistogram stock_update_latency;
+LatencyHistogram stock_sync_latency;
+
+// Time the last stock_open_save_file() spent checking and recovering the file
+unsigned long long stock_recovery_ns = 0;
+
+// Refuse other processes on the save file (set for replication and --raft-id)
+int stock_exclusive = 0;
+
+// Told about every locked update, in order (replication)
+void (*stock_update_observer)(int op, const unsigned long long atoms[NUM_ELEMENTS]) = NULL;
+
+// Takes over ADD and DELIVER and applies them once they are committed (Raft)
+int (*stock_update_proposer)(int op, const unsigned long long atoms[NUM_ELEMENTS]) = NULL;
+
+// Set by updates, cleared by the periodic msync() thread
+static int stock_dirty = 0;
+static pthread_t periodic_sync_thread;
+static int periodic_sync_running = 0;
+static int periodic_sync_stop = 0;
+
+/**
+ * Reader/writer lock protecting the stock between reactor threads of this process
+ * flock() locks belong to the open file description, which all threads share,
+ * so it cannot keep two threads of the same process apart on its own
+ */
+static pthread_rwlock_t stock_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Reader threads of this process that share the file lock (flock or fcntl range)
+ * Unlocking the open file description releases it for every thread, so only
+ * the first reader takes it and only the last one releases it
+ */
+static pthread_mutex_t file_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static int file_readers = 0;
+
+// Mapped save file, or NULL when the stock lives in memory only
+static StockFile *stock_file = NULL;
+
+// Mutex used in mutex mode when there is no save file
+static pthread_mutex_t memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Parses a --lock-mode argument
+ *
+ * @param name  Mode name ("flock", "fcntl", "atomic", "mutex" or "sharded")
+ * @param mode  Receives the parsed mode
+ * @return      1 on success, 0 if the name is unknown
+ */
+int stock_parse_lock_mode(const char *name, StockLockMode *mode) {
+    if (strcmp(name, "flock") == 0) {
+        *mode = LOCK_MODE_FLOCK;
+    } else if (strcmp(name, "fcntl") == 0) {
+        *mode = LOCK_MODE_FCNTL;
+    } else if (strcmp(name, "atomic") == 0) {
+        *mode = LOCK_MODE_ATOMIC;
+    } else if (strcmp(name, "mutex") == 0) {
+        *mode = LOCK_MODE_MUTEX;
+    } else if (strcmp(name, "sharded") == 0) {
+        *mode = LOCK_MODE_SHARDED;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Returns the --lock-mode name of a lock mode
+ *
+ * @param mode  The lock mode
+ * @return      Its name
+ */
+const char *stock_lock_mode_name(StockLockMode mode) {
+    switch (mode) {
+        case LOCK_MODE_ATOMIC: return "atomic";
+        case LOCK_MODE_MUTEX:  return "mutex";
+        case LOCK_MODE_SHARDED: return "sharded";
+        case LOCK_MODE_FCNTL:  return "fcntl";
+        case LOCK_MODE_FLOCK:
+        default:               return "flock";
+    }
+}
+
+/**
+ * Parses a --durability argument
+ *
+ * @param name  Mode name ("none", "periodic" or "per-op")
+ * @param mode  Receives the parsed mode
+ * @return      1 on success, 0 if the name is unknown
+ */
+int stock_parse_durability(const char *name, StockDurability *mode) {
+    if (strcmp(name, "none") == 0) {
+        *mode = DURABILITY_NONE;
+    } else if (strcmp(name, "periodic") == 0) {
+        *mode = DURABILITY_PERIODIC;
+    } else if (strcmp(name, "per-op") == 0) {
+        *mode = DURABILITY_PER_OP;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Returns the --durability name of a durability mode
+ *
+ * @param mode  The durability mode
+ * @return      Its name
+ */
+const char *stock_durability_name(StockDurability mode) {
+    switch (mode) {
+        case DURABILITY_PERIODIC: return "periodic";
+        case DURABILITY_PER_OP:   return "per-op";
+        case DURABILITY_NONE:
+        default:                  return "none";
+    }
+}
+
+/**
+ * Writes the mapped save file to disk and records how long it took
+ * A failed msync() stops the process, as a failed fdatasync() of the log
+ * does: whether the updates reached the disk is unknown, so a per-op reply
+ * (or the next periodic interval) could not be trusted
+ */
+static void sync_save_file() {
+    unsigned long long start = latency_now_ns();
+    if (msync(stock_file, sizeof(StockFile), MS_SYNC) == -1) {
+        perror("msync save file");
+        exit(1);
+    }
+    latency_record(&stock_sync_latency, latency_now_ns() - start);
+}
+
+/**
+ * Background thread of DURABILITY_PERIODIC: one msync() per interval in
+ * which this process updated the stock, away from the reply path
+ */
+static void *periodic_sync_main(void *arg) {
+    struct timespec interval;
+    (void)arg;
+
+    interval.tv_sec = stock_sync_interval_ms / 1000;
+    interval.tv_nsec = (stock_sync_interval_ms % 1000) * 1000000L;
+    while (!__atomic_load_n(&periodic_sync_stop, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+        if (__atomic_exchange_n(&stock_dirty, 0, __ATOMIC_ACQ_REL)) sync_save_file();
+    }
+    return NULL;
+}
+
+/**
+ * Completes an ADD or DELIVER: flushes it as --durability asks and records
+ * its latency
+ *
+ * @param start    latency_now_ns() when the update started
+ * @param changed  Non-zero if the update changed the stock
+ */
+static void finish_update(unsigned long long start, int changed) {
+    if (changed && stock_file != NULL) {
+        if (stock_durability == DURABILITY_PER_OP) {
+            sync_save_file();
+        } else if (stock_durability == DURABILITY_PERIODIC) {
+            __atomic_store_n(&stock_dirty, 1, __ATOMIC_RELEASE);
+        }
+    }
+    latency_record(&stock_update_latency, latency_now_ns() - start);
+}
+
+/**
+ * Initializes the process-shared robust mutex in the file header
+ * Only called while no other process has the file open
+ *
+ * @param file  The mapped save file
+ * @return      0 on success, -1 on failure
+ */
+static int init_file_mutex(StockFile *file) {
+    pthread_mutexattr_t attr;
+    int rc = pthread_mutexattr_init(&attr);
+    if (rc == 0) rc = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (rc == 0) rc = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (rc == 0) rc = pthread_mutex_init(&file->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0) {
+        errno = rc;
+        perror("pthread_mutex_init");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns non-zero if every counter of a stock is within MAX_ATOMS
+ */
+static int stock_in_range(const AtomStock *stock) {
+    return stock->carbon <= MAX_ATOMS && stock->hydrogen <= MAX_ATOMS && stock->oxygen <= MAX_ATOMS;
+}
+
+/**
+ * Free room under MAX_ATOMS for each atom type (atomic mode)
+ * ADD claims room for every type before it publishes any atom, and DELIVER
+ * gives room back only after it took every atom, so for each type the
+ * counter, its room and what in-flight updates hold always sum to MAX_ATOMS:
+ * neither publishing an ADD nor rolling back a DELIVER can exceed the limit.
+ * With a save file the room is kept in the header's undo record, which only
+ * locked updates use.
+ */
+static AtomStock memory_room;
+static pthread_once_t memory_room_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Sets the room of every type to what the stock leaves under MAX_ATOMS
+ * Only valid while no lock-free update is in flight
+ *
+ * @param room   Receives the room
+ * @param stock  The stock
+ */
+static void reset_room(AtomStock *room, const AtomStock *stock) {
+    room->carbon = stock->carbon < MAX_ATOMS ? MAX_ATOMS - stock->carbon : 0;
+    room->hydrogen = stock->hydrogen < MAX_ATOMS ? MAX_ATOMS - stock->hydrogen : 0;
+    room->oxygen = stock->oxygen < MAX_ATOMS ? MAX_ATOMS - stock->oxygen : 0;
+}
+
+/**
+ * Initializes the room of the in-memory stock from its initial values
+ */
+static void init_memory_room(void) {
+    reset_room(&memory_room, &in_memory_stock);
+}
+
+/**
+ * Returns the room that belongs to the active stock (atomic mode)
+ */
+static AtomStock *atomic_room(void) {
+    if (stock_file != NULL) return &stock_file->undo;
+    pthread_once(&memory_room_once, init_memory_room);
+    return &memory_room;
+}
+
+/**
+ * Commits a stock to the older of the two slots
+ * The caller keeps other slot writers out (exclusive stock lock, or the
+ * file mutex in atomic mode)
+ *
+ * @param file   The mapped save file
+ * @param stock  The stock to commit
+ */
+static void write_slot(StockFile *file, const AtomStock *stock) {
+    uint64_t seq = file->slot_seq + 1;
+    StockSlot *slot = &file->slots[seq & 1];
+
+    slot->seq = seq;
+    slot->stock = *stock;
+    slot->reserved = 0;
+    slot->crc = crc32c(slot, offsetof(StockSlot, crc));
+    __atomic_store_n(&file->slot_seq, seq, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the newest slot with a valid checksum, NULL if both are damaged
+ */
+static const StockSlot *newest_valid_slot(const StockFile *file) {
+    const StockSlot *newest = NULL;
+    for (int i = 0; i < 2; i++) {
+        const StockSlot *slot = &file->slots[i];
+        if (slot->crc == crc32c(slot, offsetof(StockSlot, crc)) && stock_in_range(&slot->stock) &&
+            (newest == NULL || slot->seq > newest->seq)) {
+            newest = slot;
+        }
+    }
+    return newest;
+}
+
+/**
+ * Reads the kernel's boot id, which changes on every boot
+ *
+ * @param out  Receives the id, or an empty string if it is unavailable
+ */
+static void read_boot_id(char out[STOCK_BOOT_ID_SIZE]) {
+    memset(out, 0, STOCK_BOOT_ID_SIZE);
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    if (fd == -1) return;
+    ssize_t n = read(fd, out, STOCK_BOOT_ID_SIZE - 1);
+    close(fd);
+    if (n <= 0) {
+        out[0] = '\0';
+        return;
+    }
+    out[strcspn(out, "\n")] = '\0';
+}
+
+/**
+ * Rolls back an update that was interrupted by the death of its process
+ * Called with the exclusive stock lock (or before other processes join)
+ *
+ * @param file  The mapped save file
+ */
+static void recover_interrupted_update(StockFile *file) {
+    if (file->undo_valid) {
+        fprintf(stderr, "Stock update was interrupted; restoring C=%llu, H=%llu, O=%llu\n",
+                file->undo.carbon, file->undo.hydrogen, file->undo.oxygen);
+        file->stock = file->undo;
+        // The slot may already hold the update that is being rolled back
+        write_slot(file, &file->stock);
+        file->undo_valid = 0;
+    }
+}
+
+/**
+ * Makes the live stock trustworthy when no other process uses the file
+ * - Same boot: the page cache survived and only a process can have died;
+ *   an interrupted locked update is rolled back with the undo record
+ * - Another boot: the file holds whatever reached the disk, possibly a
+ *   torn write; the newest valid slot replaces the live stock
+ * Afterwards the newest slot holds the live stock
+ *
+ * @param file  The mapped save file
+ * @param path  Path of the save file (for messages)
+ * @return      0 on success, -1 if no valid copy of the stock is left
+ */
+static int recover_save_file(StockFile *file, const char *path) {
+    char boot_id[STOCK_BOOT_ID_SIZE];
+    const StockSlot *newest = newest_valid_slot(file);
+
+    read_boot_id(boot_id);
+    file->slot_seq = newest != NULL ? newest->seq : 0;
+    file->changes = file->checkpointed = 0;
+
+    if (boot_id[0] != '\0' && strncmp(boot_id, file->boot_id, STOCK_BOOT_ID_SIZE) == 0 &&
+        stock_in_range(&file->stock)) {
+        recover_interrupted_update(file);
+    } else {
+        if (newest == NULL) {
+            fprintf(stderr, "Save file %s is damaged: no valid copy of the stock is left\n", path);
+            return -1;
+        }
+        if (memcmp(&newest->stock, &file->stock, sizeof(AtomStock)) != 0) {
+            printf("Save file %s: restored the stock of update %llu (C=%llu, H=%llu, O=%llu)\n", path,
+                   (unsigned long long)newest->seq, newest->stock.carbon, newest->stock.hydrogen,
+                   newest->stock.oxygen);
+        }
+        file->stock = newest->stock;
+        file->undo_valid = 0;
+    }
+
+    memcpy(file->boot_id, boot_id, STOCK_BOOT_ID_SIZE);
+    write_slot(file, &file->stock);
+    return 0;
+}
+
+/**
+ * Opens (or creates) the save file and maps the stock from it
+ * - Existing file: the stored stock is used and in_memory_stock is ignored
+ * - New file: the file is created and initialized from in_memory_stock
+ * - Legacy file (AtomStock only): upgraded in place to the current layout
+ * Setup is serialized between processes with flock(LOCK_EX); afterwards a
+ * shared fcntl() lock on byte 0 marks this process as a user of the file
+ *
+ * @param path  Path of the save file
+ * @return      0 on success, -1 on failure (error already printed)
+ */
+int stock_open_save_file(const char *path) {
+    // Shards keep leased atoms in process memory, which other processes cannot see
+    if (stock_lock_mode == LOCK_MODE_SHARDED) {
+        fprintf(stderr, "--lock-mode sharded cannot be used with a save file\n");
+        return -1;
+    }
+
+    // Lock-free updates have no single order in which they could be logged
+    if (stock_wal && stock_lock_mode == LOCK_MODE_ATOMIC) {
+        fprintf(stderr, "--wal needs a locked --lock-mode (flock, fcntl or mutex)\n");
+        return -1;
+    }
+
+    printf("Using save file: %s\n", path);
+
+    // Open the file for read/write, create it if it doesn't exist
+    // The file descriptor will be used for mmap, flock and fcntl operations
+    lock_fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (lock_fd == -1) {
+        perror("Failed to open or create save file");
+        return -1;
+    }
+
+    // Only one process at a time may create, upgrade or join the file
+    if (flock(lock_fd, LOCK_EX) == -1) {
+        perror("flock");
+        goto fail;
+    }
+
+    // Get file status to check if it's a new, legacy or current file
+    struct stat file_stat;
+    if (fstat(lock_fd, &file_stat) == -1) {
+        perror("fstat");
+        goto fail;
+    }
+
+    // If nobody else holds the presence lock, this process is the only user
+    struct flock presence;
+    memset(&presence, 0, sizeof(presence));
+    presence.l_type = F_WRLCK;
+    presence.l_whence = SEEK_SET;
+    presence.l_start = 0;
+    presence.l_len = 1;
+    int sole_user = (fcntl(lock_fd, F_SETLK, &presence) == 0);
+
+    // A process that keeps the file to itself (replication) write-locks byte 1
+    struct flock owner;
+    memset(&owner, 0, sizeof(owner));
+    owner.l_type = F_WRLCK;
+    owner.l_whence = SEEK_SET;
+    owner.l_start = 1;
+    owner.l_len = 1;
+    if (fcntl(lock_fd, F_GETLK, &owner) == 0 && owner.l_type != F_UNLCK) {
+        fprintf(stderr, "Save file %s is replicated by process %d and cannot be shared\n", path, (int)owner.l_pid);
+        goto fail;
+    }
+    if (stock_exclusive) {
+        if (!sole_user) {
+            fprintf(stderr, "Save file %s is in use by other processes; a replicated save file cannot be shared\n",
+                    path);
+            goto fail;
+        }
+        owner.l_type = F_WRLCK;
+        if (fcntl(lock_fd, F_SETLK, &owner) == -1) {
+            perror("fcntl");
+            goto fail;
+        }
+    }
+
+    AtomStock initial = in_memory_stock;
+    int initialize = 1;
+    if (file_stat.st_size == 0) {
+        printf("Save file is new. Initializing with provided stock values.\n");
+    } else if (file_stat.st_size == (off_t)sizeof(AtomStock)) {
+        printf("Loading stock from existing save file. Ignoring command-line stock values.\n");
+        printf("Upgrading save file to the current format.\n");
+        if (pread(lock_fd, &initial, sizeof(initial), 0) != (ssize_t)sizeof(initial)) {
+            perror("Failed to read save file");
+            goto fail;
+        }
+        // A bare stock has no header to check, but its counters must make sense
+        if (!stock_in_range(&initial)) {
+            fprintf(stderr, "Unrecognized save file format: %s\n", path);
+            goto fail;
+        }
+    } else if (file_stat.st_size == (off_t)sizeof(StockFileV1)) {
+        StockFileV1 old;
+        if (pread(lock_fd, &old, sizeof(old), 0) != (ssize_t)sizeof(old)) {
+            perror("Failed to read save file");
+            goto fail;
+        }
+        if (old.magic != STOCK_FILE_MAGIC || old.version != 1) {
+            fprintf(stderr, "Unrecognized save file format: %s\n", path);
+            goto fail;
+        }
+        // Running processes map the old layout, which the upgrade would change under them
+        if (!sole_user) {
+            fprintf(stderr, "Save file %s is in use by processes using the version 1 format; stop them to upgrade it\n",
+                    path);
+            goto fail;
+        }
+        printf("Loading stock from existing save file. Ignoring command-line stock values.\n");
+        printf("Upgrading save file from version 1 to the current format.\n");
+        initial = old.undo_valid ? old.undo : old.stock;
+    } else if (file_stat.st_size == (off_t)sizeof(StockFile)) {
+        printf("Loading stock from existing save file. Ignoring command-line stock values.\n");
+        initialize = 0;
+    } else {
+        fprintf(stderr, "Unrecognized save file format: %s\n", path);
+        goto fail;
+    }
+
+    // Expand new and legacy files to the full layout
+    if (initialize && ftruncate(lock_fd, sizeof(StockFile)) == -1) {
+        perror("ftruncate");
+        goto fail;
+    }
+
+    // Map the file to memory with read/write permissions
+    // MAP_SHARED ensures changes are visible to other processes
+    StockFile *mapped = mmap(NULL, sizeof(StockFile), PROT_READ | PROT_WRITE, MAP_SHARED, lock_fd, 0);
+    if (mapped == MAP_FAILED) {
+        perror(initialize ? "mmap failed on new file" : "mmap failed on existing file");
+        goto fail;
+    }
+
+    unsigned long long check_start = latency_now_ns();
+    if (initialize) {
+        memset(mapped, 0, sizeof(StockFile));
+        mapped->magic = STOCK_FILE_MAGIC;
+        mapped->version = STOCK_FILE_VERSION;
+        mapped->num_elements = NUM_ELEMENTS;
+        mapped->header_crc = crc32c(mapped, offsetof(StockFile, header_crc));
+        mapped->stock = initial;
+        read_boot_id(mapped->boot_id);
+        write_slot(mapped, &mapped->stock);
+    } else if (mapped->magic != STOCK_FILE_MAGIC || mapped->version != STOCK_FILE_VERSION ||
+               mapped->num_elements != NUM_ELEMENTS ||
+               mapped->header_crc != crc32c(mapped, offsetof(StockFile, header_crc))) {
+        fprintf(stderr, "Unrecognized save file format: %s\n", path);
+        munmap(mapped, sizeof(StockFile));
+        goto fail;
+    }
+
+    if (initialize || sole_user) {
+        // Nobody else is using the file: recover from any crash and (re)initialize the lock
+        if (!initialize && recover_save_file(mapped, path) == -1) {
+            munmap(mapped, sizeof(StockFile));
+            goto fail;
+        }
+        if (init_file_mutex(mapped) == -1) {
+            munmap(mapped, sizeof(StockFile));
+            goto fail;
+        }
+        mapped->lock_mode = stock_lock_mode;
+        // Room claimed by processes that died mid-update is reclaimed here
+        if (stock_lock_mode == LOCK_MODE_ATOMIC) reset_room(&mapped->undo, &mapped->stock);
+    } else if (mapped->lock_mode != (uint32_t)stock_lock_mode) {
+        fprintf(stderr, "Save file is in use with --lock-mode %s; all processes sharing it must use the same mode\n",
+                stock_lock_mode_name((StockLockMode)mapped->lock_mode));
+        munmap(mapped, sizeof(StockFile));
+        goto fail;
+    }
+
+    stock_recovery_ns = latency_now_ns() - check_start;
+
+    // The log lives next to the save file; a process without --wal must not
+    // change a stock whose log would then miss its updates
+    char log_path[4096];
+    snprintf(log_path, sizeof(log_path), "%s.wal", path);
+    if (stock_wal) {
+        if (wal_open(log_path, &mapped->stock, initialize || sole_user) == -1) {
+            munmap(mapped, sizeof(StockFile));
+            goto fail;
+        }
+        // The replayed stock becomes the newest slot
+        if (initialize || sole_user) write_slot(mapped, &mapped->stock);
+    } else if (access(log_path, F_OK) == 0) {
+        fprintf(stderr, "Save file has an operation log (%s); run with --wal or remove the log\n", log_path);
+        munmap(mapped, sizeof(StockFile));
+        goto fail;
+    }
+
+    // Keep a shared presence lock for as long as the file is open
+    presence.l_type = F_RDLCK;
+    if (fcntl(lock_fd, F_SETLK, &presence) == -1) {
+        perror("fcntl");
+        wal_close();
+        munmap(mapped, sizeof(StockFile));
+        goto fail;
+    }
+    flock(lock_fd, LOCK_UN);
+
+    stock_file = mapped;
+    stock_ptr = &mapped->stock;
+
+    if (stock_durability == DURABILITY_PERIODIC) {
+        int rc = pthread_create(&periodic_sync_thread, NULL, periodic_sync_main, NULL);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create (periodic msync): %s\n", strerror(rc));
+            stock_close_save_file();
+            return -1;
+        }
+        periodic_sync_running = 1;
+    }
+    return 0;
+
+fail:
+    close(lock_fd);
+    lock_fd = -1;
+    return -1;
+}
+
+/**
+ * Unmaps and closes the save file; the stock falls back to in_memory_stock
+ * Closing the descriptor also releases the flock() and presence locks
+ */
+void stock_close_save_file() {
+    if (periodic_sync_running) {
+        __atomic_store_n(&periodic_sync_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(periodic_sync_thread, NULL);
+        periodic_sync_running = 0;
+        periodic_sync_stop = 0;
+        if (stock_dirty) sync_save_file();
+    }
+    if (stock_file != NULL) {
+        munmap(stock_file, sizeof(StockFile));
+        stock_file = NULL;
+    }
+    stock_ptr = &in_memory_stock;
+    wal_close();
+    if (lock_fd != -1) {
+        close(lock_fd);
+        lock_fd = -1;
+    }
+}
+
+/**
+ * Locks the mutex used in mutex mode
+ * If the previous owner died while holding it, the interrupted update is
+ * rolled back and the mutex is marked consistent again
+ */
+static void stock_mutex_lock() {
+    if (stock_file == NULL) {
+        pthread_mutex_lock(&memory_mutex);
+        return;
+    }
+    int rc = pthread_mutex_lock(&stock_file->mutex);
+    if (rc == EOWNERDEAD) {
+        fprintf(stderr, "Stock lock owner died; recovering the stock\n");
+        recover_interrupted_update(stock_file);
+        pthread_mutex_consistent(&stock_file->mutex);
+    } else if (rc != 0) {
+        errno = rc;
+        perror("pthread_mutex_lock");
+    }
+}
+
+/**
+ * Takes or releases the fcntl-mode range lock on the live stock of the save file
+ * The lock is an open file description (OFD) lock, so it does not touch the
+ * per-process presence locks on bytes 0 and 1 and is dropped with the descriptor
+ *
+ * @param type  F_RDLCK, F_WRLCK or F_UNLCK
+ */
+static void stock_range_lock(short type) {
+    struct flock range;
+    memset(&range, 0, sizeof(range));
+    range.l_type = type;
+    range.l_whence = SEEK_SET;
+    range.l_start = offsetof(StockFile, stock);
+    range.l_len = sizeof(AtomStock);
+    while (fcntl(lock_fd, F_OFD_SETLKW, &range) == -1) {
+        if (errno != EINTR) {
+            perror("fcntl");
+            return;
+        }
+    }
+}
+
+/**
+ * Takes the shared file lock for the reader threads of this process
+ * (stock_rwlock held for reading)
+ */
+static void file_lock_shared() {
+    pthread_mutex_lock(&file_readers_lock);
+    if (file_readers++ == 0) {
+        if (stock_lock_mode == LOCK_MODE_FCNTL) {
+            stock_range_lock(F_RDLCK);
+        } else {
+            flock(lock_fd, LOCK_SH);
+        }
+    }
+    pthread_mutex_unlock(&file_readers_lock);
+}
+
+/**
+ * Releases the file lock once no thread of this process uses it
+ * While a writer holds stock_rwlock there are no readers, so a count of
+ * zero means the caller is the writer
+ */
+static void file_unlock() {
+    pthread_mutex_lock(&file_readers_lock);
+    if (file_readers == 0 || --file_readers == 0) {
+        if (stock_lock_mode == LOCK_MODE_FCNTL) {
+            stock_range_lock(F_UNLCK);
+        } else {
+            flock(lock_fd, LOCK_UN);
+        }
+    }
+    pthread_mutex_unlock(&file_readers_lock);
+}
+
+/**
+ * Acquires shared (read) access to the stock, across threads and processes
+ * In mutex mode readers are serialized as well
+ */
+void stock_lock_shared() {
+    if (stock_lock_mode == LOCK_MODE_MUTEX) {
+        stock_mutex_lock();
+        return;
+    }
+    pthread_rwlock_rdlock(&stock_rwlock);
+    if (lock_fd != -1) file_lock_shared();
+}
+
+/**
+ * Acquires exclusive (write) access to the stock, across threads and processes
+ */
+void stock_lock_exclusive() {
+    if (stock_lock_mode == LOCK_MODE_MUTEX) {
+        stock_mutex_lock();
+        return;
+    }
+    pthread_rwlock_wrlock(&stock_rwlock);
+    if (lock_fd == -1) return;
+    if (stock_lock_mode == LOCK_MODE_FCNTL) {
+        stock_range_lock(F_WRLCK);
+    } else {
+        flock(lock_fd, LOCK_EX);
+    }
+}
+
+/**
+ * Releases access acquired with stock_lock_shared() or stock_lock_exclusive()
+ */
+void stock_unlock() {
+    if (stock_lock_mode == LOCK_MODE_MUTEX) {
+        pthread_mutex_unlock(stock_file != NULL ? &stock_file->mutex : &memory_mutex);
+        return;
+    }
+    if (lock_fd != -1) file_unlock();
+    pthread_rwlock_unlock(&stock_rwlock);
+}
+
+/**
+ * Records the stock before a locked update so it can be rolled back
+ * if this process dies before stock_end_update()
+ */
+static void stock_begin_update() {
+    // In atomic mode the undo record holds the room (see atomic_room())
+    if (stock_file == NULL || stock_lock_mode == LOCK_MODE_ATOMIC) return;
+    stock_file->undo = stock_file->stock;
+    __atomic_store_n(&stock_file->undo_valid, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * Marks the locked update started with stock_begin_update() as complete
+ */
+static void stock_end_update() {
+    // Locked updates in atomic mode (Raft, standby) are the only writers there
+    if (stock_lock_mode == LOCK_MODE_ATOMIC) reset_room(atomic_room(), stock_ptr);
+    if (stock_file == NULL) return;
+    // Committing the slot is what makes the update survive a torn write
+    write_slot(stock_file, &stock_file->stock);
+    __atomic_store_n(&stock_file->undo_valid, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Lock-free take: subtracts need unless the counter holds less
+ *
+ * @param counter  Counter to update (atoms or room, may live in the shared mapping)
+ * @param need     Amount to take
+ * @return         1 on success, 0 if the counter holds less than need
+ */
+static int atomic_take(unsigned long long *counter, unsigned long long need) {
+    unsigned long long current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    do {
+        if (current < need) return 0;
+    } while (!__atomic_compare_exchange_n(counter, &current, current - need, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/**
+ * Reads the three counters without taking a lock (atomic mode)
+ * Each counter is read atomically; the three reads are not one snapshot
+ *
+ * @param stock  Pointer to the atom stock structure
+ * @param out    Receives the counter values
+ */
+static void atomic_read_stock(AtomStock *stock, AtomStock *out) {
+    out->carbon = __atomic_load_n(&stock->carbon, __ATOMIC_ACQUIRE);
+    out->hydrogen = __atomic_load_n(&stock->hydrogen, __ATOMIC_ACQUIRE);
+    out->oxygen = __atomic_load_n(&stock->oxygen, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Commits the live stock to a slot after a lock-free update (atomic mode)
+ * Whoever holds the slot writer lock also commits the updates that arrive
+ * meanwhile, so a thread that finds it busy returns at once
+ */
+static void checkpoint_lock_free() {
+    StockFile *file = stock_file;
+    if (file == NULL) return;
+
+    __atomic_add_fetch(&file->changes, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&file->changes, __ATOMIC_ACQUIRE) != __atomic_load_n(&file->checkpointed, __ATOMIC_ACQUIRE)) {
+        int rc = pthread_mutex_trylock(&file->mutex);
+        if (rc == EOWNERDEAD) {
+            pthread_mutex_consistent(&file->mutex);
+        } else if (rc != 0) {
+            return;
+        }
+        uint64_t target = __atomic_load_n(&file->changes, __ATOMIC_ACQUIRE);
+        AtomStock current;
+        atomic_read_stock(&file->stock, &current);
+        write_slot(file, &current);
+        __atomic_store_n(&file->checkpointed, target, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&file->mutex);
+    }
+}
+
+/**
+ * Sharded mode (--lock-mode sharded)
+ * Every CPU has a shard that holds a lease of atoms and of free room
+ * (MAX_ATOMS headroom) taken from the global pool. ADD spends room and
+ * gains atoms, DELIVER spends atoms and gains room, both on the local shard
+ * only. A shard that runs short leases more from the pool; if the pool is
+ * short too, every shard is drained back into the pool under all locks.
+ * For each atom type, atoms plus room over the pool and all shards always
+ * equals MAX_ATOMS, so both limits stay exact.
+ */
+#define MAX_SHARDS 64
+#define LEASE_CHUNK 256ULL                  // Extra amount leased when a shard runs short
+#define LEASE_HIGH_WATER (4 * LEASE_CHUNK)  // A shard returns what it holds above this
+#define RES_ATOMS 0                         // res[RES_ATOMS + e]: atoms of type e
+#define RES_ROOM 3                          // res[RES_ROOM + e]: room left for type e
+#define NUM_RES 6
+
+/**
+ * One per-CPU shard, on its own cache line
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned long long res[NUM_RES];
+} __attribute__((aligned(64))) StockShard;
+
+static StockShard shards[MAX_SHARDS];
+static int num_shards = 1;
+static unsigned long long pool[NUM_RES];   // Global pool, guarded by pool_lock
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Creates one shard per configured CPU and moves in_memory_stock into the pool
+ */
+static void init_shards(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    num_shards = cpus < 1 ? 1 : (cpus > MAX_SHARDS ? MAX_SHARDS : (int)cpus);
+    for (int i = 0; i < num_shards; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+
+    const unsigned long long initial[3] = {in_memory_stock.carbon, in_memory_stock.hydrogen, in_memory_stock.oxygen};
+    for (int e = 0; e < 3; e++) {
+        pool[RES_ATOMS + e] = initial[e];
+        pool[RES_ROOM + e] = initial[e] < MAX_ATOMS ? MAX_ATOMS - initial[e] : 0;
+    }
+}
+
+/**
+ * Returns the shard of the CPU the caller runs on
+ */
+static StockShard *local_shard(void) {
+    pthread_once(&shards_once, init_shards);
+    int cpu = sched_getcpu();
+    if (cpu < 0) cpu = 0;
+    return &shards[cpu % num_shards];
+}
+
+/**
+ * Locks every shard (in index order) and then the pool
+ */
+static void lock_all_shards(void) {
+    pthread_once(&shards_once, init_shards);
+    for (int i = 0; i < num_shards; i++) pthread_mutex_lock(&shards[i].lock);
+    pthread_mutex_lock(&pool_lock);
+}
+
+/**
+ * Releases the locks taken by lock_all_shards()
+ */
+static void unlock_all_shards(void) {
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = num_shards - 1; i >= 0; i--) pthread_mutex_unlock(&shards[i].lock);
+}
+
+/**
+ * Slow path: drains the short resources of every shard into the pool and
+ * applies the operation there, so it fails only if the global total is short
+ *
+ * @param need  Amount of each resource the operation consumes
+ * @param gain  Amount of each resource the operation produces
+ * @return      1 on success, 0 if a resource is short globally
+ */
+static int sharded_apply_global(const unsigned long long need[NUM_RES], const unsigned long long gain[NUM_RES]) {
+    int success = 1;
+
+    lock_all_shards();
+    for (int r = 0; r < NUM_RES && success; r++) {
+        if (need[r] == 0) continue;
+        unsigned long long total = pool[r];
+        for (int i = 0; i < num_shards; i++) total += shards[i].res[r];
+        if (total < need[r]) success = 0;
+    }
+    if (success) {
+        for (int r = 0; r < NUM_RES; r++) {
+            if (need[r] == 0 || pool[r] >= need[r]) continue;
+            for (int i = 0; i < num_shards; i++) {
+                pool[r] += shards[i].res[r];
+                shards[i].res[r] = 0;
+            }
+        }
+        for (int r = 0; r < NUM_RES; r++) pool[r] = pool[r] - need[r] + gain[r];
+    }
+    unlock_all_shards();
+    return success;
+}
+
+/**
+ * Applies an operation on the caller's shard, leasing from the pool if needed
+ *
+ * @param need  Amount of each resource the operation consumes
+ * @param gain  Amount of each resource the operation produces
+ * @return      1 on success, 0 if a resource is short globally
+ */
+static int sharded_apply(const unsigned long long need[NUM_RES], const unsigned long long gain[NUM_RES]) {
+    StockShard *shard = local_shard();
+    int r, short_of = 0, excess = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    for (r = 0; r < NUM_RES; r++) {
+        if (shard->res[r] < need[r]) short_of = 1;
+    }
+    if (short_of) {
+        // Lease the missing amount plus a chunk from the pool
+        short_of = 0;
+        pthread_mutex_lock(&pool_lock);
+        for (r = 0; r < NUM_RES; r++) {
+            if (shard->res[r] >= need[r]) continue;
+            unsigned long long want = need[r] - shard->res[r] + LEASE_CHUNK;
+            unsigned long long take = want < pool[r] ? want : pool[r];
+            pool[r] -= take;
+            shard->res[r] += take;
+            if (shard->res[r] < need[r]) short_of = 1;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    if (short_of) {
+        pthread_mutex_unlock(&shard->lock);
+        return sharded_apply_global(need, gain);
+    }
+
+    for (r = 0; r < NUM_RES; r++) {
+        shard->res[r] = shard->res[r] - need[r] + gain[r];
+        if (shard->res[r] > LEASE_HIGH_WATER) excess = 1;
+    }
+    if (excess) {
+        // Give back what this shard holds above its lease so other shards can use it
+        pthread_mutex_lock(&pool_lock);
+        for (r = 0; r < NUM_RES; r++) {
+            if (shard->res[r] <= LEASE_HIGH_WATER) continue;
+            pool[r] += shard->res[r] - LEASE_CHUNK;
+            shard->res[r] = LEASE_CHUNK;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return 1;
+}
+
+/**
+ * Exact totals in sharded mode: the pool plus every shard, under all locks
+ *
+ * @param out  Receives the counter values
+ */
+static void sharded_read_stock(AtomStock *out) {
+    unsigned long long total[3];
+
+    lock_all_shards();
+    for (int e = 0; e < 3; e++) {
+        total[e] = pool[RES_ATOMS + e];
+        for (int i = 0; i < num_shards; i++) total[e] += shards[i].res[RES_ATOMS + e];
+    }
+    unlock_all_shards();
+
+    out->carbon = total[0];
+    out->hydrogen = total[1];
+    out->oxygen = total[2];
+}
+
+/**
+ * Reads a consistent copy of the stock using the active lock mode
+ *
+ * @param stock  Pointer to the atom stock structure
+ * @param out    Receives the counter values
+ */
+static void read_stock(AtomStock *stock, AtomStock *out) {
+    if (stock_lock_mode == LOCK_MODE_ATOMIC) {
+        atomic_read_stock(stock, out);
+    } else if (stock_lock_mode == LOCK_MODE_SHARDED) {
+        sharded_read_stock(out);
+    } else {
+        // Acquire a shared lock for reading to prevent dirty reads
+        // Multiple processes can hold shared locks simultaneously for reading
+        stock_lock_shared();
+        *out = *stock;
+        // Release the lock to allow other processes to access the file
+        stock_unlock();
+    }
+}
+
+/**
+ * Returns a copy of the current stock totals, whatever the lock mode
+ *
+ * @param out  Receives the counter values
+ */
+void stock_snapshot(AtomStock *out) {
+    read_stock(stock_ptr, out);
+}
+
+/**
+ * Returns a copy of the stock together with the last log record it includes
+ * Records are appended under the exclusive lock, so the shared lock keeps
+ * both the stock and the end of the log still (--wal needs a locked mode)
+ *
+ * @param out      Receives the counter values
+ * @param log_lsn  Receives the last log record in out, 0 without --wal
+ */
+void stock_snapshot_at(AtomStock *out, unsigned long long *log_lsn) {
+    if (!wal_enabled()) {
+        read_stock(stock_ptr, out);
+        *log_lsn = 0;
+        return;
+    }
+    stock_lock_shared();
+    *out = *stock_ptr;
+    *log_lsn = wal_last_lsn();
+    stock_unlock();
+}
+
+/**
+ * Applies an update that another server already applied (replication standby),
+ * or that the Raft cluster committed
+ * The update is checked against the stock as ADD and DELIVER check it: on a
+ * standby an update that does not fit means the two copies of the stock
+ * differ; a committed Raft entry that does not fit is refused on every node
+ *
+ * @param op     WAL_OP_ADD or WAL_OP_DELIVER
+ * @param atoms  Atoms added or taken, indexed like the element ids
+ * @return       0 on success, -1 if the update does not fit the stock (nothing is changed)
+ */
+int stock_apply_update(int op, const unsigned long long atoms[NUM_ELEMENTS]) {
+    unsigned long long *counters[NUM_ELEMENTS] = {&stock_ptr->carbon, &stock_ptr->hydrogen, &stock_ptr->oxygen};
+    int fits = 1;
+    unsigned long long start = latency_now_ns();
+
+    stock_lock_exclusive();
+    for (int e = 0; e < NUM_ELEMENTS && fits; e++) {
+        fits = op == WAL_OP_ADD ? atoms[e] <= MAX_ATOMS - *counters[e] : atoms[e] <= *counters[e];
+    }
+    if (fits) {
+        stock_begin_update();
+        for (int e = 0; e < NUM_ELEMENTS; e++) {
+            if (op == WAL_OP_ADD) {
+                *counters[e] += atoms[e];
+            } else {
+                *counters[e] -= atoms[e];
+            }
+        }
+        stock_end_update();
+        capacity_stock_changed(stock_ptr);
+    }
+    stock_unlock();
+    finish_update(start, fits);
+    return fits ? 0 : -1;
+}
+
+/**
+ * Replaces the whole stock (full sync of a replication standby)
+ *
+ * @param stock  The new counter values
+ */
+void stock_replace(const AtomStock *stock) {
+    unsigned long long start = latency_now_ns();
+
+    stock_lock_exclusive();
+    stock_begin_update();
+    *stock_ptr = *stock;
+    stock_end_update();
+    capacity_stock_changed(stock_ptr);
+    stock_unlock();
+    finish_update(start, 1);
+}
+
+/**
+ * Prints the current atom inventory to stdout
+ * Called after each successful operation to show the updated stock
+ * Uses file locking to prevent reading inconsistent data
+ * during concurrent write operations by other processes
+ * (in atomic mode the counters are read without any lock, in sharded
+ * mode the pool and all shards are summed)
+ */
+void print_stock() {
+    AtomStock current;
+    read_stock(stock_ptr, &current);
+
+    printf("Stock: C=%llu, H=%llu, O=%llu\n", current.carbon, current.hydrogen, current.oxygen);
+}
+
+/**
+ * Adds atoms to the stock inventory
+ *
+ * @param stock    Pointer to the atom stock structure (can be memory-mapped)
+ * @param element  Type of atom to add ("CARBON", "HYDROGEN", or "OXYGEN")
+ * @param amount   Number of atoms to add
+ * @return         1 on success, 0 on failure
+ */
+int atom_adder(AtomStock *stock, const char *element, unsigned int amount) {
+    unsigned long long amounts[NUM_ELEMENTS] = {0};
+
+    // Resolve the atom type before taking any lock
+    int e = registry_element_id(element);
+    if (e < 0) {
+        // Invalid atom type
+        fprintf(stderr, "Error: Unknown atom type '%s'\n", element);
+        return 0;
+    }
+    amounts[e] = amount;
+
+    return atom_adder_multi(stock, amounts);
+}
+
+/**
+ * Adds several atom types in one all-or-nothing update
+ * Every type is checked against MAX_ATOMS before anything is committed
+ * (in atomic mode the room of every type is claimed first and only then
+ * are the atoms published, one type at a time)
+ *
+ * @param stock    Pointer to the atom stock structure (can be memory-mapped)
+ * @param amounts  Atoms to add, indexed CARBON, HYDROGEN, OXYGEN
+ * @return         1 on success, 0 if a type would exceed MAX_ATOMS (nothing is added)
+ */
+int atom_adder_multi(AtomStock *stock, const unsigned long long amounts[NUM_ELEMENTS]) {
+    unsigned long long *counters[NUM_ELEMENTS] = {&stock->carbon, &stock->hydrogen, &stock->oxygen};
+    int failed = -1;  // Index of the type that does not fit, NUM_ELEMENTS if unknown
+    unsigned long long start = latency_now_ns();
+
+    if (stock_update_proposer != NULL) {
+        // Applied by stock_apply_update() once the cluster committed it; the reply waits for that
+        stock_update_proposer(WAL_OP_ADD, amounts);
+        return 0;
+    }
+
+    if (stock_lock_mode == LOCK_MODE_ATOMIC) {
+        AtomStock *room = atomic_room();
+        unsigned long long *rooms[NUM_ELEMENTS] = {&room->carbon, &room->hydrogen, &room->oxygen};
+
+        // Claim the room of every type; no atom is visible until all of it is held
+        int claimed = 0;
+        while (claimed < NUM_ELEMENTS && (amounts[claimed] == 0 || atomic_take(rooms[claimed], amounts[claimed]))) {
+            claimed++;
+        }
+        if (claimed < NUM_ELEMENTS) {
+            // Nothing was published: only the claimed room goes back
+            failed = claimed;
+            while (claimed > 0) {
+                claimed--;
+                if (amounts[claimed] > 0) __atomic_fetch_add(rooms[claimed], amounts[claimed], __ATOMIC_ACQ_REL);
+            }
+        } else {
+            // The room is held, so publishing cannot fail or exceed MAX_ATOMS
+            for (int e = 0; e < NUM_ELEMENTS; e++) {
+                if (amounts[e] > 0) __atomic_fetch_add(counters[e], amounts[e], __ATOMIC_ACQ_REL);
+            }
+            checkpoint_lock_free();
+            capacity_stock_changed(NULL);
+        }
+    } else if (stock_lock_mode == LOCK_MODE_SHARDED) {
+        // Spend room and gain atoms on this CPU's shard
+        unsigned long long need[NUM_RES] = {0, 0, 0, amounts[0], amounts[1], amounts[2]};
+        unsigned long long gain[NUM_RES] = {amounts[0], amounts[1], amounts[2], 0, 0, 0};
+        if (!sharded_apply(need, gain)) {
+            failed = NUM_ELEMENTS;
+        } else {
+            capacity_stock_changed(NULL);
+        }
+    } else {
+        // Acquire an exclusive lock for writing
+        // Only one process can hold an exclusive lock at a time
+        stock_lock_exclusive();
+
+        // Check if adding would exceed the maximum allowed atoms, for every type
+        for (int e = 0; e < 3 && failed < 0; e++) {
+            if (amounts[e] > MAX_ATOMS - *counters[e]) failed = e;
+        }
+        // Log the update before applying it
+        if (failed < 0 && wal_enabled() && wal_append(WAL_OP_ADD, amounts) == -1) failed = NUM_ELEMENTS;
+        if (failed < 0) {
+            stock_begin_update();
+            for (int e = 0; e < 3; e++) *counters[e] += amounts[e];
+            stock_end_update();
+            capacity_stock_changed(stock);
+            if (stock_update_observer != NULL) stock_update_observer(WAL_OP_ADD, amounts);
+        }
+
+        // Release the lock before returning to allow other processes to access
+        stock_unlock();
+    }
+    finish_update(start, failed < 0);
+
+    if (failed >= 0) {
+        const char *name = registry_element_name(failed);
+        fprintf(stderr, "Error: Exceeds MAX_ATOMS%s%s\n", name != NULL ? " for " : "", name != NULL ? name : "");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Subtracts atoms from the stock to create molecules
+ *
+ * @param stock     Pointer to the atom stock structure (can be memory-mapped)
+ * @param molecule  Type of molecule to create
+ * @param amount    Number of molecules to create
+ * @return          1 on success, 0 on failure (insufficient atoms or unknown molecule)
+ */
+int molecule_subtract(AtomStock *stock, const char *molecule, unsigned int amount) {
+    MoleculeOrder order;
+
+    // Find the molecule type
+    int type = registry_molecule_id(molecule);
+    if (type < 0) {
+        // Unknown molecule type
+        fprintf(stderr, "Error: Unknown molecule type '%s'\n", molecule);
+        return 0;
+    }
+
+    order.molecule = type;
+    order.amount = amount;
+    if (!molecule_subtract_multi(stock, &order, 1)) {
+        fprintf(stderr, "Error: Not enough atoms for molecule %s\n", molecule);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Delivers several molecule types in one all-or-nothing transaction
+ * The atom requirement of the whole order is summed once, checked against
+ * the stock and taken under a single lock acquisition
+ *
+ * @param stock  Pointer to the atom stock structure (can be memory-mapped)
+ * @param order  Molecules to create (a molecule may appear more than once)
+ * @param count  Number of lines in order
+ * @return       1 on success, 0 if there are not enough atoms (nothing is taken)
+ */
+int molecule_subtract_multi(AtomStock *stock, const MoleculeOrder *order, int count) {
+    unsigned long long *counters[NUM_ELEMENTS] = {&stock->carbon, &stock->hydrogen, &stock->oxygen};
+    unsigned long long need[NUM_ELEMENTS] = {0};
+    int success = 1;
+    unsigned long long start = latency_now_ns();
+
+    // Sum the required atoms of the whole order
+    for (int i = 0; i < count; i++) {
+        const unsigned int *formula = registry_molecule_formula(order[i].molecule);
+        for (int e = 0; e < NUM_ELEMENTS; e++) {
+            // More than MAX_ATOMS can never be satisfied (and the sums must not overflow)
+            if (formula[e] > 0 && order[i].amount > (MAX_ATOMS - need[e]) / formula[e]) return 0;
+            need[e] += formula[e] * order[i].amount;
+        }
+    }
+
+    if (stock_update_proposer != NULL) {
+        // Applied by stock_apply_update() once the cluster committed it; the reply waits for that
+        stock_update_proposer(WAL_OP_DELIVER, need);
+        return 0;
+    }
+
+    if (stock_lock_mode == LOCK_MODE_ATOMIC) {
+        // Check every type first so a plain shortage takes nothing
+        for (int e = 0; e < NUM_ELEMENTS && success; e++) {
+            if (__atomic_load_n(counters[e], __ATOMIC_ACQUIRE) < need[e]) success = 0;
+        }
+        // Take each required atom type with its own CAS loop; if a concurrent
+        // DELIVER took one first, give back what was already taken. The room of
+        // those atoms is still held (see atomic_room()), so no ADD can have used
+        // it and giving them back cannot exceed MAX_ATOMS
+        int taken = 0;
+        while (success && taken < NUM_ELEMENTS && (need[taken] == 0 || atomic_take(counters[taken], need[taken]))) {
+            taken++;
+        }
+        if (taken > 0) {
+            if (taken < NUM_ELEMENTS) {
+                while (taken > 0) {
+                    taken--;
+                    if (need[taken] > 0) __atomic_fetch_add(counters[taken], need[taken], __ATOMIC_ACQ_REL);
+                }
+                success = 0;
+            } else {
+                // The atoms are gone for good: their room becomes free for ADD
+                AtomStock *room = atomic_room();
+                __atomic_fetch_add(&room->carbon, need[0], __ATOMIC_ACQ_REL);
+                __atomic_fetch_add(&room->hydrogen, need[1], __ATOMIC_ACQ_REL);
+                __atomic_fetch_add(&room->oxygen, need[2], __ATOMIC_ACQ_REL);
+            }
+            // Also after a rollback: a concurrent refresh may have seen the atoms taken
+            checkpoint_lock_free();
+            capacity_stock_changed(NULL);
+        } else {
+            success = 0;
+        }
+    } else if (stock_lock_mode == LOCK_MODE_SHARDED) {
+        // Spend atoms and gain room on this CPU's shard
+        unsigned long long spend[NUM_RES] = {need[0], need[1], need[2], 0, 0, 0};
+        unsigned long long gain[NUM_RES] = {0, 0, 0, need[0], need[1], need[2]};
+        success = sharded_apply(spend, gain);
+        if (success) capacity_stock_changed(NULL);
+    } else {
+        // Acquire an exclusive lock for writing
+        // This ensures atomic read-check-write operations across processes
+        stock_lock_exclusive();
+
+        // Check if we have enough atoms (atomic check under lock)
+        for (int e = 0; e < NUM_ELEMENTS && success; e++) {
+            if (*counters[e] < need[e]) success = 0;
+        }
+        // Log the update before applying it
+        if (success && wal_enabled() && wal_append(WAL_OP_DELIVER, need) == -1) success = 0;
+        if (success) {
+            // Subtract the required atoms from stock (atomic operation)
+            stock_begin_update();
+            for (int e = 0; e < NUM_ELEMENTS; e++) *counters[e] -= need[e];
+            stock_end_update();
+            capacity_stock_changed(stock);
+            if (stock_update_observer != NULL) stock_update_observer(WAL_OP_DELIVER, need);
+        }
+
+        // Release the lock before returning to allow other processes to access
+        stock_unlock();
+    }
+    finish_update(start, success);
+
+    return success;
+}
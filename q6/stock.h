@@ -0,0 +1,241 @@
+/*
+ * stock.h - מלאי האטומים של drinks_bar
+ *
+ * Atom inventory shared by every reactor thread and, through the save file,
+ * by every drinks_bar process that uses the same --save-file.
+ */
+
+#ifndef STOCK_H
+#define STOCK_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "registry.h"
+#include "latency.h"
+
+#define MAX_ATOMS 1000000000000000000ULL  // Maximum number of atoms per type (10^18)
+
+/**
+ * Structure to store the current inventory of atoms
+ * Using unsigned long long to support the large number requirement (10^18)
+ */
+typedef struct {
+    unsigned long long carbon;    // Count of carbon atoms
+    unsigned long long hydrogen;  // Count of hydrogen atoms
+    unsigned long long oxygen;    // Count of oxygen atoms
+} AtomStock;
+
+#define STOCK_FILE_MAGIC 0x46534244u   // "DBSF"
+#define STOCK_FILE_VERSION 2
+#define STOCK_BOOT_ID_SIZE 40          // /proc/sys/kernel/random/boot_id, NUL-terminated
+
+/**
+ * One checksummed copy of the stock in the save file
+ * Updates overwrite the older of the two slots, so a torn write can only
+ * damage the copy that is being replaced
+ */
+typedef struct {
+    uint64_t seq;       // Update that wrote the slot; the valid slot with the highest seq is the newest
+    AtomStock stock;    // Stock after that update
+    uint32_t crc;       // CRC32C of the slot up to this field
+    uint32_t reserved;
+} StockSlot;
+
+/**
+ * Layout of the save file (and of its shared mapping)
+ * The live stock stays last so later versions can grow the header in front of it
+ */
+typedef struct {
+    uint32_t magic;           // STOCK_FILE_MAGIC
+    uint32_t version;         // STOCK_FILE_VERSION
+    uint32_t num_elements;    // NUM_ELEMENTS (counters in every AtomStock)
+    uint32_t header_crc;      // CRC32C of the three fields above
+    uint32_t lock_mode;       // StockLockMode used by every process sharing the file
+    uint32_t undo_valid;      // 1 while a locked update is in progress
+    char boot_id[STOCK_BOOT_ID_SIZE];  // Boot of the kernel whose page cache holds the live stock
+    pthread_mutex_t mutex;    // Process-shared robust mutex (--lock-mode mutex; slot writer in atomic mode)
+    uint64_t slot_seq;        // seq of the newest slot
+    uint64_t changes;         // Lock-free updates so far (atomic mode)
+    uint64_t checkpointed;    // Value of changes the newest slot includes (atomic mode)
+    AtomStock undo;           // Stock before the update in progress (atomic mode: free room under MAX_ATOMS)
+    StockSlot slots[2];       // The last two committed stocks, written in turn
+    AtomStock stock;          // The live atom inventory
+} StockFile;
+
+/**
+ * How concurrent access to the stock is synchronized (--lock-mode)
+ */
+typedef enum {
+    LOCK_MODE_FLOCK,    // pthread_rwlock between threads + flock() between processes
+    LOCK_MODE_ATOMIC,   // Lock-free: atomic builtins directly on the (mapped) counters
+    LOCK_MODE_MUTEX,    // Process-shared robust pthread mutex in the save file header
+    LOCK_MODE_SHARDED,  // Per-CPU shards leasing atoms from a global pool (no save file)
+    LOCK_MODE_FCNTL     // pthread_rwlock between threads + fcntl() range lock on the live stock between processes
+} StockLockMode;
+
+/**
+ * When updates of the mapped save file are flushed to disk (--durability)
+ */
+typedef enum {
+    DURABILITY_NONE,      // Left to the kernel's writeback
+    DURABILITY_PERIODIC,  // msync() from a background thread every --sync-interval ms
+    DURABILITY_PER_OP     // msync(MS_SYNC) after every update, before its reply
+} StockDurability;
+
+extern AtomStock in_memory_stock;
+extern AtomStock *stock_ptr;
+extern int lock_fd;
+extern StockLockMode stock_lock_mode;
+extern int stock_wal;  // Log every update to <save-file>.wal before applying it (--wal)
+extern StockDurability stock_durability;
+extern int stock_sync_interval_ms;  // Period of DURABILITY_PERIODIC (--sync-interval)
+extern LatencyHistogram stock_update_latency;  // ADD/DELIVER updates, durability work included
+extern LatencyHistogram stock_sync_latency;    // msync() calls of the save file
+extern unsigned long long stock_recovery_ns;   // Time the last stock_open_save_file() spent checking the file
+extern int stock_exclusive;  // Keep the save file to this process: others may not join it (replication, Raft)
+
+/**
+ * Observer of the locked stock updates (replication), NULL if none
+ * Called under the exclusive stock lock after every applied ADD and DELIVER,
+ * so the calls come in the order the updates were applied
+ *
+ * @param op     WAL_OP_ADD or WAL_OP_DELIVER (wal.h)
+ * @param atoms  Atoms added or taken, indexed like the element ids
+ */
+extern void (*stock_update_observer)(int op, const unsigned long long atoms[NUM_ELEMENTS]);
+
+/**
+ * Consensus hook (Raft), NULL if none
+ * When set, ADD and DELIVER are not applied by the calling thread: they are
+ * handed to the hook and applied through stock_apply_update() once committed,
+ * in the same order on every node. The hook does not wait for that; the
+ * caller learns the outcome from the hook's owner (raft_take_pending())
+ *
+ * @param op     WAL_OP_ADD or WAL_OP_DELIVER (wal.h)
+ * @param atoms  Atoms to add or take, indexed like the element ids
+ * @return       1 if the update was handed over, 0 if it was refused
+ */
+extern int (*stock_update_proposer)(int op, const unsigned long long atoms[NUM_ELEMENTS]);
+
+/**
+ * Parses a --lock-mode argument
+ *
+ * @param name  Mode name ("flock", "fcntl", "atomic", "mutex" or "sharded")
+ * @param mode  Receives the parsed mode
+ * @return      1 on success, 0 if the name is unknown
+ */
+int stock_parse_lock_mode(const char *name, StockLockMode *mode);
+
+/**
+ * Returns the --lock-mode name of a lock mode
+ */
+const char *stock_lock_mode_name(StockLockMode mode);
+
+/**
+ * Parses a --durability argument
+ *
+ * @param name  Mode name ("none", "periodic" or "per-op")
+ * @param mode  Receives the parsed mode
+ * @return      1 on success, 0 if the name is unknown
+ */
+int stock_parse_durability(const char *name, StockDurability *mode);
+
+/**
+ * Returns the --durability name of a durability mode
+ */
+const char *stock_durability_name(StockDurability mode);
+
+/**
+ * Opens (or creates) the save file and maps the stock from it
+ * A new file is initialized from in_memory_stock, a legacy file is upgraded
+ * Fails if other processes use the file with a different lock mode
+ * With stock_wal set, the log next to the file is opened too, and the first
+ * process to open the file rebuilds the stock from it
+ * The process that opens the file alone checks it: after a reboot (power
+ * loss) the live stock may be torn, and the newest valid slot replaces it
+ * With DURABILITY_PERIODIC, the background msync() thread is started
+ *
+ * @param path  Path of the save file
+ * @return      0 on success, -1 on failure (error already printed)
+ */
+int stock_open_save_file(const char *path);
+
+/**
+ * Unmaps and closes the save file opened with stock_open_save_file()
+ */
+void stock_close_save_file();
+
+void stock_lock_shared();
+void stock_lock_exclusive();
+void stock_unlock();
+
+/**
+ * Returns a copy of the current stock totals, whatever the lock mode
+ *
+ * @param out  Receives the counter values
+ */
+void stock_snapshot(AtomStock *out);
+
+/**
+ * Returns a copy of the stock together with the last log record it includes
+ * With --wal the copy and the log position are taken under one stock lock,
+ * so replaying the records after the position from the copy is exact
+ *
+ * @param out      Receives the counter values
+ * @param log_lsn  Receives the last log record in out, 0 without --wal
+ */
+void stock_snapshot_at(AtomStock *out, unsigned long long *log_lsn);
+
+/**
+ * Applies an update that another server already applied (replication standby),
+ * or that the Raft cluster committed
+ * Takes the exclusive lock (flock or mutex mode), like ADD and DELIVER
+ *
+ * @param op     WAL_OP_ADD or WAL_OP_DELIVER (wal.h)
+ * @param atoms  Atoms added or taken, indexed like the element ids
+ * @return       0 on success, -1 if the update does not fit the stock (nothing is changed)
+ */
+int stock_apply_update(int op, const unsigned long long atoms[NUM_ELEMENTS]);
+
+/**
+ * Replaces the whole stock (full sync of a replication standby)
+ *
+ * @param stock  The new counter values
+ */
+void stock_replace(const AtomStock *stock);
+
+void print_stock();
+int atom_adder(AtomStock *stock, const char *element, unsigned int amount);
+
+/**
+ * Adds several atom types in one all-or-nothing update
+ *
+ * @param stock    Pointer to the atom stock structure
+ * @param amounts  Atoms to add, indexed CARBON, HYDROGEN, OXYGEN
+ * @return         1 on success, 0 if a type would exceed MAX_ATOMS (nothing is added),
+ *                 or if stock_update_proposer took the update
+ */
+int atom_adder_multi(AtomStock *stock, const unsigned long long amounts[NUM_ELEMENTS]);
+int molecule_subtract(AtomStock *stock, const char *molecule, unsigned int amount);
+
+/**
+ * One line of a DELIVER order
+ */
+typedef struct {
+    int molecule;               // Molecule id (registry_molecule_id())
+    unsigned long long amount;  // Number of molecules
+} MoleculeOrder;
+
+/**
+ * Delivers several molecule types in one all-or-nothing transaction
+ *
+ * @param stock  Pointer to the atom stock structure
+ * @param order  Molecules to create (a molecule may appear more than once)
+ * @param count  Number of lines in order
+ * @return       1 on success, 0 if there are not enough atoms (nothing is taken),
+ *               or if stock_update_proposer took the update
+ */
+int molecule_subtract_multi(AtomStock *stock, const MoleculeOrder *order, int count);
+
+#endif
@@ -0,0 +1,454 @@
+/*
+ * wal.c - יומן פעולות עם group commit
+ * -----------------------------------
+ * כל ADD ו-DELIVER שמצליח נרשם ביומן לפני שהוא מוחל על המלאי, תחת הנעילה
+ * הבלעדית, כך שסדר הרשומות הוא סדר העדכונים (גם בין תהליכים שחולקים את הקובץ).
+ *
+ * group commit:
+ * - כל תהליכון זוכר את הרשומה האחרונה שכתב; התשובות של סבב (שורות TCP או
+ *   מנת datagrams) נשמרות בצד עד שהרשומה מגיעה לדיסק, ולולאת האירועים
+ *   ממשיכה לשרת לקוחות אחרים בינתיים
+ * - תהליכון סנכרון יחיד קורא ל-fdatasync עבור כל מה שנכתב עד אז, ואחר כך
+ *   מעיר (eventfd) את הלולאות שביקשו, והן שולחות את התשובות שכבר בטוחות
+ * - --wal-window: תהליכון הסנכרון ממתין עוד מיקרו-שניות כדי לאסוף רשומות נוספות
+ *
+ * שחזור (התהליך הראשון שפותח את קובץ השמירה):
+ * המלאי = מלאי הבסיס שבכותרת היומן + כל הרשומות התקינות (CRC ומספר רצף),
+ * וזנב קרוע של רשומה שלא נכתבה עד הסוף נחתך.
+ * היומן ממופה לזיכרון ונסרק פעם אחת לפי הסדר, ללא קריאת מערכת לכל רשומה;
+ * אותה סריקה (wal_replay) משמשת גם את כלי השחזור drinks_restore.
+ * קובץ השמירה הממופה אינו נכתב לדיסק באופן מסודר, ולכן היומן הוא מקור האמת.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "wal.h"
+#include "crc32c.h"
+
+#define REPLAY_BATCH 64  // Records whose CRCs are computed together during replay
+
+int wal_window_us = 0;
+
+static int wal_fd = -1;
+static uint64_t wal_base_lsn = 0;
+
+// Records appended by this process, and how many of them are known to be on disk
+static unsigned long long wal_appended = 0;
+static unsigned long long wal_synced = 0;
+static unsigned long long wal_syncs = 0;
+
+// Last record appended by the calling thread, not yet taken by wal_take_pending()
+static __thread unsigned long long wal_pending = 0;
+
+// Descriptors to signal after the next fdatasync; each event loop is listed at most once
+#define WAL_MAX_WAITERS 256
+static int wal_waiters[WAL_MAX_WAITERS];
+static int wal_num_waiters = 0;
+static pthread_mutex_t wal_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_sync_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t wal_sync_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Returns the CLOCK_REALTIME time in nanoseconds
+ */
+static uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Makes a newly created file's directory entry durable
+ *
+ * @param path  Path of the file
+ * @return      0 on success, -1 on failure
+ */
+static int sync_parent_dir(const char *path) {
+    char copy[4096];
+    snprintf(copy, sizeof(copy), "%s", path);
+    int dir_fd = open(dirname(copy), O_RDONLY);
+    if (dir_fd == -1) return -1;
+    int rc = fsync(dir_fd);
+    close(dir_fd);
+    return rc;
+}
+
+/**
+ * Applies one record to the counters of a stock
+ *
+ * @return  1 on success, 0 if the record does not fit the stock (the log is inconsistent)
+ */
+static inline int apply_record(unsigned long long counters[NUM_ELEMENTS], const WalRecord *record) {
+    int fits = 1;
+    if (record->op == WAL_OP_ADD) {
+        for (int e = 0; e < NUM_ELEMENTS; e++) fits &= record->atoms[e] <= MAX_ATOMS - counters[e];
+        if (!fits) return 0;
+        for (int e = 0; e < NUM_ELEMENTS; e++) counters[e] += record->atoms[e];
+    } else {
+        for (int e = 0; e < NUM_ELEMENTS; e++) fits &= record->atoms[e] <= counters[e];
+        if (!fits) return 0;
+        for (int e = 0; e < NUM_ELEMENTS; e++) counters[e] -= record->atoms[e];
+    }
+    return 1;
+}
+
+/**
+ * Returns non-zero if a log header is intact and of this version
+ */
+int wal_header_valid(const WalHeader *header) {
+    return header->magic == WAL_MAGIC && header->version == WAL_VERSION && header->record_size == sizeof(WalRecord) &&
+           header->crc == crc32c(header, offsetof(WalHeader, crc));
+}
+
+/**
+ * Replays the records of a log mapped into memory onto a stock
+ * One sequential pass over the mapping, in batches: the CRC32Cs of a batch
+ * are computed together, then every record is checked (sequence number,
+ * opcode, CRC) and applied to counters held in registers. The stock is
+ * written once at the end
+ *
+ * @param path    Path of the log (for messages)
+ * @param log     The whole log file
+ * @param size    Size of the log file
+ * @param stock   The stock after replay->from_lsn; receives the stock after replay->last_lsn
+ * @param replay  Range to apply, and receives what was applied
+ * @return        0 on success, -1 if the header is invalid, records between
+ *                from_lsn and the log are missing or a record does not fit
+ *                the stock (error already printed)
+ */
+int wal_replay(const char *path, const void *log, size_t size, AtomStock *stock, WalReplay *replay) {
+    const WalHeader *header = log;
+    if (size < sizeof(WalHeader) || !wal_header_valid(header)) {
+        fprintf(stderr, "Unrecognized log format: %s\n", path);
+        return -1;
+    }
+    if (replay->from_lsn + 1 < header->base_lsn) {
+        fprintf(stderr, "%s starts at record %llu; records %llu-%llu are missing\n", path,
+                (unsigned long long)header->base_lsn, (unsigned long long)replay->from_lsn + 1,
+                (unsigned long long)header->base_lsn - 1);
+        return -1;
+    }
+
+    const WalRecord *records = (const WalRecord *)((const char *)log + sizeof(WalHeader));
+    size_t count = (size - sizeof(WalHeader)) / sizeof(WalRecord);
+    unsigned long long counters[NUM_ELEMENTS] = {stock->carbon, stock->hydrogen, stock->oxygen};
+    uint64_t expected = header->base_lsn;
+    uint32_t crcs[REPLAY_BATCH];
+    size_t i;
+
+    replay->last_lsn = replay->from_lsn;
+    replay->last_time_ns = 0;
+    replay->records = 0;
+    replay->reached_end = 0;
+    for (i = 0; i < count; i++, expected++) {
+        // CRCs of a whole batch first: the hardware computes several at once
+        if (i % REPLAY_BATCH == 0) {
+            size_t batch = count - i < REPLAY_BATCH ? count - i : REPLAY_BATCH;
+            crc32c_blocks(&records[i], sizeof(WalRecord), offsetof(WalRecord, crc), batch, crcs);
+        }
+        const WalRecord *record = &records[i];
+        // The first record that fails a check starts the torn tail
+        if (record->lsn != expected || (record->op != WAL_OP_ADD && record->op != WAL_OP_DELIVER) ||
+            record->crc != crcs[i % REPLAY_BATCH]) {
+            break;
+        }
+        if (record->lsn > replay->to_lsn || record->time_ns > replay->to_time_ns) break;
+        if (record->lsn <= replay->from_lsn) continue;
+        if (!apply_record(counters, record)) {
+            fprintf(stderr, "%s: record %llu does not fit the stock; the log is inconsistent\n", path,
+                    (unsigned long long)record->lsn);
+            return -1;
+        }
+        replay->last_lsn = record->lsn;
+        replay->last_time_ns = record->time_ns;
+        replay->records++;
+    }
+    replay->valid_size = sizeof(WalHeader) + i * sizeof(WalRecord);
+    replay->reached_end = (i == count);
+
+    stock->carbon = counters[ELEMENT_CARBON];
+    stock->hydrogen = counters[ELEMENT_HYDROGEN];
+    stock->oxygen = counters[ELEMENT_OXYGEN];
+    return 0;
+}
+
+/**
+ * Rebuilds the stock from the log and cuts off a torn tail
+ *
+ * @param path    Path of the log (for messages)
+ * @param header  The validated log header
+ * @param stock   Receives the rebuilt stock
+ * @return        0 on success, -1 if the log is inconsistent
+ */
+static int replay(const char *path, const WalHeader *header, AtomStock *stock) {
+    struct stat st;
+    if (fstat(wal_fd, &st) == -1) {
+        perror("Failed to read log");
+        return -1;
+    }
+    void *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, wal_fd, 0);
+    if (log == MAP_FAILED) {
+        perror("Failed to map log");
+        return -1;
+    }
+    madvise(log, st.st_size, MADV_SEQUENTIAL);
+
+    AtomStock rebuilt = header->base;
+    WalReplay result;
+    memset(&result, 0, sizeof(result));
+    result.from_lsn = header->base_lsn - 1;
+    result.to_lsn = UINT64_MAX;
+    result.to_time_ns = UINT64_MAX;
+    int rc = wal_replay(path, log, st.st_size, &rebuilt, &result);
+    munmap(log, st.st_size);
+    if (rc == -1) return -1;
+
+    // Anything after the last valid record was never acknowledged
+    if ((size_t)st.st_size > result.valid_size) {
+        printf("Log %s: discarding %lld bytes of incomplete records\n", path,
+               (long long)(st.st_size - result.valid_size));
+        if (ftruncate(wal_fd, result.valid_size) == -1 || fdatasync(wal_fd) == -1) {
+            perror("Failed to truncate log");
+            return -1;
+        }
+    }
+
+    printf("Log %s: replayed %llu records (C=%llu, H=%llu, O=%llu)\n", path, (unsigned long long)result.records,
+           rebuilt.carbon, rebuilt.hydrogen, rebuilt.oxygen);
+    *stock = rebuilt;
+    return 0;
+}
+
+/**
+ * Opens the log of a save file, creating it if needed
+ * - New log: starts from the current stock
+ * - Existing log, sole user: the stock is rebuilt from the log
+ * - Existing log, other users: the live stock is already up to date
+ *
+ * @param path     Path of the log
+ * @param stock    The mapped stock
+ * @param recover  Non-zero if no other process uses the save file
+ * @return         0 on success, -1 on failure (error already printed)
+ */
+int wal_open(const char *path, AtomStock *stock, int recover) {
+    WalHeader header;
+    struct stat st;
+
+    wal_fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (wal_fd == -1 || fstat(wal_fd, &st) == -1) {
+        perror("Failed to open log");
+        goto fail;
+    }
+
+    if (st.st_size == 0) {
+        // Processes already running without a log have updates the log would miss
+        if (!recover) {
+            fprintf(stderr, "Save file is in use without --wal; all processes sharing it must use the same setting\n");
+            unlink(path);
+            goto fail;
+        }
+        memset(&header, 0, sizeof(header));
+        header.magic = WAL_MAGIC;
+        header.version = WAL_VERSION;
+        header.base_lsn = 1;
+        header.time_ns = realtime_ns();
+        header.base = *stock;
+        header.record_size = sizeof(WalRecord);
+        header.crc = crc32c(&header, offsetof(WalHeader, crc));
+        if (pwrite(wal_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || fdatasync(wal_fd) == -1 ||
+            sync_parent_dir(path) == -1) {
+            perror("Failed to create log");
+            goto fail;
+        }
+        printf("Created log %s\n", path);
+    } else {
+        if (pread(wal_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || !wal_header_valid(&header)) {
+            fprintf(stderr, "Unrecognized log format: %s\n", path);
+            goto fail;
+        }
+        if (recover && replay(path, &header, stock) == -1) goto fail;
+    }
+
+    wal_base_lsn = header.base_lsn;
+    return 0;
+
+fail:
+    if (wal_fd != -1) close(wal_fd);
+    wal_fd = -1;
+    return -1;
+}
+
+/**
+ * Closes the log opened with wal_open()
+ */
+void wal_close() {
+    if (wal_fd != -1) {
+        close(wal_fd);
+        wal_fd = -1;
+    }
+}
+
+/**
+ * Returns non-zero if stock updates are being logged
+ */
+int wal_enabled() {
+    return wal_fd != -1;
+}
+
+/**
+ * Appends one update to the log (called under the exclusive stock lock)
+ * The record goes after the last record of every process, so the log
+ * order is the order in which the updates were applied
+ *
+ * @param op     WAL_OP_ADD or WAL_OP_DELIVER
+ * @param atoms  Atoms added or taken, indexed like the element ids
+ * @return       0 on success, -1 if the record could not be written
+ */
+int wal_append(int op, const unsigned long long atoms[NUM_ELEMENTS]) {
+    WalRecord record;
+
+    off_t end = lseek(wal_fd, 0, SEEK_END);
+    if (end == -1) {
+        perror("lseek log");
+        return -1;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.lsn = wal_base_lsn + (end - sizeof(WalHeader)) / sizeof(WalRecord);
+    record.time_ns = realtime_ns();
+    memcpy(record.atoms, atoms, sizeof(record.atoms));
+    record.op = op;
+    record.crc = crc32c(&record, offsetof(WalRecord, crc));
+    if (pwrite(wal_fd, &record, sizeof(record), end) != (ssize_t)sizeof(record)) {
+        perror("write log");
+        // Do not leave a partial record for the next append to follow
+        if (ftruncate(wal_fd, end) == -1) perror("ftruncate log");
+        return -1;
+    }
+
+    wal_pending = __atomic_add_fetch(&wal_appended, 1, __ATOMIC_ACQ_REL);
+    return 0;
+}
+
+/**
+ * Returns the last record appended by the calling thread and forgets it
+ *
+ * @return  Record number to wait for, 0 if the thread appended nothing since the last call
+ */
+unsigned long long wal_take_pending() {
+    unsigned long long ticket = wal_pending;
+    wal_pending = 0;
+    return ticket;
+}
+
+/**
+ * Returns non-zero if a record returned by wal_take_pending() is on disk
+ */
+int wal_durable(unsigned long long ticket) {
+    return __atomic_load_n(&wal_synced, __ATOMIC_ACQUIRE) >= ticket;
+}
+
+/**
+ * Sync thread: one fdatasync for everything appended so far, then wakes every
+ * loop that asked; records appended meanwhile form the next group
+ */
+static void *sync_main(void *arg) {
+    int waiters[WAL_MAX_WAITERS];
+    uint64_t one = 1;
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&wal_sync_lock);
+        while (wal_num_waiters == 0) pthread_cond_wait(&wal_sync_cond, &wal_sync_lock);
+        int count = wal_num_waiters;
+        memcpy(waiters, wal_waiters, count * sizeof(int));
+        wal_num_waiters = 0;
+        pthread_mutex_unlock(&wal_sync_lock);
+
+        if (!wal_durable(__atomic_load_n(&wal_appended, __ATOMIC_ACQUIRE))) {
+            // Let the loops add more records to this group
+            if (wal_window_us > 0) usleep(wal_window_us);
+            unsigned long long end = __atomic_load_n(&wal_appended, __ATOMIC_ACQUIRE);
+            if (fdatasync(wal_fd) == -1) {
+                // Whether the records reached the disk is unknown: replies cannot be trusted
+                perror("fdatasync log");
+                exit(1);
+            }
+            __atomic_fetch_add(&wal_syncs, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&wal_synced, end, __ATOMIC_RELEASE);
+        }
+
+        // A loop whose records came after this group asks again when it wakes
+        for (int i = 0; i < count; i++) {
+            if (write(waiters[i], &one, sizeof(one)) == -1 && errno != EAGAIN) perror("wake event loop");
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Starts the sync thread (once per process)
+ */
+static void start_sync_thread() {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, sync_main, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "pthread_create (log sync): %s\n", strerror(rc));
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/**
+ * Asks for everything appended so far to be synced
+ * notify_fd (an eventfd) is written to after the next fdatasync; the caller
+ * then checks its records with wal_durable() and asks again if needed
+ *
+ * @param notify_fd  Descriptor of the calling event loop
+ */
+void wal_request_sync(int notify_fd) {
+    pthread_once(&wal_sync_once, start_sync_thread);
+
+    pthread_mutex_lock(&wal_sync_lock);
+    int listed = 0;
+    for (int i = 0; i < wal_num_waiters && !listed; i++) listed = (wal_waiters[i] == notify_fd);
+    if (!listed && wal_num_waiters < WAL_MAX_WAITERS) wal_waiters[wal_num_waiters++] = notify_fd;
+    pthread_cond_signal(&wal_sync_cond);
+    pthread_mutex_unlock(&wal_sync_lock);
+}
+
+/**
+ * Returns the sequence number of the last record in the log
+ * The log is only appended to under the exclusive stock lock, so its size
+ * is stable while the caller holds a stock lock
+ *
+ * @return  Record number, base_lsn - 1 if the log has no records, 0 without a log
+ */
+unsigned long long wal_last_lsn() {
+    struct stat st;
+    if (wal_fd == -1 || fstat(wal_fd, &st) == -1) return 0;
+    if (st.st_size <= (off_t)sizeof(WalHeader)) return wal_base_lsn - 1;
+    return wal_base_lsn + (st.st_size - sizeof(WalHeader)) / sizeof(WalRecord) - 1;
+}
+
+/**
+ * Group commit statistics (console command STATS)
+ *
+ * @param records  Receives the number of records appended by this process
+ * @param syncs    Receives the number of fdatasync calls
+ */
+void wal_stats(unsigned long long *records, unsigned long long *syncs) {
+    *records = __atomic_load_n(&wal_appended, __ATOMIC_RELAXED);
+    *syncs = __atomic_load_n(&wal_syncs, __ATOMIC_RELAXED);
+}
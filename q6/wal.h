@@ -0,0 +1,156 @@
+/*
+ * wal.h - יומן הפעולות (write-ahead log) של המלאי
+ *
+ * Append-only log of the stock updates, kept next to the save file
+ * (<save-file>.wal). Every ADD and DELIVER is appended before it is applied,
+ * and its reply is sent only after the record is on disk.
+ */
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "stock.h"
+
+#define WAL_MAGIC 0x4c574244u   // "DBWL"
+#define WAL_VERSION 1
+
+#define WAL_OP_ADD 1       // Atoms added to the stock
+#define WAL_OP_DELIVER 2   // Atoms taken from the stock
+
+/**
+ * First bytes of the log: the stock the records start from
+ */
+typedef struct {
+    uint32_t magic;           // WAL_MAGIC
+    uint32_t version;         // WAL_VERSION
+    uint64_t base_lsn;        // Sequence number of the first record
+    uint64_t time_ns;         // CLOCK_REALTIME when the log was created
+    AtomStock base;           // Stock before the first record
+    uint32_t record_size;     // sizeof(WalRecord)
+    uint32_t crc;             // CRC32C of the header up to this field
+} WalHeader;
+
+/**
+ * One stock update, in the order the updates were applied
+ */
+typedef struct {
+    uint64_t lsn;                           // Sequence number, consecutive from base_lsn
+    uint64_t time_ns;                       // CLOCK_REALTIME when the update was applied
+    unsigned long long atoms[NUM_ELEMENTS]; // Atoms added or taken, indexed like the element ids
+    uint32_t op;                            // WAL_OP_ADD or WAL_OP_DELIVER
+    uint32_t crc;                           // CRC32C of the record up to this field
+} WalRecord;
+
+/**
+ * Which records wal_replay() applies, and what it applied
+ */
+typedef struct {
+    uint64_t from_lsn;       // Records up to this one are already in the stock
+    uint64_t to_lsn;         // Last record to apply (UINT64_MAX: no limit)
+    uint64_t to_time_ns;     // Apply only records of this CLOCK_REALTIME time or earlier (UINT64_MAX: no limit)
+    uint64_t last_lsn;       // Out: last record in the stock (from_lsn if none was applied)
+    uint64_t last_time_ns;   // Out: time of last_lsn, 0 if no record was applied
+    uint64_t records;        // Out: number of records applied
+    size_t valid_size;       // Out: header plus the valid records scanned (a torn tail starts here)
+    int reached_end;         // Out: every record up to the end of the file was valid and applied
+} WalReplay;
+
+// Microseconds a group commit waits for more records before fdatasync (--wal-window)
+extern int wal_window_us;
+
+/**
+ * Returns non-zero if a log header is intact and of this version
+ */
+int wal_header_valid(const WalHeader *header);
+
+/**
+ * Replays the records of a log mapped into memory onto a stock
+ * One sequential pass: records are checked and applied to counters held in
+ * registers, without a system call per record. The scan stops at the first
+ * invalid record (a torn tail), or at the first one past to_lsn or to_time_ns
+ * (records are in the order their updates were applied).
+ *
+ * @param path    Path of the log (for messages)
+ * @param log     The whole log file
+ * @param size    Size of the log file
+ * @param stock   The stock after replay->from_lsn; receives the stock after replay->last_lsn
+ * @param replay  Range to apply, and receives what was applied
+ * @return        0 on success, -1 on failure (error already printed)
+ */
+int wal_replay(const char *path, const void *log, size_t size, AtomStock *stock, WalReplay *replay);
+
+/**
+ * Opens the log of a save file, creating it if needed
+ * Called by stock_open_save_file() while no other process can join the file
+ *
+ * @param path     Path of the log
+ * @param stock    The mapped stock: a new log starts from it, and with
+ *                 recover it is rebuilt from the log
+ * @param recover  Non-zero if no other process uses the save file, so the
+ *                 stock is rebuilt by replaying the log
+ * @return         0 on success, -1 on failure (error already printed)
+ */
+int wal_open(const char *path, AtomStock *stock, int recover);
+
+/**
+ * Closes the log opened with wal_open()
+ */
+void wal_close();
+
+/**
+ * Returns non-zero if stock updates are being logged
+ */
+int wal_enabled();
+
+/**
+ * Appends one update to the log (called under the exclusive stock lock,
+ * before the update is applied)
+ * The caller learns the record number with wal_take_pending()
+ *
+ * @param op     WAL_OP_ADD or WAL_OP_DELIVER
+ * @param atoms  Atoms added or taken, indexed like the element ids
+ * @return       0 on success, -1 if the record could not be written
+ */
+int wal_append(int op, const unsigned long long atoms[NUM_ELEMENTS]);
+
+/**
+ * Returns the last record appended by the calling thread and forgets it
+ * Replies for the updates of a round wait until this record is durable
+ *
+ * @return  Record number to wait for, 0 if the thread appended nothing since the last call
+ */
+unsigned long long wal_take_pending();
+
+/**
+ * Returns non-zero if a record returned by wal_take_pending() is on disk
+ */
+int wal_durable(unsigned long long ticket);
+
+/**
+ * Asks the sync thread to put everything appended so far on disk
+ * Loops that ask at the same time share one fdatasync (group commit).
+ *
+ * @param notify_fd  eventfd written to after the next fdatasync
+ */
+void wal_request_sync(int notify_fd);
+
+/**
+ * Returns the sequence number of the last record in the log
+ * Call it under a stock lock so that no update is being appended
+ *
+ * @return  Record number, base_lsn - 1 if the log has no records, 0 without a log
+ */
+unsigned long long wal_last_lsn();
+
+/**
+ * Group commit statistics (console command STATS)
+ *
+ * @param records  Receives the number of records appended by this process
+ * @param syncs    Receives the number of fdatasync calls
+ */
+void wal_stats(unsigned long long *records, unsigned long long *syncs);
+
+#endif